@@ -359,6 +359,30 @@ int cf_cmp_uint32_nonzero(const uint32_t *a, const uint32_t *b)
   return cf_cmp_uint32(a, b);
 }
 
+int cf_opt_fetch_slots(uint32_t *intp, const char *text)
+{
+  uint32_t value;
+  int result = cf_opt_uint32_nonzero(&value, text);
+  if (result != CFOK)
+    return result;
+  if (value > RHIZOME_FETCH_MAX_SLOTS)
+    return CFINVALID;
+  *intp = value;
+  return CFOK;
+}
+
+int cf_fmt_fetch_slots(const char **textp, const uint32_t *uintp)
+{
+  if (*uintp > RHIZOME_FETCH_MAX_SLOTS)
+    return CFINVALID;
+  return cf_fmt_uint32_nonzero(textp, uintp);
+}
+
+int cf_cmp_fetch_slots(const uint32_t *a, const uint32_t *b)
+{
+  return cf_cmp_uint32(a, b);
+}
+
 int cf_opt_uint32_time_interval(uint32_t *intp, const char *text)
 {
   const char *t = text;
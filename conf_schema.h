@@ -430,12 +430,22 @@ END_STRUCT
 STRUCT(rhizome_http)
 ATOM(bool_t,                enable,     1, boolean,, "If true, Rhizome HTTP server is started")
 ATOM(uint16_t,              port,       HTTPD_PORT_DEFAULT, uint16_nonzero,, "Port number for Rhizome HTTP server")
+ATOM(bool_t,                log_requests, 1, boolean,, "If true, log every connection and request that the HTTP server accepts")
 END_STRUCT
 
 STRUCT(rhizome_mdp)
 ATOM(bool_t,                enable,     1, boolean,, "If true, Rhizome MDP server is started")
 ATOM(uint64_t,              stall_timeout,      1000, uint64_scaled,, "Timeout to request more data.")
 ATOM(uint64_t,              block_size, 512, uint64_scaled,, "Transfer block size.")
+ATOM(bool_t,                adaptive,   1, boolean,, "If true, adapt the request window and block size to measured loss and round trip time")
+ATOM(uint32_t,              cache_entries, 32, uint32_nonzero,, "Maximum number of payloads kept open for serving blocks")
+END_STRUCT
+
+STRUCT(rhizome_database)
+ATOM(bool_t,                wal,                1, boolean,, "If true, SQLite uses a write-ahead log, so readers do not wait for the writer")
+ATOM(uint32_t,              wal_autocheckpoint, 1000, uint32_scaled,, "Checkpoint the write-ahead log once it grows to this many pages; zero checkpoints only when the database is closed")
+ATOM(uint64_t,              mmap_size,          0, uint64_scaled,, "Maximum number of bytes of the database file to read using memory-mapped I/O")
+ATOM(uint64_t,              cache_size,         2048000, uint64_scaled,, "Size of the SQLite page cache in bytes")
 END_STRUCT
 
 STRUCT(rhizome_advertise)
@@ -443,6 +453,15 @@ ATOM(bool_t,                enable,     1, boolean,, "If true, Rhizome advertise
 ATOM(uint32_t,              interval,   500, uint32_nonzero,, "Interval between Rhizome advertisements")
 END_STRUCT
 
+STRUCT(rhizome_fetch_slots)
+ATOM(uint32_t,              under_1k,   2, fetch_slots,, "Concurrent fetches of payloads under 1KiB")
+ATOM(uint32_t,              under_8k,   2, fetch_slots,, "Concurrent fetches of payloads under 8KiB")
+ATOM(uint32_t,              under_64k,  1, fetch_slots,, "Concurrent fetches of payloads under 64KiB")
+ATOM(uint32_t,              under_512k, 1, fetch_slots,, "Concurrent fetches of payloads under 512KiB")
+ATOM(uint32_t,              under_4m,   1, fetch_slots,, "Concurrent fetches of payloads under 4MiB")
+ATOM(uint32_t,              larger,     1, fetch_slots,, "Concurrent fetches of payloads of 4MiB or more")
+END_STRUCT
+
 STRUCT(rhizome)
 ATOM(bool_t,                enable,         1, boolean,, "If true, server opens Rhizome database when starting")
 ATOM(bool_t,                fetch,          1, boolean,, "If false, no new bundles will be fetched from peers")
@@ -452,8 +471,12 @@ STRING(256,                 datastore_path, RHIZOME_DEFAULT_PATH, str_nonempty,,
 ATOM(uint64_t,              database_size,  UINT64_MAX, uint64_scaled,, "Maximum size of database in bytes")
 ATOM(uint64_t,              min_free_space, 100*1024*1024, uint64_scaled,, "Minimum free space to preserve on the disk")
 ATOM(uint32_t,              max_blob_size,  128 * 1024, uint32_scaled,, "Store payloads larger than this in files not SQLite blobs")
+SUB_STRUCT(rhizome_database, database,)
 ATOM(uint64_t,              idle_timeout,   RHIZOME_IDLE_TIMEOUT, uint64_scaled,, "Rhizome transfer timeout if no data received.")
 ATOM(uint32_t,              fetch_delay_ms, 50, uint32_nonzero,, "Delay from receiving first bundle advert to initiating fetch")
+ATOM(uint32_t,              fetch_sources,  4, uint32_nonzero,, "Maximum number of neighbours to fetch a single payload from at once")
+ATOM(uint32_t,              fetch_queue_limit, 1000, uint32_nonzero,, "Maximum number of bundles waiting to be fetched in each payload size class")
+SUB_STRUCT(rhizome_fetch_slots, fetch_slots,)
 SUB_STRUCT(rhizome_direct,  direct,)
 SUB_STRUCT(rhizome_api,     api,)
 SUB_STRUCT(rhizome_http,    http,)
@@ -518,6 +541,7 @@ STRUCT(api_restful)
 ATOM(enum http_authorization_scheme, authorization, BASIC, http_authorization_scheme,, "The kind of authorization that REST clients must supply")
 SUB_STRUCT(userlist,                 users,)
 ATOM(uint32_t,                       newsince_timeout, 60, uint32_time_interval,, "Time to block while reporting new bundles")
+ATOM(uint32_t,                       keepalive_timeout, 5, uint32_time_interval,, "Time to keep an idle persistent HTTP connection open for the next request; zero closes every connection after one response")
 END_STRUCT
 
 STRUCT(api)
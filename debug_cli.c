@@ -0,0 +1,102 @@
+/*
+Serval DNA debugging command line
+Copyright (C) 2018 Flinders University
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "cli.h"
+#include "feature.h"
+#include "conf.h"
+#include "mdp_client.h"
+#include "commandline.h"
+#include "overlay_buffer.h"
+#include "debug.h"
+
+DEFINE_FEATURE(cli_debug);
+
+DEFINE_CMD(app_debug_sched, 0,
+  "Print the latency percentiles (ms) of every alarm the daemon has called",
+  "debug","sched");
+static int app_debug_sched(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  int mdp_sockfd;
+  DEBUG_cli_parsed(verbose, parsed);
+
+  if ((mdp_sockfd = mdp_socket()) < 0)
+    return WHY("Cannot create MDP socket");
+
+  int ret=-1;
+
+  struct mdp_header mdp_header;
+  bzero(&mdp_header, sizeof mdp_header);
+
+  mdp_header.local.sid = SID_INTERNAL;
+  mdp_header.local.port = MDP_SCHED_STATS;
+  mdp_header.remote.sid = SID_ANY;
+  mdp_header.remote.port = MDP_SCHED_STATS;
+
+  if (mdp_send(mdp_sockfd, &mdp_header, NULL, 0))
+    goto end;
+
+  const char *names[]={
+    "name",
+    "calls",
+    "duration_p50",
+    "duration_p90",
+    "duration_p99",
+    "duration_max",
+    "scheduled",
+    "lateness_p50",
+    "lateness_p90",
+    "lateness_p99",
+    "lateness_max"
+  };
+  cli_start_table(context, NELS(names), names);
+  size_t rowcount=0;
+  time_ms_t timeout = gettime_ms() + 5000;
+
+  uint8_t payload[MDP_MTU];
+  struct overlay_buffer *buff = ob_static(payload, sizeof payload);
+  while(1){
+    ssize_t recv_len = mdp_poll_recv(mdp_sockfd, gettime_ms()+1000, &mdp_header, payload, sizeof payload);
+    if (recv_len == -1)
+      break;
+    if (recv_len>0){
+      ob_clear(buff);
+      ob_limitsize(buff, recv_len);
+      const char *name = ob_get_str_ptr(buff);
+      uint64_t values[NELS(names) - 1];
+      unsigned i;
+      for (i = 0; i < NELS(values); ++i)
+	values[i] = ob_get_packed_ui64(buff);
+      if (name && !ob_overrun(buff)){
+	cli_put_string(context, name, ":");
+	for (i = 0; i < NELS(values); ++i)
+	  cli_put_long(context, values[i], i + 1 < NELS(values) ? ":" : "\n");
+	rowcount++;
+      }
+    }
+    if ((mdp_header.flags & MDP_FLAG_CLOSE) || gettime_ms() > timeout)
+      break;
+  }
+  ob_free(buff);
+  ret = 0;
+  cli_end_table(context, rowcount);
+
+end:
+  mdp_close(mdp_sockfd);
+  return ret;
+}
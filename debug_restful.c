@@ -0,0 +1,140 @@
+/*
+Serval DNA debugging HTTP RESTful interface
+Copyright (C) 2018 Flinders University
+ 
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+ 
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+ 
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include "lang.h" // for bool_t, FALLTHROUGH
+#include "serval.h"
+#include "conf.h"
+#include "httpd.h"
+#include "strbuf_helpers.h"
+
+DEFINE_FEATURE(http_rest_debug);
+
+DECLARE_HANDLER("/restful/debug/", restful_debug_);
+
+static HTTP_HANDLER restful_debug_sched_json;
+
+static int restful_debug_(httpd_request *r, const char *remainder)
+{
+  r->http.response.header.content_type = &CONTENT_TYPE_JSON;
+  int ret = authorize_restful(&r->http);
+  if (ret)
+    return ret;
+  if (r->http.verb == HTTP_VERB_GET && strcmp(remainder, "sched.json") == 0)
+    return restful_debug_sched_json(r, "");
+  return 404;
+}
+
+static HTTP_CONTENT_GENERATOR restful_debug_sched_json_content;
+
+static int restful_debug_sched_json(httpd_request *r, const char *remainder)
+{
+  if (*remainder)
+    return 404;
+  r->u.latencylist.phase = LIST_HEADER;
+  r->u.latencylist.current = fd_latency_first();
+  http_request_response_generated(&r->http, 200, &CONTENT_TYPE_JSON, restful_debug_sched_json_content);
+  return 1;
+}
+
+static HTTP_CONTENT_GENERATOR_STRBUF_CHUNKER restful_debug_sched_json_content_chunk;
+
+static int restful_debug_sched_json_content(struct http_request *hr, unsigned char *buf, size_t bufsz, struct http_content_generator_result *result)
+{
+  return generate_http_content_from_strbuf_chunks(hr, (char *)buf, bufsz, result, restful_debug_sched_json_content_chunk);
+}
+
+static void strbuf_json_latency(strbuf b, const struct latency_histogram *h)
+{
+  strbuf_puts(b, ",");
+  strbuf_json_integer(b, h->count);
+  strbuf_puts(b, ",");
+  strbuf_json_integer(b, latency_histogram_percentile(h, 50));
+  strbuf_puts(b, ",");
+  strbuf_json_integer(b, latency_histogram_percentile(h, 90));
+  strbuf_puts(b, ",");
+  strbuf_json_integer(b, latency_histogram_percentile(h, 99));
+  strbuf_puts(b, ",");
+  strbuf_json_integer(b, h->max);
+}
+
+static int restful_debug_sched_json_content_chunk(struct http_request *hr, strbuf b)
+{
+  httpd_request *r = (httpd_request *) hr;
+  const char *headers[] = {
+    "name",
+    "calls",
+    "duration_p50",
+    "duration_p90",
+    "duration_p99",
+    "duration_max",
+    "scheduled",
+    "lateness_p50",
+    "lateness_p90",
+    "lateness_p99",
+    "lateness_max"
+  };
+  switch (r->u.latencylist.phase) {
+    case LIST_HEADER:
+      strbuf_puts(b, "{\n\"header\":[");
+      unsigned i;
+      for (i = 0; i != NELS(headers); ++i) {
+	if (i)
+	  strbuf_putc(b, ',');
+	strbuf_json_string(b, headers[i]);
+      }
+      strbuf_puts(b, "],\n\"rows\":[");
+      if (!strbuf_overrun(b)){
+	r->u.latencylist.phase = LIST_FIRST;
+	if (!r->u.latencylist.current)
+	  r->u.latencylist.phase = LIST_END;
+      }
+      return 1;
+
+    case LIST_ROWS:
+      strbuf_putc(b, ',');
+      FALLTHROUGH;
+    case LIST_FIRST:
+      r->u.latencylist.phase = LIST_ROWS;
+      struct alarm_latency *latency = r->u.latencylist.current;
+      assert(latency);
+      strbuf_puts(b, "\n[");
+      strbuf_json_string(b, latency->stats->name);
+      strbuf_json_latency(b, &latency->duration);
+      strbuf_json_latency(b, &latency->lateness);
+      strbuf_puts(b, "]");
+      if (!strbuf_overrun(b)) {
+	r->u.latencylist.current = latency->_next;
+	if (!r->u.latencylist.current)
+	  r->u.latencylist.phase = LIST_END;
+      }
+      return 1;
+
+    case LIST_END:
+      strbuf_puts(b, "\n]\n}\n");
+      if (strbuf_overrun(b))
+	return 1;
+
+      r->u.latencylist.phase = LIST_DONE;
+      // fall through...
+    case LIST_DONE:
+      return 0;
+  }
+  abort();
+  return 0;
+}
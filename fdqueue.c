@@ -47,8 +47,14 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include <inttypes.h> // for PRIu64
+#include <stddef.h> // for offsetof()
+#include <fcntl.h>
 #include "fdqueue.h"
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #include "conf.h"
+#include "mem.h"
 #include "net.h"
 #include "str.h"
 #include "strbuf.h"
@@ -60,135 +66,428 @@ __thread struct pollfd fds[MAX_WATCHED_FDS];
 __thread int fdcount=0;
 __thread struct sched_ent *fd_callbacks[MAX_WATCHED_FDS];
 
-__thread struct sched_ent *wake_list=NULL;
-__thread struct sched_ent *run_soon=NULL;
-__thread struct sched_ent *run_now=NULL;
+/* Scheduled alarms are kept in three binary min-heaps, so that scheduling and unscheduling are
+ * O(log n) in the number of pending alarms, instead of a walk along a sorted list:
+ *  - wake_heap orders alarms by wake_at, the earliest time we must wake the CPU for;
+ *  - run_soon_heap orders alarms by run_after, until that time has passed;
+ *  - run_now_heap orders alarms that may now run by run_before.
+ * An alarm is in both wake_heap and run_soon_heap, or in run_now_heap alone.  Each alarm records
+ * its position in each heap, so it can be removed without searching, and a sequence number, so
+ * that alarms with equal times are run in the order they were queued, as before.
+ */
+struct sched_heap {
+  struct sched_ent **items;
+  unsigned count;
+  unsigned capacity;
+  size_t key_offset;
+  size_t index_offset;
+};
+
+#define SCHED_HEAP(KEY, INDEX) {\
+    .key_offset = offsetof(struct sched_ent, KEY), \
+    .index_offset = offsetof(struct sched_ent, INDEX), \
+  }
 
-struct profile_total poll_stats={NULL,0,"Idle (in poll)",0,0,0,0};
+__thread struct sched_heap wake_heap = SCHED_HEAP(wake_at, _wake_index);
+__thread struct sched_heap run_soon_heap = SCHED_HEAP(run_after, _run_index);
+__thread struct sched_heap run_now_heap = SCHED_HEAP(run_before, _run_index);
+__thread uint64_t sched_sequence = 0;
 
-#define alloca_alarm_name(alarm) ((alarm)->stats ? alloca_str_toprint((alarm)->stats->name) : "Unnamed")
+#define heap_key(H, A) (*(time_ms_t *)((char *)(A) + (H)->key_offset))
+#define heap_index(H, A) (*(unsigned *)((char *)(A) + (H)->index_offset))
+#define heap_first(H) ((H)->count ? (H)->items[0] : NULL)
 
-int list_alarms(int log_level)
+static int heap_before(const struct sched_heap *heap, const struct sched_ent *a, const struct sched_ent *b)
 {
-  int count=0;
-  time_ms_t now = gettime_ms();
-  struct sched_ent *alarm;
-  
-  LOGF(log_level, "Run now;");
-  for (alarm = run_now; alarm; alarm=alarm->_next_run){
-    count ++;
-    LOGF(log_level, "%p %s deadline in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->run_before - now);
+  time_ms_t ka = heap_key(heap, a), kb = heap_key(heap, b);
+  return ka < kb || (ka == kb && a->_sequence < b->_sequence);
+}
+
+static void heap_set(struct sched_heap *heap, unsigned i, struct sched_ent *alarm)
+{
+  heap->items[i] = alarm;
+  heap_index(heap, alarm) = i + 1;
+}
+
+static void heap_sift_up(struct sched_heap *heap, unsigned i)
+{
+  struct sched_ent *alarm = heap->items[i];
+  while (i > 0){
+    unsigned parent = (i - 1) / 2;
+    if (!heap_before(heap, alarm, heap->items[parent]))
+      break;
+    heap_set(heap, i, heap->items[parent]);
+    i = parent;
   }
-    
-  LOGF(log_level, "Run soon;");
-  for (alarm = run_soon; alarm; alarm=alarm->_next_run){
-    count ++;
-    LOGF(log_level, "%p %s run in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->run_after - now);
+  heap_set(heap, i, alarm);
+}
+
+static void heap_sift_down(struct sched_heap *heap, unsigned i)
+{
+  struct sched_ent *alarm = heap->items[i];
+  while (1){
+    unsigned child = i * 2 + 1;
+    if (child >= heap->count)
+      break;
+    if (child + 1 < heap->count && heap_before(heap, heap->items[child + 1], heap->items[child]))
+      child++;
+    if (!heap_before(heap, heap->items[child], alarm))
+      break;
+    heap_set(heap, i, heap->items[child]);
+    i = child;
   }
+  heap_set(heap, i, alarm);
+}
 
-  LOGF(log_level, "Wake at;");
-  for (alarm = wake_list; alarm; alarm = alarm->_next_wake){
-    count ++;
-    LOGF(log_level, "%p %s wake in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->wake_at - now);
+static void heap_insert(struct sched_heap *heap, struct sched_ent *alarm)
+{
+  if (heap->count >= heap->capacity){
+    unsigned capacity = heap->capacity ? heap->capacity * 2 : 64;
+    struct sched_ent **items = erealloc(heap->items, capacity * sizeof(struct sched_ent *));
+    if (!items)
+      FATAL("Cannot grow the alarm schedule");
+    heap->items = items;
+    heap->capacity = capacity;
   }
+  heap->items[heap->count++] = alarm;
+  heap_sift_up(heap, heap->count - 1);
+}
 
-  LOGF(log_level, "File handles;");
+static int heap_contains(const struct sched_heap *heap, const struct sched_ent *alarm)
+{
+  unsigned i = heap_index(heap, alarm);
+  return i > 0 && i <= heap->count && heap->items[i - 1] == alarm;
+}
+
+static void heap_remove(struct sched_heap *heap, struct sched_ent *alarm)
+{
+  if (!heap_contains(heap, alarm))
+    return;
+  unsigned i = heap_index(heap, alarm) - 1;
+  heap_index(heap, alarm) = 0;
+  struct sched_ent *last = heap->items[--heap->count];
+  if (last == alarm)
+    return;
+  heap_set(heap, i, last);
+  if (i > 0 && heap_before(heap, last, heap->items[(i - 1) / 2]))
+    heap_sift_up(heap, i);
+  else
+    heap_sift_down(heap, i);
+}
+
+struct profile_total poll_stats={NULL,0,"Idle (in poll)",0,0,0,0,NULL};
+
+static void call_alarm(struct sched_ent *alarm, int revents);
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/* On Linux, watched file handles are registered once with an epoll(7) instance, so that each
+ * wakeup only visits the handles that are ready, instead of passing the whole fds[] array to
+ * poll() and then scanning every entry for revents.  The fds[] array is still maintained, for
+ * list_alarms() and is_watching(), and so that we can fall back to poll() at any time if epoll
+ * is unavailable or misbehaves.
+ *
+ * epoll only permits one registration per file descriptor, but several alarms may watch the
+ * same descriptor (eg, msp_proxy watches a socket for input and output with separate alarms), so
+ * alarms are chained through their _next_watch field per descriptor, and the descriptor is
+ * registered with the union of their events.  The POLL* and EPOLL* flag values are identical on
+ * Linux, so events are passed between them unchanged.
+ *
+ * Regular files cannot be registered with epoll (EPERM), but poll() always reports them as
+ * ready, so they are kept in a separate list and treated as ready on every wakeup.
+ */
+
+struct fd_slot {
+  struct sched_ent *watchers;
+  // incremented every time the descriptor is registered, to discard stale events for a
+  // descriptor number that has been unwatched and re-used by a callback in the same wakeup
+  uint32_t serial;
+  uint8_t registered;
+  uint8_t always_ready;
+};
+
+// -1 means not created yet, -2 means unavailable so use poll()
+__thread int epoll_fd = -1;
+__thread struct fd_slot *fd_slots = NULL;
+__thread unsigned fd_slot_count = 0;
+__thread struct epoll_event epoll_events[MAX_WATCHED_FDS];
+__thread int always_ready_fds[MAX_WATCHED_FDS];
+__thread unsigned always_ready_count = 0;
+// the next alarm to be called for the descriptor that is being dispatched
+__thread struct sched_ent *dispatch_next = NULL;
+
+#define USE_EPOLL (epoll_fd >= 0)
+
+static void epoll_disable()
+{
+  if (epoll_fd >= 0)
+    close(epoll_fd);
+  epoll_fd = -2;
+  free(fd_slots);
+  fd_slots = NULL;
+  fd_slot_count = 0;
+  always_ready_count = 0;
+  dispatch_next = NULL;
   int i;
-  for (i = 0; i < fdcount; ++i){
-    count ++;
-    LOGF(log_level, "%s watching #%d for %x", alloca_alarm_name(fd_callbacks[i]), fds[i].fd, fds[i].events);
-  }
+  for (i = 0; i < fdcount; ++i)
+    fd_callbacks[i]->_next_watch = NULL;
+  WARN("Falling back to poll()");
+}
 
-  return count;
+static int epoll_available()
+{
+  if (epoll_fd == -1){
+    epoll_fd = epoll_create(MAX_WATCHED_FDS);
+    if (epoll_fd == -1){
+      WARN_perror("epoll_create");
+      epoll_fd = -2;
+    }else
+      fcntl(epoll_fd, F_SETFD, FD_CLOEXEC);
+  }
+  return USE_EPOLL;
 }
 
-static void insert_run_now(struct sched_ent *alarm)
+static struct fd_slot *epoll_slot(int fd)
 {
-  struct sched_ent **list = &run_now;
-  
-  while(*list){
-    if ((*list)->run_before > alarm->run_before)
-      break;
-    list = &(*list)->_next_run;
+  if ((unsigned)fd >= fd_slot_count){
+    unsigned count = fd_slot_count ? fd_slot_count : 64;
+    while (count <= (unsigned)fd)
+      count *= 2;
+    struct fd_slot *slots = erealloc(fd_slots, count * sizeof(struct fd_slot));
+    if (!slots)
+      return NULL;
+    bzero(&slots[fd_slot_count], (count - fd_slot_count) * sizeof(struct fd_slot));
+    fd_slots = slots;
+    fd_slot_count = count;
   }
-  alarm->_next_run = *list;
-  *list = alarm;
+  return &fd_slots[fd];
 }
 
-static void insert_run_soon(struct sched_ent *alarm)
+static void always_ready_remove(int fd)
 {
-  struct sched_ent **list = &run_soon;
-  
-  while(*list){
-    if ((*list)->run_after > alarm->run_after)
+  unsigned i;
+  for (i = 0; i < always_ready_count; ++i){
+    if (always_ready_fds[i] == fd){
+      always_ready_fds[i] = always_ready_fds[--always_ready_count];
       break;
-    list = &(*list)->_next_run;
+    }
   }
-  alarm->_next_run = *list;
-  *list = alarm;
+  fd_slots[fd].always_ready = 0;
 }
 
-static void remove_run_list(struct sched_ent *alarm, struct sched_ent **list)
+// (re)register a descriptor with the union of the events of all the alarms watching it
+static int epoll_update(int fd)
 {
-  while(*list){
-    if (*list==alarm){
-      *list = alarm->_next_run;
-      list = &alarm->_next_run;
-      alarm->_next_run=NULL;
-      return;
-    }else{
-      list = &(*list)->_next_run;
+  struct fd_slot *slot = &fd_slots[fd];
+  uint32_t events = 0;
+  struct sched_ent *alarm;
+  for (alarm = slot->watchers; alarm; alarm = alarm->_next_watch)
+    events |= alarm->poll.events;
+
+  if (slot->always_ready){
+    if (!slot->watchers)
+      always_ready_remove(fd);
+    return 0;
+  }
+
+  int op;
+  if (!slot->watchers){
+    if (!slot->registered)
+      return 0;
+    op = EPOLL_CTL_DEL;
+  }else if (slot->registered){
+    op = EPOLL_CTL_MOD;
+  }else{
+    op = EPOLL_CTL_ADD;
+    slot->serial++;
+  }
+
+  struct epoll_event ev;
+  bzero(&ev, sizeof ev);
+  ev.events = events;
+  ev.data.u64 = ((uint64_t)slot->serial << 32) | (uint32_t)fd;
+
+  if (epoll_ctl(epoll_fd, op, fd, &ev) == -1){
+    if (op == EPOLL_CTL_ADD && errno == EPERM){
+      // not pollable, so poll() would always report it as ready
+      slot->always_ready = 1;
+      always_ready_fds[always_ready_count++] = fd;
+      return 0;
+    }
+    if (op == EPOLL_CTL_ADD && errno == EEXIST
+      && epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0){
+      slot->registered = 1;
+      return 0;
     }
+    if (op == EPOLL_CTL_DEL && (errno == EBADF || errno == ENOENT)){
+      // the descriptor was closed before it was unwatched, so epoll has already dropped it
+      slot->registered = 0;
+      return 0;
+    }
+    return WHYF_perror("epoll_ctl(%d, %d, %d, %s)", epoll_fd, op, fd, alloca_poll_events(events));
   }
+  slot->registered = (op != EPOLL_CTL_DEL);
+  return 0;
 }
 
-static void insert_wake_list(struct sched_ent *alarm)
+static int epoll_watch(struct sched_ent *alarm)
 {
-  if (alarm->wake_at == TIME_MS_NEVER_WILL)
-    return;
-  struct sched_ent **list = &wake_list, *last = NULL;
-  while(*list){
-    if ((*list)->wake_at > alarm->wake_at)
-      break;
-    last = (*list);
-    list = &last->_next_wake;
+  struct fd_slot *slot = epoll_slot(alarm->poll.fd);
+  if (!slot)
+    return -1;
+  struct sched_ent *w;
+  for (w = slot->watchers; w && w != alarm; w = w->_next_watch)
+    ;
+  if (!w){
+    alarm->_next_watch = slot->watchers;
+    slot->watchers = alarm;
   }
-  alarm->_next_wake = *list;
+  return epoll_update(alarm->poll.fd);
+}
+
+static int epoll_unwatch(struct sched_ent *alarm, int fd)
+{
+  if ((unsigned)fd >= fd_slot_count)
+    return 0;
+  if (dispatch_next == alarm)
+    dispatch_next = alarm->_next_watch;
+  struct sched_ent **list = &fd_slots[fd].watchers;
+  while (*list && *list != alarm)
+    list = &(*list)->_next_watch;
   if (*list)
-    (*list)->_prev_wake = alarm;
-  alarm->_prev_wake = last;
-  *list = alarm;
+    *list = alarm->_next_watch;
+  alarm->_next_watch = NULL;
+  return epoll_update(fd);
+}
+
+// call every alarm watching the descriptor that is interested in the events that occurred
+static void epoll_dispatch(int fd, int revents)
+{
+  if ((unsigned)fd >= fd_slot_count)
+    return;
+  struct sched_ent *alarm = fd_slots[fd].watchers;
+  while (alarm){
+    // the callback may unwatch (and free) any alarm, which advances dispatch_next past it
+    dispatch_next = alarm->_next_watch;
+    int events = revents & (alarm->poll.events | POLLERR | POLLHUP | POLLNVAL);
+    if (events)
+      call_alarm(alarm, events);
+    alarm = dispatch_next;
+  }
+  dispatch_next = NULL;
 }
 
-static void remove_wake_list(struct sched_ent *alarm)
+static int epoll_wait_ready(int wait)
 {
-  struct sched_ent *prev = alarm->_prev_wake;
-  struct sched_ent *next = alarm->_next_wake;
+  if (always_ready_count)
+    wait = 0;
+  int r = epoll_wait(epoll_fd, epoll_events, MAX_WATCHED_FDS, wait);
+  if (r == -1)
+    return -1;
+  if (IF_DEBUG(io)) {
+    strbuf b = strbuf_alloca(1024);
+    int i;
+    for (i = 0; i < r; ++i) {
+      if (i)
+	strbuf_puts(b, ", ");
+      strbuf_sprintf(b, "%d:", (int)(uint32_t)epoll_events[i].data.u64);
+      strbuf_append_poll_events(b, epoll_events[i].events);
+    }
+    DEBUGF(io, "epoll_wait(fdcount=%d, always_ready=%u, ms=%d) -> %d (%s)",
+	   fdcount, always_ready_count, wait, r, strbuf_str(b));
+  }
+  return r + always_ready_count;
+}
+
+static void epoll_process(int r)
+{
+  int i;
+  r -= always_ready_count;
+  for (i = 0; i < r; ++i){
+    int fd = (int)(uint32_t)epoll_events[i].data.u64;
+    uint32_t serial = epoll_events[i].data.u64 >> 32;
+    if ((unsigned)fd < fd_slot_count && fd_slots[fd].serial == serial && fd_slots[fd].registered)
+      epoll_dispatch(fd, epoll_events[i].events);
+  }
+  // callbacks may add or remove always-ready descriptors, so take a copy first
+  unsigned n = always_ready_count;
+  int ready[n ? n : 1];
+  bcopy(always_ready_fds, ready, n * sizeof(int));
+  unsigned j;
+  for (j = 0; j < n; ++j)
+    if ((unsigned)ready[j] < fd_slot_count && fd_slots[ready[j]].always_ready)
+      epoll_dispatch(ready[j], POLLIN | POLLOUT);
+}
+
+#else // !HAVE_SYS_EPOLL_H
+
+#define USE_EPOLL (0)
+
+#endif // !HAVE_SYS_EPOLL_H
+
+#define alloca_alarm_name(alarm) ((alarm)->stats ? alloca_str_toprint((alarm)->stats->name) : "Unnamed")
+
+int list_alarms(int log_level)
+{
+  int count=0;
+  time_ms_t now = gettime_ms();
+  struct sched_ent *alarm;
   
-  if (prev)
-    prev->_next_wake = next;
-  else if(wake_list==alarm)
-    wake_list = next;
+  unsigned i;
+
+  LOGF(log_level, "Run now;");
+  for (i = 0; i < run_now_heap.count; ++i){
+    alarm = run_now_heap.items[i];
+    count ++;
+    LOGF(log_level, "%p %s deadline in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->run_before - now);
+  }
     
-  if (next)
-    next->_prev_wake = prev;
-  
-  alarm->_prev_wake = NULL;
-  alarm->_next_wake = NULL;
+  LOGF(log_level, "Run soon;");
+  for (i = 0; i < run_soon_heap.count; ++i){
+    alarm = run_soon_heap.items[i];
+    count ++;
+    LOGF(log_level, "%p %s run in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->run_after - now);
+  }
+
+  LOGF(log_level, "Wake at;");
+  for (i = 0; i < wake_heap.count; ++i){
+    alarm = wake_heap.items[i];
+    count ++;
+    LOGF(log_level, "%p %s wake in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->wake_at - now);
+  }
+
+  LOGF(log_level, "File handles;");
+  for (i = 0; i < (unsigned)fdcount; ++i){
+    count ++;
+    LOGF(log_level, "%s watching #%d for %x", alloca_alarm_name(fd_callbacks[i]), fds[i].fd, fds[i].events);
+  }
+
+  return count;
 }
 
 // move alarms from run_soon to run_now
 static void move_run_list(){
   time_ms_t now = gettime_ms();
-  while(run_soon && run_soon->run_after <= now){
-    struct sched_ent *alarm = run_soon;
-    run_soon = run_soon->_next_run;
-    remove_wake_list(alarm);
-    insert_run_now(alarm);
+  struct sched_ent *alarm;
+  while((alarm = heap_first(&run_soon_heap)) && alarm->run_after <= now){
+    heap_remove(&run_soon_heap, alarm);
+    heap_remove(&wake_heap, alarm);
+    alarm->_sequence = sched_sequence++;
+    heap_insert(&run_now_heap, alarm);
     DEBUGF(io, "Moved %s from run_soon to run_now", alloca_alarm_name(alarm));
   }
 }
 
+// remove the most urgent alarm from run_now, ready to call it
+static struct sched_ent *pop_run_now()
+{
+  struct sched_ent *alarm = heap_first(&run_now_heap);
+  heap_remove(&run_now_heap, alarm);
+  alarm->_scheduled=0;
+  alarm->run_after = TIME_MS_NEVER_WILL;
+  return alarm;
+}
+
 // add an alarm to the list of scheduled function calls.
 // simply populate .alarm with the absolute time, and .function with the method to call.
 // on calling .poll.revents will be zero.
@@ -223,8 +522,10 @@ void _schedule(struct __sourceloc __whence, struct sched_ent *alarm)
   // don't bother to schedule an alarm that will (by definition) never run
   // not an error as it simplifies calling API use
   if (alarm->run_after != TIME_MS_NEVER_WILL){
-    insert_wake_list(alarm);
-    insert_run_soon(alarm);
+    alarm->_sequence = sched_sequence++;
+    if (alarm->wake_at != TIME_MS_NEVER_WILL)
+      heap_insert(&wake_heap, alarm);
+    heap_insert(&run_soon_heap, alarm);
     alarm->_scheduled=1;
   }
 }
@@ -238,9 +539,9 @@ void _unschedule(struct __sourceloc __whence, struct sched_ent *alarm)
     
   DEBUGF(io, "unschedule(alarm=%s)", alloca_alarm_name(alarm));
 
-  remove_run_list(alarm, &run_now);
-  remove_run_list(alarm, &run_soon);
-  remove_wake_list(alarm);
+  heap_remove(&run_now_heap, alarm);
+  heap_remove(&run_soon_heap, alarm);
+  heap_remove(&wake_heap, alarm);
   alarm->_scheduled=0;
   alarm->run_after = TIME_MS_NEVER_WILL;
 }
@@ -260,6 +561,11 @@ int _watch(struct __sourceloc __whence, struct sched_ent *alarm)
   if (alarm->_poll_index>=0 && fd_callbacks[alarm->_poll_index]==alarm){
     // updating event flags
     DEBUGF(io, "Updating watch %s, #%d for %s", alloca_alarm_name(alarm), alarm->poll.fd, alloca_poll_events(alarm->poll.events));
+#ifdef HAVE_SYS_EPOLL_H
+    if (USE_EPOLL && fds[alarm->_poll_index].fd != alarm->poll.fd
+      && epoll_unwatch(alarm, fds[alarm->_poll_index].fd) == -1)
+      epoll_disable();
+#endif
   }else{
     DEBUGF(io, "Adding watch %s, #%d for %s", alloca_alarm_name(alarm), alarm->poll.fd, alloca_poll_events(alarm->poll.events));
     if (fdcount>=MAX_WATCHED_FDS)
@@ -271,6 +577,10 @@ int _watch(struct __sourceloc __whence, struct sched_ent *alarm)
     fdcount++;
   }
   fds[alarm->_poll_index]=alarm->poll;
+#ifdef HAVE_SYS_EPOLL_H
+  if (epoll_available() && epoll_watch(alarm) == -1)
+    epoll_disable();
+#endif
   return 0;
 }
 
@@ -290,6 +600,11 @@ int _unwatch(struct __sourceloc __whence, struct sched_ent *alarm)
   if (index <0 || fds[index].fd!=alarm->poll.fd)
     return WHY("Attempted to unwatch a handle that is not being watched");
   
+#ifdef HAVE_SYS_EPOLL_H
+  if (USE_EPOLL && epoll_unwatch(alarm, alarm->poll.fd) == -1)
+    epoll_disable();
+#endif
+
   fdcount--;
   if (index!=fdcount){
     // squash fds
@@ -322,6 +637,13 @@ static void call_alarm(struct sched_ent *alarm, int revents)
   if (call_stats.totals)
     fd_func_enter(__HERE__, &call_stats);
   
+  // scheduled alarms are called with no revents, and may have been called late
+  time_ms_t called = gettime_ms();
+  time_ms_t lateness = -1;
+  if (!revents)
+    lateness = called > alarm->run_before ? called - alarm->run_before : 0;
+  struct profile_total *stats = alarm->stats;
+  
   alarm->poll.revents = revents;
   alarm->function(alarm);
 
@@ -330,6 +652,10 @@ static void call_alarm(struct sched_ent *alarm, int revents)
   if (call_stats.totals)
     fd_func_exit(__HERE__, &call_stats);
 
+  // the alarm may have been free()d by its own function, so don't dereference it
+  if (stats)
+    fd_record_latency(stats, gettime_ms() - called, lateness);
+
   DEBUGF(io, "Alarm %p returned",alarm);
 
   OUT();
@@ -341,15 +667,14 @@ int fd_poll2(time_ms_t (*waiting)(time_ms_t, time_ms_t, time_ms_t), void (*wokeu
   IN();
   
   // clear the run now list of any alarms that are overdue
+  struct sched_ent *run_now = heap_first(&run_now_heap);
   if (run_now && run_now->run_before <= gettime_ms()){
-    struct sched_ent *alarm = run_now;
-    run_now = alarm->_next_run;
-    alarm->_scheduled=0;
-    alarm->run_after = TIME_MS_NEVER_WILL;
-    call_alarm(alarm, 0);
+    call_alarm(pop_run_now(), 0);
     RETURN(1);
   }
   
+  struct sched_ent *wake_list = heap_first(&wake_heap);
+  
   // return 0 when there's nothing to do, it doesn't make sense to wait for infinity
   if (!run_now && !wake_list && fdcount==0)
     RETURN(0);
@@ -362,6 +687,7 @@ int fd_poll2(time_ms_t (*waiting)(time_ms_t, time_ms_t, time_ms_t), void (*wokeu
     wait_until = now;
   }else{
     time_ms_t next_run=TIME_MS_NEVER_WILL;
+    struct sched_ent *run_soon = heap_first(&run_soon_heap);
     if(run_soon)
       next_run = run_soon->run_after;
     
@@ -393,6 +719,19 @@ int fd_poll2(time_ms_t (*waiting)(time_ms_t, time_ms_t, time_ms_t), void (*wokeu
     if (fdcount){
       DEBUGF(io, "Calling poll with %dms wait", wait);
 	
+#ifdef HAVE_SYS_EPOLL_H
+      if (USE_EPOLL){
+	fd_func_enter(__HERE__, &call_stats);
+	r = epoll_wait_ready(wait);
+	fd_func_exit(__HERE__, &call_stats);
+
+	if (r==-1 && errno!=EINTR){
+	  WHY_perror("epoll_wait");
+	  epoll_disable();
+	}
+      }else
+#endif
+      {
       fd_func_enter(__HERE__, &call_stats);
       r = poll(fds, fdcount, wait);
       fd_func_exit(__HERE__, &call_stats);
@@ -413,6 +752,7 @@ int fd_poll2(time_ms_t (*waiting)(time_ms_t, time_ms_t, time_ms_t), void (*wokeu
 	}
 	DEBUGF(io, "poll(fds=(%s), fdcount=%d, ms=%d) -> %d", strbuf_str(b), fdcount, wait, r);
       }
+      }
       
     }else if(wait>0){
       fd_func_enter(__HERE__, &call_stats);
@@ -426,6 +766,7 @@ int fd_poll2(time_ms_t (*waiting)(time_ms_t, time_ms_t, time_ms_t), void (*wokeu
     wokeup();
   
   move_run_list();
+  run_now = heap_first(&run_now_heap);
   
   // We don't want a single alarm to be able to reschedule itself and starve all IO
   // So we only check for new overdue alarms if we attempted to sleep
@@ -433,6 +774,14 @@ int fd_poll2(time_ms_t (*waiting)(time_ms_t, time_ms_t, time_ms_t), void (*wokeu
     RETURN(1);
   
   // process all watched IO handles once (we need to be fair)
+#ifdef HAVE_SYS_EPOLL_H
+  if (r>0 && USE_EPOLL) {
+    epoll_process(r);
+    // time may have passed while processing IO, or processing IO could trigger a new overdue alarm
+    move_run_list();
+    
+  }else
+#endif
   if (r>0) {
     int i;
     for(i=fdcount -1;i>=0;i--){
@@ -450,11 +799,7 @@ int fd_poll2(time_ms_t (*waiting)(time_ms_t, time_ms_t, time_ms_t), void (*wokeu
     
   }else if (run_now){
     // No IO, no overdue alarms but another alarm is runnable? run a single alarm before polling again
-    struct sched_ent *alarm = run_now;
-    run_now = alarm->_next_run;
-    alarm->_scheduled=0;
-    alarm->run_after = TIME_MS_NEVER_WILL;
-    call_alarm(alarm, 0);
+    call_alarm(pop_run_now(), 0);
   }
   
   RETURN(1);
@@ -60,6 +60,32 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "os.h" // for time_ms_t
 #include "whence.h"
 
+/* HDR-style log-linear histogram of millisecond intervals.  Values below 8ms are counted
+ * exactly, above that each power of two is split into four buckets, so any percentile is
+ * reported to within 25% of its true value, in a fixed 480 bytes.
+ */
+#define LATENCY_SUB_BUCKET_BITS 2
+#define LATENCY_BUCKETS (120)
+
+struct latency_histogram {
+  uint32_t counts[LATENCY_BUCKETS];
+  uint64_t count;
+  time_ms_t max;
+};
+
+void latency_histogram_record(struct latency_histogram *h, time_ms_t value);
+time_ms_t latency_histogram_percentile(const struct latency_histogram *h, unsigned percent);
+
+/* Latency histograms for all the calls to alarms that share a profile_total; how long each call
+ * took, and for scheduled (not IO) calls, how late the call was with respect to run_before.
+ */
+struct alarm_latency {
+  struct alarm_latency *_next;
+  struct profile_total *stats;
+  struct latency_histogram duration;
+  struct latency_histogram lateness;
+};
+
 struct profile_total {
   struct profile_total *_next;
   int _initialised;
@@ -68,6 +94,7 @@ struct profile_total {
   time_ms_t total_time;
   time_ms_t child_time;
   int calls;
+  struct alarm_latency *latency;
 };
 
 struct call_stats{
@@ -82,9 +109,11 @@ struct sched_ent;
 typedef void (*ALARM_FUNCP) (struct sched_ent *alarm);
 
 struct sched_ent{
-  struct sched_ent *_next_wake;
-  struct sched_ent *_prev_wake;
-  struct sched_ent *_next_run;
+  // positions (plus one) in the wake and run heaps, zero if not present (see fdqueue.c)
+  unsigned _wake_index;
+  unsigned _run_index;
+  // breaks ties between alarms with equal times, so they run in the order they were queued
+  uint64_t _sequence;
   uint8_t _scheduled;
   
   ALARM_FUNCP function;
@@ -105,6 +134,8 @@ struct sched_ent{
   
   struct profile_total *stats;
   int _poll_index;
+  // other alarms watching the same file descriptor (see fdqueue.c)
+  struct sched_ent *_next_watch;
 };
 
 #define STRUCT_SCHED_ENT_UNUSED {\
@@ -161,10 +192,12 @@ int fd_showstats();
 int fd_checkalarms();
 int fd_func_enter(struct __sourceloc, struct call_stats *this_call);
 int fd_func_exit(struct __sourceloc, struct call_stats *this_call);
+void fd_record_latency(struct profile_total *stats, time_ms_t duration, time_ms_t lateness);
+struct alarm_latency *fd_latency_first();
 void dump_stack(int log_level);
 unsigned fd_depth();
 
-#define IN() static struct profile_total _aggregate_stats={NULL,0,__FUNCTION__,0,0,0,0}; \
+#define IN() static struct profile_total _aggregate_stats={NULL,0,__FUNCTION__,0,0,0,0,NULL}; \
     struct call_stats _this_call={.totals=&_aggregate_stats}; \
     fd_func_enter(__HERE__, &_this_call);
 
@@ -23,6 +23,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "lang.h" // for FALLTHROUGH
 #include "serval_types.h"
 #include "http_server.h"
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #include "sighandlers.h"
 #include "conf.h"
 #include "log.h"
@@ -101,6 +104,11 @@ static struct profile_total http_server_stats = {
 	  r->request_content_remaining \
 	)
 
+// The chunk-size line: CRLF closing the previous chunk, 8 hex digits and CRLF.
+#define CHUNK_HEADER_MAXLEN 12
+// The last-chunk: CRLF closing the previous chunk, "0", CRLF and the CRLF that ends the trailer.
+#define CHUNK_LAST_MAXLEN 7
+
 static void http_server_poll(struct sched_ent *);
 static void http_request_set_idle_timeout(struct http_request *r);
 static int http_request_parse_verb(struct http_request *r);
@@ -111,21 +119,23 @@ static int http_request_parse_header(struct http_request *r);
 static int http_request_start_body(struct http_request *r);
 static int http_request_parse_body_form_data(struct http_request *r);
 static void http_request_start_response(struct http_request *r);
+static void http_request_parse(struct http_request *r);
 
-void http_request_init(struct http_request *r, int sockfd)
+/* The end of the part of buffer[] that the current request may use.  Any bytes of the next
+ * request on a persistent connection are kept beyond it.
+ */
+static inline char *_buffer_end(struct http_request *r)
+{
+  return r->buffer + sizeof r->buffer - r->pipelined_length;
+}
+
+static void _http_request_start_receiving(struct http_request *r)
 {
-  assert(sockfd != -1);
   r->request_header.content_length = CONTENT_LENGTH_UNKNOWN;
   r->request_content_remaining = CONTENT_LENGTH_UNKNOWN;
   r->response.header.content_length = CONTENT_LENGTH_UNKNOWN;
   r->response.header.resource_length = CONTENT_LENGTH_UNKNOWN;
   r->response.header.minor_version = 1;
-  r->alarm.stats = &http_server_stats;
-  r->alarm.function = http_server_poll;
-  assert(r->idle_timeout >= 0);
-  if (r->idle_timeout == 0)
-    r->idle_timeout = 10000; // 10 seconds
-  r->alarm.poll.fd = sockfd;
   r->alarm.poll.events = POLLIN;
   r->phase = RECEIVE;
   r->reserved = r->buffer;
@@ -133,19 +143,37 @@ void http_request_init(struct http_request *r, int sockfd)
   // reserved ok.
   r->received = r->decode_ptr = r->end_received = r->end_decoded = r->parsed = r->cursor = r->buffer + sizeof(void*) * (1 + NELS(r->query_parameters));
   r->parser = http_request_parse_verb;
+}
+
+void http_request_init(struct http_request *r, int sockfd)
+{
+  assert(sockfd != -1);
+  r->alarm.stats = &http_server_stats;
+  r->alarm.function = http_server_poll;
+  assert(r->idle_timeout >= 0);
+  if (r->idle_timeout == 0)
+    r->idle_timeout = 10000; // 10 seconds
+  assert(r->keepalive_timeout >= 0);
+  r->alarm.poll.fd = sockfd;
+  _http_request_start_receiving(r);
   watch(&r->alarm);
   http_request_set_idle_timeout(r);
 }
 
-static void http_request_set_idle_timeout(struct http_request *r)
+static void http_request_set_timeout(struct http_request *r, time_ms_t timeout)
 {
-  assert(r->phase == RECEIVE || r->phase == TRANSMIT);
-  r->alarm.alarm = gettime_ms() + r->idle_timeout;
+  r->alarm.alarm = gettime_ms() + timeout;
   r->alarm.deadline = r->alarm.alarm + 500;
   unschedule(&r->alarm);
   schedule(&r->alarm);
 }
 
+static void http_request_set_idle_timeout(struct http_request *r)
+{
+  assert(r->phase == RECEIVE || r->phase == TRANSMIT);
+  http_request_set_timeout(r, r->idle_timeout);
+}
+
 void http_request_free_response_buffer(struct http_request *r)
 {
   if (r->response_free_buffer) {
@@ -161,7 +189,7 @@ int http_request_set_response_bufsize(struct http_request *r, size_t bufsiz)
 {
   // Don't allocate a new buffer if the existing one contains content.
   assert(r->response_buffer_sent == r->response_buffer_length);
-  const char *const bufe = r->buffer + sizeof r->buffer;
+  const char *const bufe = _buffer_end(r);
   assert(r->reserved < bufe);
   size_t rbufsiz = bufe - r->reserved;
   if (bufsiz <= rbufsiz) {
@@ -191,7 +219,7 @@ void http_request_finalise(struct http_request *r)
     RETURNVOID;
   assert(r->phase == RECEIVE || r->phase == TRANSMIT || r->phase == PAUSE);
   unschedule(&r->alarm);
-  if (r->phase != PAUSE)
+  if (r->phase != PAUSE && !r->receive_paused)
     unwatch(&r->alarm);
   close(r->alarm.poll.fd);
   r->alarm.poll.fd = -1;
@@ -374,7 +402,7 @@ static inline int _run_out_of_decoded_content(struct http_request *r)
  */
 static inline int _buffer_full(struct http_request *r)
 {
-  const char *const bufend = r->buffer + sizeof r->buffer;
+  const char *const bufend = _buffer_end(r);
   return r->parsed == r->received && (r->end_decoded == bufend || r->request_content_remaining == 0);
 }
 
@@ -1018,7 +1046,7 @@ static int http_request_start_parsing_headers(struct http_request *r)
  *
  * If the end of headers is parsed (blank line), then sets r->parser to the next parsing function
  * and returns 0.  If a single header line is successfully parsed, returns 0 after advancing
- * r->parsed.  If parsing cannot complete due to running out of data, returns 0 without changing
+ * r->parsed.  If parsing cannot complete due to running out of data, returns 100 without changing
  * r->parser, so this function will be called again once more data has been read.  Returns a 4nn or
  * 5nn HTTP result code if parsing fails.  Returns -1 if an unexpected error occurs.
  *
@@ -1027,7 +1055,8 @@ static int http_request_start_parsing_headers(struct http_request *r)
 static int http_request_parse_header(struct http_request *r)
 {
   DEBUG_DUMP_PARSER(r);
-  _skip_to_eol(r);
+  if (!_skip_to_eol(r))
+    return 100; // read more and try again
   const char *const eol = r->cursor;
   _skip_eol(r);
   if (eol == r->parsed) { // if EOL is at start of line (ie, blank line)...
@@ -1124,6 +1153,23 @@ static int http_request_parse_header(struct http_request *r)
     return 0;
   }
   _rewind(r);
+  if (_skip_literal_nocase(r, "Connection:")) {
+    struct substring token;
+    while (_skip_optional_space(r), _skip_token(r, &token)) {
+      size_t len = token.end - token.start;
+      if (len == 5 && strncasecmp(token.start, "close", len) == 0)
+	r->request_header.connection_close = 1;
+      else if (len == 10 && strncasecmp(token.start, "keep-alive", len) == 0)
+	r->request_header.connection_keep_alive = 1;
+      _skip_optional_space(r);
+      if (!_skip_literal(r, ","))
+	break;
+    }
+    r->cursor = nextline;
+    _commit(r);
+    return 0;
+  }
+  _rewind(r);
   if (_skip_literal_nocase(r, "Transfer-Encoding:")) {
     if (r->request_header.chunked){
       IDEBUGF(r->debug, "Skipping duplicate HTTP header Transfer-Encoding: %s", alloca_toprint(50, sol, r->end_decoded - sol));
@@ -1315,6 +1361,16 @@ static int http_request_start_continue(struct http_request *r){
   return 0;
 }
 
+/* HTTP/1.1 connections are persistent unless the client says otherwise, HTTP/1.0 connections only
+ * if the client asks.
+ */
+static int http_request_wants_keep_alive(const struct http_request *r)
+{
+  if (r->keepalive_timeout == 0 || r->request_header.connection_close)
+    return 0;
+  return r->version_minor >= 1 || r->request_header.connection_keep_alive;
+}
+
 /* If parsing completes, then sets r->parser to the next parsing function and returns 0.  If parsing
  * cannot complete due to running out of data, returns 0 without changing r->parser, so this
  * function will be called again once more data has been read.  Returns a 4nn or 5nn HTTP result
@@ -1390,9 +1446,20 @@ static int http_request_start_body(struct http_request *r)
   if (r->request_header.content_length != CONTENT_LENGTH_UNKNOWN) {
     size_t unparsed = r->end_decoded - r->parsed;
     if (unparsed > r->request_header.content_length) {
-      IDEBUGF(r->debug, "Malformed request: already read %zu bytes past end of content",
-	(size_t)(unparsed - r->request_header.content_length));
-      return 431; // Request Header Fields Too Large
+      size_t excess = unparsed - r->request_header.content_length;
+      if (!http_request_wants_keep_alive(r)) {
+	IDEBUGF(r->debug, "Malformed request: already read %zu bytes past end of content", excess);
+	return 431; // Request Header Fields Too Large
+      }
+      // The client has sent its next request without waiting for the response to this one, so set
+      // those bytes aside at the end of the buffer until this response has been sent.
+      assert(r->pipelined_length == 0);
+      char *next = r->end_received - excess;
+      memmove(r->buffer + sizeof r->buffer - excess, next, excess);
+      r->pipelined_length = excess;
+      r->end_received = r->decode_ptr = r->end_decoded = next;
+      r->request_content_remaining = 0;
+      IDEBUGF(r->debug, "Set aside %zu bytes of pipelined request", excess);
     }
     else
       r->request_content_remaining = r->request_header.content_length - unparsed;
@@ -1678,9 +1745,12 @@ static int http_request_parse_body_form_data(struct http_request *r)
 	      IDEBUGF(r->debug, "Skipping duplicate HTTP multipart header %s", alloca_toprint(50, sol, r->end_decoded - sol));
 	      return 400;
 	    }
-	    if (_parse_content_type(r, &r->part_header.content_type) && _skip_optional_space(r) && _skip_crlf(r)) {
+	    struct mime_content_type ct;
+	    bzero(&ct, sizeof ct);
+	    if (_parse_content_type(r, &ct) && _skip_optional_space(r) && _skip_crlf(r)) {
 	      _rewind_crlf(r);
 	      _commit(r);
+	      r->part_header.content_type = ct;
 	      IDEBUGF(r->debug, "Parsed HTTP multipart header Content-Type: %s", alloca_mime_content_type(&r->part_header.content_type));
 	      return 0;
 	    }
@@ -1690,9 +1760,12 @@ static int http_request_parse_body_form_data(struct http_request *r)
 	      IDEBUGF(r->debug, "Skipping duplicate HTTP multipart header %s", alloca_toprint(50, sol, r->end_decoded - sol));
 	      return 400;
 	    }
-	    if (_parse_content_disposition(r, &r->part_header.content_disposition) && _skip_optional_space(r) && _skip_crlf(r)) {
+	    struct mime_content_disposition cd;
+	    bzero(&cd, sizeof cd);
+	    if (_parse_content_disposition(r, &cd) && _skip_optional_space(r) && _skip_crlf(r)) {
 	      _rewind_crlf(r);
 	      _commit(r);
+	      r->part_header.content_disposition = cd;
 	      IDEBUGF(r->debug, "Parsed HTTP multipart header Content-Disposition: %s", alloca_mime_content_disposition(&r->part_header.content_disposition));
 	      return 0;
 	    }
@@ -1703,6 +1776,8 @@ static int http_request_parse_body_form_data(struct http_request *r)
 	    return 0;
 	  }
 	}
+	// A header line that is not yet complete may still be valid once the rest arrives.
+	const int ran_out = _run_out_of_decoded_content(r);
 	r->cursor = sol;
 	if (_buffer_full(r)) {
 	  // The line does not start with "<Token>:" and is too long to fit into the buffer.  Start
@@ -1714,7 +1789,7 @@ static int http_request_parse_body_form_data(struct http_request *r)
 	  _commit(r);
 	  return 0;
 	}
-	if (_run_out_of_decoded_content(r))
+	if (ran_out)
 	  return 100; // read more and try again
 	IDEBUGF(r->debug, "Malformed HTTP %s form data part: invalid header %s", r->verb, alloca_toprint(50, sol, r->end_decoded - sol));
 	DEBUG_DUMP_PARSER(r);
@@ -1801,7 +1876,7 @@ static void http_request_receive(struct http_request *r)
     http_request_read(r, buff, sizeof buff);
     RETURNVOID;
   }
-  const char *const bufend = r->buffer + sizeof r->buffer;
+  const char *const bufend = _buffer_end(r);
   assert(r->end_received <= bufend);
   assert(r->decode_ptr <= r->end_received);
   assert(r->end_decoded <= r->decode_ptr);
@@ -1860,10 +1935,18 @@ static void http_request_receive(struct http_request *r)
   // We got some data, so reset the inactivity timer and invoke the parsing state machine to process
   // it.  The state machine invokes the caller-supplied callback functions.
   http_request_set_idle_timeout(r);
-  // Parse the unparsed and received data.
+  http_request_parse(r);
+  OUT();
+}
+
+/* Parse the unparsed and received data.
+ */
+static void http_request_parse(struct http_request *r)
+{
+  IN();
   bool_t decode_more=1;
 
-  while (r->phase == RECEIVE) {
+  while (r->phase == RECEIVE && !r->receive_paused) {
     int result;
     if (r->decoder && decode_more){
       result = r->decoder(r);
@@ -1934,6 +2017,16 @@ static void http_request_receive(struct http_request *r)
       RETURNVOID;
     }
   }
+  if (r->receive_paused) {
+    if (r->phase == RECEIVE && r->response.status_code == 0) {
+      IDEBUG(r->debug, "Receive paused");
+      RETURNVOID;
+    }
+    // the handler paused but then gave a response
+    r->receive_paused = 0;
+    if (r->phase == RECEIVE)
+      watch(&r->alarm);
+  }
   if (r->phase != RECEIVE) {
     assert(r->response.status_code != 0);
     RETURNVOID;
@@ -1947,6 +2040,87 @@ static void http_request_receive(struct http_request *r)
   OUT();
 }
 
+/* Send the next part of the file content that a generator asked for.  Uses sendfile(2) where
+ * available, so the bytes never pass through the response buffer, otherwise reads them into the
+ * (empty) response buffer for sending in the usual way.  Returns the number of bytes written to the
+ * socket, which may be zero, or -1 on error.
+ */
+static ssize_t http_request_send_file(struct http_request *r)
+{
+  assert(r->response_file_length > 0);
+  assert(r->response_buffer_length == r->response_buffer_sent);
+#ifdef HAVE_SYS_SENDFILE_H
+  off_t offset = (off_t) r->response_file_offset;
+  if ((uint64_t) offset == r->response_file_offset) {
+    size_t len = r->response_file_length < 0x7ffff000 ? r->response_file_length : 0x7ffff000;
+    ssize_t written = sendfile(r->alarm.poll.fd, r->response_file_fd, &offset, len);
+    if (written != -1) {
+      if (written == 0)
+	return WHYF("sendfile(%d,%d,%"PRIu64",%zu) reached end of file", r->alarm.poll.fd, r->response_file_fd, r->response_file_offset, len);
+      r->response_file_offset += (size_t) written;
+      r->response_file_length -= (size_t) written;
+      return written;
+    }
+    switch (errno) {
+      case EINTR:
+      case EAGAIN:
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+      case EWOULDBLOCK:
+#endif
+	return 0;
+      case EINVAL:
+      case ENOSYS:
+	break; // not supported for this file or socket, so copy instead
+      default:
+	return WHYF_perror("sendfile(%d,%d,%"PRIu64",%zu)", r->alarm.poll.fd, r->response_file_fd, r->response_file_offset, len);
+    }
+  }
+#endif
+  size_t len = r->response_buffer_size;
+  if (len > r->response_file_length)
+    len = r->response_file_length;
+  ssize_t rd = pread64(r->response_file_fd, r->response_buffer, len, (off64_t) r->response_file_offset);
+  if (rd == -1)
+    return WHYF_perror("pread64(%d,%p,%zu,%"PRIu64")", r->response_file_fd, r->response_buffer, len, r->response_file_offset);
+  if (rd == 0)
+    return WHYF("pread64(%d) reached end of file at %"PRIu64, r->response_file_fd, r->response_file_offset);
+  r->response_file_offset += (size_t) rd;
+  r->response_file_length -= (size_t) rd;
+  r->response_buffer_sent = 0;
+  r->response_buffer_length = (size_t) rd;
+  ssize_t written = write_nonblock(r->alarm.poll.fd, r->response_buffer, (size_t) rd);
+  if (written != -1)
+    r->response_buffer_sent = (size_t) written;
+  return written;
+}
+
+/* Make a persistent connection ready for its next request, once the response to the last one has
+ * been sent.  If some of the next request has already been received, parse it straight away.
+ */
+static void http_request_next(struct http_request *r)
+{
+  IDEBUG(r->debug, "Done, keeping connection open for next request");
+  if (r->reset)
+    r->reset(r);
+  http_request_free_response_buffer(r);
+  HTTP_REQUEST_PARSER *handle_first_line = r->handle_first_line;
+  HTTP_REQUEST_PARSER *handle_headers = r->handle_headers;
+  const size_t start = offsetof(struct http_request, verb);
+  bzero((char *)r + start, offsetof(struct http_request, buffer) - start);
+  r->handle_first_line = handle_first_line;
+  r->handle_headers = handle_headers;
+  _http_request_start_receiving(r);
+  watch(&r->alarm);
+  if (r->pipelined_length) {
+    memmove(r->received, r->buffer + sizeof r->buffer - r->pipelined_length, r->pipelined_length);
+    r->end_received = r->decode_ptr = r->end_decoded = r->received + r->pipelined_length;
+    r->pipelined_length = 0;
+    http_request_set_idle_timeout(r);
+    http_request_parse(r);
+  } else
+    http_request_set_timeout(r, r->keepalive_timeout);
+}
+
 /* Write the current contents of the response buffer to the HTTP socket.  When no more bytes can be
  * written, return so that socket polling can continue.  Once all bytes are sent, if there is a
  * content generator function and the request is not paused, invoke it to put more content in the
@@ -1974,6 +2148,32 @@ static void http_request_send_response(struct http_request *r)
     }
     if (unsent == 0)
       r->response_buffer_sent = r->response_buffer_length = 0;
+    if (unsent == 0 && r->response_file_length) {
+      sigPipeFlag = 0;
+      ssize_t written = http_request_send_file(r);
+      if (written == -1) {
+	IDEBUG(r->debug, "HTTP socket sendfile error, closing connection");
+	http_request_finalise(r);
+	RETURNVOID;
+      }
+      if (sigPipeFlag) {
+	IDEBUG(r->debug, "Received SIGPIPE on HTTP socket write, closing connection");
+	http_request_finalise(r);
+	RETURNVOID;
+      }
+      if (written == 0)
+	RETURNVOID;
+      r->response_sent += (size_t) written;
+      assert(r->response_sent <= r->response_length);
+      IDEBUGF(r->debug, "Sent %zu bytes of file content to HTTP socket, total %"PRIhttp_size_t", remaining=%"PRIhttp_size_t,
+	    (size_t) written, r->response_sent, r->response_length - r->response_sent);
+      if (r->phase != PAUSE)
+	http_request_set_idle_timeout(r);
+      // If the socket could not take everything, go back to polling.
+      if (r->response_file_length || r->response_buffer_sent < r->response_buffer_length)
+	RETURNVOID;
+      continue;
+    }
     if (r->phase == PAUSE) {
       // If the generator has paused the request, keep polling i/o for output until the response
       // buffer is all sent, then stop polling i/o.
@@ -1982,10 +2182,13 @@ static void http_request_send_response(struct http_request *r)
 	RETURNVOID; // nothing left to send
       }
     } else if (r->response.content_generator) {
+      // A chunked response needs room around the generated content for the chunk-size line (with
+      // the CRLF that closes the previous chunk) and the last-chunk that ends the response.
+      size_t overhead = r->response_chunked ? CHUNK_HEADER_MAXLEN + CHUNK_LAST_MAXLEN : 0;
       // If the buffer is smaller than the content generator needs, and it contains no unsent
       // content, then allocate a larger buffer.
-      if (r->response_buffer_need > r->response_buffer_size && unsent == 0) {
-	if (http_request_set_response_bufsize(r, r->response_buffer_need) == -1) {
+      if (r->response_buffer_need + overhead > r->response_buffer_size && unsent == 0) {
+	if (http_request_set_response_bufsize(r, r->response_buffer_need + overhead) == -1) {
 	  WHYF("HTTP response truncated at offset=%"PRIhttp_size_t" due to insufficient buffer space",
 	      r->response_sent);
 	  http_request_finalise(r);
@@ -2003,7 +2206,10 @@ static void http_request_send_response(struct http_request *r)
       // more content.
       assert(r->response_buffer_length <= r->response_buffer_size);
       size_t unfilled = r->response_buffer_size - r->response_buffer_length;
-      if (unfilled > 0 && unfilled >= r->response_buffer_need) {
+      if (unfilled > overhead && unfilled - overhead >= r->response_buffer_need) {
+	size_t head = r->response_chunked ? (r->response_chunk_open ? CHUNK_HEADER_MAXLEN : CHUNK_HEADER_MAXLEN - 2) : 0;
+	char *content = r->response_buffer + r->response_buffer_length + head;
+	size_t room = unfilled - overhead;
 	// The content generator must fill or partly fill the part of the buffer we indicate and
 	// return the number of bytes appended.  If it returns zero, it means it has no more
 	// content (EOF), and must not be called again.  If the return value exceeds the buffer size
@@ -2012,23 +2218,65 @@ static void http_request_send_response(struct http_request *r)
 	// -1, it means an unrecoverable error occurred, and the generator must not be called again.
 	struct http_content_generator_result result;
 	bzero(&result, sizeof result);
-	int ret = r->response.content_generator(r, (unsigned char *) r->response_buffer + r->response_buffer_length, unfilled, &result);
+	int ret = r->response.content_generator(r, (unsigned char *) content, room, &result);
 	if (ret == -1) {
 	  WHY("Content generation error, closing connection");
 	  http_request_finalise(r);
 	  RETURNVOID;
 	}
-	assert(result.generated <= unfilled);
+	assert(result.generated <= room);
+	if (result.generated && r->response_chunked) {
+	  // The chunk size has a fixed number of digits, so it exactly fills the space left for it.
+	  char *hp = r->response_buffer + r->response_buffer_length;
+	  if (r->response_chunk_open) {
+	    *hp++ = '\r';
+	    *hp++ = '\n';
+	  }
+	  char hex[9];
+	  snprintf(hex, sizeof hex, "%08zx", result.generated);
+	  memcpy(hp, hex, 8);
+	  hp[8] = '\r';
+	  hp[9] = '\n';
+	  assert(hp + 10 == content);
+	  r->response_buffer_length += head;
+	  r->response_chunk_open = 1;
+	}
 	r->response_buffer_length += result.generated;
 	r->response_buffer_need = result.need;
-	if (result.generated == 0 && result.need <= unfilled && r->phase != PAUSE) {
+	if (result.file_length && r->response_chunked) {
+	  WHY("HTTP response generator cannot send file content without a Content-Length, closing connection");
+	  http_request_finalise(r);
+	  RETURNVOID;
+	}
+	if (result.file_length) {
+	  r->response_file_fd = result.file_fd;
+	  r->response_file_offset = result.file_offset;
+	  r->response_file_length = result.file_length;
+	  // like buffered content, file content is truncated at the Content-Length
+	  if (remaining != CONTENT_LENGTH_UNKNOWN) {
+	    size_t buffered = r->response_buffer_length - r->response_buffer_sent;
+	    http_size_t room = remaining > buffered ? remaining - buffered : 0;
+	    if (r->response_file_length > room)
+	      r->response_file_length = room;
+	  }
+	}
+	if (result.generated == 0 && result.file_length == 0 && result.need <= room && r->phase != PAUSE) {
 	  WHYF("HTTP response generator produced no content at offset %"PRIhttp_size_t" (ret=%d)", r->response_sent, ret);
 	  http_request_finalise(r);
 	  RETURNVOID;
 	}
 	IDEBUGF(r->debug, "Generated HTTP %zu bytes of content, need %zu bytes of buffer (ret=%d)", result.generated, result.need, ret);
-	if (r->phase != PAUSE && ret == 0)
+	if (r->phase != PAUSE && ret == 0) {
 	  r->response.content_generator = NULL; // ensure we never invoke again
+	  if (r->response_chunked) {
+	    const char *last = r->response_chunk_open ? "\r\n0\r\n\r\n" : "0\r\n\r\n";
+	    size_t len = strlen(last);
+	    assert(r->response_buffer_length + len <= r->response_buffer_size);
+	    memcpy(r->response_buffer + r->response_buffer_length, last, len);
+	    r->response_buffer_length += len;
+	    r->response_chunk_open = 0;
+	  }
+	}
 	continue;
       }
     } else if (remaining != CONTENT_LENGTH_UNKNOWN && unsent < remaining) {
@@ -2073,6 +2321,10 @@ static void http_request_send_response(struct http_request *r)
     if ((size_t) written < (size_t) unsent)
       RETURNVOID;
   }
+  if (r->keep_alive) {
+    http_request_next(r);
+    RETURNVOID;
+  }
   IDEBUG(r->debug, "Done, closing connection");
   http_request_finalise(r);
   OUT();
@@ -2082,7 +2334,8 @@ static void _http_request_start_transmitting(struct http_request *r)
 {
   assert(r->phase == RECEIVE || r->phase == PAUSE);
   r->phase = TRANSMIT;
-  r->alarm.poll.events = POLLIN|POLLOUT;
+  // On a persistent connection, the next request stays in the socket until this response is done.
+  r->alarm.poll.events = r->keep_alive ? POLLOUT : POLLIN|POLLOUT;
   watch(&r->alarm);
   http_request_set_idle_timeout(r);
 }
@@ -2117,6 +2370,36 @@ void http_request_resume_response(struct http_request *r)
   }
 }
 
+/* Request handlers can call this method to stop the request content from being received and parsed,
+ * eg, while they do work in steps from their own alarm that must finish before they can accept
+ * more content or respond.  The connection is neither polled nor timed out until the handler calls
+ * http_request_resume_receive(), which it must always do.  If the handler pauses in its
+ * handle_content_end function, it is called again after resuming.
+ */
+void http_request_pause_receive(struct http_request *r)
+{
+  IDEBUG(r->debug, "Pausing receive");
+  assert(r->phase == RECEIVE);
+  assert(!r->receive_paused);
+  r->receive_paused = 1;
+  unschedule(&r->alarm);
+  unwatch(&r->alarm);
+}
+
+void http_request_resume_receive(struct http_request *r)
+{
+  assert(r->phase == RECEIVE);
+  assert(r->receive_paused);
+  IDEBUG(r->debug, "Resuming receive");
+  r->receive_paused = 0;
+  r->alarm.poll.events = POLLIN;
+  watch(&r->alarm);
+  http_request_set_idle_timeout(r);
+  http_request_parse(r); // could change the phase to TRANSMIT or DONE
+  if (r->phase == DONE && r->release)
+    r->release(r); // after this, *r is no longer valid
+}
+
 static void http_server_poll(struct sched_ent *alarm)
 {
   struct http_request *r = (struct http_request *) alarm;
@@ -2358,8 +2641,16 @@ static int _render_response(struct http_request *r)
   assert(hr.header.content_type != NULL);
   assert(hr.header.content_type->type[0]);
   assert(hr.header.content_type->subtype[0]);
+  // Without a Content-Length, the client can only find the end of generated content on a
+  // persistent connection if it is chunked, which HTTP/1.0 clients do not understand.
+  if (r->keep_alive && hr.header.content_length == CONTENT_LENGTH_UNKNOWN) {
+    if (r->version_minor >= 1)
+      r->response_chunked = 1;
+    else
+      r->keep_alive = 0;
+  }
   strbuf_sprintf(sb, "HTTP/1.%d %03u %s\r\n", hr.header.minor_version, hr.status_code, hr.reason);
-  strbuf_puts(sb, "Connection: Close\r\n");
+  strbuf_puts(sb, r->keep_alive ? "Connection: keep-alive\r\n" : "Connection: Close\r\n");
   strbuf_sprintf(sb, "Server: servald %s\r\n", version_servald);
   if (hr.header.location) {
     strbuf_puts(sb, "Location: ");
@@ -2385,6 +2676,8 @@ static int _render_response(struct http_request *r)
   }
   if (hr.header.content_length != CONTENT_LENGTH_UNKNOWN)
     strbuf_sprintf(sb, "Content-Length: %"PRIhttp_size_t"\r\n", hr.header.content_length);
+  else if (r->response_chunked)
+    strbuf_puts(sb, "Transfer-Encoding: chunked\r\n");
   if (hr.header.allow_origin.null || hr.header.allow_origin.scheme[0]) {
     strbuf_puts(sb, "Access-Control-Allow-Origin: ");
     if (hr.header.allow_origin.null) {
@@ -2469,6 +2762,11 @@ static void http_request_start_response(struct http_request *r)
 {
   IN();
   assert(r->phase == RECEIVE);
+  // The connection can only be kept open for the next request if all of this one has been read.
+  r->keep_alive = http_request_wants_keep_alive(r)
+	       && !r->decoder
+	       && r->request_content_remaining == 0
+	       && r->parsed == r->end_decoded;
   _release_reserved(r);
   if (r->response.content || r->response.content_generator) {
     assert(r->response.header.content_type != NULL);
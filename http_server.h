@@ -108,6 +108,8 @@ struct http_request_headers {
   struct http_client_authorization authorization;
   bool_t expect:1;
   bool_t chunked:1;
+  bool_t connection_close:1; // Connection: close
+  bool_t connection_keep_alive:1; // Connection: keep-alive
 };
 
 struct http_response_headers {
@@ -127,6 +129,12 @@ struct http_response_headers {
 struct http_content_generator_result {
   size_t generated;
   size_t need;
+  // The generator may also ask for the next file_length bytes of content to be sent straight from
+  // file_fd starting at file_offset, after any bytes it generated into the buffer.  Only allowed if
+  // the response has a Content-Length, because a chunked response cannot frame file content.
+  int file_fd;
+  uint64_t file_offset;
+  size_t file_length;
 };
 
 typedef int (HTTP_CONTENT_GENERATOR)(struct http_request *, unsigned char *, size_t, struct http_content_generator_result *);
@@ -182,6 +190,8 @@ int http_request_set_response_bufsize(struct http_request *r, size_t bufsiz);
 void http_request_finalise(struct http_request *r);
 void http_request_pause_response(struct http_request *r, time_ms_t until);
 void http_request_resume_response(struct http_request *r);
+void http_request_pause_receive(struct http_request *r);
+void http_request_resume_receive(struct http_request *r);
 void http_request_response_static(struct http_request *r, int result, const struct mime_content_type *content_type, const char *body, uint64_t bytes);
 void http_request_response_generated(struct http_request *r, int result, const struct mime_content_type *content_type, HTTP_CONTENT_GENERATOR *);
 void http_request_simple_response(struct http_request *r, uint16_t result, const char *body);
@@ -198,6 +208,10 @@ struct http_request {
   enum http_request_phase { RECEIVE, TRANSMIT, PAUSE, DONE } phase;
   void (*finalise)(struct http_request *);
   void (*release)(void*);
+  // Called on a persistent connection after each response has been sent, to release anything held
+  // for that request before the next one is parsed.  The finalise function is still called once,
+  // when the connection closes.
+  void (*reset)(struct http_request *);
   // Identify request from others being run.  Monotonic counter feeds it.  Only
   // used for debugging when we write post-<uuid>.log files for multi-part form
   // requests.
@@ -209,7 +223,13 @@ struct http_request {
   // The following are used for parsing the HTTP request.
   time_ms_t initiate_time; // time connection was initiated
   time_ms_t idle_timeout; // disconnect if no bytes received for this long
+  time_ms_t keepalive_timeout; // wait this long for the next request; zero for no persistent connections
   struct socket_address client_addr; // caller may supply this
+  // Bytes of the next request that arrived with the last one, kept at the end of buffer[] until
+  // the last response has been sent.
+  size_t pipelined_length;
+  // All the following fields are cleared between requests on a persistent connection, except
+  // handle_first_line and handle_headers.
   // The parsed HTTP request is accumulated into the following fields.
   const char *verb; // points to nul terminated static string, "GET", "PUT", etc.
   const char *path; // points into buffer; nul terminated
@@ -220,6 +240,7 @@ struct http_request {
     query_parameters[10]; // can make this as big as needed, but not dynamic
   uint8_t version_major; // m from from HTTP/m.n
   uint8_t version_minor; // n from HTTP/m.n
+  bool_t keep_alive; // decided when the response starts
   struct http_request_headers request_header;
   // Parsing is done by setting 'parser' to point to a series of parsing
   // functions as the parsing state progresses.
@@ -239,6 +260,7 @@ struct http_request {
   char *parsed; // start of unparsed data in buffer[]
   char *cursor; // for parsing
   http_size_t request_content_remaining;
+  bool_t receive_paused; // set by http_request_pause_receive()
   enum chunk_state {CHUNK_SIZE, CHUNK_DATA, CHUNK_NEWLINE} chunk_state;
   uint64_t chunk_size;
   // The following are used for parsing a multipart body.
@@ -254,12 +276,18 @@ struct http_request {
   // sending.
   http_size_t response_length; // total response bytes (header + content)
   http_size_t response_sent; // for counting up to response_length
+  bool_t response_chunked; // generated content is sent with Transfer-Encoding: chunked
+  bool_t response_chunk_open; // a chunk has been sent that still needs its closing CRLF
   char *response_buffer;
   size_t response_buffer_need;
   size_t response_buffer_size;
   size_t response_buffer_length;
   size_t response_buffer_sent;
   void (*response_free_buffer)(void*);
+  // Content to send straight from a file once the response buffer is empty.
+  int response_file_fd;
+  uint64_t response_file_offset;
+  http_size_t response_file_length;
   // This buffer is used during RECEIVE and TRANSMIT phase.
   char buffer[8 * 1024];
 };
@@ -18,6 +18,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include <sys/ioctl.h>
+#include <netinet/tcp.h>
 #include "httpd.h"
 #include "mem.h"
 #include "net.h"
@@ -73,28 +74,83 @@ static unsigned int http_request_uuid_counter = 0;
 static httpd_request * current_httpd_requests = NULL;
 unsigned int current_httpd_request_count = 0;
 
-static int httpd_dispatch(struct http_request *hr)
+/* A prefix trie over the paths of all the handlers in the httpd section, built once when the
+ * server starts, so that dispatching a request walks its path once instead of comparing it with
+ * every handler.  Nodes refer to each other by index; node zero is the root (the empty path).
+ */
+struct httpd_route {
+  char byte;
+  struct http_handler *handler;
+  unsigned child;
+  unsigned sibling;
+};
+static struct httpd_route *httpd_routes = NULL;
+
+static int httpd_build_routes()
 {
-  httpd_request *r = (httpd_request *) hr;
-  INFOF("HTTP SERVER, %s %s", r->http.verb, r->http.path);
-  r->http.response.content_generator = NULL;
-  
-  struct http_handler *parser=NULL;
-  const char *remainder=NULL;
+  if (httpd_routes)
+    return 0;
+  size_t count = 1;
   struct http_handler *handler;
-  size_t match_len=0;
+  for (handler = SECTION_START(httpd); handler < SECTION_END(httpd); ++handler)
+    count += strlen(handler->path);
+  if ((httpd_routes = emalloc_zero(count * sizeof *httpd_routes)) == NULL)
+    return -1;
+  unsigned used = 1;
   for (handler = SECTION_START(httpd); handler < SECTION_END(httpd); ++handler) {
-    size_t path_len = strlen(handler->path);
-    if (parser && path_len < match_len)
-      continue;
-    
+    unsigned node = 0;
     const char *p;
-    if (str_startswith(r->http.path, handler->path, &p)){
-      match_len = path_len;
-      parser = handler;
-      remainder = p;
+    for (p = handler->path; *p; ++p) {
+      unsigned *link = &httpd_routes[node].child;
+      while (*link && httpd_routes[*link].byte != *p)
+	link = &httpd_routes[*link].sibling;
+      if (*link == 0) {
+	assert(used < count);
+	httpd_routes[used].byte = *p;
+	*link = used++;
+      }
+      node = *link;
+    }
+    // as with a linear scan, a later handler for the same path replaces an earlier one
+    httpd_routes[node].handler = handler;
+  }
+  DEBUGF(httpd, "Built dispatch trie of %u nodes for %u handlers",
+      used, (unsigned)(SECTION_END(httpd) - SECTION_START(httpd)));
+  return 0;
+}
+
+/* Return the handler with the longest path that is a prefix of the given path, and set
+ * *remainder to the rest of the path following that prefix.
+ */
+static struct http_handler *httpd_route(const char *path, const char **remainder)
+{
+  unsigned node = 0;
+  struct http_handler *handler = httpd_routes[0].handler;
+  *remainder = path;
+  for (; *path; ++path) {
+    unsigned child = httpd_routes[node].child;
+    while (child && httpd_routes[child].byte != *path)
+      child = httpd_routes[child].sibling;
+    if (child == 0)
+      break;
+    node = child;
+    if (httpd_routes[node].handler) {
+      handler = httpd_routes[node].handler;
+      *remainder = path + 1;
     }
   }
+  return handler;
+}
+
+static int httpd_dispatch(struct http_request *hr)
+{
+  httpd_request *r = (httpd_request *) hr;
+  if (config.rhizome.http.log_requests)
+    INFOF("HTTP SERVER, %s %s", r->http.verb, r->http.path);
+  r->http.response.content_generator = NULL;
+  
+  const char *remainder;
+  struct http_handler *parser = httpd_route(r->http.path, &remainder);
   if (parser){
     int result = parser->parser(r, remainder);
     if (result == -1 || (result >= 200 && result < 600))
@@ -174,6 +230,8 @@ int httpd_server_start(const uint16_t port_low, const uint16_t port_high)
 {
   if (httpd_server_socket != -1)
     return 1;
+  if (httpd_build_routes() == -1)
+    return WHY("Failed to start HTTP server");
 
   /* Only try to start http server every five seconds. */
   time_ms_t now = gettime_ms();
@@ -254,6 +312,34 @@ success:
   return 0;
 }
 
+/* Release everything held for the current request.
+ */
+static void httpd_release_request(httpd_request *r)
+{
+  rhizome_bundle_result_free(&r->bundle_result);
+  if (r->manifest) {
+    rhizome_manifest_free(r->manifest);
+    r->manifest = NULL;
+  }
+  if (r->finalise_union) {
+    r->finalise_union(r);
+    r->finalise_union = NULL;
+  }
+}
+
+/* Between requests on a persistent connection, put everything after the list links back the way
+ * httpd_server_poll() set it up for the first request.
+ */
+static void httpd_server_reset_http_request(struct http_request *hr)
+{
+  httpd_request *r = (httpd_request *) hr;
+  httpd_release_request(r);
+  const size_t start = offsetof(httpd_request, manifest);
+  bzero((char *)r + start, sizeof *r - start);
+  r->payload_status = INVALID_RHIZOME_PAYLOAD_STATUS; // will cause FATAL unless set
+  r->bundle_result = INVALID_RHIZOME_BUNDLE_RESULT; // will cause FATAL unless set
+}
+
 static void httpd_server_finalise_http_request(struct http_request *hr)
 {
   httpd_request *r = (httpd_request *) hr;
@@ -278,15 +364,7 @@ static void httpd_server_finalise_http_request(struct http_request *hr)
   if (current_httpd_requests == NULL) {
     assert(current_httpd_request_count == 0);
   }
-  rhizome_bundle_result_free(&r->bundle_result);
-  if (r->manifest) {
-    rhizome_manifest_free(r->manifest);
-    r->manifest = NULL;
-  }
-  if (r->finalise_union) {
-    r->finalise_union(r);
-    r->finalise_union = NULL;
-  }
+  httpd_release_request(r);
 }
 
 void httpd_server_poll(struct sched_ent *alarm)
@@ -301,9 +379,15 @@ void httpd_server_poll(struct sched_ent *alarm)
 	WARN_perror("accept");
     } else {
       set_nonblock(sock);
+      // Responses on a persistent connection are written back to back, so don't let Nagle hold
+      // the next one until the client acknowledges the last.
+      int on = 1;
+      if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on) == -1)
+	WARN_perror("setsockopt(TCP_NODELAY)");
       ++http_request_uuid_counter;
       strbuf_sprintf(&log_context, "httpd/%u", http_request_uuid_counter);
-      INFOF("HTTP SERVER, ACCEPT %s", alloca_socket_address(&addr));
+      if (config.rhizome.http.log_requests)
+	INFOF("HTTP SERVER, ACCEPT %s", alloca_socket_address(&addr));
       httpd_request *request = emalloc_zero(sizeof(httpd_request));
       if (request == NULL) {
 	WHY("Cannot respond to HTTP request, out of memory");
@@ -325,8 +409,10 @@ void httpd_server_poll(struct sched_ent *alarm)
 	request->http.debug = INDIRECT_CONFIG_DEBUG(httpd);
 	request->http.disable_tx = INDIRECT_CONFIG_DEBUG(nohttptx);
 	request->http.finalise = httpd_server_finalise_http_request;
+	request->http.reset = httpd_server_reset_http_request;
 	request->http.release = free;
 	request->http.idle_timeout = RHIZOME_IDLE_TIMEOUT;
+	request->http.keepalive_timeout = config.api.restful.keepalive_timeout * 1000;
 	http_request_init(&request->http, sock);
       }
     }
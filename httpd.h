@@ -158,6 +158,23 @@ typedef struct httpd_request
     }
       insert;
 
+    /* For receiving RESTful Rhizome bulk import request
+     */
+    struct {
+      // Which part is currently being received
+      const char *current_part;
+      struct form_buf_malloc manifest;
+      struct form_buf_malloc payload;
+      // The last manifest received, held until it is known whether a payload part follows
+      rhizome_manifest *pending;
+      struct rhizome_bulk_import *bulk;
+      // Stores a full batch in steps, while receiving is paused
+      struct sched_ent flush_alarm;
+      // The last manifest was malformed, so its payload part is discarded
+      bool_t discard_payload:1;
+    }
+      bulk_import;
+
     /* For responses that send part or all of a payload.
     */
     struct rhizome_read read_state;
@@ -178,6 +195,22 @@ typedef struct httpd_request
     }
       subscriberlist;
 
+    /* For responses that list scheduler latency histograms.
+    */
+    struct {
+      enum list_phase phase;
+      struct alarm_latency *current;
+    }
+      latencylist;
+
+    /* For responses that list Rhizome fetch queues.
+    */
+    struct {
+      enum list_phase phase;
+      unsigned index;
+    }
+      fetchqueuelist;
+
     /* For responses that list manifests.
     */
     struct {
@@ -21,6 +21,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <stdio.h>
 #include <assert.h>
 #include "serval.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include "conf.h"
 #include "constants.h"
 #include "overlay_buffer.h"
@@ -493,6 +496,7 @@ static int keyring_munge_block(
   unsigned char hashNonce[crypto_hash_sha512_BYTES];
 
   unsigned char work[65536];
+  unsigned used = 0; // high water mark of work[], the only part that needs wiping
 
   if (len<96) return WHY("block too short");
 
@@ -517,6 +521,8 @@ static int keyring_munge_block(
     } \
     bcopy((buf), &work[ofs], __len); \
     ofs += __len; \
+    if (ofs > used) \
+      used = ofs; \
   }
   /* Form key as hash of various concatenated inputs.
      The ordering and repetition of the inputs is designed to make rainbow tables
@@ -547,7 +553,7 @@ static int keyring_munge_block(
  kmb_safeexit:
   /* Wipe out all sensitive structures before returning */
   ofs=0;
-  bzero(&work[0],65536);
+  bzero(&work[0],used);
   bzero(&hashKey[0],crypto_hash_sha512_BYTES);
   bzero(&hashNonce[0],crypto_hash_sha512_BYTES);
   return exit_code;
@@ -1292,6 +1298,7 @@ static int keyring_identity_mac(const keyring_identity *id, unsigned char *pkrsa
     APPEND(id->PKRPin, strlen(id->PKRPin));
 #undef APPEND
   crypto_hash_sha512(mac, work, ofs);
+  bzero(work, ofs);
   return 0;
 }
 
@@ -1338,34 +1345,31 @@ static int keyring_finalise_identity(uint8_t *dirty, keyring_identity *id)
 }
 
 
-/* Read the slot, and try to decrypt it.  Decryption is symmetric with encryption, so the same
+/* Try to decrypt the contents of a slot.  Decryption is symmetric with encryption, so the same
  * function is used for munging the slot before making use of it, whichever way we are going.  Once
  * munged, we then need to verify that the slot is valid, and if so unpack the details of the
- * identity.
+ * identity.  The slot data is wiped afterwards.
+ *
+ * Only reads the keyring's salt and PIN, and only logs if keyring debug is enabled or something is
+ * badly wrong, so keyring_enter_pin() runs it on several threads at once.
  */
-static int keyring_decrypt_pkr(keyring_file *k, const char *pin, int slot)
+static keyring_identity *keyring_decrypt_pkr(keyring_file *k, const char *pin, unsigned slot, unsigned char *slot_data)
 {
-  DEBUGF(keyring, "k=%p pin=%s slot=%d", k, alloca_str_toprint(pin), slot);
-  unsigned char slot_data[KEYRING_PAGE_SIZE];
+  DEBUGF(keyring, "k=%p pin=%s slot=%u", k, alloca_str_toprint(pin), slot);
   keyring_identity *id=NULL;
+  unsigned char hash[crypto_hash_sha512_BYTES];
 
-  /* 1. Read slot. */
-  if (fseeko(k->file,slot*KEYRING_PAGE_SIZE,SEEK_SET))
-    return WHY_perror("fseeko");
-  if (fread(slot_data, KEYRING_PAGE_SIZE, 1, k->file) != 1)
-    return WHY_perror("fread");
-  /* 2. Decrypt data from slot. */
+  /* 1. Decrypt data from slot. */
   if (keyring_munge_block(slot_data, KEYRING_PAGE_SIZE, k->KeyRingSalt, k->KeyRingSaltLen, k->KeyRingPin, pin)) {
     WHYF("keyring_munge_block() failed, slot=%u", slot);
     goto kdp_safeexit;
   }
-  /* 3. Unpack contents of slot into a new identity in the provided context. */
+  /* 2. Unpack contents of slot into a new identity. */
   DEBUGF(keyring, "unpack slot %u", slot);
   if (((id = keyring_unpack_identity(slot_data, pin)) == NULL))
     goto kdp_safeexit; // Not a valid slot
   id->slot = slot;
-  /* 4. Verify that slot is self-consistent (check MAC) */
-  unsigned char hash[crypto_hash_sha512_BYTES];
+  /* 3. Verify that slot is self-consistent (check MAC) */
   if (keyring_identity_mac(id, slot_data, hash))
     goto kdp_safeexit;
   /* compare hash to record */
@@ -1375,12 +1379,8 @@ static int keyring_decrypt_pkr(keyring_file *k, const char *pin, int slot)
     DEBUG_dump(keyring, "stored",&slot_data[PKR_SALT_BYTES],crypto_hash_sha512_BYTES);
     goto kdp_safeexit;
   }
-
-  if (!keyring_commit_identity(k, id))
-    goto kdp_safeexit;
-
-  INFOF("unlocked identity slot=%u SID=%s", id->slot, alloca_tohex_sid_t(*id->box_pk));
-  return 0;
+  bzero(slot_data,KEYRING_PAGE_SIZE);
+  return id;
 
  kdp_safeexit:
   /* Clean up any potentially sensitive data before exiting */
@@ -1388,7 +1388,74 @@ static int keyring_decrypt_pkr(keyring_file *k, const char *pin, int slot)
   bzero(hash,crypto_hash_sha512_BYTES);
   if (id)
     free_identity(id);
-  return -1;
+  return NULL;
+}
+
+/* keyring_enter_pin() reads the loadable slots in batches, decrypts each batch on a pool of
+ * threads, then commits the identities found on the calling thread, in slot order.
+ */
+#define KEYRING_UNLOCK_BATCH 256
+#define KEYRING_UNLOCK_MAX_THREADS 8
+#define KEYRING_UNLOCK_SLOTS_PER_THREAD 16
+
+struct keyring_unlock_slot {
+  unsigned slot;
+  keyring_identity *id;
+  unsigned char data[KEYRING_PAGE_SIZE];
+};
+
+struct keyring_unlock {
+  keyring_file *k;
+  const char *pin;
+  struct keyring_unlock_slot *slots;
+  unsigned count;
+  unsigned next;
+};
+
+static void *keyring_unlock_worker(void *arg)
+{
+  struct keyring_unlock *u = arg;
+  unsigned i;
+  while ((i = __sync_fetch_and_add(&u->next, 1)) < u->count)
+    u->slots[i].id = keyring_decrypt_pkr(u->k, u->pin, u->slots[i].slot, u->slots[i].data);
+  return NULL;
+}
+
+static void keyring_unlock_batch(struct keyring_unlock *u)
+{
+  u->next = 0;
+#ifdef HAVE_PTHREAD
+  unsigned nthreads = 1;
+  // debug logging is not thread safe
+  if (!IF_DEBUG(keyring)) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus > 1)
+      nthreads = (unsigned) ncpus;
+    if (nthreads > KEYRING_UNLOCK_MAX_THREADS)
+      nthreads = KEYRING_UNLOCK_MAX_THREADS;
+    // not worth starting a thread for only a few slots
+    unsigned useful = (u->count + KEYRING_UNLOCK_SLOTS_PER_THREAD - 1) / KEYRING_UNLOCK_SLOTS_PER_THREAD;
+    if (nthreads > useful)
+      nthreads = useful ? useful : 1;
+  }
+  // The calling thread is one of the workers.
+  pthread_t threads[KEYRING_UNLOCK_MAX_THREADS - 1];
+  unsigned started = 0;
+  for (; started + 1 < nthreads; ++started) {
+    int err = pthread_create(&threads[started], NULL, keyring_unlock_worker, u);
+    if (err) {
+      // not fatal, the threads that did start will share the work
+      WARNF("pthread_create: %s [errno=%d]", strerror(err), err);
+      break;
+    }
+  }
+  keyring_unlock_worker(u);
+  unsigned i;
+  for (i = 0; i < started; ++i)
+    pthread_join(threads[i], NULL);
+#else
+  keyring_unlock_worker(u);
+#endif
 }
 
 /* Try all valid slots with the PIN and see if we find any identities with that PIN.  We might find
@@ -1423,17 +1490,47 @@ unsigned keyring_enter_pin(keyring_file *k, const char *pin)
     unsigned slots = k->file_size / KEYRING_PAGE_SIZE;
     if (slots >= KEYRING_BAM_BITS)
       slots = KEYRING_BAM_BITS - 1;
+    struct keyring_unlock u = { .k = k, .pin = pin };
     // slot zero is the BAM and salt, so skip it
-    for (slot = 1; slot < slots; ++slot) {
-       // only try to decrypt slots that are marked as allocated and not already loaded; the cost of
-       // decrypting can be up to a second of CPU time on a phone
-      if (is_slot_loadable(k, slot)) {
-	if (keyring_decrypt_pkr(k, pin, slot) == 0) {
-	  mark_slot_loaded(k, slot, 1);
-	  ++identity_count;
+    for (slot = 1; slot < slots; ) {
+      u.count = 0;
+      for (; slot < slots && u.count < KEYRING_UNLOCK_BATCH; ++slot) {
+	// only try to decrypt slots that are marked as allocated and not already loaded; the cost of
+	// decrypting can be up to a second of CPU time on a phone
+	if (!is_slot_loadable(k, slot))
+	  continue;
+	if (!u.slots && (u.slots = emalloc(KEYRING_UNLOCK_BATCH * sizeof *u.slots)) == NULL)
+	  break;
+	struct keyring_unlock_slot *us = &u.slots[u.count];
+	if (fseeko(k->file, slot * KEYRING_PAGE_SIZE, SEEK_SET)) {
+	  WHY_perror("fseeko");
+	  continue;
+	}
+	if (fread(us->data, KEYRING_PAGE_SIZE, 1, k->file) != 1) {
+	  WHY_perror("fread");
+	  continue;
 	}
+	us->slot = slot;
+	us->id = NULL;
+	++u.count;
+      }
+      if (u.count == 0)
+	break;
+      keyring_unlock_batch(&u);
+      unsigned i;
+      for (i = 0; i < u.count; ++i) {
+	keyring_identity *id = u.slots[i].id;
+	if (!id)
+	  continue;
+	if (keyring_commit_identity(k, id)) {
+	  INFOF("unlocked identity slot=%u SID=%s", id->slot, alloca_tohex_sid_t(*id->box_pk));
+	  mark_slot_loaded(k, id->slot, 1);
+	  ++identity_count;
+	} else
+	  free_identity(id);
       }
     }
+    free(u.slots);
 
     // now all identities with the given PIN have been unlocked, so mark the PIN being fully
     // unlocked
@@ -1580,14 +1677,20 @@ keyring_identity *keyring_create_identity(keyring_file *k, const char *pin)
 
 static int write_random_slot(keyring_file *k, unsigned slot)
 {
-  if (is_slot_allocated(k, slot))
+  off_t file_offset = KEYRING_PAGE_SIZE * slot;
+
+  if (is_slot_allocated(k, slot)) {
+    // The identity in this slot is written separately, but the file must still grow past it, or
+    // keyring_commit() would never finish padding up to a later slot.
+    if (k->file_size < file_offset + KEYRING_PAGE_SIZE)
+      k->file_size = file_offset + KEYRING_PAGE_SIZE;
     return 0;
+  }
 
   DEBUGF(keyring, "Fill slot %u with randomness", slot);
   uint8_t random_data[KEYRING_PAGE_SIZE];
   randombytes_buf(random_data, sizeof random_data);
 
-  off_t file_offset = KEYRING_PAGE_SIZE * slot;
 
   if (fseeko(k->file, k->file_size, SEEK_SET) == -1)
     return WHYF_perror("fseeko(%d, %ld, SEEK_SET)", fileno(k->file), (long)file_offset);
@@ -106,6 +106,14 @@ struct mdp_identity_request {
 /* Tell the daemon to check for new manifests after adding a bundle from any other process */
 #define MDP_SYNC_RHIZOME 6
 
+/* Fetch the daemon's scheduler latency histograms.
+ * One reply is sent per alarm, containing its name as a NUL terminated string, followed by packed
+ * 64 bit integers; the number of calls, then the 50th, 90th and 99th percentile and maximum call
+ * durations, the number of scheduled calls, then the same percentiles of their lateness, all in
+ * milliseconds.
+*/
+#define MDP_SCHED_STATS 7
+
 struct overlay_mdp_scan{
   struct in_addr addr;
 };
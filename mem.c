@@ -18,6 +18,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include <string.h>
+#include <assert.h>
+#include <inttypes.h> // for PRIu64 on Android
 #include "mem.h"
 
 void *_emalloc(struct __sourceloc __whence, size_t bytes)
@@ -60,3 +62,141 @@ char *_str_edup(struct __sourceloc __whence, const char *str)
 {
   return _strn_edup(__whence, str, strlen(str));
 }
+
+/* Each object is preceded by a pointer to the slab that holds it, padded so that objects keep the
+ * alignment malloc(3) would have given them.  Free objects hold the free list link in place of
+ * their contents.
+ */
+union mem_object_header {
+  struct mem_slab *slab;
+  long double _align;
+};
+
+struct mem_slab {
+  struct mem_slab *next;
+  struct mem_slab *prev;
+  void *free;
+  unsigned used;
+};
+
+#define HEADER_SIZE (sizeof(union mem_object_header))
+#define ROUND_UP(N) (((N) + HEADER_SIZE - 1) / HEADER_SIZE * HEADER_SIZE)
+#define SLOT_SIZE(POOL) (HEADER_SIZE + ROUND_UP((POOL)->object_size))
+#define SLAB_OBJECTS(SLAB) ((unsigned char *)(SLAB) + ROUND_UP(sizeof(struct mem_slab)))
+
+#define MAX_SPARE_SLABS 2
+
+static __thread struct mem_pool *mem_pools = NULL;
+
+static void slab_unlink(struct mem_pool *pool, struct mem_slab *slab)
+{
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    pool->partial = slab->next;
+  if (slab->next)
+    slab->next->prev = slab->prev;
+  slab->next = slab->prev = NULL;
+}
+
+static void slab_link(struct mem_pool *pool, struct mem_slab *slab)
+{
+  slab->prev = NULL;
+  slab->next = pool->partial;
+  if (slab->next)
+    slab->next->prev = slab;
+  pool->partial = slab;
+}
+
+static struct mem_slab *slab_new(struct __sourceloc __whence, struct mem_pool *pool)
+{
+  size_t slot_size = SLOT_SIZE(pool);
+  struct mem_slab *slab = _emalloc(__whence, ROUND_UP(sizeof(struct mem_slab)) + slot_size * pool->per_slab);
+  if (!slab)
+    return NULL;
+  slab->next = slab->prev = NULL;
+  slab->used = 0;
+  slab->free = NULL;
+  unsigned char *slot = SLAB_OBJECTS(slab) + slot_size * pool->per_slab;
+  unsigned i;
+  for (i = 0; i < pool->per_slab; ++i) {
+    slot -= slot_size;
+    ((union mem_object_header *)slot)->slab = slab;
+    void **object = (void **)(slot + HEADER_SIZE);
+    *object = slab->free;
+    slab->free = object;
+  }
+  pool->slab_count++;
+  pool->slab_allocations++;
+  if (!pool->_registered) {
+    pool->_registered = 1;
+    pool->_next = mem_pools;
+    mem_pools = pool;
+  }
+  return slab;
+}
+
+void *_mpool_alloc(struct __sourceloc __whence, struct mem_pool *pool)
+{
+  assert(pool->per_slab > 0);
+  struct mem_slab *slab = pool->partial;
+  if (!slab) {
+    if (pool->spare) {
+      slab = pool->spare;
+      pool->spare = slab->next;
+      pool->spare_count--;
+    } else if ((slab = slab_new(__whence, pool)) == NULL)
+      return NULL;
+    slab_link(pool, slab);
+  }
+  void **object = slab->free;
+  slab->free = *object;
+  if (++slab->used == pool->per_slab)
+    slab_unlink(pool, slab);
+  pool->allocations++;
+  if (++pool->in_use > pool->peak)
+    pool->peak = pool->in_use;
+  return object;
+}
+
+void *_mpool_alloc_zero(struct __sourceloc __whence, struct mem_pool *pool)
+{
+  void *object = _mpool_alloc(__whence, pool);
+  if (object)
+    memset(object, 0, pool->object_size);
+  return object;
+}
+
+void mpool_free(struct mem_pool *pool, void *object)
+{
+  if (!object)
+    return;
+  struct mem_slab *slab = ((union mem_object_header *)((unsigned char *)object - HEADER_SIZE))->slab;
+  assert(slab->used > 0);
+  assert(pool->in_use > 0);
+  *(void **)object = slab->free;
+  slab->free = object;
+  pool->in_use--;
+  if (slab->used-- == pool->per_slab)
+    slab_link(pool, slab);
+  if (slab->used == 0) {
+    slab_unlink(pool, slab);
+    if (pool->spare_count < MAX_SPARE_SLABS) {
+      slab->next = pool->spare;
+      pool->spare = slab;
+      pool->spare_count++;
+    } else {
+      free(slab);
+      pool->slab_count--;
+    }
+  }
+}
+
+void mpool_showstats()
+{
+  struct mem_pool *pool;
+  for (pool = mem_pools; pool; pool = pool->_next)
+    INFOF("pool %s: %u in use, peak %u, %u slabs (%u spare) of %u x %zu bytes, %"PRIu64" allocations, %"PRIu64" slab allocations",
+	  pool->name, pool->in_use, pool->peak, pool->slab_count, pool->spare_count, pool->per_slab, pool->object_size,
+	  pool->allocations, pool->slab_allocations);
+}
@@ -21,6 +21,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define __SERVAL_DNA__MEM_H
 
 #include <sys/types.h>
+#include <stdint.h>
 #include "lang.h"
 #include "log.h"
 
@@ -53,10 +54,54 @@ void *_emalloc_zero(struct __sourceloc, size_t bytes) __attribute__ ((__ATTRIBUT
 char *_str_edup(struct __sourceloc, const char *str) __attribute__ ((__ATTRIBUTE_malloc));
 char *_strn_edup(struct __sourceloc, const char *str, size_t len) __attribute__ ((__ATTRIBUTE_malloc));
 
+/* A slab allocator for small fixed-size objects that are allocated and freed at a high rate, eg,
+ * overlay frames and buffers on the packet forwarding path.  Objects are carved out of slabs of
+ * per_slab objects, each slab keeping its own free list, so that a slab can be returned to
+ * malloc(3) once all of its objects have been freed.  A couple of empty slabs are kept in reserve
+ * to absorb alloc/free churn.
+ *
+ * Like other daemon state, pools are not thread safe and should be declared __thread; an object
+ * must be freed by the thread that allocated it.
+ */
+struct mem_slab;
+
+struct mem_pool {
+  const char *name;
+  size_t object_size;
+  unsigned per_slab;
+  // slabs with at least one free object
+  struct mem_slab *partial;
+  // fully free slabs held in reserve
+  struct mem_slab *spare;
+  unsigned spare_count;
+  unsigned slab_count;
+  unsigned in_use;
+  unsigned peak;
+  uint64_t allocations;
+  uint64_t slab_allocations;
+  struct mem_pool *_next;
+  bool_t _registered;
+};
+
+#define MEM_POOL_INIT(NAME, SIZE, PER_SLAB) { .name = (NAME), .object_size = (SIZE), .per_slab = (PER_SLAB) }
+
+/* Return an object from the pool, or NULL (after logging an error) if a new slab could not be
+ * allocated.  The _zero variant fills the object with zeroes, like emalloc_zero().
+ */
+void *_mpool_alloc(struct __sourceloc, struct mem_pool *pool) __attribute__ ((__ATTRIBUTE_malloc));
+void *_mpool_alloc_zero(struct __sourceloc, struct mem_pool *pool) __attribute__ ((__ATTRIBUTE_malloc));
+void mpool_free(struct mem_pool *pool, void *object);
+
+/* Log the occupancy of every pool that has been used by the calling thread.
+ */
+void mpool_showstats();
+
 #define emalloc(bytes)       _emalloc(__HERE__, (bytes))
 #define erealloc(ptr, bytes) _erealloc(__HERE__, (ptr), (bytes))
 #define emalloc_zero(bytes)  _emalloc_zero(__HERE__, (bytes))
 #define str_edup(str)        _str_edup(__HERE__, (str))
 #define strn_edup(str, len)  _strn_edup(__HERE__, (str), (len))
+#define mpool_alloc(pool)    _mpool_alloc(__HERE__, (pool))
+#define mpool_alloc_zero(pool) _mpool_alloc_zero(__HERE__, (pool))
 
 #endif // __SERVAL_DNA__MEM_H
@@ -162,6 +162,7 @@ static int app_meshmb_find(const struct cli_parsed *parsed, struct cli_context *
 
   struct rhizome_list_cursor cursor;
   bzero(&cursor, sizeof cursor);
+  cursor.columns_only = 1;
   cursor.service = RHIZOME_SERVICE_MESHMB;
   cursor.name = search && search[0] ? search : NULL;
 
@@ -20,6 +20,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define __MESHMS_INLINE
 #include <assert.h>
 #include "serval.h"
+#include "server.h"
 #include "rhizome_types.h"
 #include "meshms.h"
 #include "log.h"
@@ -34,6 +35,23 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 static unsigned mark_read(struct meshms_conversations *conv, const sid_t *their_sid, const uint64_t offset);
 
+/* While the daemon is running, it keeps the conversation list of each identity in memory after it
+ * has been read or saved, so that it does not have to decrypt the conversation bundle's payload and
+ * look up every ply in the database each time.  The bundle_add trigger keeps the ply details in the
+ * cached lists current, so update_conversations() only reads the plys that have changed.  A cached
+ * list is only used while the conversation bundle in the store is the same version that the list
+ * was read from or saved to.
+ */
+struct meshms_list_cache {
+  struct meshms_list_cache *_next;
+  sid_t my_sid;
+  rhizome_bid_t bundle_id;
+  uint64_t version;
+  struct meshms_conversations *conv;
+};
+
+static struct meshms_list_cache *list_cache = NULL;
+
 void meshms_free_conversations(struct meshms_conversations *conv)
 {
   while(conv){
@@ -87,6 +105,63 @@ static enum meshms_status get_my_conversation_bundle(const keyring_identity *id,
   return MESHMS_STATUS_OK;
 }
 
+static struct meshms_list_cache **find_cached_list(const sid_t *my_sid)
+{
+  struct meshms_list_cache **ptr = &list_cache;
+  while (*ptr && cmp_sid_t(&(*ptr)->my_sid, my_sid) != 0)
+    ptr = &(*ptr)->_next;
+  return ptr;
+}
+
+static void forget_cached_list(const sid_t *my_sid)
+{
+  struct meshms_list_cache **ptr = find_cached_list(my_sid);
+  struct meshms_list_cache *c = *ptr;
+  if (c) {
+    *ptr = c->_next;
+    meshms_free_conversations(c->conv);
+    free(c);
+  }
+}
+
+static enum meshms_status copy_conversations(const struct meshms_conversations *conv, struct meshms_conversations **copy)
+{
+  struct meshms_conversations **ptr = copy;
+  for (; conv; conv = conv->_next) {
+    if ((*ptr = emalloc(sizeof **ptr)) == NULL)
+      return MESHMS_STATUS_ERROR;
+    **ptr = *conv;
+    (*ptr)->_next = NULL;
+    ptr = &(*ptr)->_next;
+  }
+  return MESHMS_STATUS_OK;
+}
+
+// remember the conversation list that was just read from, or saved to, the bundle in 'm'
+static void cache_list(const keyring_identity *id, const rhizome_manifest *m, const struct meshms_conversations *conv)
+{
+  if (serverMode == SERVER_NOT_RUNNING)
+    return;
+  struct meshms_conversations *copy = NULL;
+  if (meshms_failed(copy_conversations(conv, &copy))) {
+    meshms_free_conversations(copy);
+    forget_cached_list(id->box_pk);
+    return;
+  }
+  struct meshms_list_cache **ptr = find_cached_list(id->box_pk);
+  if (!*ptr) {
+    if ((*ptr = emalloc_zero(sizeof **ptr)) == NULL) {
+      meshms_free_conversations(copy);
+      return;
+    }
+    (*ptr)->my_sid = *id->box_pk;
+  }
+  meshms_free_conversations((*ptr)->conv);
+  (*ptr)->conv = copy;
+  (*ptr)->bundle_id = m->keypair.public_key;
+  (*ptr)->version = m->version;
+}
+
 static struct meshms_conversations *add_conv(struct meshms_conversations **conv, const sid_t *them)
 {
   struct meshms_conversations **ptr = conv;
@@ -105,16 +180,30 @@ static struct meshms_conversations *add_conv(struct meshms_conversations **conv,
   return n;
 }
 
+static void set_ply(struct message_ply *p, const rhizome_bid_t *bid, uint64_t version, uint64_t tail, uint64_t size)
+{
+  p->found = p->known_bid = 1;
+  p->bundle_id = *bid;
+  p->version = version;
+  p->tail = tail;
+  p->size = size;
+}
+
 // find matching conversations
 // if their_sid == my_sid, return all conversations with any recipient
 static enum meshms_status get_database_conversations(const keyring_identity *id, struct meshms_conversations **conv)
 {
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  // Two halves, so that each can use its own (service, sender) or (service, recipient) index; the
+  // last column says whether the ply is ours.
   sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
-      "SELECT id, version, filesize, tail, sender, recipient"
+      "SELECT id, version, filesize, tail, recipient, 1"
+      " FROM manifests"
+      " WHERE service = ?2 AND sender = ?1"
+      " UNION ALL"
+      " SELECT id, version, filesize, tail, sender, 0"
       " FROM manifests"
-      " WHERE service = ?2"
-      " AND (sender=?1 or recipient=?1)",
+      " WHERE service = ?2 AND recipient = ?1 AND sender IS NOT ?1",
       SID_T, id->box_pk,
       STATIC_TEXT, RHIZOME_SERVICE_MESHMS2,
       END
@@ -128,48 +217,59 @@ static enum meshms_status get_database_conversations(const keyring_identity *id,
     uint64_t version = sqlite3_column_int64(statement, 1);
     int64_t size = sqlite3_column_int64(statement, 2);
     int64_t tail = sqlite3_column_int64(statement, 3);
-    const char *sender = (const char *)sqlite3_column_text(statement, 4);
-    const char *recipient = (const char *)sqlite3_column_text(statement, 5);
-    DEBUGF(meshms, "found id %s, sender %s, recipient %s, size %"PRId64, id_hex, sender, recipient, size);
+    const char *them = (const char *)sqlite3_column_text(statement, 4);
+    int mine = sqlite3_column_int(statement, 5);
+    DEBUGF(meshms, "found id %s, %s %s, size %"PRId64, id_hex, mine ? "recipient" : "sender", them, size);
     rhizome_bid_t bid;
     if (str_to_rhizome_bid_t(&bid, id_hex) == -1) {
       WHYF("invalid Bundle ID hex: %s -- skipping", alloca_str_toprint(id_hex));
       continue;
     }
-    const char *them = sender;
     sid_t their_sid;
     if (str_to_sid_t(&their_sid, them) == -1) {
       WHYF("invalid SID hex: %s -- skipping", alloca_str_toprint(them));
       continue;
     }
-    if (cmp_sid_t(&their_sid, id->box_pk) == 0) {
-      them = recipient;
-      if (str_to_sid_t(&their_sid, them) == -1) {
-	WHYF("invalid SID hex: %s -- skipping", alloca_str_toprint(them));
-	continue;
-      }
-    }
     struct meshms_conversations *ptr = add_conv(conv, &their_sid);
     if (!ptr)
       break;
-    struct message_ply *p;
-    if (them==sender){
-      p=&ptr->their_ply;
-    }else{
-      p=&ptr->my_ply;
-    }
-    p->found = p->known_bid = 1;
-    p->bundle_id = bid;
-    p->version = version;
-    p->tail = tail;
-    p->size = size;
+    set_ply(mine ? &ptr->my_ply : &ptr->their_ply, &bid, version, tail, size);
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   if (!sqlite_code_ok(r))
     return MESHMS_STATUS_ERROR;
   return MESHMS_STATUS_OK;
 }
 
+// keep the ply details of cached conversation lists current
+static void meshms_on_bundle_added(rhizome_manifest *m)
+{
+  if (!list_cache
+    || !m->service || strcmp(m->service, RHIZOME_SERVICE_MESHMS2) != 0
+    || !m->has_sender || !m->has_recipient)
+    return;
+  struct meshms_list_cache **ptr = &list_cache;
+  while (*ptr) {
+    struct meshms_list_cache *c = *ptr;
+    int mine = cmp_sid_t(&c->my_sid, &m->sender) == 0;
+    if (mine || cmp_sid_t(&c->my_sid, &m->recipient) == 0) {
+      struct meshms_conversations *conv = add_conv(&c->conv, mine ? &m->recipient : &m->sender);
+      if (!conv) {
+	forget_cached_list(&c->my_sid);
+	continue;
+      }
+      DEBUGF(meshms, "Cached conversation %s -> %s, %s ply version %"PRIu64" size %"PRIu64,
+	     alloca_tohex_sid_t(c->my_sid), alloca_tohex_sid_t(conv->them),
+	     mine ? "my" : "their", m->version, m->filesize);
+      set_ply(mine ? &conv->my_ply : &conv->their_ply,
+	      &m->keypair.public_key, m->version, m->is_journal ? m->tail : 0, m->filesize);
+    }
+    ptr = &c->_next;
+  }
+}
+
+DEFINE_TRIGGER(bundle_add, meshms_on_bundle_added);
+
 static enum meshms_status open_ply(struct message_ply *ply, struct message_ply_read *reader)
 {
   if (ply->found
@@ -620,6 +720,18 @@ static enum meshms_status meshms_open_list(const keyring_identity *id, rhizome_m
 
   if (meshms_failed(status = get_my_conversation_bundle(id, m)))
     goto end;
+  struct meshms_list_cache *cached = *find_cached_list(id->box_pk);
+  if (cached) {
+    if (cached->version == m->version && cmp_rhizome_bid_t(&cached->bundle_id, &m->keypair.public_key) == 0) {
+      // bring the cached plys up to date with any bundles that other processes have stored
+      rhizome_process_added_bundles(INT64_MAX);
+      if ((cached = *find_cached_list(id->box_pk)) != NULL) {
+	status = copy_conversations(cached->conv, conv);
+	goto end;
+      }
+    } else
+      forget_cached_list(id->box_pk);
+  }
   // read conversations payload
   if (meshms_failed(status = read_known_conversations(m, conv)))
     goto end;
@@ -632,8 +744,11 @@ static enum meshms_status meshms_save_list(const keyring_identity *id, rhizome_m
 {
   enum meshms_status status;
 
-  if ((status = update_conversations(id, conv)) == MESHMS_STATUS_UPDATED)
-    status = write_known_conversations(m, *conv);
+  if ((status = update_conversations(id, conv)) == MESHMS_STATUS_UPDATED) {
+    if ((status = write_known_conversations(m, *conv)) == MESHMS_STATUS_UPDATED)
+      cache_list(id, m, *conv);
+  } else if (status == MESHMS_STATUS_OK)
+    cache_list(id, m, *conv);
 
   return status;
 }
@@ -934,7 +1049,8 @@ enum meshms_status meshms_send_message(const sid_t *sender, const sid_t *recipie
     c->metadata.my_size += ob_position(b);
 
     // save known conversations since our stats will always change.
-    write_known_conversations(m, conv);
+    if (write_known_conversations(m, conv) == MESHMS_STATUS_UPDATED)
+      cache_list(id, m, conv);
 
     status = MESHMS_STATUS_UPDATED;
   }else{
@@ -986,6 +1102,8 @@ enum meshms_status meshms_mark_read(const sid_t *sender, const sid_t *recipient,
   DEBUGF(meshms, "changed=%u", changed);
   if (changed)
     status = write_known_conversations(m, conv);
+  if (status == MESHMS_STATUS_UPDATED || !changed)
+    cache_list(id, m, conv);
 end:
   if (m)
     rhizome_manifest_free(m);
@@ -7,9 +7,25 @@
 #define FLAG_ACK (1<<1)
 #define FLAG_FIRST (1<<2)
 #define FLAG_STOP (1<<3)
+// The ack header is followed by a selective ack bitmap
+#define FLAG_SACK (1<<4)
+// The sender understands FLAG_SACK and MSP_MAX_WINDOW.  Peers that never set this flag
+// are sent neither, and only ever have MAX_WINDOW_SIZE packets in flight.
+#define FLAG_EXTENDED (1<<5)
 #define RETRANSMIT_TIME 1500
 #define HANDLER_KEEPALIVE 1000
 
+// Bounds of the retransmit timeout estimated from the round trip time
+#define MSP_RTO_MIN 200
+#define MSP_RTO_MAX 4000
+
+// Bit i of the selective ack bitmap is set if packet ack_seq + 1 + i has been received
+#define MSP_SACK_BYTES 4
+// Largest possible header, on a data packet to a peer that understands FLAG_SACK
+#define MSP_MAX_PREAMBLE_SIZE (MSP_PAYLOAD_PREAMBLE_SIZE + MSP_SACK_BYTES)
+// Number of later packets that must be selectively acked before a missing packet is resent
+#define MSP_DUPACK_THRESHOLD 3
+
 typedef uint16_t msp_state_t;
 
 struct msp_packet{
@@ -18,12 +34,19 @@ struct msp_packet{
   uint8_t flags;
   time_ms_t added;
   time_ms_t sent;
+  uint8_t transmissions;
+  bool_t sacked;
+  bool_t resend;
   size_t len;
   size_t offset;
   uint8_t payload[];
 };
 
+// Window used with peers that do not set FLAG_EXTENDED
 #define MAX_WINDOW_SIZE 4
+// Window limit for peers that do; must not exceed the bits in the selective ack bitmap
+#define MSP_MAX_WINDOW 32
+#define MSP_MIN_WINDOW 2
 struct msp_window{
   unsigned packet_count;
   uint32_t base_rtt;
@@ -42,6 +65,24 @@ struct msp_stream{
   time_ms_t next_ack;
   time_ms_t timeout;
   time_ms_t next_action;
+  bool_t peer_extended;
+
+  /* Retransmit timeout, estimated from the smoothed round trip time and its
+   * variation as in RFC 6298 (srtt is scaled by 8 and rttvar by 4).
+   */
+  uint32_t srtt;
+  uint32_t rttvar;
+  uint32_t rto;
+
+  /* AIMD congestion window, in packets.  Grows by one per acked packet up to
+   * ssthresh, then by one per window of acked packets.  Halves at most once per
+   * window when a packet is lost, ie, until recover_seq has been acked.
+   */
+  unsigned cwnd;
+  unsigned cwnd_acked;
+  unsigned ssthresh;
+  bool_t in_recovery;
+  uint16_t recover_seq;
 };
 
 static void msp_stream_init(struct msp_stream *stream)
@@ -56,6 +97,86 @@ static void msp_stream_init(struct msp_stream *stream)
   stream->next_action = TIME_MS_NEVER_WILL;
   stream->timeout = gettime_ms() + 10000;
   stream->previous_ack = 0x7FFF;
+  stream->rto = RETRANSMIT_TIME;
+  stream->cwnd = MAX_WINDOW_SIZE;
+  stream->ssthresh = MSP_MAX_WINDOW;
+}
+
+// The number of packets at the head of the transmit queue that may be in flight
+static unsigned msp_stream_window(const struct msp_stream *stream)
+{
+  unsigned limit = stream->peer_extended ? MSP_MAX_WINDOW : MAX_WINDOW_SIZE;
+  return stream->cwnd < limit ? stream->cwnd : limit;
+}
+
+// Set MSP_STATE_DATAOUT if the application may queue another packet
+static void msp_stream_update_dataout(struct msp_stream *stream)
+{
+  if (stream->tx.packet_count < msp_stream_window(stream)
+    && !(stream->state & MSP_STATE_SHUTDOWN_LOCAL)
+    && !(stream->state & MSP_STATE_CLOSED))
+    stream->state|=MSP_STATE_DATAOUT;
+  else
+    stream->state&=~MSP_STATE_DATAOUT;
+}
+
+static void msp_stream_rtt_sample(struct msp_stream *stream, uint32_t rtt)
+{
+  if (rtt < 10)
+    rtt=10;
+  stream->tx.rtt = rtt;
+  if (stream->tx.base_rtt > rtt)
+    stream->tx.base_rtt = rtt;
+  if (stream->srtt == 0){
+    stream->srtt = rtt << 3;
+    stream->rttvar = rtt << 1;
+  }else{
+    int32_t err = (int32_t)rtt - (int32_t)(stream->srtt >> 3);
+    stream->srtt += err;
+    if (err < 0)
+      err = -err;
+    stream->rttvar += err - (int32_t)(stream->rttvar >> 2);
+  }
+  uint32_t rto = (stream->srtt >> 3) + stream->rttvar;
+  if (rto < MSP_RTO_MIN)
+    rto = MSP_RTO_MIN;
+  if (rto > MSP_RTO_MAX)
+    rto = MSP_RTO_MAX;
+  stream->rto = rto;
+}
+
+// Multiplicative decrease, once per window of packets
+static void msp_stream_congestion(struct msp_stream *stream)
+{
+  if (stream->in_recovery)
+    return;
+  stream->ssthresh = stream->cwnd / 2;
+  if (stream->ssthresh < MSP_MIN_WINDOW)
+    stream->ssthresh = MSP_MIN_WINDOW;
+  stream->cwnd = stream->ssthresh;
+  stream->cwnd_acked = 0;
+  stream->in_recovery = 1;
+  stream->recover_seq = stream->tx.next_seq - 1;
+  DEBUGF(msp, "Congestion, window %u", stream->cwnd);
+}
+
+// When the packet should next be (re)transmitted
+static time_ms_t msp_packet_due(const struct msp_stream *stream, const struct msp_packet *packet)
+{
+  if (packet->sacked)
+    return TIME_MS_NEVER_WILL;
+  if (packet->resend || packet->sent == TIME_MS_NEVER_HAS)
+    return 0;
+  return packet->sent + stream->rto;
+}
+
+// The packet whose retransmit timer is the one that counts
+static const struct msp_packet *msp_oldest_unacked(const struct msp_stream *stream)
+{
+  const struct msp_packet *p;
+  for (p = stream->tx._head; p && p->sacked; p = p->_next)
+    ;
+  return p;
 }
 
 static void free_all_packets(struct msp_window *window)
@@ -75,35 +196,81 @@ static void free_acked_packets(struct msp_window *window, uint16_t seq)
   if (!window->_head)
     return;
   struct msp_packet *p = window->_head;
-  uint32_t rtt=0xFFFFFFFF, rtt_max=0;
-  time_ms_t now = gettime_ms();
-
   while(p && compare_wrapped_uint16(p->seq, seq)<=0){
-    if (p->sent!=TIME_MS_NEVER_HAS){
-      uint32_t this_rtt=now - p->sent;
-      if (rtt > this_rtt)
-	rtt = this_rtt;
-      if (rtt_max < this_rtt)
-	rtt_max = this_rtt;
-    }
     struct msp_packet *free_me=p;
     p=p->_next;
     free(free_me);
     window->packet_count--;
   }
   window->_head = p;
-  if (rtt!=0xFFFFFFFF){
-    if (rtt < 10)
-      rtt=10;
-    window->rtt = rtt;
-    if (window->base_rtt > rtt)
-      window->base_rtt = rtt;
-    DEBUGF(msp, "ACK %x, RTT %u-%u, base %u", seq, rtt, rtt_max, window->base_rtt);
-  }
   if (!p)
     window->_tail = NULL;
 }
 
+/* Process an acknowledgement of every transmitted packet up to ack_seq, and
+ * those after it that are marked in the selective ack bitmap.  Round trip
+ * times are only sampled from packets that were transmitted once, as their
+ * ack cannot be for an earlier copy.
+ */
+static void msp_stream_acked(struct msp_stream *stream, uint16_t ack_seq, uint32_t sack)
+{
+  struct msp_window *tx = &stream->tx;
+  time_ms_t now = gettime_ms();
+  uint32_t rtt=0xFFFFFFFF;
+  unsigned acked=0;
+
+  struct msp_packet *p = tx->_head;
+  while(p && compare_wrapped_uint16(p->seq, ack_seq)<=0){
+    if (!p->sacked){
+      if (p->transmissions==1 && rtt > now - p->sent)
+	rtt = now - p->sent;
+      acked++;
+    }
+    p=p->_next;
+  }
+  free_acked_packets(tx, ack_seq);
+
+  unsigned sacked=0;
+  for (p = tx->_head; p; p=p->_next){
+    int bit = compare_wrapped_uint16(p->seq, ack_seq) - 1;
+    if (!p->sacked && bit >= 0 && bit < MSP_SACK_BYTES*8 && (sack & (1u<<bit))){
+      if (p->transmissions==1 && rtt > now - p->sent)
+	rtt = now - p->sent;
+      p->sacked = 1;
+      acked++;
+    }
+    if (p->sacked)
+      sacked++;
+  }
+
+  if (rtt!=0xFFFFFFFF){
+    msp_stream_rtt_sample(stream, rtt);
+    DEBUGF(msp, "ACK %x, RTT %u, base %u, RTO %u", ack_seq, tx->rtt, tx->base_rtt, stream->rto);
+  }
+
+  if (stream->in_recovery && compare_wrapped_uint16(ack_seq, stream->recover_seq)>=0)
+    stream->in_recovery = 0;
+  while(acked--){
+    if (stream->cwnd < stream->ssthresh)
+      stream->cwnd++;
+    else if (++stream->cwnd_acked >= stream->cwnd){
+      stream->cwnd_acked = 0;
+      stream->cwnd++;
+    }
+  }
+  if (stream->cwnd > MSP_MAX_WINDOW)
+    stream->cwnd = MSP_MAX_WINDOW;
+
+  // The oldest packet is missing but enough later ones have arrived, so it was
+  // probably lost; resend it now rather than waiting for the timeout.
+  p = tx->_head;
+  if (p && !p->sacked && !p->resend && p->transmissions==1 && sacked >= MSP_DUPACK_THRESHOLD){
+    DEBUGF(msp, "Fast retransmit %x", p->seq);
+    p->resend = 1;
+    msp_stream_congestion(stream);
+  }
+}
+
 static int add_packet(struct msp_window *window, uint16_t seq, uint8_t flags, const uint8_t *payload, size_t len)
 {
   assert(payload || len==0);
@@ -158,7 +325,7 @@ static int add_packet(struct msp_window *window, uint16_t seq, uint8_t flags, co
 
 static size_t msp_write_ack_header(uint8_t *header, struct msp_stream *stream)
 {
-  header[0]=0;
+  header[0]=FLAG_EXTENDED;
   // if we haven't heard a sequence number, we can't ack data
   // (but we can indicate the existence of the connection)
   if (stream->state & MSP_STATE_RECEIVED_DATA)
@@ -169,27 +336,53 @@ static size_t msp_write_ack_header(uint8_t *header, struct msp_stream *stream)
     header[0]|=FLAG_FIRST;
     
   write_uint16(&header[1], stream->rx.next_seq -1);
-  
+  size_t len = 3;
+
+  if (stream->peer_extended){
+    uint32_t sack = 0;
+    const struct msp_packet *p;
+    for (p = stream->rx._head; p; p=p->_next){
+      int bit = compare_wrapped_uint16(p->seq, stream->rx.next_seq);
+      if (bit >= 0 && bit < MSP_SACK_BYTES*8)
+	sack |= 1u<<bit;
+    }
+    header[0]|=FLAG_SACK;
+    write_uint32(&header[len], sack);
+    len += MSP_SACK_BYTES;
+  }
+
   stream->previous_ack = stream->rx.next_seq -1;
   stream->tx.last_activity = gettime_ms();
   stream->next_ack = stream->tx.last_activity + RETRANSMIT_TIME;
   
   DEBUGF(msp, "Sending packet flags %02x (acked %02x)", 
     header[0], stream->rx.next_seq -1);
-  return 3;
+  return len;
 }
 
 static size_t msp_write_preamble(uint8_t *header, struct msp_stream *stream, struct msp_packet *packet)
 {
-  msp_write_ack_header(header, stream);
+  size_t len = msp_write_ack_header(header, stream);
   header[0]|=packet->flags;
   
-  write_uint16(&header[3], packet->seq);
+  write_uint16(&header[len], packet->seq);
+  len += 2;
   
   DEBUGF(msp, "With packet flags %02x seq %02x len %zd", 
     header[0], packet->seq, packet->len);
+  if (packet->transmissions && !packet->resend && packet == msp_oldest_unacked(stream)){
+    // retransmit timeout; back off, and treat it as a sign of congestion.  Only once per expiry of
+    // the timer, not for every later packet that is resent with it (RFC 6298 5.5)
+    stream->rto *= 2;
+    if (stream->rto > MSP_RTO_MAX)
+      stream->rto = MSP_RTO_MAX;
+    msp_stream_congestion(stream);
+  }
+  packet->resend = 0;
+  if (packet->transmissions < 0xFF)
+    packet->transmissions++;
   packet->sent = stream->tx.last_packet = stream->tx.last_activity;
-  return MSP_PAYLOAD_PREAMBLE_SIZE;
+  return len;
 }
 
 static ssize_t msp_stream_send(struct msp_stream *stream, const uint8_t *payload, size_t len)
@@ -197,14 +390,13 @@ static ssize_t msp_stream_send(struct msp_stream *stream, const uint8_t *payload
   assert(!(stream->state & MSP_STATE_LISTENING));
   assert((stream->state & MSP_STATE_SHUTDOWN_LOCAL)==0);
   
-  if ((stream->state & MSP_STATE_CLOSED) || stream->tx.packet_count > MAX_WINDOW_SIZE)
+  if ((stream->state & MSP_STATE_CLOSED) || stream->tx.packet_count > msp_stream_window(stream))
     return -1;
   if (add_packet(&stream->tx, stream->tx.next_seq, 0, payload, len)==-1)
     return -1;
   
   stream->tx.next_seq++;
-  if (stream->tx.packet_count>=MAX_WINDOW_SIZE)
-    stream->state&=~MSP_STATE_DATAOUT;
+  msp_stream_update_dataout(stream);
   // make sure we attempt to process packets from this sock soon
   // TODO calculate based on congestion window
   stream->next_action = gettime_ms();
@@ -313,33 +505,40 @@ static int msp_process_packet(struct msp_stream *stream, const uint8_t *payload,
   if (len<3)
     return 0;
   
+  if (flags & FLAG_EXTENDED)
+    stream->peer_extended = 1;
+  
+  size_t header_len = 3;
+  uint32_t sack = 0;
+  if (flags & FLAG_SACK){
+    if (len < header_len + MSP_SACK_BYTES)
+      return WHY("Expected selective ack bitmap");
+    sack = read_uint32(&payload[header_len]);
+    header_len += MSP_SACK_BYTES;
+  }
+  
   if (flags & FLAG_ACK){
     uint16_t ack_seq = read_uint16(&payload[1]);
     // release acknowledged packets
-    free_acked_packets(&stream->tx, ack_seq);
-    
-    // TODO if their ack seq has not advanced, we may need to hurry up and retransmit a packet
+    msp_stream_acked(stream, ack_seq, sack);
   }
   
   // Do we have space for more data now?
-  if (stream->tx.packet_count < MAX_WINDOW_SIZE 
-    && !(stream->state & MSP_STATE_SHUTDOWN_LOCAL)
-    && !(stream->state & MSP_STATE_CLOSED)){
-    stream->state|=MSP_STATE_DATAOUT;
-  }
+  msp_stream_update_dataout(stream);
   
   // make sure we attempt to process packets from this sock soon
   // TODO calculate based on congestion window
   stream->next_action = now;
   
-  if (len<MSP_PAYLOAD_PREAMBLE_SIZE)
+  if (len<header_len + 2)
     return 0;
   
   stream->state |= MSP_STATE_RECEIVED_DATA;
-  uint16_t seq = read_uint16(&payload[3]);
+  uint16_t seq = read_uint16(&payload[header_len]);
+  header_len += 2;
   stream->rx.last_packet = stream->rx.last_activity;
   if (compare_wrapped_uint16(seq, stream->rx.next_seq)>=0){
-    if (add_packet(&stream->rx, seq, flags, &payload[MSP_PAYLOAD_PREAMBLE_SIZE], len - MSP_PAYLOAD_PREAMBLE_SIZE)==1)
+    if (add_packet(&stream->rx, seq, flags, &payload[header_len], len - header_len)==1)
       stream->next_ack = now;
   }
   
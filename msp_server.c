@@ -127,9 +127,10 @@ static void send_frame(struct msp_server_state *state, struct overlay_buffer *pa
 static void send_packet(struct msp_server_state *state, struct msp_packet *packet)
 {
   struct overlay_buffer *payload = ob_new();
-  uint8_t *msp_header = ob_append_space(payload, MSP_PAYLOAD_PREAMBLE_SIZE);
+  uint8_t msp_header[MSP_MAX_PREAMBLE_SIZE];
   size_t len = msp_write_preamble(msp_header, &state->stream, packet);
-  assert(len == MSP_PAYLOAD_PREAMBLE_SIZE);
+  assert(len <= sizeof msp_header);
+  ob_append_bytes(payload, msp_header, len);
   if (packet->len)
     ob_append_bytes(payload, packet->payload, packet->len);
   ob_flip(payload);
@@ -139,8 +140,9 @@ static void send_packet(struct msp_server_state *state, struct msp_packet *packe
 static void send_ack(struct msp_server_state *state)
 {
   struct overlay_buffer *payload = ob_new();
-  uint8_t *msp_header = ob_append_space(payload, 3);
-  msp_write_ack_header(msp_header, &state->stream);
+  uint8_t msp_header[MSP_MAX_PREAMBLE_SIZE];
+  size_t len = msp_write_ack_header(msp_header, &state->stream);
+  ob_append_bytes(payload, msp_header, len);
   ob_flip(payload);
   send_frame(state, payload);
 }
@@ -154,18 +156,24 @@ struct msp_server_state * msp_process_next(struct msp_iterator *iterator)
     if (ptr){
       struct msp_packet *packet = ptr->stream.tx._head;
       time_ms_t next_packet = TIME_MS_NEVER_WILL;
+      unsigned window = msp_stream_window(&ptr->stream);
       
       ptr->stream.next_action = ptr->stream.timeout;
-      while(packet){
-	if (packet->sent + RETRANSMIT_TIME <= now)
+      while(packet && window--){
+	time_ms_t due = msp_packet_due(&ptr->stream, packet);
+	if (due <= now){
 	  // (re)transmit this packet
 	  send_packet(ptr, packet);
+	  due = msp_packet_due(&ptr->stream, packet);
+	}
 	
-	if (next_packet > packet->sent + RETRANSMIT_TIME)
-	  next_packet = packet->sent + RETRANSMIT_TIME;
+	if (next_packet > due)
+	  next_packet = due;
 	  
 	packet=packet->_next;
       }
+      // a retransmit timeout may have shrunk the window
+      msp_stream_update_dataout(&ptr->stream);
       
       // should we send an ack now without sending a payload?
       if (now >= ptr->stream.next_ack)
@@ -27,78 +27,385 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "mem.h"
 #include "nibble_tree.h"
 
-static unsigned get_nibble(const uint8_t *binary, int pos)
+// Node types, the embedded root node must be valid when zeroed
+#define NODE256 0
+#define NODE4 1
+#define NODE16 2
+#define NODE48 3
+
+struct tree_node4 {
+  struct tree_node header;
+  uint8_t key[4];
+  void *slot[4];
+};
+
+struct tree_node16 {
+  struct tree_node header;
+  uint8_t key[16];
+  void *slot[16];
+};
+
+struct tree_node48 {
+  struct tree_node header;
+  // index+1 of the slot for each byte value, or zero
+  uint8_t index[256];
+  void *slot[48];
+};
+
+// Slots that point to another node have the lowest bit set, records are never
+// stored at odd addresses.
+#define NODE_TAG ((uintptr_t)1)
+
+static inline bool_t is_node(void *ptr)
+{
+  return ((uintptr_t)ptr & NODE_TAG) ? 1 : 0;
+}
+
+static inline struct tree_node *to_node(void *ptr)
+{
+  return (struct tree_node *)((uintptr_t)ptr & ~NODE_TAG);
+}
+
+static inline void *from_node(struct tree_node *node)
+{
+  return (void *)((uintptr_t)node | NODE_TAG);
+}
+
+static size_t node_size(uint8_t type)
+{
+  switch (type) {
+    case NODE4: return sizeof(struct tree_node4);
+    case NODE16: return sizeof(struct tree_node16);
+    case NODE48: return sizeof(struct tree_node48);
+  }
+  return sizeof(struct tree_node256);
+}
+
+static unsigned node_capacity(uint8_t type)
+{
+  switch (type) {
+    case NODE4: return 4;
+    case NODE16: return 16;
+    case NODE48: return 48;
+  }
+  return 256;
+}
+
+// the bytes shared by every record below this node
+static inline uint8_t *node_prefix(struct tree_node *node)
+{
+  return (uint8_t *)node + node_size(node->type);
+}
+
+static struct tree_node *new_node(uint8_t type, unsigned depth, const uint8_t *prefix)
+{
+  struct tree_node *node = (struct tree_node *) emalloc_zero(node_size(type) + depth);
+  if (node) {
+    node->type = type;
+    node->depth = depth;
+    memcpy(node_prefix(node), prefix, depth);
+  }
+  return node;
+}
+
+// return the slot for this byte value, or NULL if the node doesn't have one
+static void **find_slot(struct tree_node *node, unsigned byte)
+{
+  unsigned i;
+  switch (node->type) {
+    case NODE4: {
+      struct tree_node4 *n = (struct tree_node4 *)node;
+      for (i = 0; i < node->count && n->key[i] <= byte; ++i)
+	if (n->key[i] == byte)
+	  return &n->slot[i];
+      return NULL;
+    }
+    case NODE16: {
+      struct tree_node16 *n = (struct tree_node16 *)node;
+      for (i = 0; i < node->count && n->key[i] <= byte; ++i)
+	if (n->key[i] == byte)
+	  return &n->slot[i];
+      return NULL;
+    }
+    case NODE48: {
+      struct tree_node48 *n = (struct tree_node48 *)node;
+      return n->index[byte] ? &n->slot[n->index[byte] - 1] : NULL;
+    }
+  }
+  return &((struct tree_node256 *)node)->slot[byte];
+}
+
+// return the first slot for a byte value >= from, which may be NULL if its
+// record has been deleted
+static void **next_slot(struct tree_node *node, unsigned from, unsigned *byte)
+{
+  unsigned i;
+  switch (node->type) {
+    case NODE4: {
+      struct tree_node4 *n = (struct tree_node4 *)node;
+      for (i = 0; i < node->count; ++i)
+	if (n->key[i] >= from) {
+	  *byte = n->key[i];
+	  return &n->slot[i];
+	}
+      return NULL;
+    }
+    case NODE16: {
+      struct tree_node16 *n = (struct tree_node16 *)node;
+      for (i = 0; i < node->count; ++i)
+	if (n->key[i] >= from) {
+	  *byte = n->key[i];
+	  return &n->slot[i];
+	}
+      return NULL;
+    }
+    case NODE48: {
+      struct tree_node48 *n = (struct tree_node48 *)node;
+      for (i = from; i < 256; ++i)
+	if (n->index[i]) {
+	  *byte = i;
+	  return &n->slot[n->index[i] - 1];
+	}
+      return NULL;
+    }
+  }
+  struct tree_node256 *n = (struct tree_node256 *)node;
+  for (i = from; i < 256; ++i)
+    if (n->slot[i]) {
+      *byte = i;
+      return &n->slot[i];
+    }
+  return NULL;
+}
+
+// add a slot for a new byte value to a node that has room for it
+static void **insert_slot(struct tree_node *node, unsigned byte)
+{
+  assert(node->count < node_capacity(node->type));
+  unsigned i;
+  switch (node->type) {
+    case NODE4: {
+      struct tree_node4 *n = (struct tree_node4 *)node;
+      for (i = node->count; i > 0 && n->key[i - 1] > byte; --i) {
+	n->key[i] = n->key[i - 1];
+	n->slot[i] = n->slot[i - 1];
+      }
+      node->count++;
+      n->key[i] = byte;
+      n->slot[i] = NULL;
+      return &n->slot[i];
+    }
+    case NODE16: {
+      struct tree_node16 *n = (struct tree_node16 *)node;
+      for (i = node->count; i > 0 && n->key[i - 1] > byte; --i) {
+	n->key[i] = n->key[i - 1];
+	n->slot[i] = n->slot[i - 1];
+      }
+      node->count++;
+      n->key[i] = byte;
+      n->slot[i] = NULL;
+      return &n->slot[i];
+    }
+    case NODE48: {
+      struct tree_node48 *n = (struct tree_node48 *)node;
+      i = node->count++;
+      n->index[byte] = i + 1;
+      n->slot[i] = NULL;
+      return &n->slot[i];
+    }
+  }
+  return &((struct tree_node256 *)node)->slot[byte];
+}
+
+// discard the slots of deleted records
+static void compact(struct tree_node *node)
+{
+  unsigned i, j = 0;
+  switch (node->type) {
+    case NODE4: {
+      struct tree_node4 *n = (struct tree_node4 *)node;
+      for (i = 0; i < node->count; ++i)
+	if (n->slot[i]) {
+	  n->key[j] = n->key[i];
+	  n->slot[j++] = n->slot[i];
+	}
+      break;
+    }
+    case NODE16: {
+      struct tree_node16 *n = (struct tree_node16 *)node;
+      for (i = 0; i < node->count; ++i)
+	if (n->slot[i]) {
+	  n->key[j] = n->key[i];
+	  n->slot[j++] = n->slot[i];
+	}
+      break;
+    }
+    case NODE48: {
+      struct tree_node48 *n = (struct tree_node48 *)node;
+      void *values[48];
+      memcpy(values, n->slot, sizeof values);
+      bzero(n->slot, sizeof n->slot);
+      for (i = 0; i < 256; ++i) {
+	if (!n->index[i])
+	  continue;
+	void *value = values[n->index[i] - 1];
+	if (value) {
+	  n->slot[j] = value;
+	  n->index[i] = ++j;
+	} else
+	  n->index[i] = 0;
+      }
+      break;
+    }
+    default:
+      return;
+  }
+  node->count = j;
+}
+
+// drop an iterator's reference to a node, free()ing it if it has been replaced
+static void release(struct tree_node *node)
+{
+  assert(node->ref_count != 0);
+  if (--node->ref_count == 0 && node->replaced_by) {
+    struct tree_node *next = node->replaced_by;
+    free(node);
+    release(next);
+  }
+}
+
+// add a slot for this byte value, growing the node (and updating the parent slot) if it is full
+static void **add_slot(void **parent_slot, struct tree_node *node, unsigned byte)
+{
+  unsigned capacity = node_capacity(node->type);
+  if (node->count >= capacity)
+    compact(node);
+  if (node->count < capacity)
+    return insert_slot(node, byte);
+
+  struct tree_node *bigger = new_node(node->type == NODE4 ? NODE16 : node->type == NODE16 ? NODE48 : NODE256,
+    node->depth, node_prefix(node));
+  if (!bigger)
+    return NULL;
+  unsigned value_byte = 0;
+  void **slot;
+  while ((slot = next_slot(node, value_byte, &value_byte))) {
+    *insert_slot(bigger, value_byte) = *slot;
+    value_byte++;
+  }
+  *parent_slot = from_node(bigger);
+  if (node->ref_count) {
+    // keep the old node until the iterators using it move on
+    node->replaced_by = bigger;
+    bigger->ref_count++;
+  } else
+    free(node);
+  return insert_slot(bigger, byte);
+}
+
+static enum tree_error_reason create_record(void **result, void **slot, const uint8_t *binary, size_t binary_size_bytes,
+  unsigned depth, tree_create_callback create_node, void *context)
 {
-  unsigned byte = binary[pos>>1];
-  if (!(pos&1))
-    byte=byte>>4;
-  return byte&0xF;
+  void *node_ptr = create_node(context, binary, binary_size_bytes);
+  if (!node_ptr)
+    return TREE_ERROR;
+  struct tree_record *tree_record = (struct tree_record *)node_ptr;
+  assert(memcmp(tree_record->binary, binary, binary_size_bytes) == 0);
+  assert(!is_node(node_ptr));
+  tree_record->binary_size_bits = (depth + 1) * 8;
+  if (result)
+    *result = node_ptr;
+  *slot = node_ptr;
+  return TREE_FOUND;
+}
+
+// insert a new node with two slots where a record and an existing slot first differ
+static enum tree_error_reason split(void **result, void **slot, const uint8_t *binary, size_t binary_size_bytes,
+  unsigned depth, unsigned existing_byte, tree_create_callback create_node, void *context)
+{
+  struct tree_node *node = new_node(NODE4, depth, binary);
+  if (!node)
+    return TREE_ERROR;
+  *insert_slot(node, existing_byte) = *slot;
+  enum tree_error_reason ret = create_record(result, insert_slot(node, binary[depth]),
+    binary, binary_size_bytes, depth, create_node, context);
+  if (ret != TREE_FOUND) {
+    free(node);
+    return ret;
+  }
+  if (!is_node(*slot))
+    ((struct tree_record *)*slot)->binary_size_bits = (depth + 1) * 8;
+  *slot = from_node(node);
+  return TREE_FOUND;
 }
 
 enum tree_error_reason tree_find(struct tree_root *root, void **result, const uint8_t *binary, size_t binary_size_bytes,
   tree_create_callback create_node, void *context)
 {
   assert(binary_size_bytes <= root->index_size_bytes);
-  struct tree_node *ptr = &root->_root_node;
+  assert(root->index_size_bytes <= 255);
+  struct tree_node *node = &root->_root_node.header;
+  void **parent_slot = NULL;
 
   if (result)
     *result = NULL;
 
-  unsigned pos=0;
-  while(1) {
-    if (pos >= binary_size_bytes * 2)
-      return TREE_NOT_UNIQUE;
-
-    unsigned nibble = get_nibble(binary, pos++);
-    void *node_ptr = ptr->slot[nibble];
+  // only create whole records
+  if (binary_size_bytes != root->index_size_bytes)
+    create_node = NULL;
 
-    if (ptr->is_tree & (1<<nibble)){
-      // search the next level of the tree
-      ptr = (struct tree_node *)node_ptr;
-
-    }else if(!node_ptr){
-      // allow caller to provide a node constructor
-      if (create_node && binary_size_bytes == root->index_size_bytes){
-	node_ptr = create_node(context, binary, binary_size_bytes);
-	if (!node_ptr)
-	  return TREE_ERROR;
-	struct tree_record *tree_record = (struct tree_record *)node_ptr;
-	assert(memcmp(tree_record->binary, binary, binary_size_bytes) == 0);
-	tree_record->binary_size_bits = pos*4;
-	if (result)
-	  *result = node_ptr;
-	ptr->slot[nibble] = node_ptr;
-	return TREE_FOUND;
-      }
-      return TREE_NOT_FOUND;
+  unsigned checked = 0;
+  while(1) {
+    if (node->depth >= binary_size_bytes)
+      return memcmp(node_prefix(node), binary, binary_size_bytes) == 0 ? TREE_NOT_UNIQUE : TREE_NOT_FOUND;
 
-    }else{
-      struct tree_record *tree_record = (struct tree_record *)node_ptr;
+    if (create_node) {
+      // lookups only compare the record they find, but records can't be added below a node with a different prefix
+      const uint8_t *prefix = node_prefix(node);
+      for (; checked < node->depth; ++checked)
+	if (prefix[checked] != binary[checked])
+	  return split(result, parent_slot, binary, binary_size_bytes, checked, prefix[checked], create_node, context);
+    }
 
-      // check that the remaining bytes of the value are the same
-      if (memcmp(tree_record->binary, binary, binary_size_bytes) == 0){
-	if (result)
-	  *result = node_ptr;
-	return TREE_FOUND;
-      }
+    unsigned byte = binary[node->depth];
+    void **slot = find_slot(node, byte);
+    void *node_ptr = slot ? *slot : NULL;
 
+    if (!node_ptr) {
       if (!create_node)
 	return TREE_NOT_FOUND;
-
-      // no match? we need to bump this leaf node down a level so we can create a new record
-      struct tree_node *new_node = (struct tree_node *) emalloc_zero(sizeof(struct tree_node));
-      if (!new_node)
+      // the node may be replaced by a bigger one
+      unsigned depth = node->depth;
+      if (!slot && !(slot = add_slot(parent_slot, node, byte)))
 	return TREE_ERROR;
+      return create_record(result, slot, binary, binary_size_bytes, depth, create_node, context);
+    }
+
+    if (is_node(node_ptr)) {
+      // search the next level of the tree
+      checked = node->depth + 1;
+      parent_slot = slot;
+      node = to_node(node_ptr);
+      continue;
+    }
 
-      ptr->slot[nibble] = new_node;
-      ptr->is_tree |= (1<<nibble);
-      ptr = new_node;
+    struct tree_record *tree_record = (struct tree_record *)node_ptr;
 
-      // get the nibble of the existing node
-      nibble = get_nibble(tree_record->binary, pos);
-      tree_record->binary_size_bits = (pos+1)*4;
-      ptr->slot[nibble] = node_ptr;
+    // check that the remaining bytes of the value are the same
+    if (memcmp(tree_record->binary, binary, binary_size_bytes) == 0) {
+      if (result)
+	*result = node_ptr;
+      return TREE_FOUND;
     }
+
+    if (!create_node)
+      return TREE_NOT_FOUND;
+
+    // no match? we need to bump this record down a level so we can create a new record
+    unsigned depth = node->depth + 1;
+    while (tree_record->binary[depth] == binary[depth])
+      depth++;
+    return split(result, slot, binary, binary_size_bytes, depth, tree_record->binary[depth], create_node, context);
   }
 }
 
@@ -106,101 +413,137 @@ void tree_iterator_start(tree_iterator *it, struct tree_root *root)
 {
   it->stack = &it->bottom;
   it->bottom.down = NULL;
-  it->bottom.node = &root->_root_node;
-  it->bottom.slotnum = 0;
-  root->_root_node.ref_count++;
+  it->bottom.node = &root->_root_node.header;
+  it->bottom.next = 0;
+  root->_root_node.header.ref_count++;
+}
+
+// move on to the replacement of a node that has grown
+static void follow_replacement(tree_node_iterator *nit)
+{
+  while (nit->node->replaced_by) {
+    struct tree_node *next = nit->node->replaced_by;
+    next->ref_count++;
+    release(nit->node);
+    nit->node = next;
+  }
 }
 
-static bool_t push(tree_iterator *it)
+static bool_t push(tree_iterator *it, struct tree_node *child)
 {
-  assert(it->stack->node->is_tree & (1 << it->stack->slotnum));
-  struct tree_node *child = it->stack->node->slot[it->stack->slotnum];
-  assert(child);
   tree_node_iterator *nit = (tree_node_iterator *) emalloc_zero(sizeof(tree_node_iterator));
   if (!nit)
     return 0;
   nit->down = it->stack;
   nit->node = child;
-  nit->slotnum = 0;
+  nit->next = 0;
   it->stack = nit;
   child->ref_count++;
   return 1;
 }
 
-static inline bool_t is_empty(struct tree_node *node)
+// free() a node that no longer has any records, or replace it with its only record or sub-tree
+static void tidy(void **slot, struct tree_node *node, unsigned parent_depth)
 {
-  unsigned i;
-  for (i = 0; i < 16; ++i)
-    if (node->slot[i])
-      return 0;
-  return 1;
+  unsigned byte = 0, live = 0;
+  void **child, *only = NULL;
+  while (live < 2 && (child = next_slot(node, byte, &byte))) {
+    if (*child) {
+      only = *child;
+      live++;
+    }
+    byte++;
+  }
+  if (live >= 2)
+    return;
+  if (only && !is_node(only))
+    ((struct tree_record *)only)->binary_size_bits = (parent_depth + 1) * 8;
+  *slot = only;
+  free(node);
 }
 
 static void pop(tree_iterator *it)
 {
   assert(it->stack);
-  assert(it->stack->node->ref_count != 0);
   tree_node_iterator *popped = it->stack;
-  it->stack = it->stack->down;
-  if (--popped->node->ref_count == 0 && it->stack && is_empty(popped->node)) {
-    assert(it->stack->slotnum < 16);
-    assert(it->stack->node->is_tree & (1 << it->stack->slotnum));
-    assert(it->stack->node->slot[it->stack->slotnum] == popped->node);
-    if (it->stack) {
-      assert(popped != &it->bottom);
-      assert(popped->node != it->bottom.node);
-      free(popped->node);
-    }
-    else {
-      assert(popped == &it->bottom);
-      assert(popped->node == it->bottom.node);
-    }
-    popped->node = NULL;
-    it->stack->node->slot[it->stack->slotnum] = NULL;
-    it->stack->node->is_tree &= ~(1 << it->stack->slotnum);
+  follow_replacement(popped);
+  struct tree_node *node = popped->node;
+  it->stack = popped->down;
+  release(node);
+  if (!it->stack) {
+    assert(popped == &it->bottom);
+    return;
   }
-  if (it->stack) {
-    free(popped);
-    it->stack->slotnum++;
+  assert(popped != &it->bottom);
+  free(popped);
+  follow_replacement(it->stack);
+  if (node->ref_count == 0) {
+    // a new node may have been inserted above this one since it was pushed
+    struct tree_node *parent = it->stack->node;
+    void **slot = find_slot(parent, it->stack->next);
+    while (slot && is_node(*slot) && *slot != from_node(node)) {
+      parent = to_node(*slot);
+      slot = parent->depth < node->depth ? find_slot(parent, node_prefix(node)[parent->depth]) : NULL;
+    }
+    if (slot && *slot == from_node(node))
+      tidy(slot, node, parent->depth);
   }
-  else
-    assert(popped == &it->bottom);
+  it->stack->next++;
 }
 
 void tree_iterator_advance_to(tree_iterator *it, const uint8_t *binary, size_t binary_size_bytes)
 {
   // can only call this function once on an iterator, straight after tree_iterator_start()
   assert(it->stack == &it->bottom);
-  assert(it->stack->slotnum == 0);
+  assert(it->stack->next == 0);
   assert(it->stack->node);
-  unsigned n;
-  for (n = 0; n < binary_size_bytes * 2; ++n) {
-    it->stack->slotnum = get_nibble(binary, n);
-    if (!((it->stack->node->is_tree & (1 << it->stack->slotnum)) && push(it)))
-      break;
+  while (1) {
+    tree_node_iterator *nit = it->stack;
+    struct tree_node *node = nit->node;
+    size_t depth = node->depth;
+    int cmp = memcmp(node_prefix(node), binary, depth < binary_size_bytes ? depth : binary_size_bytes);
+    // every record below this node comes after the given binary value
+    if (cmp > 0 || depth >= binary_size_bytes)
+      return;
+    // every record below this node comes before the given binary value
+    if (cmp < 0) {
+      nit->next = 256;
+      return;
+    }
+    nit->next = binary[depth];
+    void **slot = find_slot(node, nit->next);
+    if (!slot || !*slot)
+      return;
+    if (is_node(*slot)) {
+      if (!push(it, to_node(*slot)))
+	return;
+      continue;
+    }
+    if (memcmp(((struct tree_record *)*slot)->binary, binary, binary_size_bytes) < 0)
+      nit->next++;
+    return;
   }
 }
 
 void **tree_iterator_get_node(tree_iterator *it)
 {
   while (it->stack) {
-    if (it->stack->slotnum < 16) {
-      if (it->stack->node->is_tree & (1 << it->stack->slotnum)) {
-	if (!push(it))
-	  return NULL;
-      }
-      else {
-	void **childp = &it->stack->node->slot[it->stack->slotnum];
-	if (*childp)
-	  return childp;
-	else
-	  it->stack->slotnum++;
-      }
+    tree_node_iterator *nit = it->stack;
+    follow_replacement(nit);
+    void **childp;
+    unsigned byte;
+    while ((childp = next_slot(nit->node, nit->next, &byte))) {
+      nit->next = byte;
+      if (*childp)
+	break;
+      nit->next++;
     }
-    else {
-      assert(it->stack->slotnum == 16);
+    if (!childp)
       pop(it);
-    }
+    else if (!is_node(*childp))
+      return childp;
+    else if (!push(it, to_node(*childp)))
+      return NULL;
   }
   return NULL;
 }
@@ -209,8 +552,8 @@ void tree_iterator_advance(tree_iterator *it)
 {
   if (tree_iterator_get_node(it)) {
     assert(it->stack);
-    assert(it->stack->slotnum < 16);
-    it->stack->slotnum++;
+    assert(it->stack->next < 256);
+    it->stack->next++;
   }
 }
 
@@ -232,8 +575,11 @@ int tree_walk(struct tree_root *root, const uint8_t *binary, size_t binary_size_
     tree_iterator_advance_to(&it, binary, binary_size_bytes);
   }
   void **node;
-  while ((node = tree_iterator_get_node(&it)) && (ret = callback(node, context)) == 0)
+  while ((node = tree_iterator_get_node(&it)) && (ret = callback(node, context)) == 0) {
+    // if the callback removed the record, the iterator is already positioned at the next one
+    if (*node)
       tree_iterator_advance(&it);
+  }
   tree_iterator_free(&it);
   return ret;
 }
@@ -249,8 +595,10 @@ int tree_walk_prefix(struct tree_root *root, const uint8_t *binary, size_t binar
   void **node;
   while (   (node = tree_iterator_get_node(&it))
 	 && memcmp(((struct tree_record *)*node)->binary, binary, binary_size_bytes) == 0
-	 && (ret = callback(node, context)) == 0)
+	 && (ret = callback(node, context)) == 0) {
+    if (*node)
       tree_iterator_advance(&it);
+  }
   tree_iterator_free(&it);
   return ret;
 }
@@ -260,20 +608,27 @@ static void walk_statistics(struct tree_node *node, unsigned depth, struct tree_
   stats->node_count++;
   if (depth > stats->maximum_depth)
     stats->maximum_depth = depth;
-  if (is_empty(node))
-    stats->empty_node_count++;
-  unsigned i;
-  for (i = 0; i < 16; ++i)
-    if (node->is_tree & (1 << i))
-      walk_statistics(node->slot[i], depth + 1, stats);
-    else if (node->slot[i])
+  bool_t empty = 1;
+  unsigned byte = 0;
+  void **slot;
+  while ((slot = next_slot(node, byte, &byte))) {
+    if (is_node(*slot)) {
+      empty = 0;
+      walk_statistics(to_node(*slot), depth + 1, stats);
+    } else if (*slot) {
+      empty = 0;
       stats->record_count++;
+    }
+    byte++;
+  }
+  if (empty)
+    stats->empty_node_count++;
 }
 
 struct tree_statistics tree_compute_statistics(struct tree_root *root)
 {
   struct tree_statistics stats;
   bzero(&stats, sizeof stats);
-  walk_statistics(&root->_root_node, 0, &stats);
+  walk_statistics(&root->_root_node.header, 0, &stats);
   return stats;
 }
@@ -33,29 +33,45 @@ struct tree_record {
   uint8_t binary[0];
 };
 
-// Each node in the nibble tree has 16 slots based on the next 4 bits of the
-// binary value.
+// Despite the name, the tree is an adaptive radix tree that branches on whole
+// bytes of the binary index.  Each node only has room for as many slots as it
+// needs (4, 16, 48 or 256), and a node is only created where two records
+// differ, so the path to a record skips over any bytes it shares with all of
+// its neighbours.  Every node starts with this header.
 struct tree_node {
+  // Which kind of node this is; the root is always a node with 256 slots.
+  uint8_t type;
+
+  // Which byte of the binary index selects a slot in this node.  All records
+  // below this node share the same bytes before this one, which are kept at
+  // the end of the node.
+  uint8_t depth;
+
+  // The number of slots in use, for nodes that don't have one slot per value.
+  uint16_t count;
+
   // A reference count that is incremented by an iterator while it has a
   // pointer to the node, and decremented when it discards the pointer.  The
   // iterator free()s the node if its count decrements to zero and all of its
   // slots are NULL.  This prevents nodes being free()d while in-use.
   unsigned ref_count;
 
-  // A bitmask that has tbe bit (1 << slot_number) set if the corresponding
-  // slot points to a sub-tree.
-  uint16_t is_tree;
+  // When a node grows while an iterator is using it, the old node is kept
+  // until the last iterator moves on to its replacement.
+  struct tree_node *replaced_by;
+};
 
-  // Each slot either points to another tree node or a data record, depending
-  // on its corresponding bit in 'is_tree'.
-  void *slot[16];
+// Each slot either points to another tree node or a data record.
+struct tree_node256 {
+  struct tree_node header;
+  void *slot[256];
 };
 
 // The root of a nibble tree specifies the binary index size, in bytes, and
 // contains the root node.
 struct tree_root {
   size_t index_size_bytes;
-  struct tree_node _root_node;
+  struct tree_node256 _root_node;
 };
 
 enum tree_error_reason {
@@ -111,12 +127,17 @@ enum tree_error_reason tree_find(struct tree_root *root, void **result, const ui
 // tree_iterator_free() functions all free() empty nodes as long as no other
 // iterator is currently traversing the node.  If there are several iterators
 // positioned within an empty node, then only the last one to advance out of it
-// will free() the node.
+// will free() the node.  Nodes left with a single record are merged into
+// their parent in the same way.
+//
+// The pointer returned by tree_iterator_get_node() is only valid until the
+// tree is next modified by tree_find().
 
 typedef struct tree_node_iterator {
   struct tree_node_iterator *down;
   struct tree_node *node;
-  unsigned slotnum;
+  // the byte value of the next slot to visit in this node
+  unsigned next;
 } tree_node_iterator;
 
 typedef struct tree_iterator {
@@ -108,6 +108,21 @@ __SERVAL_DNA__OS_INLINE off64_t lseek64(int fd, off64_t offset, int whence) {
 # endif
 #endif
 
+/* Positional reads from large files.  If there is no pread64(2) system call, use pread(2) if off_t
+ * is 64 bits, otherwise seek then read.
+ */
+#ifndef HAVE_PREAD64
+__SERVAL_DNA__OS_INLINE ssize_t pread64(int fd, void *buf, size_t count, off64_t offset) {
+# if SIZEOF_OFF_T == 8
+    return pread(fd, buf, count, (off_t) offset);
+# else
+    if (lseek64(fd, offset, SEEK_SET) == -1)
+	return -1;
+    return read(fd, buf, count);
+# endif
+}
+#endif
+
 /* Functions to create a directory and any missing parent directories.  The "e"
  * variants log the error before returning -1.  The "_info" variants log all
  * created directories at INFO level.
@@ -289,10 +289,10 @@ static int add_explain_response(void **record, void *context)
   subscriber->last_explained = now;
 
   if (!response->please_explain){
-    if ((response->please_explain = emalloc_zero(sizeof(struct overlay_frame))) == NULL)
+    if ((response->please_explain = op_new()) == NULL)
       return 1; // stop walking
     if ((response->please_explain->payload = ob_new()) == NULL) {
-      free(response->please_explain);
+      op_free(response->please_explain);
       response->please_explain = NULL;
       return 1; // stop walking
     }
@@ -356,7 +356,8 @@ static int find_subscr_buffer(struct decode_context *context, struct overlay_buf
       
       // add the abbreviation you told me about
       if (!context->please_explain){
-	context->please_explain = calloc(sizeof(struct overlay_frame),1);
+	if ((context->please_explain = op_new()) == NULL)
+	  return -1;
 	if ((context->please_explain->payload = ob_new()) == NULL)
 	  return -1;
 	ob_limitsize(context->please_explain->payload, MDP_MTU);
@@ -431,7 +432,8 @@ int overlay_address_parse(struct decode_context *context, struct overlay_buffer
 	if ((context->flags & DECODE_FLAG_DONT_EXPLAIN) == 0){
 	  // add the abbreviation you told me about
 	  if (!context->please_explain){
-	    context->please_explain = calloc(sizeof(struct overlay_frame),1);
+	    if ((context->please_explain = op_new()) == NULL)
+	      return -1;
 	    if ((context->please_explain->payload = ob_new()) == NULL)
 	      return -1;
 	    ob_limitsize(context->please_explain->payload, MDP_MTU);
@@ -31,11 +31,93 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  When reading from a buffer, sizeLimit should first be set to the length of any existing data.
  
  In either case, functions that don't take an offset use and advance the position.
+
+ Allocated bytes are held in reference counted blocks, so that ob_dup() can share them instead of
+ copying.  Writing to a shared block through any of the ob_ functions first takes a private copy.
+ Small blocks, and the buffer structures themselves, are taken from per-thread slab pools.
  */
 
+struct ob_block {
+  unsigned ref_count;
+  // index into block_pools[], or BLOCK_UNPOOLED
+  uint8_t size_class;
+  unsigned char bytes[];
+};
+
+#define BLOCK_UNPOOLED 0xFF
+
+static const size_t block_sizes[] = {128, 512, 1536};
+
+static __thread struct mem_pool block_pools[] = {
+  MEM_POOL_INIT("ob_block_128", sizeof(struct ob_block) + 128, 64),
+  MEM_POOL_INIT("ob_block_512", sizeof(struct ob_block) + 512, 32),
+  MEM_POOL_INIT("ob_block_1536", sizeof(struct ob_block) + 1536, 16),
+};
+
+static __thread struct mem_pool buffer_pool = MEM_POOL_INIT("overlay_buffer", sizeof(struct overlay_buffer), 64);
+
+// Allocate a block of at least *size bytes, rounding *size up to the size actually allocated.
+static struct ob_block *block_new(struct __sourceloc __whence, size_t *size)
+{
+  struct ob_block *block;
+  uint8_t i;
+  for (i = 0; i < NELS(block_sizes); ++i) {
+    if (*size <= block_sizes[i]) {
+      if ((block = _mpool_alloc(__whence, &block_pools[i])) == NULL)
+	return NULL;
+      *size = block_sizes[i];
+      block->size_class = i;
+      block->ref_count = 1;
+      return block;
+    }
+  }
+  if ((block = _emalloc(__whence, sizeof(struct ob_block) + *size)) == NULL)
+    return NULL;
+  block->size_class = BLOCK_UNPOOLED;
+  block->ref_count = 1;
+  return block;
+}
+
+static void block_release(struct ob_block *block)
+{
+  assert(block->ref_count > 0);
+  if (--block->ref_count)
+    return;
+  if (block->size_class == BLOCK_UNPOOLED)
+    free(block);
+  else
+    mpool_free(&block_pools[block->size_class], block);
+}
+
+static int is_shared(struct overlay_buffer *b)
+{
+  return b->allocated && b->allocated->ref_count > 1;
+}
+
+// Move the contents of an allocated buffer into a new private block of at least newSize bytes.
+static int ob_reallocate(struct __sourceloc __whence, struct overlay_buffer *b, size_t newSize)
+{
+  DEBUGF(overlaybuffer, "realloc(b->bytes=%p, newSize=%zu)", b->bytes, newSize);
+  struct ob_block *new = block_new(__whence, &newSize);
+  if (!new)
+    return 0;
+  // a shared block may hold bytes beyond the position, eg, in a copy that is yet to be read
+  size_t count = is_shared(b) ? b->allocSize : b->position;
+  if (count)
+    bcopy(b->bytes, new->bytes, count);
+  if (b->allocated) {
+    assert(b->allocated->bytes == b->bytes);
+    block_release(b->allocated);
+  }
+  b->bytes = new->bytes;
+  b->allocated = new;
+  b->allocSize = newSize;
+  return 1;
+}
+
 struct overlay_buffer *_ob_new(struct __sourceloc __whence)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = _mpool_alloc_zero(__whence, &buffer_pool);
   DEBUGF(overlaybuffer, "ob_new() return %p", ret);
   if (ret == NULL)
     return NULL;
@@ -47,7 +129,7 @@ struct overlay_buffer *_ob_new(struct __sourceloc __whence)
 // and allow other callers to use the ob_ convenience methods for reading and writing up to size bytes.
 struct overlay_buffer *_ob_static(struct __sourceloc __whence, unsigned char *bytes, size_t size)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = _mpool_alloc_zero(__whence, &buffer_pool);
   DEBUGF(overlaybuffer, "ob_static(bytes=%p, size=%zu) return %p", bytes, size, ret);
   if (ret == NULL)
     return NULL;
@@ -67,7 +149,7 @@ struct overlay_buffer *_ob_slice(struct __sourceloc __whence, struct overlay_buf
     WHY("Buffer isn't long enough to slice");
     return NULL;
   }
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = _mpool_alloc_zero(__whence, &buffer_pool);
   DEBUGF(overlaybuffer, "ob_slice(b=%p, offset=%zu, length=%zu) return %p", b, offset, length, ret);
   if (ret == NULL)
       return NULL;
@@ -80,7 +162,7 @@ struct overlay_buffer *_ob_slice(struct __sourceloc __whence, struct overlay_buf
 
 struct overlay_buffer *_ob_dup(struct __sourceloc __whence, struct overlay_buffer *b)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = _mpool_alloc_zero(__whence, &buffer_pool);
   DEBUGF(overlaybuffer, "ob_dup(b=%p) return %p", b, ret);
   if (ret == NULL)
     return NULL;
@@ -96,7 +178,14 @@ struct overlay_buffer *_ob_dup(struct __sourceloc __whence, struct overlay_buffe
     }
     if (byteCount > b->allocSize)
       byteCount = b->allocSize;
-    if (byteCount)
+    if (byteCount && b->allocated && b->position == 0){
+      // share the bytes of an allocated buffer, leaving the copy positioned as if they were appended
+      b->allocated->ref_count++;
+      ret->allocated = b->allocated;
+      ret->bytes = b->bytes;
+      ret->allocSize = b->allocSize;
+      ret->position = byteCount;
+    }else if (byteCount)
       ob_append_bytes(ret, b->bytes, byteCount);
   }
   return ret;
@@ -107,8 +196,8 @@ void _ob_free(struct __sourceloc __whence, struct overlay_buffer *b)
   assert(b != NULL);
   DEBUGF(overlaybuffer, "ob_free(b=%p)", b);
   if (b->allocated)
-    free(b->allocated);
-  free(b);
+    block_release(b->allocated);
+  mpool_free(&buffer_pool, b);
 }
 
 int _ob_checkpoint(struct __sourceloc __whence, struct overlay_buffer *b)
@@ -175,7 +264,7 @@ ssize_t _ob_makespace(struct __sourceloc __whence, struct overlay_buffer *b, siz
     DEBUGF(overlaybuffer, "ob_makespace(): asked for space to %zu, beyond size limit of %zu", b->position + bytes, b->sizeLimit);
     return 0;
   }
-  if (b->position + bytes <= b->allocSize)
+  if (b->position + bytes <= b->allocSize && !is_shared(b))
     return 1;
   // Don't realloc a static buffer.
   if (b->bytes && b->allocated == NULL) {
@@ -183,26 +272,15 @@ ssize_t _ob_makespace(struct __sourceloc __whence, struct overlay_buffer *b, siz
     return 0;
   }
   size_t newSize = b->position + bytes;
+  if (newSize < b->allocSize)
+    newSize = b->allocSize;
   if (newSize<64) newSize=64;
   if (newSize&63) newSize+=64-(newSize&63);
   if (newSize>1024 && (newSize&1023))
     newSize+=1024-(newSize&1023);
   if (newSize>65536 && (newSize&65535))
     newSize+=65536-(newSize&65535);
-  DEBUGF(overlaybuffer, "realloc(b->bytes=%p, newSize=%zu)", b->bytes, newSize);
-  unsigned char *new = emalloc(newSize);
-  if (!new)
-    return 0;
-  if (b->position)
-    bcopy(b->bytes,new,b->position);
-  if (b->allocated) {
-    assert(b->allocated == b->bytes);
-    free(b->allocated);
-  }
-  b->bytes=new;
-  b->allocated=new;
-  b->allocSize=newSize;
-  return 1;
+  return ob_reallocate(__whence, b, newSize);
 }
 
 /*
@@ -583,6 +661,8 @@ void _ob_set_ui16(struct __sourceloc __whence, struct overlay_buffer *b, size_t
   assert(b != NULL);
   assert(offset + bytes <= b->sizeLimit);
   assert(offset + bytes <= b->allocSize);
+  if (is_shared(b) && !ob_reallocate(__whence, b, b->allocSize))
+    return;
   b->bytes[offset] = (v >> 8) & 0xFF;
   b->bytes[offset+1] = v & 0xFF;
   DEBUGF(overlaybuffer, "ob_set_ui16(b=%p, offset=%zd, v=%u) %p[%zd]=%s", b, offset, v, b->bytes, offset, alloca_tohex(&b->bytes[offset], bytes));
@@ -594,6 +674,8 @@ void _ob_set(struct __sourceloc __whence, struct overlay_buffer *b, size_t offse
   assert(b != NULL);
   assert(offset + bytes <= b->sizeLimit);
   assert(offset + bytes <= b->allocSize);
+  if (is_shared(b) && !ob_reallocate(__whence, b, b->allocSize))
+    return;
   b->bytes[offset] = byte;
   DEBUGF(overlaybuffer, "ob_set(b=%p, offset=%zd, byte=0x%02x) %p[%zd]=%s", b, offset, byte, b->bytes, offset, alloca_tohex(&b->bytes[offset], bytes));
 }
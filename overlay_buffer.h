@@ -24,6 +24,8 @@
 #include <stdint.h>
 #include "whence.h"
 
+struct ob_block;
+
 struct overlay_buffer {
   unsigned char *bytes;
   
@@ -40,7 +42,8 @@ struct overlay_buffer {
   size_t allocSize;
   
   // is this an allocated buffer? can it be resized? Should it be freed?
-  unsigned char * allocated;
+  // Allocated bytes are reference counted, and may be shared with copies made by ob_dup().
+  struct ob_block *allocated;
 };
 
 struct overlay_buffer *_ob_new(struct __sourceloc __whence);
@@ -127,6 +130,7 @@ size_t ob_remaining(struct overlay_buffer *b);
 size_t ob_mark(struct overlay_buffer *b);
 int _ob_overrun(struct __sourceloc, struct overlay_buffer *b);
 // get the raw pointer of the whole buffer
+// the bytes of a buffer returned by ob_dup() may be shared, only modify them with ob_ functions
 unsigned char* ob_ptr(struct overlay_buffer *b);
 // get the raw pointer of the current position
 unsigned char* ob_current_ptr(struct overlay_buffer *b);
@@ -65,6 +65,7 @@ struct profile_total sock_any_stats;
 static void overlay_interface_poll(struct sched_ent *alarm);
 static int inet_up_count=0;
 static void rescan_soon(time_ms_t run_at);
+static void tx_discard(overlay_interface *interface);
 
 void overlay_interface_close(overlay_interface *interface)
 {
@@ -89,6 +90,7 @@ void overlay_interface_close(overlay_interface *interface)
   }
   
   unschedule(&interface->alarm);
+  tx_discard(interface);
   if (interface->radio_link_state)
     radio_link_free(interface);
 
@@ -167,6 +169,10 @@ void interface_state_html(struct strbuf *b, struct overlay_interface *interface)
   }
   strbuf_sprintf(b, "TX: %d<br>", interface->tx_count);
   strbuf_sprintf(b, "RX: %d<br>", interface->recv_count);
+  if (interface->ifconfig.socket_type == SOCK_DGRAM){
+    strbuf_sprintf(b, "TX calls: %d<br>", interface->tx_calls);
+    strbuf_sprintf(b, "RX calls: %d<br>", interface->recv_calls);
+  }
 }
 
 static int
@@ -601,6 +607,8 @@ overlay_interface_init(const char *name,
   interface->alarm.poll.fd=-1;
   interface->tx_count=0;
   interface->recv_count=0;
+  interface->tx_calls=0;
+  interface->recv_calls=0;
 
   if (addr)
     interface->address = *addr;
@@ -685,6 +693,56 @@ cleanup:
   return cleanup_ret;
 }
 
+#ifdef HAVE_RECVMMSG
+
+// Read up to RX_BATCH_SIZE packets per system call, and drain at most RX_BATCH_READS batches per
+// wakeup so that a flood on one interface can't starve the others.
+#define RX_BATCH_SIZE 16
+#define RX_BATCH_READS 4
+
+static void interface_read_dgram(struct overlay_interface *interface)
+{
+  static unsigned char packets[RX_BATCH_SIZE][8096];
+  struct socket_address addrs[RX_BATCH_SIZE];
+  struct iovec iov[RX_BATCH_SIZE];
+  struct mmsghdr msgs[RX_BATCH_SIZE];
+  unsigned reads, i;
+
+  for (reads = 0; reads < RX_BATCH_READS; reads++){
+    bzero(addrs, sizeof addrs);
+    bzero(msgs, sizeof msgs);
+    for (i = 0; i < RX_BATCH_SIZE; i++){
+      iov[i].iov_base = packets[i];
+      iov[i].iov_len = sizeof packets[i];
+      msgs[i].msg_hdr.msg_name = &addrs[i].addr;
+      msgs[i].msg_hdr.msg_namelen = sizeof addrs[i].raw;
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int count = recvmmsg(interface->alarm.poll.fd, msgs, RX_BATCH_SIZE, MSG_DONTWAIT, NULL);
+    if (count == -1){
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	return;
+      WHYF_perror("recvmmsg(%d) on interface %s", interface->alarm.poll.fd, interface->name);
+      overlay_interface_close(interface);
+      return;
+    }
+    interface->recv_calls++;
+    DEBUGF(verbose_io, "recvmmsg(%d) -> %d packets", interface->alarm.poll.fd, count);
+    for (i = 0; i < (unsigned)count; i++){
+      addrs[i].addrlen = msgs[i].msg_hdr.msg_namelen;
+      packetOkOverlay(interface, packets[i], msgs[i].msg_len, &addrs[i]);
+      // processing a packet may bring the interface down
+      if (interface->state != INTERFACE_STATE_UP || interface->alarm.poll.fd == -1)
+	return;
+    }
+    if (count < RX_BATCH_SIZE)
+      return;
+  }
+}
+
+#else
+
 static void interface_read_dgram(struct overlay_interface *interface)
 {
   int plen=0;
@@ -701,9 +759,12 @@ static void interface_read_dgram(struct overlay_interface *interface)
     overlay_interface_close(interface);
     return;
   }
+  interface->recv_calls++;
   packetOkOverlay(interface, packet, plen, &recvaddr);
 }
 
+#endif
+
 struct file_packet{
   struct socket_address src_addr;
   struct socket_address dst_addr;
@@ -924,49 +985,215 @@ static void overlay_interface_poll(struct sched_ent *alarm)
   }  
 }
 
-static int send_local_packet(int fd, const uint8_t *bytes, size_t len, const char *folder, const char *file)
+/* Packets for SOCK_DGRAM interfaces are queued while the transmit queues are being drained (see
+ * overlay_tx_batch_begin()), then sent together with as few system calls as possible.  Outside of
+ * a batch, each packet is sent as soon as it is queued.
+ */
+
+#define TX_BATCH_SIZE 16
+
+struct tx_packet{
+  struct socket_address address;
+  struct overlay_buffer *buffer;
+  // the last (or only) destination of this buffer, count the packet and free the buffer once sent
+  char last;
+  // a local broadcast, sent to every socket in the interface folder
+  char local;
+  // sent to the interface broadcast address, bring the interface down if it fails
+  char broadcast;
+};
+
+static struct tx_batch{
+  unsigned count;
+  struct tx_packet packets[TX_BATCH_SIZE];
+} tx_batches[OVERLAY_MAX_INTERFACES];
+
+static unsigned tx_batching = 0;
+
+static void tx_discard(overlay_interface *interface)
+{
+  struct tx_batch *batch = &tx_batches[interface - overlay_interfaces];
+  unsigned i;
+  for (i = 0; i < batch->count; i++){
+    if (batch->packets[i].last && batch->packets[i].buffer)
+      ob_free(batch->packets[i].buffer);
+  }
+  batch->count = 0;
+}
+
+// Report a packet that could not be sent, return -1 if the interface was closed as a result.
+static int tx_failed(overlay_interface *interface, struct tx_packet *packet)
 {
-  struct socket_address addr;
-  
-  strbuf d = strbuf_local_buf(addr.local.sun_path);
+  if (errno == EAGAIN || errno == EWOULDBLOCK)
+    return 0;
+  if (packet->local){
+    WHYF_perror("sendto(%d, %zu, %s)", interface->alarm.poll.fd, ob_position(packet->buffer), alloca_socket_address(&packet->address));
+    return 0;
+  }
+  if (errno == ENOENT || errno == ENOTDIR)
+    return 0;
+  WHYF_perror("sendto(fd=%d,len=%zu,addr=%s) on interface %s",
+      interface->alarm.poll.fd,
+      ob_position(packet->buffer),
+      alloca_socket_address(&packet->address),
+      interface->name
+    );
+  // if we had any error while sending broadcast packets,
+  // it could be because the interface is coming down
+  // or there might be some socket error that we can't fix.
+  // So bring the interface down, and scan for network changes soon
+  if (packet->broadcast){
+    overlay_interface_close(interface);
+    rescan_soon(gettime_ms()+100);
+    return -1;
+  }
+  return 0;
+}
+
+static void tx_flush(overlay_interface *interface)
+{
+  struct tx_batch *batch = &tx_batches[interface - overlay_interfaces];
+  unsigned i = 0;
+  while (i < batch->count){
+    struct tx_packet *packet = &batch->packets[i];
+#ifdef HAVE_SENDMMSG
+    struct iovec iov[TX_BATCH_SIZE];
+    struct mmsghdr msgs[TX_BATCH_SIZE];
+    unsigned n = batch->count - i, j;
+    bzero(msgs, sizeof msgs);
+    for (j = 0; j < n; j++){
+      iov[j].iov_base = ob_ptr(packet[j].buffer);
+      iov[j].iov_len = ob_position(packet[j].buffer);
+      msgs[j].msg_hdr.msg_name = &packet[j].address.addr;
+      msgs[j].msg_hdr.msg_namelen = packet[j].address.addrlen;
+      msgs[j].msg_hdr.msg_iov = &iov[j];
+      msgs[j].msg_hdr.msg_iovlen = 1;
+    }
+    int sent = sendmmsg(interface->alarm.poll.fd, msgs, n, 0);
+    interface->tx_calls++;
+    DEBUGF(verbose_io, "sendmmsg(%d, %u) -> %d", interface->alarm.poll.fd, n, sent);
+    if (sent == -1){
+      if (tx_failed(interface, packet) == -1)
+	return;
+      if (packet->last){
+	ob_free(packet->buffer);
+	packet->buffer = NULL;
+      }
+      i++;
+      continue;
+    }
+    for (j = 0; j < (unsigned)sent; j++){
+      if (packet[j].last){
+	interface->tx_count++;
+	ob_free(packet[j].buffer);
+	packet[j].buffer = NULL;
+      }
+    }
+    i += sent;
+#else
+    ssize_t sent = sendto(interface->alarm.poll.fd,
+	      ob_ptr(packet->buffer), ob_position(packet->buffer), 0,
+	      &packet->address.addr, packet->address.addrlen);
+    interface->tx_calls++;
+    if (sent == -1){
+      if (tx_failed(interface, packet) == -1)
+	return;
+    }else if (packet->last)
+      interface->tx_count++;
+    if (packet->last){
+      ob_free(packet->buffer);
+      packet->buffer = NULL;
+    }
+    i++;
+#endif
+  }
+  batch->count = 0;
+}
+
+// Queue a packet, returning NULL (and freeing the buffer) if the interface has gone down.
+static struct tx_packet *tx_queue(overlay_interface *interface, const struct socket_address *address, struct overlay_buffer *buffer, char local, char broadcast)
+{
+  struct tx_batch *batch = &tx_batches[interface - overlay_interfaces];
+  if (batch->count >= TX_BATCH_SIZE)
+    tx_flush(interface);
+  // flushing may have closed the interface
+  if (interface->state != INTERFACE_STATE_UP){
+    ob_free(buffer);
+    return NULL;
+  }
+  struct tx_packet *packet = &batch->packets[batch->count++];
+  packet->address = *address;
+  packet->buffer = buffer;
+  packet->last = 1;
+  packet->local = local;
+  packet->broadcast = broadcast;
+  return packet;
+}
+
+void overlay_tx_batch_begin()
+{
+  tx_batching++;
+}
+
+void overlay_tx_batch_flush()
+{
+  assert(tx_batching > 0);
+  if (--tx_batching)
+    return;
+  unsigned i;
+  for (i = 0; i < OVERLAY_MAX_INTERFACES; i++){
+    if (tx_batches[i].count)
+      tx_flush(&overlay_interfaces[i]);
+  }
+}
+
+static int local_packet_address(struct socket_address *addr, const char *folder, const char *file)
+{
+  strbuf d = strbuf_local_buf(addr->local.sun_path);
   strbuf_path_join(d, folder, file, NULL);
   if (strbuf_overrun(d))
     return WHYF("interface file name overrun: %s", alloca_str_toprint(strbuf_str(d)));
   
   struct stat st;
-  if (lstat(addr.local.sun_path, &st))
+  if (lstat(addr->local.sun_path, &st))
     return 1;
   if (!S_ISSOCK(st.st_mode))
     return 1;
     
-  addr.local.sun_family = AF_UNIX;
-  addr.addrlen = offsetof(struct sockaddr_un, sun_path) + strlen(addr.local.sun_path)+1;
-  
-  ssize_t sent = sendto(fd, bytes, len, 0, 
-	    &addr.addr, addr.addrlen);
-  if (sent == -1){
-    if (errno != EAGAIN && errno != EWOULDBLOCK)
-      return WHYF_perror("sendto(%d, %zu, %s)", fd, len, alloca_socket_address(&addr));
-  }
+  addr->local.sun_family = AF_UNIX;
+  addr->addrlen = offsetof(struct sockaddr_un, sun_path) + strlen(addr->local.sun_path)+1;
   return 0;
 }
 
-static int send_local_broadcast(int fd, const uint8_t *bytes, size_t len, const char *folder)
+// queue the packet for every socket in this folder
+static void send_local_broadcast(overlay_interface *interface, struct overlay_buffer *buffer, const char *folder)
 {
-  if (send_local_packet(fd, bytes, len, folder, "broadcast")==0)
-    return 0;
-    
+  struct socket_address addr;
+  if (local_packet_address(&addr, folder, "broadcast")==0){
+    tx_queue(interface, &addr, buffer, 1, 0);
+    return;
+  }
+  
   DIR *dir;
   struct dirent *dp;
   if ((dir = opendir(folder)) == NULL) {
     WARNF_perror("opendir(%s)", alloca_str_toprint(folder));
-    return -1;
+    ob_free(buffer);
+    return;
   }
+  struct tx_packet *previous = NULL;
   while ((dp = readdir(dir)) != NULL) {
-    send_local_packet(fd, bytes, len, folder, dp->d_name);
+    if (local_packet_address(&addr, folder, dp->d_name)!=0)
+      continue;
+    // only the last packet queued for this buffer will free it
+    if (previous)
+      previous->last = 0;
+    if ((previous = tx_queue(interface, &addr, buffer, 1, 0)) == NULL)
+      break;
   }
   closedir(dir);
-  return 0;
+  if (!previous && !dp)
+    ob_free(buffer);
 }
 
 int overlay_broadcast_ensemble(struct network_destination *destination, struct overlay_buffer *buffer)
@@ -1067,36 +1294,12 @@ int overlay_broadcast_ensemble(struct network_destination *destination, struct o
       if (destination->address.addr.sa_family == AF_UNIX
 	&& !destination->unicast){
 	// find all sockets in this folder and send to them
-	send_local_broadcast(interface->alarm.poll.fd, 
-		  bytes, (size_t)len, destination->address.local.sun_path);
+	send_local_broadcast(interface, buffer, destination->address.local.sun_path);
       }else{
-	ssize_t sent = sendto(interface->alarm.poll.fd, 
-		  bytes, (size_t)len, 0, 
-		  &destination->address.addr, destination->address.addrlen);
-	if (sent == -1){
-	  if (errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=ENOENT && errno!=ENOTDIR){
-	    WHYF_perror("sendto(fd=%d,len=%zu,addr=%s) on interface %s",
-		interface->alarm.poll.fd,
-		(size_t)len,
-		alloca_socket_address(&destination->address),
-		interface->name
-	      );
-	
-	    // if we had any error while sending broadcast packets,
-	    // it could be because the interface is coming down
-	    // or there might be some socket error that we can't fix.
-	    // So bring the interface down, and scan for network changes soon
-	    if (destination == interface->destination){
-	      overlay_interface_close(interface);
-	      rescan_soon(gettime_ms()+100);
-	    }
-	  }
-	  ob_free(buffer);
-	  return -1;
-	}
+	tx_queue(interface, &destination->address, buffer, 0, destination == interface->destination);
       }
-      ob_free(buffer);
-      interface->tx_count++;
+      if (!tx_batching)
+	tx_flush(interface);
       return 0;
     }
       
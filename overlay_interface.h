@@ -24,6 +24,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "os.h" // for time_ms_t
 #include "socket.h"
 #include "limit.h"
+#include "constants.h" // for OQ_MAX
 
 #define INTERFACE_STATE_DOWN 0
 #define INTERFACE_STATE_UP 1
@@ -63,6 +64,14 @@ struct network_destination {
 
   // rate limit for outgoing packets
   struct limit_state transfer_limit;
+
+  // queued frames going this way, one list per tx queue;
+  // frames not yet sent here in the order they were queued,
+  // then frames waiting for an ack in the order they were sent
+  struct packet_destination_list {
+    struct packet_destination *first;
+    struct packet_destination *last;
+  } unsent[OQ_MAX], sent[OQ_MAX];
 };
 
 typedef struct overlay_interface {
@@ -89,6 +98,9 @@ typedef struct overlay_interface {
   
   int recv_count;
   int tx_count;
+  // system calls used to read and send those packets
+  int recv_calls;
+  int tx_calls;
   
   struct radio_link_state *radio_link_state;
 
@@ -148,6 +160,8 @@ overlay_interface * overlay_interface_find(struct in_addr addr, int return_defau
 overlay_interface * overlay_interface_find_name_file_addr(const char *name, const char *file_path, struct socket_address *addr);
 int overlay_interface_compare(overlay_interface *one, overlay_interface *two);
 int overlay_broadcast_ensemble(struct network_destination *destination, struct overlay_buffer *buffer);
+void overlay_tx_batch_begin();
+void overlay_tx_batch_flush();
 void interface_state_html(struct strbuf *b, struct overlay_interface *interface);
 void overlay_interface_monitor_up();
 
@@ -136,8 +136,9 @@ int overlay_send_probe(struct subscriber *peer, struct network_destination *dest
   
   // TODO enhance overlay_send_frame to support pre-supplied network destinations
   
-  struct overlay_frame *frame=malloc(sizeof(struct overlay_frame));
-  bzero(frame,sizeof(struct overlay_frame));
+  struct overlay_frame *frame=op_new();
+  if (!frame)
+    return -1;
   frame->type=OF_TYPE_DATA;
   frame->source = get_my_subscriber(1);
   frame->destination = peer;
@@ -850,7 +850,7 @@ int _overlay_send_frame(struct __sourceloc whence, struct internal_mdp_header *h
          header->destination?alloca_tohex_sid_t(header->destination->sid):"broadcast", header->destination_port);
       
   /* Prepare the overlay frame for dispatch */
-  struct overlay_frame *frame = emalloc_zero(sizeof(struct overlay_frame));
+  struct overlay_frame *frame = op_new();
   if (!frame)
     return -1;
   
@@ -1287,6 +1287,32 @@ static int mdp_process_identity_request(struct socket_address *client, struct md
   return 0;
 }
 
+static void mdp_send_latency_histogram(struct overlay_buffer *b, const struct latency_histogram *h)
+{
+  ob_append_packed_ui64(b, h->count);
+  ob_append_packed_ui64(b, latency_histogram_percentile(h, 50));
+  ob_append_packed_ui64(b, latency_histogram_percentile(h, 90));
+  ob_append_packed_ui64(b, latency_histogram_percentile(h, 99));
+  ob_append_packed_ui64(b, h->max);
+}
+
+static void mdp_sched_stats(struct socket_address *client, struct mdp_header *header)
+{
+  struct alarm_latency *latency;
+  for (latency = fd_latency_first(); latency; latency = latency->_next){
+    uint8_t payload[MDP_MTU];
+    struct overlay_buffer *b = ob_static(payload, sizeof payload);
+    ob_limitsize(b, sizeof payload);
+    ob_append_strn(b, latency->stats->name, 256);
+    mdp_send_latency_histogram(b, &latency->duration);
+    mdp_send_latency_histogram(b, &latency->lateness);
+    assert(!ob_overrun(b));
+    mdp_reply2(__WHENCE__, client, header, 0, payload, ob_position(b));
+    ob_free(b);
+  }
+  mdp_reply_ok(client, header);
+}
+
 // return one response per matching identity
 static int mdp_search_identities(struct socket_address *client, struct mdp_header *header, 
   struct overlay_buffer *payload)
@@ -1624,6 +1650,10 @@ static void mdp_process_packet(struct socket_address *client, struct mdp_header
 	rhizome_process_added_bundles(INT64_MAX);
 	mdp_reply_ok(client, header);
 	break;
+      case MDP_SCHED_STATS:
+	DEBUGF(mdprequests, "Processing MDP_SCHED_STATS from %s", alloca_socket_address(client));
+	mdp_sched_stats(client, header);
+	break;
       case MDP_INTERFACE:
 	DEBUGF(mdprequests, "Processing MDP_INTERFACE from %s", alloca_socket_address(client));
 	mdp_interface_packet(client, header, payload);
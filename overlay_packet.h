@@ -40,6 +40,10 @@ struct packet_destination{
   struct network_destination *destination;
   // next hop in the route
   struct subscriber *next_hop;
+  // while queued, the frame and its neighbours in destination->unsent[] or ->sent[]
+  struct overlay_frame *frame;
+  struct packet_destination *_prev;
+  struct packet_destination *_next;
 };
 
 struct overlay_frame {
@@ -122,6 +126,7 @@ struct internal_mdp_header{
 };
 
 
+struct overlay_frame *op_new();
 int op_free(struct overlay_frame *p);
 struct overlay_frame *op_dup(struct overlay_frame *f);
 
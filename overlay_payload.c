@@ -20,6 +20,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "serval.h"
 #include "conf.h"
 #include "str.h"
+#include "mem.h"
 #include "overlay_buffer.h"
 #include "overlay_packet.h"
 
@@ -114,6 +115,13 @@ cleanup:
   return -1;
 }
 
+static __thread struct mem_pool frame_pool = MEM_POOL_INIT("overlay_frame", sizeof(struct overlay_frame), 32);
+
+struct overlay_frame *op_new()
+{
+  return mpool_alloc_zero(&frame_pool);
+}
+
 int op_free(struct overlay_frame *p)
 {
   if (!p) return WHY("Asked to free NULL");
@@ -123,7 +131,7 @@ int op_free(struct overlay_frame *p)
   p->next=NULL;
   if (p->payload) ob_free(p->payload);
   p->payload=NULL;
-  free(p);
+  mpool_free(&frame_pool, p);
   return 0;
 }
 
@@ -132,7 +140,7 @@ struct overlay_frame *op_dup(struct overlay_frame *in)
   if (!in) return NULL;
 
   /* clone the frame */
-  struct overlay_frame *out = emalloc(sizeof(struct overlay_frame));
+  struct overlay_frame *out = mpool_alloc(&frame_pool);
   if (out == NULL)
     return NULL;
 
@@ -141,7 +149,7 @@ struct overlay_frame *op_dup(struct overlay_frame *in)
 
   if (in->payload) {
     if ((out->payload = ob_dup(in->payload)) == NULL) {
-      free(out);
+      mpool_free(&frame_pool, out);
       return NULL;
     }
   }
@@ -54,6 +54,8 @@ struct outgoing_packet{
 };
 
 #define SMALL_PACKET_SIZE (400)
+// stop filling a packet after skipping this many frames that won't fit
+#define PACKET_FULL_MISSES (8)
 
 int32_t mdp_sequence=0;
 struct sched_ent next_packet;
@@ -80,6 +82,69 @@ int overlay_queue_init(){
   return 0;
 }
 
+/* Each destination keeps its own lists of the queued frames that are going that way, so that
+ * once we start building a packet for a destination, and when that destination acks a packet, we
+ * only need to look at those frames. Frames move from the unsent list to the tail of the sent
+ * list each time they are sent, so the sent list stays in the order the frames become due for
+ * retransmission.
+ */
+static struct packet_destination_list *destination_list(struct packet_destination *pd)
+{
+  uint8_t queue = pd->frame->queue;
+  return pd->transmit_time ? &pd->destination->sent[queue] : &pd->destination->unsent[queue];
+}
+
+static void destination_link(struct overlay_frame *frame, struct packet_destination *pd)
+{
+  pd->frame = frame;
+  struct packet_destination_list *list = destination_list(pd);
+  pd->_next = NULL;
+  pd->_prev = list->last;
+  if (pd->_prev)
+    pd->_prev->_next = pd;
+  else
+    list->first = pd;
+  list->last = pd;
+}
+
+static void destination_unlink(struct packet_destination *pd)
+{
+  struct packet_destination_list *list = destination_list(pd);
+  if (pd->_prev)
+    pd->_prev->_next = pd->_next;
+  else
+    list->first = pd->_next;
+  if (pd->_next)
+    pd->_next->_prev = pd->_prev;
+  else
+    list->last = pd->_prev;
+  pd->frame = NULL;
+  pd->_prev = pd->_next = NULL;
+}
+
+// the entry has been copied into another slot of frame->destinations, repoint its neighbours
+static void destination_relink(struct packet_destination *pd)
+{
+  struct packet_destination_list *list = destination_list(pd);
+  if (pd->_prev)
+    pd->_prev->_next = pd;
+  else
+    list->first = pd;
+  if (pd->_next)
+    pd->_next->_prev = pd;
+  else
+    list->last = pd;
+}
+
+// the next entry in a destination list that belongs to a different frame
+static struct packet_destination *destination_next(struct packet_destination *pd)
+{
+  struct packet_destination *next = pd->_next;
+  while (next && next->frame == pd->frame)
+    next = next->_next;
+  return next;
+}
+
 /* remove and free a payload from the queue */
 static struct overlay_frame *
 overlay_queue_remove(overlay_txqueue *queue, struct overlay_frame *frame){
@@ -97,20 +162,25 @@ overlay_queue_remove(overlay_txqueue *queue, struct overlay_frame *frame){
   
   queue->length--;
   
-  while(frame->destination_count>0)
-    release_destination_ref(frame->destinations[--frame->destination_count].destination);
+  while(frame->destination_count>0){
+    struct packet_destination *pd = &frame->destinations[--frame->destination_count];
+    if (pd->frame)
+      destination_unlink(pd);
+    release_destination_ref(pd->destination);
+  }
     
   op_free(frame);
   
   return next;
 }
 
-static void overlay_queue_release(){
+void overlay_queue_release(){
   unsigned i;
   for(i=0;i<OQ_MAX;i++) {
     while(overlay_tx[i].first)
       overlay_queue_remove(&overlay_tx[i], overlay_tx[i].first);
   }
+  unschedule(&next_packet);
 }
 DEFINE_TRIGGER(shutdown, overlay_queue_release);
 
@@ -155,6 +225,11 @@ int overlay_queue_remaining(int queue){
   return overlay_tx[queue].maxLength - overlay_tx[queue].length;
 }
 
+void overlay_queue_set_max_length(int queue, int max_length){
+  assert(queue>=0 && queue<OQ_MAX);
+  overlay_tx[queue].maxLength = max_length;
+}
+
 int _overlay_payload_enqueue(struct __sourceloc __whence, struct overlay_frame *p)
 {
   /* Add payload p to queue q.
@@ -230,6 +305,8 @@ int _overlay_payload_enqueue(struct __sourceloc __whence, struct overlay_frame *
   queue->last=p;
   if (!queue->first) queue->first=p;
   queue->length++;
+  for (i=0;i<p->destination_count;i++)
+    destination_link(p, &p->destinations[i]);
   if (p->queue==OQ_ISOCHRONOUS_VOICE)
     rhizome_saw_voice_traffic();
   
@@ -293,10 +370,15 @@ void frame_remove_destination(struct overlay_frame *frame, int i){
 	 frame->destinations[i].destination->unicast?"unicast":"broadcast",
 	 frame->destinations[i].destination->interface->name
 	);
+  if (frame->destinations[i].frame)
+    destination_unlink(&frame->destinations[i]);
   release_destination_ref(frame->destinations[i].destination);
   frame->destination_count --;
-  if (i<frame->destination_count)
+  if (i<frame->destination_count){
     frame->destinations[i]=frame->destinations[frame->destination_count];
+    if (frame->destinations[i].frame)
+      destination_relink(&frame->destinations[i]);
+  }
 }
 
 void frame_add_destination(struct overlay_frame *frame, struct subscriber *next_hop, struct network_destination *dest){
@@ -307,6 +389,11 @@ void frame_add_destination(struct overlay_frame *frame, struct subscriber *next_
   frame->destinations[i].destination=add_destination_ref(dest);
   frame->destinations[i].next_hop = next_hop;
   frame->destinations[i].sent_sequence=-1;
+  frame->destinations[i].transmit_time=0;
+  frame->destinations[i].frame=NULL;
+  // frames that are already queued need to be found via their new destination
+  if (frame->enqueued_at)
+    destination_link(frame, &frame->destinations[i]);
   DEBUGF(overlayframes, "Add %s destination on interface %s", 
 	 frame->destinations[i].destination->unicast?"unicast":"broadcast",
 	 frame->destinations[i].destination->interface->name
@@ -359,184 +446,226 @@ overlay_calc_queue_time(struct overlay_frame *frame)
   return 0;
 }
 
+// try to add one queued frame to the packet, or start a new packet with it
 static void
-overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, time_ms_t now, strbuf debug){
-  struct overlay_frame *frame = queue->first;
+overlay_stuff_frame(struct outgoing_packet *packet, overlay_txqueue *queue, struct overlay_frame *frame, time_ms_t now, strbuf debug){
+  if (queue->latencyTarget!=0 && frame->enqueued_at + queue->latencyTarget < now){
+    DEBUGF(ack,"Dropping frame (%p) type %x (length %zu) for %s due to expiry timeout", 
+	   frame, frame->type, frame->payload->checkpointLength,
+	   frame->destination?alloca_tohex_sid_t(frame->destination->sid):"All"
+	  );
+    overlay_queue_remove(queue, frame);
+    return;
+  }
   
-  // TODO stop when the packet is nearly full?
-  while(frame){
-    if (queue->latencyTarget!=0 && frame->enqueued_at + queue->latencyTarget < now){
-      DEBUGF(ack,"Dropping frame (%p) type %x (length %zu) for %s due to expiry timeout", 
-	     frame, frame->type, frame->payload->checkpointLength,
-	     frame->destination?alloca_tohex_sid_t(frame->destination->sid):"All"
-	    );
-      frame = overlay_queue_remove(queue, frame);
-      continue;
-    }
-    
-    /* Note, once we queue a broadcast packet we are currently 
-     * committed to sending it to every destination, 
-     * even if we hear it from somewhere else in the mean time
-     */
-    
-    // ignore payloads that are waiting for ack / nack resends
-    if (frame->delay_until > now)
-      goto skip;
+  /* Note, once we queue a broadcast packet we are currently 
+   * committed to sending it to every destination, 
+   * even if we hear it from somewhere else in the mean time
+   */
+  
+  // ignore payloads that are waiting for ack / nack resends
+  if (frame->delay_until > now)
+    goto skip;
 
-    if (packet->buffer && packet->destination->ifconfig.encapsulation==ENCAP_SINGLE)
-      goto skip;
-      
-    // quickly skip payloads that have no chance of fitting
-    if (packet->buffer && ob_position(frame->payload) > ob_remaining(packet->buffer))
-      goto skip;
+  if (packet->buffer && packet->destination->ifconfig.encapsulation==ENCAP_SINGLE)
+    goto skip;
     
-    if (!frame->manual_destinations)
-      link_add_destinations(frame);
-    
-    if(frame->mdp_sequence != -1 && ((mdp_sequence - frame->mdp_sequence)&0xFFFF) >= 64){
-      // too late, we've sent too many packets for the next hop to correctly de-duplicate
-      DEBUGF(overlayframes, "Retransmition of frame %p mdp seq %d, is too late to be de-duplicated", 
-	     frame, frame->mdp_sequence);
-      frame = overlay_queue_remove(queue, frame);
-      continue;
-    }
-    
-    int destination_index=-1;
-    {
-      int i;
-      for (i=frame->destination_count -1;i>=0;i--){
-	struct network_destination *dest = frame->destinations[i].destination;
-	if (!dest)
-	  FATALF("Destination %d is NULL", i);
-	if (!dest->interface)
-	  FATALF("Destination interface %d is NULL", i);
-	if (dest->interface->state!=INTERFACE_STATE_UP){
-	  // remove this destination
-	  frame_remove_destination(frame, i);
-	  continue;
-	}
-	if (frame->enqueued_at + dest->ifconfig.transmit_timeout_ms < now){
-	  DEBUGF(ack,"Dropping %p, %s packet destination for %s sent w. seq %d, %dms ago", 
-	    frame, dest->unicast?"unicast":"broadcast",
-	    frame->whence.function, frame->destinations[i].sent_sequence,
-	    (int)(gettime_ms() - frame->destinations[i].transmit_time));
-	  frame_remove_destination(frame, i);
-	  continue;
-	}
-	if (ob_position(frame->payload) > (unsigned)dest->ifconfig.mtu){
-	  WARNF("Skipping packet destination as size %zu > destination mtu %zd", 
-	  ob_position(frame->payload), dest->ifconfig.mtu);
-	  frame_remove_destination(frame, i);
+  // quickly skip payloads that have no chance of fitting
+  if (packet->buffer && ob_position(frame->payload) > ob_remaining(packet->buffer))
+    goto skip;
+  
+  if (!frame->manual_destinations)
+    link_add_destinations(frame);
+  
+  if(frame->mdp_sequence != -1 && ((mdp_sequence - frame->mdp_sequence)&0xFFFF) >= 64){
+    // too late, we've sent too many packets for the next hop to correctly de-duplicate
+    DEBUGF(overlayframes, "Retransmition of frame %p mdp seq %d, is too late to be de-duplicated", 
+	   frame, frame->mdp_sequence);
+    overlay_queue_remove(queue, frame);
+    return;
+  }
+  
+  int destination_index=-1;
+  {
+    int i;
+    for (i=frame->destination_count -1;i>=0;i--){
+      struct network_destination *dest = frame->destinations[i].destination;
+      if (!dest)
+	FATALF("Destination %d is NULL", i);
+      if (!dest->interface)
+	FATALF("Destination interface %d is NULL", i);
+      if (dest->interface->state!=INTERFACE_STATE_UP){
+	// remove this destination
+	frame_remove_destination(frame, i);
+	continue;
+      }
+      if (frame->enqueued_at + dest->ifconfig.transmit_timeout_ms < now){
+	DEBUGF(ack,"Dropping %p, %s packet destination for %s sent w. seq %d, %dms ago", 
+	  frame, dest->unicast?"unicast":"broadcast",
+	  frame->whence.function, frame->destinations[i].sent_sequence,
+	  (int)(gettime_ms() - frame->destinations[i].transmit_time));
+	frame_remove_destination(frame, i);
+	continue;
+      }
+      if (ob_position(frame->payload) > (unsigned)dest->ifconfig.mtu){
+	WARNF("Skipping packet destination as size %zu > destination mtu %zd", 
+	ob_position(frame->payload), dest->ifconfig.mtu);
+	frame_remove_destination(frame, i);
+	continue;
+      }
+      // degrade packet version if required to reach the destination
+      if (frame->destinations[i].next_hop 
+	&& frame->packet_version > frame->destinations[i].next_hop->max_packet_version)
+	frame->packet_version = frame->destinations[i].next_hop->max_packet_version;
+      
+      if (frame->destinations[i].transmit_time && 
+	frame->destinations[i].transmit_time + frame->destinations[i].destination->resend_delay > now)
+	continue;
+      
+      if (packet->buffer){
+	if (frame->packet_version!=packet->packet_version)
 	  continue;
-	}
-	// degrade packet version if required to reach the destination
-	if (frame->destinations[i].next_hop 
-	  && frame->packet_version > frame->destinations[i].next_hop->max_packet_version)
-	  frame->packet_version = frame->destinations[i].next_hop->max_packet_version;
 	
-	if (frame->destinations[i].transmit_time && 
-	  frame->destinations[i].transmit_time + frame->destinations[i].destination->resend_delay > now)
+	// is this packet going our way?
+	if (dest==packet->destination){
+	  destination_index=i;
+	  break;
+	}
+      }else{
+	// skip this interface if the stream tx buffer has data
+	if (radio_link_is_busy(dest->interface))
 	  continue;
-	
-	if (packet->buffer){
-	  if (frame->packet_version!=packet->packet_version)
-	    continue;
 	  
-	  // is this packet going our way?
-	  if (dest==packet->destination){
-	    destination_index=i;
-	    break;
-	  }
-	}else{
-	  // skip this interface if the stream tx buffer has data
-	  if (radio_link_is_busy(dest->interface))
-	    continue;
-	    
-	  // can we send a packet to this destination now?
-	  if (limit_is_allowed(&dest->transfer_limit))
-	    continue;
-      
-	  // send a packet to this destination
-	  if (frame->source_full)
-	    get_my_subscriber(1)->send_full=1;
-	  if (overlay_init_packet(packet, frame->packet_version, dest) != -1) {
-	    if (debug){
-	      strbuf_sprintf(debug, "building packet %s %s %d [", 
-		packet->destination->interface->name, 
-		alloca_socket_address(&packet->destination->address),
-		packet->seq);
-	    }
-	    destination_index=i;
-	    frame->destinations[i].sent_sequence = dest->sequence_number;
-	    break;
+	// can we send a packet to this destination now?
+	if (limit_is_allowed(&dest->transfer_limit))
+	  continue;
+    
+	// send a packet to this destination
+	if (frame->source_full)
+	  get_my_subscriber(1)->send_full=1;
+	if (overlay_init_packet(packet, frame->packet_version, dest) != -1) {
+	  if (debug){
+	    strbuf_sprintf(debug, "building packet %s %s %d [", 
+	      packet->destination->interface->name, 
+	      alloca_socket_address(&packet->destination->address),
+	      packet->seq);
 	  }
+	  destination_index=i;
+	  frame->destinations[i].sent_sequence = dest->sequence_number;
+	  break;
 	}
       }
     }
-    
-    if (frame->destination_count==0){
-      frame = overlay_queue_remove(queue, frame);
-      continue;
-    }
-    
-    if (destination_index==-1)
-      goto skip;
-    
-    if (frame->send_hook){
-      // last minute check if we really want to send this frame, or track when we sent it
-      if (frame->send_hook(frame, packet->destination, packet->seq, frame->send_context)){
-        // drop packet
-        frame = overlay_queue_remove(queue, frame);
-        continue;
-      }
-    }
-    
-    if (frame->mdp_sequence == -1){
-      frame->mdp_sequence = mdp_sequence = (mdp_sequence+1)&0xFFFF;
+  }
+  
+  if (frame->destination_count==0){
+    overlay_queue_remove(queue, frame);
+    return;
+  }
+  
+  if (destination_index==-1)
+    goto skip;
+  
+  if (frame->send_hook){
+    // last minute check if we really want to send this frame, or track when we sent it
+    if (frame->send_hook(frame, packet->destination, packet->seq, frame->send_context)){
+      // drop packet
+      overlay_queue_remove(queue, frame);
+      return;
     }
-    
-    char will_retransmit=1;
-    if (frame->packet_version<1 || frame->resend<=0 || packet->seq==-1)
-      will_retransmit=0;
-    
-    if (overlay_frame_append_payload(&packet->context, packet->destination->ifconfig.encapsulation, frame, 
-	frame->destinations[destination_index].next_hop, packet->buffer, will_retransmit)){
-      // payload was not queued, delay the next attempt slightly
-      frame->delay_until = now + 5;
-      goto skip;
+  }
+  
+  if (frame->mdp_sequence == -1){
+    frame->mdp_sequence = mdp_sequence = (mdp_sequence+1)&0xFFFF;
+  }
+  
+  char will_retransmit=1;
+  if (frame->packet_version<1 || frame->resend<=0 || packet->seq==-1)
+    will_retransmit=0;
+  
+  if (overlay_frame_append_payload(&packet->context, packet->destination->ifconfig.encapsulation, frame, 
+      frame->destinations[destination_index].next_hop, packet->buffer, will_retransmit)){
+    // payload was not queued, delay the next attempt slightly
+    frame->delay_until = now + 5;
+    goto skip;
+  }
+  
+  frame->transmit_count++;
+  
+  {
+    struct packet_destination *dest = &frame->destinations[destination_index];
+    dest->sent_sequence = dest->destination->sequence_number;
+    // move to the back of the destination's sent list
+    destination_unlink(dest);
+    dest->transmit_time = now;
+    destination_link(frame, dest);
+    if (debug)
+      strbuf_sprintf(debug, "%d(%s), ", frame->mdp_sequence, frame->whence.function);
+    DEBUGF(overlayframes, "Appended payload %p, %d type %x len %zd for %s via %s", 
+	   frame, frame->mdp_sequence,
+	   frame->type, ob_position(frame->payload),
+	   frame->destination?alloca_tohex_sid_t(frame->destination->sid):"All",
+	   dest->next_hop?alloca_tohex_sid_t(dest->next_hop->sid):alloca_tohex(frame->broadcast_id.id, BROADCAST_LEN)
+	  );
+  }
+  
+  
+  // dont retransmit if we aren't sending sequence numbers, or we've been asked not to
+  if (!will_retransmit){
+    DEBUGF(overlayframes, "Not waiting for retransmission (%d, %d, %d)", frame->packet_version, frame->resend, packet->seq);
+    frame_remove_destination(frame, destination_index);
+    if (frame->destination_count==0){
+      overlay_queue_remove(queue, frame);
+      return;
     }
-    
-    frame->transmit_count++;
-    
-    {
-      struct packet_destination *dest = &frame->destinations[destination_index];
-      dest->sent_sequence = dest->destination->sequence_number;
-      dest->transmit_time = now;
-      if (debug)
-	strbuf_sprintf(debug, "%d(%s), ", frame->mdp_sequence, frame->whence.function);
-      DEBUGF(overlayframes, "Appended payload %p, %d type %x len %zd for %s via %s", 
-	     frame, frame->mdp_sequence,
-	     frame->type, ob_position(frame->payload),
-	     frame->destination?alloca_tohex_sid_t(frame->destination->sid):"All",
-	     dest->next_hop?alloca_tohex_sid_t(dest->next_hop->sid):alloca_tohex(frame->broadcast_id.id, BROADCAST_LEN)
-	    );
+  }
+  
+skip:
+  // if we can't send the payload now, check when we should try next
+  overlay_calc_queue_time(frame);
+}
+
+// look for the first frame that can start a new packet
+static void
+overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, time_ms_t now, strbuf debug){
+  struct overlay_frame *frame = queue->first;
+  while(frame && !packet->buffer){
+    struct overlay_frame *next = frame->next;
+    overlay_stuff_frame(packet, queue, frame, now, debug);
+    frame = next;
+  }
+}
+
+// fill the rest of the packet, only looking at frames that are going the same way
+static void
+overlay_stuff_destination(struct outgoing_packet *packet, time_ms_t now, strbuf debug){
+  // only one frame per packet
+  if (packet->destination->ifconfig.encapsulation==ENCAP_SINGLE)
+    return;
+  
+  int i;
+  for (i=0;i<OQ_MAX;i++){
+    // oldest retransmissions first, stopping at the first one that isn't due yet,
+    // or that has just been added to this packet
+    struct packet_destination *pd = packet->destination->sent[i].first;
+    while(pd && pd->transmit_time < now && pd->transmit_time + packet->destination->resend_delay <= now){
+      struct packet_destination *next = destination_next(pd);
+      overlay_stuff_frame(packet, &overlay_tx[i], pd->frame, now, debug);
+      pd = next;
     }
     
-    
-    // dont retransmit if we aren't sending sequence numbers, or we've been asked not to
-    if (!will_retransmit){
-      DEBUGF(overlayframes, "Not waiting for retransmission (%d, %d, %d)", frame->packet_version, frame->resend, packet->seq);
-      frame_remove_destination(frame, destination_index);
-      if (frame->destination_count==0){
-	frame = overlay_queue_remove(queue, frame);
-	continue;
-      }
+    // then frames that haven't been sent here yet, until we have skipped a few that are too big
+    // for the space left in the packet
+    unsigned too_big = 0;
+    pd = packet->destination->unsent[i].first;
+    while(pd && too_big < PACKET_FULL_MISSES){
+      struct packet_destination *next = destination_next(pd);
+      if (ob_position(pd->frame->payload) > ob_remaining(packet->buffer))
+	too_big++;
+      else
+	overlay_stuff_frame(packet, &overlay_tx[i], pd->frame, now, debug);
+      pd = next;
     }
-    
-  skip:
-    // if we can't send the payload now, check when we should try next
-    overlay_calc_queue_time(frame);
-    frame = frame->next;
   }
 }
 
@@ -551,13 +680,19 @@ overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now, strbuf d
   next_packet.alarm=0;
   next_packet.deadline=0;
   
-  for (i=0;i<OQ_MAX;i++){
+  for (i=0;i<OQ_MAX && !packet->buffer;i++){
     overlay_txqueue *queue=&overlay_tx[i];
     
     overlay_stuff_packet(packet, queue, now, debug);
   }
   
   if(packet->buffer){
+    overlay_stuff_destination(packet, now, debug);
+    
+    // we stopped looking at frames for other destinations once this packet was started,
+    // so look through the queues again as soon as it has been sent
+    overlay_queue_schedule_next(now);
+    
     if (debug){
       strbuf_sprintf(debug, "]");
       _DEBUGF("%s", strbuf_str(debug));
@@ -570,14 +705,33 @@ overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now, strbuf d
   OUT();
 }
 
-// when the queue timer elapses, send a packet
+// when the queue timer elapses, send every packet that is due, up to a limit so that
+// incoming packets are still read promptly. The packets are sent to each interface together.
+#define MAX_PACKETS_PER_WAKEUP 16
+
 static void overlay_send_packet(struct sched_ent *UNUSED(alarm))
 {
-  struct outgoing_packet packet;
-  bzero(&packet, sizeof(struct outgoing_packet));
-  packet.seq=-1;
-  strbuf debug = IF_DEBUG(packets_sent) ? strbuf_alloca(256) : NULL;
-  overlay_fill_send_packet(&packet, gettime_ms(), debug);
+  time_ms_t now = gettime_ms();
+  unsigned count = 0;
+  overlay_tx_batch_begin();
+  do{
+    struct outgoing_packet packet;
+    bzero(&packet, sizeof(struct outgoing_packet));
+    packet.seq=-1;
+    strbuf debug = IF_DEBUG(packets_sent) ? strbuf_alloca(256) : NULL;
+    overlay_fill_send_packet(&packet, now, debug);
+    if (!packet.buffer)
+      break;
+  }while(++count < MAX_PACKETS_PER_WAKEUP);
+  overlay_tx_batch_flush();
+}
+
+// send every packet that is due now, as if the alarm had gone off, and return when the next one
+// will be due
+time_ms_t overlay_queue_send_now()
+{
+  overlay_send_packet(&next_packet);
+  return is_scheduled(&next_packet) ? next_packet.alarm : TIME_MS_NEVER_WILL;
 }
 
 int overlay_send_tick_packet(struct network_destination *destination)
@@ -606,53 +760,49 @@ int overlay_send_tick_packet(struct network_destination *destination)
 // de-queue all packets that have been sent to this subscriber & have arrived.
 int overlay_queue_ack(struct subscriber *neighbour, struct network_destination *destination, uint32_t ack_mask, int ack_seq)
 {
-  int i, j;
+  int i;
   time_ms_t now = gettime_ms();
   int rtt=0;
   
+  // only frames that were sent to this destination can be acked by it
   for (i=0;i<OQ_MAX;i++){
-    struct overlay_frame *frame = overlay_tx[i].first;
+    struct packet_destination *pd = destination->sent[i].first;
 
-    while(frame){
+    while(pd){
+      struct overlay_frame *frame = pd->frame;
+      struct packet_destination *next = destination_next(pd);
+      int frame_seq = pd->sent_sequence;
       
-      for (j=frame->destination_count -1;j>=0;j--)
-	if (frame->destinations[j].destination==destination)
-	  break;
+      if (frame_seq >=0 && (pd->next_hop == neighbour || !frame->destination)){
+	int seq_delta = (ack_seq - frame_seq)&0xFF;
+	char acked = (seq_delta==0 || (seq_delta <= 32 && ack_mask&((uint32_t)1<<(seq_delta-1))))?1:0;
+
+	if (acked){
+	  int this_rtt = now - pd->transmit_time;
+	  // if we're on a fake network, the actual rtt can be unrealistic
+	  if (this_rtt < 10)
+	    this_rtt = 10;
+	  if (!rtt || this_rtt < rtt)
+	    rtt = this_rtt;
 	  
-      if (j>=0){
-	int frame_seq = frame->destinations[j].sent_sequence;
-	if (frame_seq >=0 && (frame->destinations[j].next_hop == neighbour || !frame->destination)){
-	  int seq_delta = (ack_seq - frame_seq)&0xFF;
-	  char acked = (seq_delta==0 || (seq_delta <= 32 && ack_mask&((uint32_t)1<<(seq_delta-1))))?1:0;
-
-	  if (acked){
-	    int this_rtt = now - frame->destinations[j].transmit_time;
-	    // if we're on a fake network, the actual rtt can be unrealistic
-	    if (this_rtt < 10)
-	      this_rtt = 10;
-	    if (!rtt || this_rtt < rtt)
-	      rtt = this_rtt;
-	    
-	    DEBUGF(ack, "DROPPED DUE TO ACK: Packet %p to %s sent by seq %d, acked with seq %d", 
-		   frame, alloca_tohex_sid_t(neighbour->sid), frame_seq, ack_seq);
-		
-	    // drop packets that don't need to be retransmitted
-	    if (frame->destination || frame->destination_count<=1){
-	      frame = overlay_queue_remove(&overlay_tx[i], frame);
-	      continue;
-	    }
-	    frame_remove_destination(frame, j);
-	    
-	  }else if (seq_delta < 128 && frame->destination && frame->delay_until>now){
-	    // retransmit asap
-	    DEBUGF(ack, "RE-TX DUE TO NACK: Requeue packet %p to %s sent by seq %d due to ack of seq %d", frame, alloca_tohex_sid_t(neighbour->sid), frame_seq, ack_seq);
-	    frame->delay_until = now;
-	    overlay_calc_queue_time(frame);
-	  }
+	  DEBUGF(ack, "DROPPED DUE TO ACK: Packet %p to %s sent by seq %d, acked with seq %d", 
+		 frame, alloca_tohex_sid_t(neighbour->sid), frame_seq, ack_seq);
+	      
+	  // drop packets that don't need to be retransmitted
+	  if (frame->destination || frame->destination_count<=1)
+	    overlay_queue_remove(&overlay_tx[i], frame);
+	  else
+	    frame_remove_destination(frame, pd - frame->destinations);
+	  
+	}else if (seq_delta < 128 && frame->destination && frame->delay_until>now){
+	  // retransmit asap
+	  DEBUGF(ack, "RE-TX DUE TO NACK: Requeue packet %p to %s sent by seq %d due to ack of seq %d", frame, alloca_tohex_sid_t(neighbour->sid), frame_seq, ack_seq);
+	  frame->delay_until = now;
+	  overlay_calc_queue_time(frame);
 	}
       }
       
-      frame = frame->next;
+      pd = next;
     }
   }
   
@@ -49,10 +49,96 @@
 #include <inttypes.h> // for PRIu64 on Android
 #include "fdqueue.h"
 #include "conf.h"
+#include "mem.h"
 #include "debug.h"
 
 __thread struct profile_total *stats_head=NULL;
 __thread struct call_stats *current_call=NULL;
+// alarms whose latency has been recorded, in the order they were first called
+__thread struct alarm_latency *latency_head=NULL;
+__thread struct alarm_latency *latency_tail=NULL;
+
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_EXACT (LATENCY_SUB_BUCKETS * 2)
+#define LATENCY_MAX_VALUE ((time_ms_t)INT32_MAX)
+
+static unsigned latency_bucket(time_ms_t value)
+{
+  if (value < 0)
+    value = 0;
+  if (value > LATENCY_MAX_VALUE)
+    value = LATENCY_MAX_VALUE;
+  if (value < LATENCY_EXACT)
+    return value;
+  unsigned exponent = 0;
+  while ((value >> exponent) >= LATENCY_EXACT)
+    ++exponent;
+  // value >> exponent is in [LATENCY_SUB_BUCKETS, LATENCY_EXACT)
+  return LATENCY_EXACT + (exponent - 1) * LATENCY_SUB_BUCKETS + (value >> exponent) - LATENCY_SUB_BUCKETS;
+}
+
+// the highest value that is counted in the given bucket
+static time_ms_t latency_bucket_limit(unsigned bucket)
+{
+  if (bucket < LATENCY_EXACT)
+    return bucket;
+  unsigned exponent = (bucket - LATENCY_EXACT) / LATENCY_SUB_BUCKETS + 1;
+  time_ms_t sub = (bucket - LATENCY_EXACT) % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS;
+  return ((sub + 1) << exponent) - 1;
+}
+
+void latency_histogram_record(struct latency_histogram *h, time_ms_t value)
+{
+  unsigned bucket = latency_bucket(value);
+  assert(bucket < LATENCY_BUCKETS);
+  h->counts[bucket]++;
+  h->count++;
+  if (value > h->max)
+    h->max = value;
+}
+
+time_ms_t latency_histogram_percentile(const struct latency_histogram *h, unsigned percent)
+{
+  if (h->count == 0)
+    return 0;
+  uint64_t rank = (h->count * percent + 99) / 100;
+  if (rank == 0)
+    rank = 1;
+  uint64_t seen = 0;
+  unsigned bucket;
+  for (bucket = 0; bucket < LATENCY_BUCKETS; ++bucket){
+    seen += h->counts[bucket];
+    if (seen >= rank){
+      time_ms_t limit = latency_bucket_limit(bucket);
+      return limit < h->max ? limit : h->max;
+    }
+  }
+  return h->max;
+}
+
+// Record the duration of an alarm call, and its lateness if it was scheduled, ie, not called
+// for IO (lateness < 0).  Unlike the profile totals, these are never cleared.
+void fd_record_latency(struct profile_total *stats, time_ms_t duration, time_ms_t lateness)
+{
+  if (!stats->latency){
+    if ((stats->latency = emalloc_zero(sizeof(struct alarm_latency))) == NULL)
+      return;
+    stats->latency->stats = stats;
+    if (latency_tail)
+      latency_tail->_next = stats->latency;
+    else
+      latency_head = stats->latency;
+    latency_tail = stats->latency;
+  }
+  latency_histogram_record(&stats->latency->duration, duration);
+  if (lateness >= 0)
+    latency_histogram_record(&stats->latency->lateness, lateness);
+}
+
+struct alarm_latency *fd_latency_first()
+{
+  return latency_head;
+}
 
 void fd_clearstat(struct profile_total *s){
   s->max_time = 0;
@@ -172,7 +258,7 @@ int fd_clearstats()
 
 int fd_showstats()
 {
-  struct profile_total total={NULL, 0, "Total", 0,0,0,0};
+  struct profile_total total={NULL, 0, "Total", 0,0,0,0,NULL};
   
   stats_head = sort(stats_head);
   
@@ -206,6 +292,7 @@ int fd_showstats()
       stats = stats->_next;
     }    
     fd_showstat(&total,&total);
+    mpool_showstats();
   }
   
   return 0;
@@ -461,7 +461,10 @@ enum rhizome_bundle_status rhizome_bundle_import_files(rhizome_manifest *m, rhiz
     ret = RHIZOME_BUNDLE_STATUS_INVALID;
     goto end;
   }
-  bcopy(manifest_ptr, m->manifestdata, m->manifest_all_bytes);
+  if (rhizome_manifest_copy_data(m, manifest_ptr, m->manifest_all_bytes) == -1){
+    ret = RHIZOME_BUNDLE_STATUS_ERROR;
+    goto end;
+  }
 
   if (   rhizome_manifest_parse(m) == -1
       || !rhizome_manifest_validate(m)
@@ -52,6 +52,7 @@ extern time_ms_t rhizome_voice_timeout;
 
 #define MAX_MANIFEST_VARS 256
 #define MAX_MANIFEST_BYTES 8192
+#define RHIZOME_MANIFEST_DATA_ROUND 128
 #define MAX_MANIFEST_FIELD_LABEL_LEN 80
 
 typedef struct rhizome_manifest
@@ -83,23 +84,35 @@ typedef struct rhizome_manifest
    * hash which was used to sign the manifest, so the signature can only be
    * checked if order is preserved).
    *
-   * TODO: reduce to only unknown fields.
-   *
-   * TODO: store all vars and values as NUL terminated strings within
-   * manifestdata[], not malloc()/free() heap, to reduce memory fragmentation
-   * and allow manifest struct copying without string lifetime issues.
+   * A known field (one that has a member in this struct) only records its
+   * label in 'known', and its value is formatted from the struct member when
+   * the manifest is packed.  An unknown field is a pair of offsets into
+   * field_text[], a single heap block that holds the unknown labels and
+   * values as NUL terminated strings, along with the service and name
+   * strings, so a manifest costs two heap blocks for its fields however many
+   * it has.  Replaced and deleted fields leave garbage in field_text[] that
+   * is reclaimed whenever the block next has to grow.
    */
   unsigned short var_count;
-  const char *vars[MAX_MANIFEST_VARS];
-  const char *values[MAX_MANIFEST_VARS];
-
-  /* Parties who have signed this manifest (binary format, malloc(3)).
-   * Recognised signature types:
+  unsigned short var_alloc;
+  struct rhizome_manifest_field {
+    const char *known; // static label string, or NULL for an unknown field
+    unsigned label;
+    unsigned value;
+  } *fields;
+  char *field_text;
+  size_t field_text_used;
+  size_t field_text_alloc;
+  size_t field_text_garbage;
+
+  /* Public keys of the parties who have signed this manifest, in the order of
+   * their signature blocks (heap block of sig_alloc elements).  Recognised
+   * signature types:
    *    0x17 = crypto_sign_edwards25519sha512batch()
    */
   unsigned short sig_count;
-  unsigned char *signatories[MAX_MANIFEST_VARS];
-  uint8_t signatureTypes[MAX_MANIFEST_VARS];
+  unsigned short sig_alloc;
+  sign_public_t *signatories;
 
   /* Set to non-NULL if a manifest has been parsed that cannot be fully
    * understood by this version of Rhizome (probably from a future or a very
@@ -215,15 +228,22 @@ typedef struct rhizome_manifest
   sid_t author;
   const struct keyring_identity *author_identity;
 
+  /* The manifest text and signature blocks, manifest_all_bytes long, in a heap
+   * block of manifestdata_alloc bytes that is only as big as the manifest
+   * (rounded up to a multiple of RHIZOME_MANIFEST_DATA_ROUND) and never more
+   * than MAX_MANIFEST_BYTES.  Copy received manifests in with
+   * rhizome_manifest_copy_data().
+   */
   size_t manifest_body_bytes;
   size_t manifest_all_bytes;
-  unsigned char manifestdata[MAX_MANIFEST_BYTES];
+  size_t manifestdata_alloc;
+  unsigned char *manifestdata;
   rhizome_filehash_t manifesthash;
 
 } rhizome_manifest;
 
 /* These setter functions (methods) are needed because the relevant attributes
- * are stored in two places: in the vars[] array and in a dedicated struct
+ * are stored in two places: in the fields[] array and in a dedicated struct
  * element.
  *
  * TODO: refactor to remove the redundancy, possibly removing these setter
@@ -346,6 +366,12 @@ struct rhizome_database {
   char dir_path[1024];
   sqlite3 *db;
   serval_uuid_t uuid;
+  // set while a bulk import holds one transaction open around a batch of bundles
+  bool_t bulk;
+  // set if room was made for all of the batch's payloads when it began
+  bool_t bulk_space_reserved;
+  // the highest manifest rowid before the batch began
+  uint64_t bulk_rowid;
 };
 
 extern __thread struct rhizome_database rhizome_database;
@@ -367,6 +393,17 @@ sqlite_retry_state sqlite_retry_state_init(int serverLimit, int serverSleep, int
 
 #define SQLITE_RETRY_STATE_DEFAULT sqlite_retry_state_init(-1,-1,-1,-1)
 
+/* Every change to the store is made inside one of these transactions.  Normally they are plain
+ * BEGIN/COMMIT/ROLLBACK, but between rhizome_bulk_begin() and rhizome_bulk_commit() they become
+ * savepoints nested within the bulk transaction, so that a whole batch of bundles is written to
+ * disk by a single COMMIT.
+ */
+int rhizome_transaction_begin(sqlite_retry_state *retry);
+int rhizome_transaction_commit(sqlite_retry_state *retry);
+void rhizome_transaction_rollback(sqlite_retry_state *retry);
+int rhizome_bulk_begin(uint64_t payload_bytes);
+int rhizome_bulk_commit();
+
 struct rhizome_cleanup_report {
     unsigned deleted_stale_incoming_files;
     unsigned deleted_expired_files;
@@ -377,6 +414,7 @@ struct rhizome_cleanup_report {
 
 int rhizome_cleanup(struct rhizome_cleanup_report *report);
 int rhizome_store_cleanup(struct rhizome_cleanup_report *report);
+enum rhizome_payload_status rhizome_store_make_space(uint64_t bytes);
 void rhizome_vacuum_db(sqlite_retry_state *retry);
 int rhizome_manifest_createid(rhizome_manifest *m);
 struct rhizome_bundle_result rhizome_private_bundle(rhizome_manifest *m, const sign_keypair_t *keypair);
@@ -468,6 +506,8 @@ const char *rhizome_payload_status_message_nonnull(enum rhizome_payload_status);
 
 int rhizome_write_manifest_file(rhizome_manifest *m, const char *filename, char append);
 int rhizome_read_manifest_from_file(rhizome_manifest *m, const char *filename);
+int rhizome_manifest_reserve_data(rhizome_manifest *m, size_t bytes);
+int rhizome_manifest_copy_data(rhizome_manifest *m, const void *data, size_t len);
 int rhizome_manifest_validate(rhizome_manifest *m);
 const char *rhizome_manifest_validate_reason(rhizome_manifest *m);
 int rhizome_manifest_parse(rhizome_manifest *m);
@@ -505,6 +545,7 @@ int rhizome_manifest_add_bundle_key(rhizome_manifest *);
 int rhizome_lookup_author(rhizome_manifest *m);
 void rhizome_authenticate_author(rhizome_manifest *m);
 
+struct rhizome_bundle_result rhizome_manifest_sign(rhizome_manifest *m);
 struct rhizome_bundle_result rhizome_manifest_finalise(rhizome_manifest *m, rhizome_manifest **m_out, int deduplicate);
 enum rhizome_bundle_status rhizome_manifest_check_stored(rhizome_manifest *m, rhizome_manifest **m_out);
 enum rhizome_bundle_status rhizome_add_manifest_to_store(rhizome_manifest *m_in, rhizome_manifest **m_out);
@@ -557,6 +598,7 @@ sqlite3_stmt *_sqlite_prepare(struct __sourceloc, int log_level, sqlite_retry_st
 int _sqlite_bind(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement, ...);
 int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement, va_list ap);
 sqlite3_stmt *_sqlite_prepare_bind(struct __sourceloc, int log_level, sqlite_retry_state *retry, const char *sqltext, ...);
+void sqlite_finalize(sqlite3_stmt *statement);
 int _sqlite_retry(struct __sourceloc, sqlite_retry_state *retry, const char *action);
 void _sqlite_retry_done(struct __sourceloc, sqlite_retry_state *retry, const char *action);
 int _sqlite_step(struct __sourceloc, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement);
@@ -626,6 +668,55 @@ int _sqlite_blob_close(struct __sourceloc, int log_level, sqlite3_blob *blob);
 
 double rhizome_manifest_get_double(rhizome_manifest *m,char *var,double default_value);
 int rhizome_manifest_extract_signature(rhizome_manifest *m, unsigned *ofs);
+
+/* The expensive part of verifying a manifest's self-signature, separated so it can be run in
+ * parallel by a bulk import.
+ */
+struct rhizome_signature_check {
+  unsigned char hash[crypto_hash_sha512_BYTES];
+  const unsigned char *sig; // NULL if the manifest has no usable signature block
+  int valid; // 0 if valid, -1 if not, like crypto_sign_verify_detached()
+};
+void rhizome_manifest_check_signature(const rhizome_manifest *m, struct rhizome_signature_check *check);
+void rhizome_manifest_prime_signature_cache(const struct rhizome_signature_check *check);
+
+/* Import many bundles at once; see rhizome_bulk.c.  Each added manifest must already be parsed,
+ * and its payload is either a file path, or a buffer, or neither if the payload is empty or already
+ * in the store.  The bulk import takes ownership of the manifest and the (malloc(3)ed) path and
+ * buffer.  Bundles are stored in batches: the caller must flush the batch whenever it is full, and
+ * flush the final batch before reading the totals.
+ */
+#define RHIZOME_BULK_BATCH_SIZE 100
+#define RHIZOME_BULK_BATCH_BUFFERED (8 * 1024 * 1024) // payload bytes held in memory
+#define RHIZOME_BULK_STEP_SIZE 10
+#define RHIZOME_BULK_STEP_BUFFERED (1024 * 1024)
+
+struct rhizome_bulk_bundle {
+  rhizome_manifest *m;
+  char *payload_path;
+  uint8_t *payload;
+  size_t payload_len;
+  struct rhizome_signature_check check;
+};
+
+struct rhizome_bulk_import {
+  unsigned count;
+  unsigned flushed; // bundles of the batch already stored by rhizome_bulk_import_flush_step()
+  struct rhizome_bulk_bundle bundles[RHIZOME_BULK_BATCH_SIZE];
+  size_t buffered;
+  // totals so far
+  unsigned added;
+  unsigned stored; // same, duplicate or older than the one already in the store
+  unsigned rejected;
+  unsigned failed;
+};
+
+void rhizome_bulk_import_add(struct rhizome_bulk_import *bulk, rhizome_manifest *m, char *payload_path, uint8_t *payload, size_t payload_len);
+int rhizome_bulk_import_full(const struct rhizome_bulk_import *bulk);
+int rhizome_bulk_import_flush(struct rhizome_bulk_import *bulk);
+int rhizome_bulk_import_flush_step(struct rhizome_bulk_import *bulk);
+void rhizome_bulk_import_release(struct rhizome_bulk_import *bulk);
+
 enum rhizome_bundle_status rhizome_find_duplicate(const rhizome_manifest *m, rhizome_manifest **found);
 int rhizome_manifest_to_bar(rhizome_manifest *m, rhizome_bar_t *bar);
 enum rhizome_bundle_status rhizome_is_bar_interesting(const rhizome_bar_t *bar);
@@ -665,6 +756,12 @@ struct rhizome_list_cursor {
   // moves in descending (reverse chronological) order starting from the most
   // recent bundle.
   uint64_t rowid_since;
+  // If set, then next() fills in only the manifest fields that the MANIFESTS
+  // table keeps in columns of their own (id, version, service, name, sender,
+  // recipient, date, filesize, filehash), without reading and parsing the
+  // manifest blob.  The resulting manifest has no signatures and must not be
+  // stored, exported or verified.
+  bool_t columns_only;
   // Set by calling the next() function.
   rhizome_manifest *manifest;
   // Private state - implementation that could change.
@@ -685,7 +782,14 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
 rhizome_manifest * rhizome_fetch_search(const unsigned char *id, int prefix_length);
 int rhizome_fetch_bar_queued(const rhizome_bar_t *bar);
 
+// Most concurrent fetches allowed for each payload size (rhizome.fetch_slots)
+#define RHIZOME_FETCH_MAX_SLOTS 4
+
 /* Rhizome file storage api */
+
+// rhizome_random_write() holds at most this many bytes that it cannot write yet, and drops the rest
+#define RHIZOME_BUFFER_MAXIMUM_SIZE (1024*1024)
+
 struct rhizome_write_buffer
 {
   struct rhizome_write_buffer *_next;
@@ -872,6 +976,17 @@ int rhizome_any_fetch_queued();
 int rhizome_fetch_status_html(struct strbuf *b);
 int rhizome_fetch_has_queue_space(unsigned char log2_size);
 
+/* Snapshot of one payload size class of the fetch queue, for status reports.
+ */
+struct rhizome_fetch_queue_status {
+  uint64_t max_size; // only payloads smaller than this are queued, zero for no limit
+  unsigned slots; // configured number of concurrent fetches
+  unsigned active; // fetches in progress
+  unsigned candidates; // bundles waiting to be fetched
+  uint64_t candidate_bytes;
+};
+int rhizome_fetch_queue_status(unsigned i, struct rhizome_fetch_queue_status *status);
+
 /* Rhizome storage methods */
 
 enum rhizome_payload_status rhizome_exists(const rhizome_filehash_t *hashp);
@@ -899,6 +1014,7 @@ int rhizome_crypt_xor_block(unsigned char *buffer, size_t buffer_size, uint64_t
 			    const unsigned char *key, const unsigned char *nonce);
 enum rhizome_payload_status rhizome_open_read(struct rhizome_read *read, const rhizome_filehash_t *hashp);
 ssize_t rhizome_read(struct rhizome_read *read, unsigned char *buffer, size_t buffer_length);
+ssize_t rhizome_read_direct(struct rhizome_read *read_state, size_t length, int *fdp, uint64_t *offsetp);
 ssize_t rhizome_read_buffered(struct rhizome_read *read, struct rhizome_read_buffer *buffer, unsigned char *data, size_t len);
 void rhizome_read_close(struct rhizome_read *read);
 enum rhizome_payload_status rhizome_open_decrypt_read(rhizome_manifest *m, struct rhizome_read *read_state);
@@ -0,0 +1,280 @@
+/*
+Serval DNA Rhizome bulk import
+Copyright (C) 2018 Flinders University
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* Seeding a store from an archive of thousands of bundles one "rhizome import bundle" at a time
+ * costs several fsync(2)s per bundle, and the Ed25519 signature check of every manifest on one
+ * core.  A bulk import collects bundles into batches, checks the signatures of a batch on worker
+ * threads, then stores the whole batch inside one transaction (see rhizome_bulk_begin()).
+ *
+ * The signature checks are the only work done off the calling thread; the database, the signature
+ * cache and logging all stay on the calling thread.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include "rhizome.h"
+#include "conf.h"
+#include "log.h"
+#include "debug.h"
+#include "mem.h"
+
+#define RHIZOME_BULK_MAX_THREADS 8
+
+void rhizome_bulk_import_add(struct rhizome_bulk_import *bulk, rhizome_manifest *m, char *payload_path, uint8_t *payload, size_t payload_len)
+{
+  if (!m->finalised && !rhizome_manifest_validate(m)) {
+    WARNF("Bulk import: invalid manifest%s%s",
+	  m->has_id ? " bid=" : "",
+	  m->has_id ? alloca_tohex_rhizome_bid_t(m->keypair.public_key) : "");
+    bulk->rejected++;
+    rhizome_manifest_free(m);
+    free(payload_path);
+    free(payload);
+    return;
+  }
+  assert(!rhizome_bulk_import_full(bulk));
+  assert(bulk->flushed == 0);
+  struct rhizome_bulk_bundle *b = &bulk->bundles[bulk->count++];
+  b->m = m;
+  b->payload_path = payload_path;
+  b->payload = payload;
+  b->payload_len = payload_len;
+  if (payload)
+    bulk->buffered += payload_len;
+}
+
+// The current batch must be flushed before any more bundles are added.
+int rhizome_bulk_import_full(const struct rhizome_bulk_import *bulk)
+{
+  return bulk->count == NELS(bulk->bundles) || bulk->buffered >= RHIZOME_BULK_BATCH_BUFFERED;
+}
+
+struct signature_checks {
+  struct rhizome_bulk_import *bulk;
+  unsigned next;
+  unsigned end;
+};
+
+static void *check_signatures_worker(void *arg)
+{
+  struct signature_checks *checks = arg;
+  unsigned i;
+  while ((i = __sync_fetch_and_add(&checks->next, 1)) < checks->end) {
+    struct rhizome_bulk_bundle *b = &checks->bulk->bundles[i];
+    rhizome_manifest_check_signature(b->m, &b->check);
+  }
+  return NULL;
+}
+
+static void check_signatures(struct rhizome_bulk_import *bulk, unsigned first, unsigned end)
+{
+  struct signature_checks checks = { .bulk = bulk, .next = first, .end = end };
+#ifdef HAVE_PTHREAD
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned nthreads = ncpus > 1 ? (unsigned) ncpus : 1;
+  if (nthreads > RHIZOME_BULK_MAX_THREADS)
+    nthreads = RHIZOME_BULK_MAX_THREADS;
+  if (nthreads > end - first)
+    nthreads = end - first;
+  // The calling thread is one of the workers.
+  pthread_t threads[RHIZOME_BULK_MAX_THREADS - 1];
+  unsigned started = 0;
+  for (; started + 1 < nthreads; ++started) {
+    int err = pthread_create(&threads[started], NULL, check_signatures_worker, &checks);
+    if (err) {
+      // not fatal, the threads that did start will share the work
+      WARNF("pthread_create: %s [errno=%d]", strerror(err), err);
+      break;
+    }
+  }
+  check_signatures_worker(&checks);
+  unsigned i;
+  for (i = 0; i < started; ++i)
+    pthread_join(threads[i], NULL);
+  DEBUGF(rhizome, "Checked %u manifest signatures using %u threads", end - first, started + 1);
+#else
+  check_signatures_worker(&checks);
+#endif
+}
+
+static enum rhizome_bundle_status import_bundle(struct rhizome_bulk_bundle *b)
+{
+  rhizome_manifest *m = b->m;
+  rhizome_manifest_prime_signature_cache(&b->check);
+  if (!rhizome_manifest_verify(m))
+    return RHIZOME_BUNDLE_STATUS_FAKE;
+  enum rhizome_bundle_status status = rhizome_manifest_check_stored(m, NULL);
+  if (status != RHIZOME_BUNDLE_STATUS_NEW)
+    return status;
+
+  enum rhizome_payload_status pstatus;
+  if (m->filesize == 0)
+    pstatus = RHIZOME_PAYLOAD_STATUS_EMPTY;
+  else if (b->payload_path)
+    pstatus = rhizome_import_payload_from_file(m, b->payload_path);
+  else if (b->payload)
+    pstatus = rhizome_import_buffer(m, b->payload, b->payload_len);
+  else if ((pstatus = rhizome_exists(&m->filehash)) == RHIZOME_PAYLOAD_STATUS_NEW) {
+    WARNF("Bulk import: missing payload for bid=%s", alloca_tohex_rhizome_bid_t(m->keypair.public_key));
+    return RHIZOME_BUNDLE_STATUS_INCONSISTENT;
+  }
+
+  switch (pstatus) {
+    case RHIZOME_PAYLOAD_STATUS_EMPTY:
+    case RHIZOME_PAYLOAD_STATUS_STORED:
+    case RHIZOME_PAYLOAD_STATUS_NEW:
+      return rhizome_add_manifest_to_store(m, NULL);
+    case RHIZOME_PAYLOAD_STATUS_TOO_BIG:
+    case RHIZOME_PAYLOAD_STATUS_EVICTED:
+      return RHIZOME_BUNDLE_STATUS_NO_ROOM;
+    case RHIZOME_PAYLOAD_STATUS_BUSY:
+      return RHIZOME_BUNDLE_STATUS_BUSY;
+    case RHIZOME_PAYLOAD_STATUS_ERROR:
+    case RHIZOME_PAYLOAD_STATUS_CRYPTO_FAIL:
+      return RHIZOME_BUNDLE_STATUS_ERROR;
+    case RHIZOME_PAYLOAD_STATUS_WRONG_SIZE:
+    case RHIZOME_PAYLOAD_STATUS_WRONG_HASH:
+      return RHIZOME_BUNDLE_STATUS_INCONSISTENT;
+  }
+  FATALF("pstatus = %d", pstatus);
+}
+
+static void release_batch(struct rhizome_bulk_import *bulk)
+{
+  unsigned i;
+  for (i = 0; i < bulk->count; ++i) {
+    struct rhizome_bulk_bundle *b = &bulk->bundles[i];
+    rhizome_manifest_free(b->m);
+    free(b->payload_path);
+    free(b->payload);
+  }
+  bulk->count = 0;
+  bulk->flushed = 0;
+  bulk->buffered = 0;
+}
+
+/* Store the next n bundles of the current batch in one transaction, and release the batch once it
+ * has all been stored.  Returns -1 if the transaction could not be committed, in which case the
+ * bundles it would have added are counted as failed.
+ */
+static int flush_bundles(struct rhizome_bulk_import *bulk, unsigned n)
+{
+  unsigned first = bulk->flushed;
+  unsigned end = first + n;
+  assert(end <= bulk->count);
+  bulk->flushed = end;
+  check_signatures(bulk, first, end);
+  uint64_t payload_bytes = 0;
+  unsigned i;
+  for (i = first; i < end; ++i)
+    if (bulk->bundles[i].payload_path || bulk->bundles[i].payload)
+      payload_bytes += bulk->bundles[i].m->filesize;
+  if (rhizome_bulk_begin(payload_bytes) == -1) {
+    bulk->failed += n;
+    if (end == bulk->count)
+      release_batch(bulk);
+    return -1;
+  }
+  unsigned added = 0;
+  for (i = first; i < end; ++i) {
+    rhizome_manifest *m = bulk->bundles[i].m;
+    enum rhizome_bundle_status status = import_bundle(&bulk->bundles[i]);
+    switch (status) {
+      case RHIZOME_BUNDLE_STATUS_NEW:
+	++added;
+	continue;
+      case RHIZOME_BUNDLE_STATUS_SAME:
+      case RHIZOME_BUNDLE_STATUS_DUPLICATE:
+      case RHIZOME_BUNDLE_STATUS_OLD:
+	bulk->stored++;
+	continue;
+      case RHIZOME_BUNDLE_STATUS_INVALID:
+      case RHIZOME_BUNDLE_STATUS_FAKE:
+      case RHIZOME_BUNDLE_STATUS_INCONSISTENT:
+      case RHIZOME_BUNDLE_STATUS_READONLY:
+      case RHIZOME_BUNDLE_STATUS_MANIFEST_TOO_BIG:
+	bulk->rejected++;
+	break;
+      case RHIZOME_BUNDLE_STATUS_ERROR:
+      case RHIZOME_BUNDLE_STATUS_BUSY:
+      case RHIZOME_BUNDLE_STATUS_NO_ROOM:
+	bulk->failed++;
+	break;
+    }
+    WARNF("Bulk import: bid=%s version=%"PRIu64" %s",
+	  alloca_tohex_rhizome_bid_t(m->keypair.public_key), m->version,
+	  rhizome_bundle_status_message(status));
+  }
+  int ret = 0;
+  if (rhizome_bulk_commit() == -1) {
+    bulk->failed += added;
+    ret = -1;
+  } else
+    bulk->added += added;
+  DEBUGF(rhizome, "Bulk import batch of %u: %u added, totals added=%u stored=%u rejected=%u failed=%u",
+	 n, added, bulk->added, bulk->stored, bulk->rejected, bulk->failed);
+  if (end == bulk->count)
+    release_batch(bulk);
+  return ret;
+}
+
+/* Store every bundle in the current batch that is not yet stored, in one transaction.  Returns -1
+ * if the batch could not be committed, in which case the bundles it would have added are counted as
+ * failed.
+ */
+int rhizome_bulk_import_flush(struct rhizome_bulk_import *bulk)
+{
+  if (bulk->count == 0)
+    return 0;
+  return flush_bundles(bulk, bulk->count - bulk->flushed);
+}
+
+/* Store the next few bundles of the current batch, up to RHIZOME_BULK_STEP_SIZE of them or about
+ * RHIZOME_BULK_STEP_BUFFERED payload bytes, in one transaction, so that the daemon can store a
+ * batch in steps from an alarm without holding up everything else for the whole batch.  Returns 1
+ * if the batch has more bundles to store, or 0 once they have all been stored or counted as
+ * failed.
+ */
+int rhizome_bulk_import_flush_step(struct rhizome_bulk_import *bulk)
+{
+  if (bulk->count == 0)
+    return 0;
+  unsigned n = 0;
+  size_t bytes = 0;
+  while (bulk->flushed + n < bulk->count && n < RHIZOME_BULK_STEP_SIZE && bytes < RHIZOME_BULK_STEP_BUFFERED) {
+    const struct rhizome_bulk_bundle *b = &bulk->bundles[bulk->flushed + n++];
+    if (b->payload)
+      bytes += b->payload_len;
+  }
+  flush_bundles(bulk, n);
+  return bulk->count ? 1 : 0;
+}
+
+void rhizome_bulk_import_release(struct rhizome_bulk_import *bulk)
+{
+  release_batch(bulk);
+}
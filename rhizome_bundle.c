@@ -33,13 +33,114 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "dataformats.h"
 #include "debug.h"
 
-static const char *rhizome_manifest_get(const rhizome_manifest *m, const char *var)
+#define FIELD_LABEL(m,i) (&(m)->field_text[(m)->fields[i].label])
+#define FIELD_VALUE(m,i) (&(m)->field_text[(m)->fields[i].value])
+#define FIELD_NAME(m,i) ((m)->fields[i].known ? (m)->fields[i].known : FIELD_LABEL(m,i))
+
+/* Return the index in m->fields[] of the field with the given label, or -1 if there is none.
+ */
+static int rhizome_manifest_find(const rhizome_manifest *m, const char *var)
 {
   unsigned i;
   for (i = 0; i < m->var_count; ++i)
-    if (strcmp(m->vars[i], var) == 0)
-      return m->values[i];
-  return NULL;
+    if (strcmp(FIELD_NAME(m, i), var) == 0)
+      return i;
+  return -1;
+}
+
+/* Return the value of the unknown field with the given label, or NULL if there is none.
+ */
+static const char *rhizome_manifest_get(const rhizome_manifest *m, const char *var)
+{
+  int i = rhizome_manifest_find(m, var);
+  return i == -1 || m->fields[i].known ? NULL : FIELD_VALUE(m, i);
+}
+
+// Whether the field's value (and, if it is an unknown field, its label) is kept in m->field_text[]
+#define FIELD_HAS_TEXT(m,i) (!(m)->fields[i].known || (m)->fields[i].value != NO_TEXT)
+#define NO_TEXT (~0u)
+
+/* Ensure there is room for 'need' more bytes at the end of m->field_text[], by
+ * copying the live strings into a new block, which discards any garbage left by
+ * replaced or deleted fields and grows the block if it is still too small.
+ * Fixes up the m->service and m->name pointers, which point into the block.
+ *
+ * Returns 0 if successful, -1 if out of memory.
+ */
+static int rhizome_manifest_reserve_text(rhizome_manifest *m, size_t need)
+{
+  if (m->field_text_used + need <= m->field_text_alloc)
+    return 0;
+  size_t live = m->field_text_used - m->field_text_garbage;
+  size_t alloc = m->field_text_alloc ? m->field_text_alloc : 128;
+  while (alloc < live + need)
+    alloc *= 2;
+  char *text = emalloc(alloc);
+  if (text == NULL)
+    return -1;
+  size_t used = 0;
+  unsigned i;
+  for (i = 0; i < m->var_count; ++i) {
+    size_t len;
+    if (!m->fields[i].known) {
+      len = strlen(FIELD_LABEL(m, i)) + 1;
+      memcpy(&text[used], FIELD_LABEL(m, i), len);
+      m->fields[i].label = used;
+      used += len;
+    }
+    if (FIELD_HAS_TEXT(m, i)) {
+      len = strlen(FIELD_VALUE(m, i)) + 1;
+      memcpy(&text[used], FIELD_VALUE(m, i), len);
+      m->fields[i].value = used;
+      used += len;
+    }
+  }
+  assert(used == live);
+  free(m->field_text);
+  m->field_text = text;
+  m->field_text_used = used;
+  m->field_text_alloc = alloc;
+  m->field_text_garbage = 0;
+  int s;
+  if (m->service && (s = rhizome_manifest_find(m, "service")) != -1)
+    m->service = FIELD_VALUE(m, s);
+  if (m->name && (s = rhizome_manifest_find(m, "name")) != -1)
+    m->name = FIELD_VALUE(m, s);
+  return 0;
+}
+
+static unsigned rhizome_manifest_append_text(rhizome_manifest *m, const char *str)
+{
+  size_t len = strlen(str) + 1;
+  assert(m->field_text_used + len <= m->field_text_alloc);
+  unsigned ofs = m->field_text_used;
+  memcpy(&m->field_text[ofs], str, len);
+  m->field_text_used += len;
+  return ofs;
+}
+
+/* Return the index of a new field appended to m->fields[], or -1 if out of memory or there are
+ * too many fields.
+ */
+static int rhizome_manifest_append_field(rhizome_manifest *m)
+{
+  if (m->var_count >= MAX_MANIFEST_VARS)
+    return WHY("no more manifest vars");
+  if (m->var_count >= m->var_alloc) {
+    unsigned short alloc = m->var_alloc ? m->var_alloc * 2 : 16;
+    if (alloc > MAX_MANIFEST_VARS)
+      alloc = MAX_MANIFEST_VARS;
+    struct rhizome_manifest_field *fields = erealloc(m->fields, alloc * sizeof *fields);
+    if (fields == NULL)
+      return -1;
+    m->fields = fields;
+    m->var_alloc = alloc;
+  }
+  unsigned i = m->var_count++;
+  m->fields[i].known = NULL;
+  m->fields[i].label = NO_TEXT;
+  m->fields[i].value = NO_TEXT;
+  return i;
 }
 
 /* Remove the field with the given label from the manifest
@@ -49,61 +150,84 @@ static const char *rhizome_manifest_get(const rhizome_manifest *m, const char *v
 static int _rhizome_manifest_del(struct __sourceloc __whence, rhizome_manifest *m, const char *var)
 {
   DEBUGF(rhizome_manifest, "DEL manifest %p %s", m, var);
-  int ret = 0;
-  unsigned i;
-  for (i = 0; i < m->var_count; ++i)
-    if (strcmp(m->vars[i], var) == 0) {
-      free((char *) m->vars[i]);
-      free((char *) m->values[i]);
-      --m->var_count;
-      ret = 1;
-      break;
-    }
-  for (; i < m->var_count; ++i) {
-    m->vars[i] = m->vars[i + 1];
-    m->values[i] = m->values[i + 1];
-  }
-  return ret;
+  int i = rhizome_manifest_find(m, var);
+  if (i == -1)
+    return 0;
+  if (!m->fields[i].known)
+    m->field_text_garbage += strlen(FIELD_LABEL(m, i)) + 1;
+  if (FIELD_HAS_TEXT(m, i))
+    m->field_text_garbage += strlen(FIELD_VALUE(m, i)) + 1;
+  --m->var_count;
+  for (; (unsigned)i < m->var_count; ++i)
+    m->fields[i] = m->fields[i + 1];
+  return 1;
 }
 
 #define rhizome_manifest_set(m,var,value) _rhizome_manifest_set(__WHENCE__, (m), (var), (value))
-#define rhizome_manifest_set_ui64(m,var,value) _rhizome_manifest_set_ui64(__WHENCE__, (m), (var), (value))
+#define rhizome_manifest_set_known(m,var,text) _rhizome_manifest_set_known(__WHENCE__, (m), (var), (text))
 #define rhizome_manifest_del(m,var) _rhizome_manifest_del(__WHENCE__, (m), (var))
 
+/* Set the value of the unknown field with the given label, appending a new field if there is none.
+ * Returns a pointer to the stored value string, which remains valid until the next time any field
+ * in the manifest is set, or NULL if out of memory or there are too many fields.
+ */
 static const char *_rhizome_manifest_set(struct __sourceloc __whence, rhizome_manifest *m, const char *var, const char *value)
 {
   DEBUGF(rhizome_manifest, "SET manifest %p %s = %s", m, var, alloca_str_toprint(value));
-  unsigned i;
-  for(i=0;i<m->var_count;i++)
-    if (strcmp(m->vars[i],var) == 0) {
-      const char *ret = str_edup(value);
-      if (ret == NULL)
-	return NULL;
-      free((char *)m->values[i]);
-      m->values[i] = ret;
-      return ret;
-    }
-  if (m->var_count >= NELS(m->vars)) {
-    WHY("no more manifest vars");
-    return NULL;
+  // The strings may be moved by rhizome_manifest_reserve_text(), so the caller's
+  // strings must not point into them.
+  if (m->field_text && value >= m->field_text && value < m->field_text + m->field_text_used)
+    value = alloca_strdup(value);
+  if (m->field_text && var >= m->field_text && var < m->field_text + m->field_text_used)
+    var = alloca_strdup(var);
+  size_t valuelen = strlen(value) + 1;
+  int i = rhizome_manifest_find(m, var);
+  if (i != -1) {
+    assert(!m->fields[i].known);
+    size_t oldlen = strlen(FIELD_VALUE(m, i)) + 1;
+    if (rhizome_manifest_reserve_text(m, valuelen) == -1)
+      return NULL;
+    m->fields[i].value = rhizome_manifest_append_text(m, value);
+    m->field_text_garbage += oldlen;
+    return FIELD_VALUE(m, i);
   }
-  if ((m->vars[m->var_count] = str_edup(var)) == NULL)
+  if (rhizome_manifest_reserve_text(m, strlen(var) + 1 + valuelen) == -1)
     return NULL;
-  const char *ret = m->values[m->var_count] = str_edup(value);
-  if (ret == NULL) {
-    free((char *)m->vars[i]);
-    m->vars[i] = NULL;
+  if ((i = rhizome_manifest_append_field(m)) == -1)
     return NULL;
-  }
-  m->var_count++;
-  return ret;
-}
-
-static const char *_rhizome_manifest_set_ui64(struct __sourceloc __whence, rhizome_manifest *m, char *var, uint64_t value)
+  m->fields[i].label = rhizome_manifest_append_text(m, var);
+  m->fields[i].value = rhizome_manifest_append_text(m, value);
+  return FIELD_VALUE(m, i);
+}
+
+/* Record the position of a known field, whose value is held in the typed members of the manifest
+ * struct, appending it to m->fields[] if it is not already there.  The 'var' label must be a
+ * string constant.  The service and name fields have no other home for their string values, so
+ * for them 'text' is stored in m->field_text[] and a pointer to the stored string is returned,
+ * which remains valid until the next time any field in the manifest is set.  For other fields,
+ * 'text' is NULL and the label is returned.  Returns NULL if out of memory or there are too many
+ * fields.
+ */
+static const char *_rhizome_manifest_set_known(struct __sourceloc __whence, rhizome_manifest *m, const char *var, const char *text)
 {
-  char str[50];
-  snprintf(str, sizeof str, "%" PRIu64, value);
-  return rhizome_manifest_set(m, var, str);
+  DEBUGF(rhizome_manifest, "SET manifest %p %s%s%s", m, var, text ? " = " : "", text ? alloca_str_toprint(text) : "");
+  if (text && m->field_text && text >= m->field_text && text < m->field_text + m->field_text_used)
+    text = alloca_strdup(text);
+  if (text && rhizome_manifest_reserve_text(m, strlen(text) + 1) == -1)
+    return NULL;
+  int i = rhizome_manifest_find(m, var);
+  if (i == -1) {
+    if ((i = rhizome_manifest_append_field(m)) == -1)
+      return NULL;
+    m->fields[i].known = var;
+  }
+  assert(m->fields[i].known);
+  if (!text)
+    return var;
+  if (m->fields[i].value != NO_TEXT)
+    m->field_text_garbage += strlen(FIELD_VALUE(m, i)) + 1;
+  m->fields[i].value = rhizome_manifest_append_text(m, text);
+  return FIELD_VALUE(m, i);
 }
 
 void _rhizome_manifest_set_id(struct __sourceloc __whence, rhizome_manifest *m, const rhizome_bid_t *bidp)
@@ -111,11 +235,12 @@ void _rhizome_manifest_set_id(struct __sourceloc __whence, rhizome_manifest *m,
   if (bidp) {
     if (m->has_id && (bidp == &m->keypair.public_key || cmp_rhizome_bid_t(&m->keypair.public_key, bidp) == 0))
       return; // unchanged
-    const char *v = rhizome_manifest_set(m, "id", alloca_tohex_rhizome_bid_t(*bidp));
-    assert(v); // TODO: remove known manifest fields from vars[]
+    const char *v = rhizome_manifest_set_known(m, "id", NULL);
+    assert(v);
     m->keypair.public_key = *bidp;
     m->has_id = 1;
   } else if (m->has_id) {
+    rhizome_manifest_del(m, "id");
     bzero(&m->keypair.public_key, sizeof m->keypair.public_key); // not strictly necessary but aids debugging
     m->has_id = 0;
   } else
@@ -139,8 +264,8 @@ void _rhizome_manifest_set_id(struct __sourceloc __whence, rhizome_manifest *m,
 void _rhizome_manifest_set_version(struct __sourceloc __whence, rhizome_manifest *m, uint64_t version)
 {
   if (version) {
-    const char *v = rhizome_manifest_set_ui64(m, "version", version);
-    assert(v); // TODO: remove known manifest fields from vars[]
+    const char *v = rhizome_manifest_set_known(m, "version", NULL);
+    assert(v);
   } else
     rhizome_manifest_del(m, "version");
   m->version = version;
@@ -157,8 +282,8 @@ void _rhizome_manifest_set_filesize(struct __sourceloc __whence, rhizome_manifes
   if (size == RHIZOME_SIZE_UNSET) {
     rhizome_manifest_del(m, "filesize");
   } else {
-    const char *v = rhizome_manifest_set_ui64(m, "filesize", size);
-    assert(v); // TODO: remove known manifest fields from vars[]
+    const char *v = rhizome_manifest_set_known(m, "filesize", NULL);
+    assert(v);
   }
   m->filesize = size;
   m->finalised = 0;
@@ -174,8 +299,8 @@ void _rhizome_manifest_del_filesize(struct __sourceloc __whence, rhizome_manifes
 void _rhizome_manifest_set_filehash(struct __sourceloc __whence, rhizome_manifest *m, const rhizome_filehash_t *hash)
 {
   if (hash) {
-    const char *v = rhizome_manifest_set(m, "filehash", alloca_tohex_rhizome_filehash_t(*hash));
-    assert(v); // TODO: remove known manifest fields from vars[]
+    const char *v = rhizome_manifest_set_known(m, "filehash", NULL);
+    assert(v);
     m->filehash = *hash;
     m->has_filehash = 1;
   } else {
@@ -197,8 +322,8 @@ void _rhizome_manifest_set_tail(struct __sourceloc __whence, rhizome_manifest *m
     rhizome_manifest_del(m, "tail");
     m->is_journal = 0;
   } else {
-    const char *v = rhizome_manifest_set_ui64(m, "tail", tail);
-    assert(v); // TODO: remove known manifest fields from vars[]
+    const char *v = rhizome_manifest_set_known(m, "tail", NULL);
+    assert(v);
     m->is_journal = 1;
   }
   m->tail = tail;
@@ -208,8 +333,8 @@ void _rhizome_manifest_set_tail(struct __sourceloc __whence, rhizome_manifest *m
 void _rhizome_manifest_set_bundle_key(struct __sourceloc __whence, rhizome_manifest *m, const rhizome_bk_t *bkp)
 {
   if (bkp) {
-    const char *v = rhizome_manifest_set(m, "BK", alloca_tohex_rhizome_bk_t(*bkp));
-    assert(v); // TODO: remove known manifest fields from vars[]
+    const char *v = rhizome_manifest_set_known(m, "BK", NULL);
+    assert(v);
     m->bundle_key = *bkp;
     m->has_bundle_key = 1;
     m->finalised = 0;
@@ -225,7 +350,7 @@ void _rhizome_manifest_del_bundle_key(struct __sourceloc __whence, rhizome_manif
     m->bundle_key = RHIZOME_BK_NONE; // not strictly necessary, but aids debugging
     m->finalised = 0;
   } else
-    assert(rhizome_manifest_get(m, "BK") == NULL);
+    assert(rhizome_manifest_find(m, "BK") == -1);
   // Once there is no BK field, any authenticated authorship is no longer.
   if (m->authorship == AUTHOR_AUTHENTIC)
     m->authorship = AUTHOR_LOCAL;
@@ -235,8 +360,8 @@ void _rhizome_manifest_set_service(struct __sourceloc __whence, rhizome_manifest
 {
   if (service) {
     assert(rhizome_str_is_manifest_service(service));
-    const char *v = rhizome_manifest_set(m, "service", service);
-    assert(v); // TODO: remove known manifest fields from vars[]
+    const char *v = rhizome_manifest_set_known(m, "service", service);
+    assert(v);
     m->service = v;
     m->finalised = 0;
   } else
@@ -250,7 +375,7 @@ void _rhizome_manifest_del_service(struct __sourceloc __whence, rhizome_manifest
     m->finalised = 0;
     rhizome_manifest_del(m, "service");
   } else
-    assert(rhizome_manifest_get(m, "service") == NULL);
+    assert(rhizome_manifest_find(m, "service") == -1);
 }
 
 void _rhizome_manifest_set_name(struct __sourceloc __whence, rhizome_manifest *m, const char *name)
@@ -258,8 +383,8 @@ void _rhizome_manifest_set_name(struct __sourceloc __whence, rhizome_manifest *m
   m->finalised = 0;
   if (name) {
     assert(rhizome_str_is_manifest_name(name));
-    const char *v = rhizome_manifest_set(m, "name", name);
-    assert(v); // TODO: remove known manifest fields from vars[]
+    const char *v = rhizome_manifest_set_known(m, "name", name);
+    assert(v);
     m->name = v;
   } else {
     rhizome_manifest_del(m, "name");
@@ -274,13 +399,13 @@ void _rhizome_manifest_del_name(struct __sourceloc __whence, rhizome_manifest *m
     m->finalised = 0;
     rhizome_manifest_del(m, "name");
   } else
-    assert(rhizome_manifest_get(m, "name") == NULL);
+    assert(rhizome_manifest_find(m, "name") == -1);
 }
 
 void _rhizome_manifest_set_date(struct __sourceloc __whence, rhizome_manifest *m, time_ms_t date)
 {
-  const char *v = rhizome_manifest_set_ui64(m, "date", (uint64_t)date);
-  assert(v); // TODO: remove known manifest fields from vars[]
+  const char *v = rhizome_manifest_set_known(m, "date", NULL);
+  assert(v);
   m->date = date;
   m->has_date = 1;
   m->finalised = 0;
@@ -293,14 +418,14 @@ void _rhizome_manifest_del_date(struct __sourceloc __whence, rhizome_manifest *m
     m->finalised = 0;
     rhizome_manifest_del(m, "date");
   } else
-    assert(rhizome_manifest_get(m, "date") == NULL);
+    assert(rhizome_manifest_find(m, "date") == -1);
 }
 
 void _rhizome_manifest_set_sender(struct __sourceloc __whence, rhizome_manifest *m, const sid_t *sidp)
 {
   if (sidp) {
-    const char *v = rhizome_manifest_set(m, "sender", alloca_tohex_sid_t(*sidp));
-    assert(v); // TODO: remove known manifest fields from vars[]
+    const char *v = rhizome_manifest_set_known(m, "sender", NULL);
+    assert(v);
     m->sender = *sidp;
     m->has_sender = 1;
     m->finalised = 0;
@@ -316,14 +441,14 @@ void _rhizome_manifest_del_sender(struct __sourceloc __whence, rhizome_manifest
     m->has_sender = 0;
     m->finalised = 0;
   } else
-    assert(rhizome_manifest_get(m, "sender") == NULL);
+    assert(rhizome_manifest_find(m, "sender") == -1);
 }
 
 void _rhizome_manifest_set_recipient(struct __sourceloc __whence, rhizome_manifest *m, const sid_t *sidp)
 {
   if (sidp) {
-    const char *v = rhizome_manifest_set(m, "recipient", alloca_tohex_sid_t(*sidp));
-    assert(v); // TODO: remove known manifest fields from vars[]
+    const char *v = rhizome_manifest_set_known(m, "recipient", NULL);
+    assert(v);
     m->recipient = *sidp;
     m->has_recipient = 1;
     m->finalised = 0;
@@ -339,7 +464,7 @@ void _rhizome_manifest_del_recipient(struct __sourceloc __whence, rhizome_manife
     m->has_recipient = 0;
     m->finalised = 0;
   } else
-    assert(rhizome_manifest_get(m, "recipient") == NULL);
+    assert(rhizome_manifest_find(m, "recipient") == -1);
 }
 
 void _rhizome_manifest_set_crypt(struct __sourceloc __whence, rhizome_manifest *m, enum rhizome_manifest_crypt flag)
@@ -348,14 +473,10 @@ void _rhizome_manifest_set_crypt(struct __sourceloc __whence, rhizome_manifest *
     case PAYLOAD_CRYPT_UNKNOWN:
       rhizome_manifest_del(m, "crypt");
       break;
-    case PAYLOAD_CLEAR: {
-      const char *v = rhizome_manifest_set(m, "crypt", "0");
-      assert(v); // TODO: remove known manifest fields from vars[]
-      break;
-    }
+    case PAYLOAD_CLEAR:
     case PAYLOAD_ENCRYPTED: {
-      const char *v = rhizome_manifest_set(m, "crypt", "1");
-      assert(v); // TODO: remove known manifest fields from vars[]
+      const char *v = rhizome_manifest_set_known(m, "crypt", NULL);
+      assert(v);
       break;
     }
     default: abort();
@@ -443,9 +564,9 @@ int rhizome_manifest_verify(rhizome_manifest *m)
     m->selfSigned = 0;
     return 0;
   }
-  if (memcmp(m->signatories[0], m->keypair.public_key.binary, sizeof m->keypair.public_key.binary) != 0) {
+  if (memcmp(m->signatories[0].binary, m->keypair.public_key.binary, sizeof m->keypair.public_key.binary) != 0) {
     DEBUGF(rhizome_manifest, "Manifest id does not match first signature block (signature key is %s)",
-	   alloca_tohex(m->signatories[0], crypto_sign_PUBLICKEYBYTES)
+	   alloca_tohex(m->signatories[0].binary, crypto_sign_PUBLICKEYBYTES)
 	  );
     m->selfSigned = 0;
     return 0;
@@ -456,17 +577,14 @@ int rhizome_manifest_verify(rhizome_manifest *m)
 
 static void rhizome_manifest_clear(rhizome_manifest *m)
 {
-  while (m->var_count) {
-    --m->var_count;
-    free((char *) m->vars[m->var_count]);
-    free((char *) m->values[m->var_count]);
-    m->vars[m->var_count] = m->values[m->var_count] = NULL;
-  }
-  while (m->sig_count) {
-    --m->sig_count;
-    free(m->signatories[m->sig_count]);
-    m->signatories[m->sig_count] = NULL;
-  }
+  // Keep the field and signatory blocks for re-use; they are only freed by
+  // rhizome_manifest_free().
+  m->var_count = 0;
+  m->field_text_used = 0;
+  m->field_text_garbage = 0;
+  m->sig_count = 0;
+  m->service = NULL;
+  m->name = NULL;
   m->malformed = NULL;
   m->has_id = 0;
   m->has_filehash = 0;
@@ -564,14 +682,15 @@ int rhizome_manifest_inspect(const char *buf, size_t len, struct rhizome_manifes
  *       CR is ASCII 13
  *       LF is ASCII 10
  *
- * Unpacks all parsed field labels and string values into the m->vars[] and m->values[] arrays, as
- * pointers to malloc(3)ed NUL terminated strings, in the order they appear, and sets m->var_count
- * to the number of fields unpacked.  Sets m->manifest_body_bytes to the number of bytes in the text
+ * Unpacks all parsed fields into the m->fields[] array in the order they appear, and sets
+ * m->var_count to the number of fields unpacked.  Known fields are parsed into their manifest struct
+ * elements; the labels and values of unknown fields are stored as offsets of NUL terminated strings
+ * in m->field_text[].  Sets m->manifest_body_bytes to the number of bytes in the text
  * portion up to and including the optional NUL that starts the signature block (if present).
  *
  * Returns 1 if the manifest is not well formed (syntax violation), any essential field is
- * malformed, or if there are any duplicate fields.  In this case the m->vars[] and m->values[]
- * arrays are not set and the manifest is returned to the state it was in prior to calling.
+ * malformed, or if there are any duplicate fields.  In this case the m->fields[] array is not set
+ * and the manifest is returned to the state it was in prior to calling.
  *
  * Returns 0 if the manifest is well formed, if there are no duplicate fields, and if all essential
  * fields are valid.  Counts invalid non-essential fields and unrecognised fields in m->malformed.
@@ -583,7 +702,7 @@ int rhizome_manifest_inspect(const char *buf, size_t len, struct rhizome_manifes
 int rhizome_manifest_parse(rhizome_manifest *m)
 {
   IN();
-  assert(m->manifest_all_bytes <= sizeof m->manifestdata);
+  assert(m->manifest_all_bytes <= m->manifestdata_alloc);
   assert(m->manifest_body_bytes == 0);
   assert(m->var_count == 0);
   assert(!m->finalised);
@@ -677,6 +796,7 @@ typedef int MANIFEST_FIELD_TESTER(const rhizome_manifest *);
 typedef void MANIFEST_FIELD_UNSETTER(struct __sourceloc, rhizome_manifest *);
 typedef void MANIFEST_FIELD_COPIER(struct __sourceloc, rhizome_manifest *, const rhizome_manifest *);
 typedef int MANIFEST_FIELD_PARSER(rhizome_manifest *, const char *);
+typedef void MANIFEST_FIELD_FORMATTER(const rhizome_manifest *, strbuf);
 
 static int _rhizome_manifest_test_id(const rhizome_manifest *m)
 {
@@ -698,6 +818,10 @@ static int _rhizome_manifest_parse_id(rhizome_manifest *m, const char *text)
   rhizome_manifest_set_id(m, &bid);
   return 1;
 }
+static void _rhizome_manifest_format_id(const rhizome_manifest *m, strbuf sb)
+{
+  strbuf_puts(sb, alloca_tohex_rhizome_bid_t(m->keypair.public_key));
+}
 
 static int _rhizome_manifest_test_version(const rhizome_manifest *m)
 {
@@ -719,6 +843,10 @@ static int _rhizome_manifest_parse_version(rhizome_manifest *m, const char *text
   rhizome_manifest_set_version(m, version);
   return 1;
 }
+static void _rhizome_manifest_format_version(const rhizome_manifest *m, strbuf sb)
+{
+  strbuf_sprintf(sb, "%" PRIu64, m->version);
+}
 
 static int _rhizome_manifest_test_filehash(const rhizome_manifest *m)
 {
@@ -740,6 +868,10 @@ static int _rhizome_manifest_parse_filehash(rhizome_manifest *m, const char *tex
   rhizome_manifest_set_filehash(m, &hash);
   return 1;
 }
+static void _rhizome_manifest_format_filehash(const rhizome_manifest *m, strbuf sb)
+{
+  strbuf_puts(sb, alloca_tohex_rhizome_filehash_t(m->filehash));
+}
 
 static int _rhizome_manifest_test_filesize(const rhizome_manifest *m)
 {
@@ -761,6 +893,10 @@ static int _rhizome_manifest_parse_filesize(rhizome_manifest *m, const char *tex
   rhizome_manifest_set_filesize(m, size);
   return 1;
 }
+static void _rhizome_manifest_format_filesize(const rhizome_manifest *m, strbuf sb)
+{
+  strbuf_sprintf(sb, "%" PRIu64, m->filesize);
+}
 
 static int _rhizome_manifest_test_tail(const rhizome_manifest *m)
 {
@@ -782,6 +918,10 @@ static int _rhizome_manifest_parse_tail(rhizome_manifest *m, const char *text)
   rhizome_manifest_set_tail(m, tail);
   return 1;
 }
+static void _rhizome_manifest_format_tail(const rhizome_manifest *m, strbuf sb)
+{
+  strbuf_sprintf(sb, "%" PRIu64, m->tail);
+}
 
 static int _rhizome_manifest_test_BK(const rhizome_manifest *m)
 {
@@ -803,6 +943,10 @@ static int _rhizome_manifest_parse_BK(rhizome_manifest *m, const char *text)
   rhizome_manifest_set_bundle_key(m, &bk);
   return 1;
 }
+static void _rhizome_manifest_format_BK(const rhizome_manifest *m, strbuf sb)
+{
+  strbuf_puts(sb, alloca_tohex_rhizome_bk_t(m->bundle_key));
+}
 
 static int _rhizome_manifest_test_service(const rhizome_manifest *m)
 {
@@ -823,6 +967,10 @@ static int _rhizome_manifest_parse_service(rhizome_manifest *m, const char *text
   rhizome_manifest_set_service(m, text);
   return 1;
 }
+static void _rhizome_manifest_format_service(const rhizome_manifest *m, strbuf sb)
+{
+  strbuf_puts(sb, m->service);
+}
 
 static int _rhizome_manifest_test_date(const rhizome_manifest *m)
 {
@@ -847,6 +995,10 @@ static int _rhizome_manifest_parse_date(rhizome_manifest *m, const char *text)
   rhizome_manifest_set_date(m, date);
   return 1;
 }
+static void _rhizome_manifest_format_date(const rhizome_manifest *m, strbuf sb)
+{
+  strbuf_sprintf(sb, "%" PRIu64, (uint64_t)m->date);
+}
 
 static int _rhizome_manifest_test_sender(const rhizome_manifest *m)
 {
@@ -868,6 +1020,10 @@ static int _rhizome_manifest_parse_sender(rhizome_manifest *m, const char *text)
   rhizome_manifest_set_sender(m, &sid);
   return 1;
 }
+static void _rhizome_manifest_format_sender(const rhizome_manifest *m, strbuf sb)
+{
+  strbuf_puts(sb, alloca_tohex_sid_t(m->sender));
+}
 
 static int _rhizome_manifest_test_recipient(const rhizome_manifest *m)
 {
@@ -889,6 +1045,10 @@ static int _rhizome_manifest_parse_recipient(rhizome_manifest *m, const char *te
   rhizome_manifest_set_recipient(m, &sid);
   return 1;
 }
+static void _rhizome_manifest_format_recipient(const rhizome_manifest *m, strbuf sb)
+{
+  strbuf_puts(sb, alloca_tohex_sid_t(m->recipient));
+}
 
 static int _rhizome_manifest_test_name(const rhizome_manifest *m)
 {
@@ -907,6 +1067,10 @@ static int _rhizome_manifest_parse_name(rhizome_manifest *m, const char *text)
   rhizome_manifest_set_name(m, text);
   return 1;
 }
+static void _rhizome_manifest_format_name(const rhizome_manifest *m, strbuf sb)
+{
+  strbuf_puts(sb, m->name);
+}
 
 static int _rhizome_manifest_test_crypt(const rhizome_manifest *m)
 {
@@ -927,6 +1091,10 @@ static int _rhizome_manifest_parse_crypt(rhizome_manifest *m, const char *text)
   rhizome_manifest_set_crypt(m, (text[0] == '1') ? PAYLOAD_ENCRYPTED : PAYLOAD_CLEAR);
   return 1;
 }
+static void _rhizome_manifest_format_crypt(const rhizome_manifest *m, strbuf sb)
+{
+  strbuf_putc(sb, m->payloadEncryption == PAYLOAD_ENCRYPTED ? '1' : '0');
+}
 
 static struct rhizome_manifest_field_descriptor {
     const char *label;
@@ -935,10 +1103,12 @@ static struct rhizome_manifest_field_descriptor {
     MANIFEST_FIELD_UNSETTER *unset;
     MANIFEST_FIELD_COPIER *copy;
     MANIFEST_FIELD_PARSER *parse;
+    MANIFEST_FIELD_FORMATTER *format;
 }
     rhizome_manifest_fields[] = {
 #define FIELD(CORE, NAME) \
-        { #NAME, CORE, _rhizome_manifest_test_ ## NAME, _rhizome_manifest_unset_ ## NAME, _rhizome_manifest_copy_ ## NAME, _rhizome_manifest_parse_ ## NAME }
+        { #NAME, CORE, _rhizome_manifest_test_ ## NAME, _rhizome_manifest_unset_ ## NAME, _rhizome_manifest_copy_ ## NAME, _rhizome_manifest_parse_ ## NAME, \
+          _rhizome_manifest_format_ ## NAME }
 	FIELD(1, id),
 	FIELD(1, version),
 	FIELD(1, filehash),
@@ -963,6 +1133,19 @@ static struct rhizome_manifest_field_descriptor *get_rhizome_manifest_field_desc
   return NULL;
 }
 
+/* Append the value of the i'th field to the given strbuf, formatting it from the manifest struct if
+ * it is a known field, or copying its stored text if not.
+ */
+static void rhizome_manifest_format_field(const rhizome_manifest *m, unsigned i, strbuf sb)
+{
+  if (m->fields[i].known) {
+    struct rhizome_manifest_field_descriptor *desc = get_rhizome_manifest_field_descriptor(m->fields[i].known);
+    assert(desc);
+    desc->format(m, sb);
+  } else
+    strbuf_puts(sb, FIELD_VALUE(m, i));
+}
+
 /* Overwrite a Rhizome manifest with fields from another.  Used in the "add bundle" application API
  * when the application supplies a partial manifest to override or add to existing manifest fields.
  *
@@ -983,9 +1166,8 @@ int _rhizome_manifest_overwrite(struct __sourceloc __whence, rhizome_manifest *m
       }
   }
   for (i = 0; i < srcm->var_count; ++i) {
-    struct rhizome_manifest_field_descriptor *desc = get_rhizome_manifest_field_descriptor(srcm->vars[i]);
-    if (!desc)
-      if (_rhizome_manifest_set(__whence, m, srcm->vars[i], srcm->values[i]) == NULL)
+    if (!srcm->fields[i].known)
+      if (_rhizome_manifest_set(__whence, m, FIELD_LABEL(srcm, i), FIELD_VALUE(srcm, i)) == NULL)
 	return -1;
   }
   return 0;
@@ -1035,9 +1217,10 @@ int rhizome_manifest_field_value_is_valid(const char *field_value, size_t field_
  * RHIZOME_MANIFEST_MALFORMED and leaves the manifest unchanged.  Unsupported fields are not parsed;
  * their value string is simply stored, so they cannot evoke a MALFORMED result.
  *
- * Otherwise, sets the relevant element(s) of the manifest structure and appends the field_label and
- * field_value strings into the m->vars[] and m->values[] arrays, as pointers to malloc(3)ed NUL
- * terminated strings, and increments m->var_count.  Returns RHIZOME_MANIFEST_OK.
+ * Otherwise, sets the relevant element(s) of the manifest structure and appends the field to the
+ * m->fields[] array, storing the field_label and field_value strings as offsets of NUL terminated
+ * strings in m->field_text[] if the field is unsupported, and increments m->var_count.  Returns
+ * RHIZOME_MANIFEST_OK.
  *
  * Returns -1 (RHIZOME_MANIFEST_ERROR) if there is an unrecoverable error (eg, malloc(3) returns
  * NULL, out of memory).
@@ -1061,11 +1244,11 @@ rhizome_manifest_parse_field(rhizome_manifest *m, const char *field_label, size_
   const char *value = alloca_strndup(field_value, field_value_len);
   struct rhizome_manifest_field_descriptor *desc = get_rhizome_manifest_field_descriptor(label);
   enum rhizome_manifest_parse_status status = RHIZOME_MANIFEST_OK;
-  assert(m->var_count <= NELS(m->vars));
+  assert(m->var_count <= MAX_MANIFEST_VARS);
   if (desc ? desc->test(m) : rhizome_manifest_get(m, label) != NULL) {
     DEBUGF(rhizome_manifest, "Duplicate field at %s=%s", label, alloca_toprint(100, field_value, field_value_len));
     status = RHIZOME_MANIFEST_DUPLICATE_FIELD;
-  } else if (m->var_count == NELS(m->vars)) {
+  } else if (m->var_count == MAX_MANIFEST_VARS) {
     DEBUGF(rhizome_manifest, "Manifest field limit reached at %s=%s", label, alloca_toprint(100, field_value, field_value_len));
     status = RHIZOME_MANIFEST_OVERFLOW;
   } else if (desc) {
@@ -1168,13 +1351,48 @@ const char *rhizome_manifest_validate_reason(rhizome_manifest *m)
 
 int rhizome_read_manifest_from_file(rhizome_manifest *m, const char *filename)
 {
-  ssize_t bytes = read_whole_file(filename, m->manifestdata, sizeof m->manifestdata);
-  if (bytes == -1)
+  unsigned char buf[MAX_MANIFEST_BYTES];
+  ssize_t bytes = read_whole_file(filename, buf, sizeof buf);
+  if (bytes == -1 || rhizome_manifest_copy_data(m, buf, (size_t) bytes) == -1)
     return -1;
-  m->manifest_all_bytes = (size_t) bytes;
   return rhizome_manifest_parse(m);
 }
 
+/* Ensure m->manifestdata[] can hold 'bytes' bytes, keeping its first m->manifest_all_bytes.
+ *
+ * Returns 0 if successful, -1 if 'bytes' exceeds MAX_MANIFEST_BYTES or out of memory.
+ */
+int rhizome_manifest_reserve_data(rhizome_manifest *m, size_t bytes)
+{
+  if (bytes <= m->manifestdata_alloc)
+    return 0;
+  if (bytes > MAX_MANIFEST_BYTES)
+    return WHYF("Manifest of %zu bytes exceeds limit of %zu", bytes, (size_t)MAX_MANIFEST_BYTES);
+  size_t alloc = (bytes + RHIZOME_MANIFEST_DATA_ROUND - 1) / RHIZOME_MANIFEST_DATA_ROUND * RHIZOME_MANIFEST_DATA_ROUND;
+  if (alloc > MAX_MANIFEST_BYTES)
+    alloc = MAX_MANIFEST_BYTES;
+  unsigned char *data = erealloc(m->manifestdata, alloc);
+  if (data == NULL)
+    return -1;
+  m->manifestdata = data;
+  m->manifestdata_alloc = alloc;
+  return 0;
+}
+
+/* Set the manifest text and signature blocks to be parsed by rhizome_manifest_parse().
+ *
+ * Returns 0 if successful, -1 if 'len' exceeds MAX_MANIFEST_BYTES or out of memory.
+ */
+int rhizome_manifest_copy_data(rhizome_manifest *m, const void *data, size_t len)
+{
+  if (rhizome_manifest_reserve_data(m, len) == -1)
+    return -1;
+  if (len)
+    memcpy(m->manifestdata, data, len);
+  m->manifest_all_bytes = len;
+  return 0;
+}
+
 rhizome_manifest *_rhizome_new_manifest(struct __sourceloc __whence)
 {
   rhizome_manifest *m=emalloc_zero(sizeof(rhizome_manifest));
@@ -1194,6 +1412,10 @@ void _rhizome_manifest_free(struct __sourceloc __whence, rhizome_manifest *m)
   
   /* Free variable and signature blocks. */
   rhizome_manifest_clear(m);
+  free(m->fields);
+  free(m->field_text);
+  free(m->signatories);
+  free(m->manifestdata);
   free(m);
   return;
 }
@@ -1203,22 +1425,26 @@ void _rhizome_manifest_free(struct __sourceloc __whence, rhizome_manifest *m)
  */
 static struct rhizome_bundle_result rhizome_manifest_pack_variables(rhizome_manifest *m)
 {
-  assert(m->var_count <= NELS(m->vars));
-  strbuf sb = strbuf_local_buf(m->manifestdata);
+  assert(m->var_count <= MAX_MANIFEST_VARS);
+  strbuf sb = strbuf_alloca(MAX_MANIFEST_BYTES);
   unsigned i;
   for (i = 0; i < m->var_count; ++i) {
-    strbuf_puts(sb, m->vars[i]);
+    strbuf_puts(sb, FIELD_NAME(m, i));
     strbuf_putc(sb, '=');
-    strbuf_puts(sb, m->values[i]);
+    rhizome_manifest_format_field(m, i, sb);
     strbuf_putc(sb, '\n');
   }
   if (strbuf_overrun(sb)) {
     return rhizome_bundle_result_sprintf(
 	RHIZOME_BUNDLE_STATUS_MANIFEST_TOO_BIG,
 	"Manifest too big: body of %zu bytes exceeds limit of %zu",
-	strbuf_count(sb) + 1, sizeof m->manifestdata);
+	strbuf_count(sb) + 1, (size_t)MAX_MANIFEST_BYTES);
   }
-  m->manifest_body_bytes = strbuf_len(sb) + 1;
+  size_t body_bytes = strbuf_len(sb) + 1;
+  if (rhizome_manifest_reserve_data(m, body_bytes) == -1)
+    return rhizome_bundle_result_static(RHIZOME_BUNDLE_STATUS_ERROR, "Out of memory");
+  memcpy(m->manifestdata, strbuf_str(sb), body_bytes);
+  m->manifest_body_bytes = body_bytes;
   DEBUGF(rhizome, "Repacked variables into manifest: %zu bytes", m->manifest_body_bytes);
   m->manifest_all_bytes = m->manifest_body_bytes;
   m->selfSigned = 0;
@@ -1231,19 +1457,21 @@ static struct rhizome_bundle_result rhizome_manifest_pack_variables(rhizome_mani
 static struct rhizome_bundle_result rhizome_manifest_selfsign(rhizome_manifest *m)
 {
   assert(m->manifest_body_bytes > 0);
-  assert(m->manifest_body_bytes <= sizeof m->manifestdata);
+  assert(m->manifest_body_bytes <= m->manifestdata_alloc);
   assert(m->manifestdata[m->manifest_body_bytes - 1] == '\0');
   assert(m->manifest_body_bytes == m->manifest_all_bytes); // no signature yet
   if (!m->haveSecret)
     return rhizome_bundle_result_static(RHIZOME_BUNDLE_STATUS_READONLY, "Missing bundle secret");
 
   size_t sigLen = 1 + crypto_sign_BYTES + crypto_sign_PUBLICKEYBYTES;
-  if (sizeof m->manifestdata - m->manifest_body_bytes < sigLen)
+  if (MAX_MANIFEST_BYTES - m->manifest_body_bytes < sigLen)
     return rhizome_bundle_result_sprintf(RHIZOME_BUNDLE_STATUS_MANIFEST_TOO_BIG,
 	    "Manifest too big: body of %zu + signature of %zu bytes exceeds limit of %zu",
 	    m->manifest_body_bytes,
 	    sigLen,
-	    sizeof m->manifestdata);
+	    (size_t)MAX_MANIFEST_BYTES);
+  if (rhizome_manifest_reserve_data(m, m->manifest_body_bytes + sigLen) == -1)
+    return rhizome_bundle_result_static(RHIZOME_BUNDLE_STATUS_ERROR, "Out of memory");
 
   crypto_hash_sha512(m->manifesthash.binary, m->manifestdata, m->manifest_body_bytes);
   uint8_t *p = &m->manifestdata[m->manifest_body_bytes];
@@ -1251,12 +1479,24 @@ static struct rhizome_bundle_result rhizome_manifest_selfsign(rhizome_manifest *
   if (crypto_sign_detached(p, NULL, m->manifesthash.binary, sizeof m->manifesthash.binary, m->keypair.binary))
     return rhizome_bundle_result_static(RHIZOME_BUNDLE_STATUS_ERROR, "crypto_sign_detached() failed");
   p+=crypto_sign_BYTES;
-  bcopy(m->keypair.public_key.binary, p, crypto_sign_BYTES);
+  bcopy(m->keypair.public_key.binary, p, crypto_sign_PUBLICKEYBYTES);
   m->manifest_all_bytes = m->manifest_body_bytes + sigLen;
   m->selfSigned = 1;
   return rhizome_bundle_result(RHIZOME_BUNDLE_STATUS_NEW);
 }
 
+/* Convert the manifest to final form and sign it, ready for writing to disk or sending, but do not
+ * add it to the store.
+ */
+struct rhizome_bundle_result rhizome_manifest_sign(rhizome_manifest *m)
+{
+  struct rhizome_bundle_result result = rhizome_manifest_pack_variables(m);
+  if (result.status != RHIZOME_BUNDLE_STATUS_NEW)
+    return result;
+  rhizome_bundle_result_free(&result);
+  return rhizome_manifest_selfsign(m);
+}
+
 int rhizome_write_manifest_file(rhizome_manifest *m, const char *path, char append)
 {
   DEBUGF(rhizome, "write manifest (%zd bytes) to %s", m->manifest_all_bytes, path);
@@ -1289,8 +1529,12 @@ int rhizome_manifest_dump(rhizome_manifest *m, const char *msg)
 {
   unsigned i;
   WHYF("Dumping manifest %s:", msg);
-  for(i=0;i<m->var_count;i++)
-    WHYF("[%s]=[%s]\n", m->vars[i], m->values[i]);
+  strbuf b = strbuf_alloca(MAX_MANIFEST_BYTES);
+  for(i=0;i<m->var_count;i++) {
+    strbuf_reset(b);
+    rhizome_manifest_format_field(m, i, b);
+    WHYF("[%s]=[%s]\n", FIELD_NAME(m, i), strbuf_str(b));
+  }
   return 0;
 }
 
@@ -1330,15 +1574,8 @@ struct rhizome_bundle_result rhizome_manifest_finalise(rhizome_manifest *m, rhiz
   assert(*mout == NULL);
   *mout = m;
 
-  /* Convert to final form for signing and writing to disk */
-  struct rhizome_bundle_result result = rhizome_manifest_pack_variables(m);
-  if (result.status != RHIZOME_BUNDLE_STATUS_NEW)
-    RETURN(result);
-  rhizome_bundle_result_free(&result);
-
-  /* Sign it */
   assert(!m->selfSigned);
-  result = rhizome_manifest_selfsign(m);
+  struct rhizome_bundle_result result = rhizome_manifest_sign(m);
   if (result.status == RHIZOME_BUNDLE_STATUS_NEW) {
     assert(m->selfSigned);
     rhizome_bundle_result_free(&result);
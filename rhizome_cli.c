@@ -19,6 +19,7 @@
  */
 
 #include <fcntl.h>
+#include <dirent.h>
 #include "cli.h"
 #include "conf.h"
 #include "keyring.h"
@@ -26,6 +27,8 @@
 #include "rhizome.h"
 #include "instance.h"
 #include "debug.h"
+#include "mem.h"
+#include "strbuf_helpers.h"
 
 DEFINE_FEATURE(cli_rhizome);
 
@@ -390,6 +393,81 @@ static int app_rhizome_import_bundle(const struct cli_parsed *parsed, struct cli
   return status;
 }
 
+DEFINE_CMD(app_rhizome_import_bulk, 0,
+  "Import every <name>.manifest file in a directory into Rhizome, with its payload in <name>",
+  "rhizome","import","bulk","<directory>");
+static int app_rhizome_import_bulk(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  DEBUG_cli_parsed(verbose, parsed);
+  const char *dirpath;
+  cli_arg(parsed, "directory", &dirpath, NULL, "");
+
+  if (rhizome_opendb() == -1)
+    return -1;
+  DIR *dir = opendir(dirpath);
+  if (!dir)
+    return WHYF_perror("opendir(%s)", alloca_str_toprint(dirpath));
+  struct rhizome_bulk_import *bulk = emalloc_zero(sizeof *bulk);
+  if (!bulk) {
+    closedir(dir);
+    return -1;
+  }
+  int ret = 0;
+  struct dirent *de;
+  while ((de = readdir(dir)) != NULL) {
+    const char *suffix = ".manifest";
+    size_t namelen = strlen(de->d_name);
+    if (namelen <= strlen(suffix) || strcmp(de->d_name + namelen - strlen(suffix), suffix) != 0)
+      continue;
+    char manifest_path[1024];
+    char payload_path[1024];
+    strbuf mp = strbuf_path_join(strbuf_local_buf(manifest_path), dirpath, de->d_name, NULL);
+    strbuf pp = strbuf_trunc(strbuf_path_join(strbuf_local_buf(payload_path), dirpath, de->d_name, NULL), -(int)strlen(suffix));
+    if (strbuf_overrun(mp) || strbuf_overrun(pp)) {
+      ret = WHYF("Path too long: %s", alloca_str_toprint(manifest_path));
+      break;
+    }
+    rhizome_manifest *m = rhizome_new_manifest();
+    if (!m) {
+      ret = -1;
+      break;
+    }
+    if (rhizome_read_manifest_from_file(m, manifest_path) != 0) {
+      WARNF("Bulk import: cannot read manifest %s", alloca_str_toprint(manifest_path));
+      bulk->rejected++;
+      rhizome_manifest_free(m);
+      continue;
+    }
+    // A missing payload file is only an error if the payload is not already in the store.
+    char *payload = NULL;
+    if (access(payload_path, F_OK) == 0 && (payload = str_edup(payload_path)) == NULL) {
+      rhizome_manifest_free(m);
+      ret = -1;
+      break;
+    }
+    rhizome_bulk_import_add(bulk, m, payload, NULL, 0);
+    if (rhizome_bulk_import_full(bulk))
+      rhizome_bulk_import_flush(bulk);
+  }
+  closedir(dir);
+  if (ret == -1)
+    rhizome_bulk_import_release(bulk);
+  else if (rhizome_bulk_import_flush(bulk) == -1)
+    ret = -1;
+  cli_field_name(context, "added", ":");
+  cli_put_long(context, bulk->added, "\n");
+  cli_field_name(context, "stored", ":");
+  cli_put_long(context, bulk->stored, "\n");
+  cli_field_name(context, "rejected", ":");
+  cli_put_long(context, bulk->rejected, "\n");
+  cli_field_name(context, "failed", ":");
+  cli_put_long(context, bulk->failed, "\n");
+  if (ret == 0 && (bulk->rejected || bulk->failed))
+    ret = 1;
+  free(bulk);
+  return ret;
+}
+
 DEFINE_CMD(app_rhizome_append_manifest, 0,
   "Append a manifest to the end of the file it belongs to.",
   "rhizome", "append", "manifest", "[--zip-comment]", "<filepath>", "<manifestpath>");
@@ -702,6 +780,7 @@ static int app_rhizome_list(const struct cli_parsed *parsed, struct cli_context
   size_t rowoffset = atoi(offset_ascii);
   struct rhizome_list_cursor cursor;
   bzero(&cursor, sizeof cursor);
+  cursor.columns_only = 1;
   cursor.service = service && service[0] ? service : NULL;
   cursor.name = name && name[0] ? name : NULL;
   if (sender_hex && sender_hex[0]) {
@@ -785,4 +864,3 @@ static int app_rhizome_list(const struct cli_parsed *parsed, struct cli_context
   cli_end_table(context, rowcount);
   return 0;
 }
-
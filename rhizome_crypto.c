@@ -401,47 +401,114 @@ int rhizome_apply_bundle_secret(rhizome_manifest *m, const rhizome_bk_t *bsk)
   OUT();
 }
 
-typedef struct manifest_signature_block_cache {
+/* The results of manifest signature checks are cached, because the same manifest
+ * arrives from every neighbour that has it, and in bursts when a node joins a
+ * mesh, and each check costs an Ed25519 verification.  The cache is set
+ * associative with least recently used replacement within each set, so a burst
+ * of new manifests cannot evict the results for bundles that are still being
+ * offered.
+ */
+#define SIG_CACHE_SETS 512
+#define SIG_CACHE_WAYS 4
+#define SIG_CACHE_SIG_BYTES (crypto_sign_BYTES + crypto_sign_PUBLICKEYBYTES)
+
+struct manifest_signature_cache_entry {
   unsigned char manifest_hash[crypto_hash_sha512_BYTES];
-  unsigned char signature_bytes[256];
-  size_t signature_length;
+  unsigned char signature_bytes[SIG_CACHE_SIG_BYTES];
+  uint32_t last_used; // zero if the entry is empty
   int signature_valid;
-} manifest_signature_block_cache;
+};
 
-#define SIG_CACHE_SIZE 1024
-manifest_signature_block_cache sig_cache[SIG_CACHE_SIZE];
+static struct manifest_signature_cache_entry sig_cache[SIG_CACHE_SETS][SIG_CACHE_WAYS];
+static uint32_t sig_cache_clock = 0;
 
-static int rhizome_manifest_lookup_signature_validity(const unsigned char *hash, const unsigned char *sig, size_t sig_len)
+/* Find the cache entry for the given manifest hash and signature block.  If there is none, then
+ * evicts the least recently used entry in the set, fills in its key and returns it with *found = 0,
+ * so the caller must set its signature_valid field.
+ */
+static struct manifest_signature_cache_entry *sig_cache_lookup(const unsigned char *hash, const unsigned char *sig, size_t sig_len, int *found)
 {
-  IN();
-  unsigned slot=0;
-  unsigned i;
-
-  for(i=0;i<crypto_hash_sha512_BYTES;i++) {
-    slot=(slot<<1)+(slot&0x80000000?1:0);
-    slot+=hash[i];
+  assert(sig_len == SIG_CACHE_SIG_BYTES);
+  // The manifest hash is the output of SHA-512, so its leading bytes are already
+  // well distributed; mixing in the signature spreads several signatories of one
+  // manifest over different sets.
+  unsigned set = ((hash[0] << 8 | hash[1]) ^ (sig[0] << 8 | sig[1])) % SIG_CACHE_SETS;
+  struct manifest_signature_cache_entry *ways = sig_cache[set];
+  if (++sig_cache_clock == 0) {
+    // wrapped; forget all recency rather than make stale entries look new
+    unsigned s, w;
+    for (s = 0; s < SIG_CACHE_SETS; ++s)
+      for (w = 0; w < SIG_CACHE_WAYS; ++w)
+	if (sig_cache[s][w].last_used)
+	  sig_cache[s][w].last_used = 1;
+    sig_cache_clock = 2;
   }
-  for(i=0;i<sig_len;i++) {
-    slot=(slot<<1)+(slot&0x80000000?1:0);
-    slot+=sig[i];
+  struct manifest_signature_cache_entry *victim = &ways[0];
+  unsigned i;
+  for (i = 0; i < SIG_CACHE_WAYS; ++i) {
+    struct manifest_signature_cache_entry *e = &ways[i];
+    if (e->last_used
+	&& memcmp(hash, e->manifest_hash, crypto_hash_sha512_BYTES) == 0
+	&& memcmp(sig, e->signature_bytes, sig_len) == 0) {
+      e->last_used = sig_cache_clock;
+      *found = 1;
+      return e;
+    }
+    if (e->last_used < victim->last_used)
+      victim = e;
   }
-  slot%=SIG_CACHE_SIZE;
-
-  if (sig_cache[slot].signature_length!=sig_len || 
-      memcmp(hash, sig_cache[slot].manifest_hash, crypto_hash_sha512_BYTES) ||
-      memcmp(sig, sig_cache[slot].signature_bytes, sig_len)){
-    bcopy(hash, sig_cache[slot].manifest_hash, crypto_hash_sha512_BYTES);
-    bcopy(sig, sig_cache[slot].signature_bytes, sig_len);
-    sig_cache[slot].signature_length=sig_len;
+  bcopy(hash, victim->manifest_hash, crypto_hash_sha512_BYTES);
+  bcopy(sig, victim->signature_bytes, sig_len);
+  victim->last_used = sig_cache_clock;
+  *found = 0;
+  return victim;
+}
 
-    sig_cache[slot].signature_valid=
+static int rhizome_manifest_lookup_signature_validity(const unsigned char *hash, const unsigned char *sig, size_t sig_len)
+{
+  IN();
+  int found;
+  struct manifest_signature_cache_entry *e = sig_cache_lookup(hash, sig, sig_len, &found);
+  if (!found)
+    e->signature_valid =
       crypto_sign_verify_detached(sig, hash, crypto_hash_sha512_BYTES, &sig[crypto_sign_BYTES])
       ? -1 : 0;
-  }
-  RETURN(sig_cache[slot].signature_valid);
+  RETURN(e->signature_valid);
   OUT();
 }
 
+/* Check the first (self) signature block of a manifest that has been parsed, without consulting
+ * the signature cache or logging anything, so that the expensive part of rhizome_manifest_verify()
+ * can be done for many manifests at once on worker threads.  The result is only a hint: it must be
+ * passed to rhizome_manifest_prime_signature_cache() on the thread that owns the cache before
+ * calling rhizome_manifest_verify(), which then finds it in the cache instead of verifying again.
+ */
+void rhizome_manifest_check_signature(const rhizome_manifest *m, struct rhizome_signature_check *check)
+{
+  check->sig = NULL;
+  check->valid = -1;
+  if (m->manifest_body_bytes == 0 || m->manifest_body_bytes >= m->manifest_all_bytes)
+    return;
+  const unsigned char *sig = m->manifestdata + m->manifest_body_bytes;
+  // only the Ed25519 signature block type is supported, see rhizome_manifest_extract_signature()
+  if (sig[0] != 0x17 || m->manifest_body_bytes + 1 + SIG_CACHE_SIG_BYTES > m->manifest_all_bytes)
+    return;
+  crypto_hash_sha512(check->hash, m->manifestdata, m->manifest_body_bytes);
+  check->sig = sig + 1;
+  check->valid =
+    crypto_sign_verify_detached(check->sig, check->hash, crypto_hash_sha512_BYTES, &check->sig[crypto_sign_BYTES])
+    ? -1 : 0;
+}
+
+void rhizome_manifest_prime_signature_cache(const struct rhizome_signature_check *check)
+{
+  if (!check->sig)
+    return;
+  int found;
+  struct manifest_signature_cache_entry *e = sig_cache_lookup(check->hash, check->sig, SIG_CACHE_SIG_BYTES, &found);
+  e->signature_valid = check->valid;
+}
+
 int rhizome_manifest_extract_signature(rhizome_manifest *m, unsigned *ofs)
 {
   IN();
@@ -457,8 +524,8 @@ int rhizome_manifest_extract_signature(rhizome_manifest *m, unsigned *ofs)
     RETURN(1);
   }
   *ofs += len;
-  assert (m->sig_count <= NELS(m->signatories));
-  if (m->sig_count == NELS(m->signatories)) {
+  assert (m->sig_count <= MAX_MANIFEST_VARS);
+  if (m->sig_count == MAX_MANIFEST_VARS) {
     WARN("Too many signature blocks in manifest");
     RETURN(2);
   }
@@ -472,10 +539,15 @@ int rhizome_manifest_extract_signature(rhizome_manifest *m, unsigned *ofs)
 	WARN("Signature verification failed");
 	RETURN(4);
       }
-      m->signatureTypes[m->sig_count] = len;
-      if ((m->signatories[m->sig_count] = emalloc(crypto_sign_PUBLICKEYBYTES)) == NULL)
-	RETURN(-1);
-      bcopy(sig + 1 + 64, m->signatories[m->sig_count], crypto_sign_PUBLICKEYBYTES);
+      if (m->sig_count == m->sig_alloc) {
+	unsigned short alloc = m->sig_alloc ? m->sig_alloc * 2 : 2;
+	sign_public_t *signatories = erealloc(m->signatories, alloc * sizeof *signatories);
+	if (signatories == NULL)
+	  RETURN(-1);
+	m->signatories = signatories;
+	m->sig_alloc = alloc;
+      }
+      bcopy(sig + 1 + 64, m->signatories[m->sig_count].binary, crypto_sign_PUBLICKEYBYTES);
       m->sig_count++;
       DEBUG(rhizome, "Signature verified");
       RETURN(0);
@@ -500,43 +572,67 @@ static void add_nonce(unsigned char *nonce, uint64_t value)
 
 /* Encrypt a block of a stream in-place, allowing for offsets that don't align perfectly to block
  * boundaries for efficiency the caller should use a buffer size of (n*RHIZOME_CRYPT_PAGE_SIZE).
+ *
+ * Each page is encrypted with its own XSalsa20 nonce, the payload nonce plus the page offset.
+ * XSalsa20 derives a subkey from the first 16 bytes of the nonce using HSalsa20, then runs Salsa20
+ * with that subkey and the last 8 bytes, so the subkey only needs to be derived again when adding
+ * the page offset carries into the first 16 bytes.  The pages themselves are XORed with the Salsa20
+ * keystream in place, starting at whatever 64 byte block the buffer begins in, so that libsodium
+ * can process many blocks of each page at once.
  */
 int rhizome_crypt_xor_block(unsigned char *buffer, size_t buffer_size, uint64_t stream_offset, 
 			    const unsigned char *key, const unsigned char *nonce)
 {
   uint64_t nonce_offset = stream_offset & ~(RHIZOME_CRYPT_PAGE_SIZE -1);
+  size_t page_offset = (size_t)(stream_offset - nonce_offset);
   size_t offset=0;
   
-  unsigned char block_nonce[crypto_box_NONCEBYTES];
+  unsigned char block_nonce[crypto_stream_xsalsa20_NONCEBYTES];
   bcopy(nonce, block_nonce, sizeof(block_nonce));
   add_nonce(block_nonce, nonce_offset);
   
-  if (nonce_offset < stream_offset){
-    size_t padding = stream_offset & (RHIZOME_CRYPT_PAGE_SIZE -1);
-    size_t size = RHIZOME_CRYPT_PAGE_SIZE - padding;
-    if (size>buffer_size)
-      size=buffer_size;
-    
-    unsigned char temp[RHIZOME_CRYPT_PAGE_SIZE];
-    bcopy(buffer, temp + padding, size);
-    crypto_stream_xsalsa20_xor(temp, temp, size+padding, block_nonce, key);
-    bcopy(temp + padding, buffer, size);
-    
-    add_nonce(block_nonce, RHIZOME_CRYPT_PAGE_SIZE);
-    offset+=size;
-  }
+  unsigned char subkey[crypto_core_hsalsa20_OUTPUTBYTES];
+  unsigned char subkey_nonce[crypto_core_hsalsa20_INPUTBYTES];
+  crypto_core_hsalsa20(subkey, block_nonce, key, NULL);
+  bcopy(block_nonce, subkey_nonce, sizeof subkey_nonce);
   
   while(offset < buffer_size){
-    size_t size = buffer_size - offset;
-    if (size>RHIZOME_CRYPT_PAGE_SIZE)
-      size=RHIZOME_CRYPT_PAGE_SIZE;
+    if (memcmp(subkey_nonce, block_nonce, sizeof subkey_nonce) != 0){
+      crypto_core_hsalsa20(subkey, block_nonce, key, NULL);
+      bcopy(block_nonce, subkey_nonce, sizeof subkey_nonce);
+    }
+    const unsigned char *salsa_nonce = block_nonce + sizeof subkey_nonce;
+    
+    size_t size = RHIZOME_CRYPT_PAGE_SIZE - page_offset;
+    if (size > buffer_size - offset)
+      size = buffer_size - offset;
+    unsigned char *p = buffer + offset;
+    size_t remain = size;
+    uint64_t ic = page_offset / 64;
+    size_t skip = page_offset % 64;
     
-    crypto_stream_xsalsa20_xor(buffer+offset, buffer+offset, (unsigned long long) size, block_nonce, key);
+    // only a partial leading 64 byte block needs to go through a temporary buffer
+    if (skip){
+      unsigned char temp[64];
+      size_t len = 64 - skip;
+      if (len > remain)
+	len = remain;
+      bcopy(p, temp + skip, len);
+      crypto_stream_salsa20_xor_ic(temp, temp, skip + len, salsa_nonce, ic, subkey);
+      bcopy(temp + skip, p, len);
+      p += len;
+      remain -= len;
+      ic++;
+    }
+    if (remain)
+      crypto_stream_salsa20_xor_ic(p, p, remain, salsa_nonce, ic, subkey);
     
     add_nonce(block_nonce, RHIZOME_CRYPT_PAGE_SIZE);
-    offset+=size;
+    offset += size;
+    page_offset = 0;
   }
   
+  sodium_memzero(subkey, sizeof subkey);
   return 0;
 }
 
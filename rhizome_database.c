@@ -37,6 +37,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "debug.h"
 
 static int rhizome_delete_manifest_retry(sqlite_retry_state *retry, const rhizome_bid_t *bidp);
+static void statement_cache_flush();
 
 __thread struct rhizome_database rhizome_database = {
     .dir_path = "",
@@ -145,10 +146,9 @@ void verify_bundles()
     size_t blob_length = sqlite3_column_bytes(statement, 1);
     rhizome_manifest *m = rhizome_new_manifest();
     if (m) {
-      memcpy(m->manifestdata, blob, blob_length);
-      m->manifest_all_bytes = blob_length;
       int ret = -1;
-      if (   rhizome_manifest_parse(m) != -1
+      if (   rhizome_manifest_copy_data(m, blob, blob_length) != -1
+	  && rhizome_manifest_parse(m) != -1
 	  && rhizome_manifest_validate(m)
 	  && rhizome_manifest_verify(m)
       ) {
@@ -200,7 +200,7 @@ void verify_bundles()
       rhizome_manifest_free(m);
     }
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
 }
 
 /*
@@ -330,6 +330,32 @@ int rhizome_opendb()
 
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
 
+  // The journal mode is stored in the database file, so it is set every time in case the config
+  // has changed.  In WAL mode, readers (eg, a REST list) do not block the writer and vice versa, and
+  // synchronous=NORMAL only syncs the log at checkpoints, which cannot corrupt the database but
+  // can lose the last few commits on power failure.
+  {
+    const char *want = config.rhizome.database.wal ? "wal" : "delete";
+    char mode[20];
+    if (sqlite_exec_strbuf_retry(&retry, strbuf_local_buf(mode),
+	  config.rhizome.database.wal ? "PRAGMA journal_mode=WAL;" : "PRAGMA journal_mode=DELETE;", END) != -1
+	&& strcasecmp(mode, want) != 0)
+      WARNF("Rhizome database journal_mode=%s, not %s", alloca_str_toprint(mode), want);
+    if (config.rhizome.database.wal) {
+      sqlite_exec_void_retry(&retry, "PRAGMA synchronous=NORMAL;", END);
+      sqlite3_wal_autocheckpoint(rhizome_database.db, config.rhizome.database.wal_autocheckpoint);
+    }
+  }
+  // PRAGMA arguments cannot be bound parameters, but these are only numbers.
+  {
+    strbuf sql = strbuf_alloca(60);
+    strbuf_sprintf(sql, "PRAGMA cache_size=-%"PRIu64";", config.rhizome.database.cache_size / 1024);
+    sqlite_exec_void_retry(&retry, strbuf_str(sql), END);
+    strbuf_reset(sql);
+    strbuf_sprintf(sql, "PRAGMA mmap_size=%"PRIu64";", config.rhizome.database.mmap_size);
+    sqlite_exec_strbuf_retry(&retry, strbuf_alloca(30), strbuf_str(sql), END);
+  }
+
   uint64_t version;
   if (sqlite_exec_uint64_retry(&retry, &version, "PRAGMA user_version;", END) != SQLITE_ROW)
     RETURN(-1);
@@ -354,7 +380,8 @@ int rhizome_opendb()
 		      "sender text collate nocase, "
 		      "recipient text collate nocase, "
 		      "tail integer, "
-		      "manifest_hash text collate nocase"
+		      "manifest_hash text collate nocase, "
+		      "date integer"
 		  ");", END) == -1
       ||	sqlite_exec_void_retry(&retry, 
 		  "CREATE TABLE IF NOT EXISTS FILES("
@@ -423,6 +450,40 @@ int rhizome_opendb()
     
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=8;", END);
   }
+
+  if (version<9){
+    // Rows stored before the date column existed are left NULL, so listing them falls back to
+    // parsing the manifest blob.
+    if (db_exists)
+      sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "ALTER TABLE MANIFESTS ADD COLUMN date integer;", END);
+    // Bundle lists filter on these, newest (highest rowid) first, which every index supplies as
+    // its implicit last column.
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_SERVICE ON MANIFESTS(service);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_SERVICE_SENDER ON MANIFESTS(service, sender);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_SERVICE_RECIPIENT ON MANIFESTS(service, recipient);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=9;", END);
+  }
+
+  if (version<10){
+    // Record the hash of every manifest that is replaced or deleted, or whose payload is deleted,
+    // by any process, so that the daemon can drop their keys from its saved sync key tree (see
+    // rhizome_sync_keys.c).  REPLACE does not fire delete triggers, so replaced rows are caught
+    // before the insert.  Rows are numbered with AUTOINCREMENT, so that a row deleted by one
+    // process is never mistaken for a new one by the daemon that is clearing the rows it has
+    // applied.  If nothing clears them, eg, when sync never runs, the table is emptied once it
+    // spans 4096 rows, leaving a NULL row to tell the daemon that its saved keys must be rebuilt.
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TABLE IF NOT EXISTS SYNC_REMOVED(id integer primary key autoincrement, manifest_hash text collate nocase);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TRIGGER IF NOT EXISTS SYNC_REMOVED_REPLACE BEFORE INSERT ON MANIFESTS BEGIN "
+	"INSERT INTO SYNC_REMOVED(manifest_hash) SELECT manifest_hash FROM MANIFESTS WHERE id = new.id; END;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TRIGGER IF NOT EXISTS SYNC_REMOVED_DELETE AFTER DELETE ON MANIFESTS BEGIN "
+	"INSERT INTO SYNC_REMOVED(manifest_hash) VALUES(old.manifest_hash); END;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TRIGGER IF NOT EXISTS SYNC_REMOVED_PAYLOAD AFTER DELETE ON FILES BEGIN "
+	"INSERT INTO SYNC_REMOVED(manifest_hash) SELECT manifest_hash FROM MANIFESTS WHERE filehash = old.id; END;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TRIGGER IF NOT EXISTS SYNC_REMOVED_LIMIT AFTER INSERT ON SYNC_REMOVED "
+	"WHEN new.id - (SELECT MIN(id) FROM SYNC_REMOVED) >= 4096 BEGIN "
+	"DELETE FROM SYNC_REMOVED; INSERT INTO SYNC_REMOVED(manifest_hash) VALUES(NULL); END;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=10;", END);
+  }
   
   // TODO recreate tables with collate nocase on all hex columns
 
@@ -476,6 +537,9 @@ int rhizome_close_db()
       WHY("Uncommitted transaction!");
       sqlite_exec_void("ROLLBACK;", END);
     }
+    rhizome_database.bulk = 0;
+    rhizome_database.bulk_space_reserved = 0;
+    statement_cache_flush();
     sqlite3_stmt *stmt = NULL;
     while ((stmt = sqlite3_next_stmt(rhizome_database.db, stmt))) {
       const char *sql = sqlite3_sql(stmt);
@@ -603,6 +667,70 @@ void _sqlite_retry_done(struct __sourceloc __whence, sqlite_retry_state *retry,
     retry->start = -1;
 }
 
+/* Prepared statements are kept for re-use while the database is open, keyed by their SQL text, so
+ * that frequent queries are only compiled once.  A statement is taken out of the cache by
+ * _sqlite_prepare() and given back by sqlite_finalize(), which resets it instead of finalising it.
+ * If the same SQL is prepared again while its cached statement is still in use, the new statement
+ * is not cached.
+ */
+#define SQLITE_STATEMENT_CACHE_SIZE 32
+
+struct sqlite_cached_statement {
+  sqlite3_stmt *statement;
+  uint32_t hash;
+  bool_t in_use;
+  unsigned last_used;
+};
+
+// The cache belongs to the connection, which is per-thread.
+static __thread struct sqlite_cached_statement statement_cache[SQLITE_STATEMENT_CACHE_SIZE];
+static __thread unsigned statement_cache_clock = 0;
+
+static uint32_t statement_cache_hash(const char *sqltext)
+{
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (; *sqltext; ++sqltext)
+    hash = (hash ^ (unsigned char)*sqltext) * 16777619u;
+  return hash;
+}
+
+/* Release a statement returned by _sqlite_prepare() or _sqlite_prepare_bind().  Every statement
+ * prepared by those functions must be released with this, not sqlite3_finalize().
+ */
+void sqlite_finalize(sqlite3_stmt *statement)
+{
+  if (!statement)
+    return;
+  unsigned i;
+  for (i = 0; i < NELS(statement_cache); ++i) {
+    struct sqlite_cached_statement *e = &statement_cache[i];
+    if (e->statement == statement) {
+      assert(e->in_use);
+      sqlite3_reset(statement);
+      sqlite3_clear_bindings(statement);
+      e->in_use = 0;
+      return;
+    }
+  }
+  sqlite3_finalize(statement);
+}
+
+/* Finalise all the cached statements that are not in use, before closing the database.  Any still
+ * in use are left for rhizome_close_db() to report.
+ */
+static void statement_cache_flush()
+{
+  unsigned i;
+  for (i = 0; i < NELS(statement_cache); ++i) {
+    struct sqlite_cached_statement *e = &statement_cache[i];
+    if (e->statement && !e->in_use)
+      sqlite3_finalize(e->statement);
+  }
+  bzero(statement_cache, sizeof statement_cache);
+  statement_cache_clock = 0;
+}
+
 /* Prepare an SQL command from a simple string.  Returns NULL if an error occurs (logged as an
  * error), otherwise returns a pointer to the prepared SQLite statement.
  *
@@ -624,10 +752,34 @@ sqlite3_stmt *_sqlite_prepare(struct __sourceloc __whence, int log_level, sqlite
   IN();
   sqlite3_stmt *statement = NULL;
   assert(rhizome_database.db);
+  uint32_t hash = statement_cache_hash(sqltext);
+  struct sqlite_cached_statement *victim = NULL;
+  unsigned i;
+  for (i = 0; i < NELS(statement_cache); ++i) {
+    struct sqlite_cached_statement *e = &statement_cache[i];
+    if (e->in_use)
+      continue;
+    if (e->statement && e->hash == hash && strcmp(sqlite3_sql(e->statement), sqltext) == 0) {
+      e->in_use = 1;
+      e->last_used = ++statement_cache_clock;
+      sqlite_trace_done = 0;
+      RETURN(e->statement);
+    }
+    if (!victim || (victim->statement && (!e->statement || e->last_used < victim->last_used)))
+      victim = e;
+  }
   while (1) {
     switch (sqlite3_prepare_v2(rhizome_database.db, sqltext, -1, &statement, NULL)) {
       case SQLITE_OK:
 	sqlite_trace_done = 0;
+	if (victim) {
+	  if (victim->statement)
+	    sqlite3_finalize(victim->statement);
+	  victim->statement = statement;
+	  victim->hash = hash;
+	  victim->in_use = 1;
+	  victim->last_used = ++statement_cache_clock;
+	}
 	RETURN(statement);
       case SQLITE_BUSY:
       case SQLITE_LOCKED:
@@ -705,7 +857,6 @@ int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state
 	      FALLTHROUGH; \
 	    default: \
 	      LOGF(log_level, #FUNC "(%d) failed, %s: %s", index, sqlite3_errmsg(rhizome_database.db), sqlite3_sql(statement)); \
-	      sqlite3_finalize(statement); \
 	      return -1; \
 	  } \
 	  break; \
@@ -716,7 +867,6 @@ int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state
 	  BIND_RETRY(sqlite3_bind_null); \
 	} else { \
 	  LOGF(log_level, "at bind arg %u, %s%s parameter is NULL: %s", argnum, #TYP, strbuf_str(ext), sqlite3_sql(statement)); \
-	  sqlite3_finalize(statement); \
 	  return -1; \
 	}
     switch (typ) {
@@ -979,7 +1129,7 @@ sqlite3_stmt *_sqlite_prepare_bind(struct __sourceloc __whence, int log_level, s
     int ret = _sqlite_vbind(__whence, log_level, retry, statement, ap);
     va_end(ap);
     if (ret == -1) {
-      sqlite3_finalize(statement);
+      sqlite_finalize(statement);
       statement = NULL;
     }
   }
@@ -1027,7 +1177,7 @@ int _sqlite_exec_code(struct __sourceloc __whence, int log_level, sqlite_retry_s
   int stepcode;
   while ((stepcode = _sqlite_step(__whence, log_level, retry, statement)) == SQLITE_ROW)
     ++(*rowcount);
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   if (sqlite_trace_func())
     _DEBUGF("rowcount=%d changes=%d", *rowcount, sqlite3_changes(rhizome_database.db));
   return stepcode;
@@ -1062,8 +1212,10 @@ static int _sqlite_vexec_void_code(struct __sourceloc __whence, int log_level, s
   sqlite3_stmt *statement = _sqlite_prepare(__whence, log_level, retry, sqltext);
   if (!statement)
     return SQLITE_ERROR;
-  if (_sqlite_vbind(__whence, log_level, retry, statement, ap) == -1)
+  if (_sqlite_vbind(__whence, log_level, retry, statement, ap) == -1) {
+    sqlite_finalize(statement);
     return SQLITE_ERROR;
+  }
   int stepcode = _sqlite_exec_code(__whence, log_level, retry, statement, rowcount);
   if (sqlite_code_ok(stepcode)){
     *changes = sqlite3_changes(rhizome_database.db);
@@ -1127,8 +1279,10 @@ static int _sqlite_vexec_uint64(struct __sourceloc __whence, sqlite_retry_state
   sqlite3_stmt *statement = _sqlite_prepare(__whence, LOG_LEVEL_ERROR, retry, sqltext);
   if (!statement)
     return -1;
-  if (_sqlite_vbind(__whence, LOG_LEVEL_ERROR, retry, statement, ap) == -1)
+  if (_sqlite_vbind(__whence, LOG_LEVEL_ERROR, retry, statement, ap) == -1) {
+    sqlite_finalize(statement);
     return -1;
+  }
   int rows = 0;
   int stepcode;
   while ((stepcode = _sqlite_step(__whence, LOG_LEVEL_ERROR, retry, statement)) == SQLITE_ROW) {
@@ -1140,7 +1294,7 @@ static int _sqlite_vexec_uint64(struct __sourceloc __whence, sqlite_retry_state
   }
   if (rows > 1)
     FATALF("query unexpectedly returned %d rows", rows);
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   if (sqlite_trace_func())
     _DEBUGF("rowcount=%d changes=%d result=%"PRIu64, rows, sqlite3_changes(rhizome_database.db), *result);
   if (sqlite_code_ok(stepcode) && rows>0)
@@ -1204,8 +1358,10 @@ int _sqlite_vexec_strbuf_retry(struct __sourceloc __whence, sqlite_retry_state *
   sqlite3_stmt *statement = _sqlite_prepare(__whence, LOG_LEVEL_ERROR, retry, sqltext);
   if (!statement)
     return -1;
-  if (_sqlite_vbind(__whence, LOG_LEVEL_ERROR, retry, statement, ap) == -1)
+  if (_sqlite_vbind(__whence, LOG_LEVEL_ERROR, retry, statement, ap) == -1) {
+    sqlite_finalize(statement);
     return -1;
+  }
   int ret = 0;
   int rowcount = 0;
   int stepcode;
@@ -1218,7 +1374,7 @@ int _sqlite_vexec_strbuf_retry(struct __sourceloc __whence, sqlite_retry_state *
   }
   if (rowcount > 1)
     WARNF("query unexpectedly returned %d rows, ignored all but first", rowcount);
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   return sqlite_code_ok(stepcode) && ret != -1 ? rowcount : -1;
 }
 
@@ -1356,7 +1512,7 @@ int rhizome_cleanup(struct rhizome_cleanup_report *report)
         && rhizome_delete_file(&filehash)==0 && report)
       ++report->deleted_stale_incoming_files;
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
 
   // Remove external payload files for old, unreferenced payloads.
   statement = sqlite_prepare_bind(&retry,
@@ -1369,7 +1525,7 @@ int rhizome_cleanup(struct rhizome_cleanup_report *report)
         && rhizome_delete_file(&filehash)==0 && report)
       ++report->deleted_orphan_files;
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
 
   // TODO Iterate through all files in RHIZOME_BLOB_SUBDIR and delete any which are no longer
   // referenced or are stale.  This could take a long time, so for scalability should be done
@@ -1435,6 +1591,85 @@ end:
   mdp_close(mdpsock);
 }
 
+int rhizome_transaction_begin(sqlite_retry_state *retry)
+{
+  if (rhizome_database.bulk)
+    return sqlite_exec_void_retry(retry, "SAVEPOINT bundle;", END);
+  return sqlite_exec_void_retry(retry, "BEGIN TRANSACTION;", END);
+}
+
+int rhizome_transaction_commit(sqlite_retry_state *retry)
+{
+  if (rhizome_database.bulk)
+    return sqlite_exec_void_retry(retry, "RELEASE bundle;", END);
+  return sqlite_exec_void_retry(retry, "COMMIT;", END);
+}
+
+void rhizome_transaction_rollback(sqlite_retry_state *retry)
+{
+  if (rhizome_database.bulk) {
+    // ROLLBACK TO leaves the savepoint open
+    sqlite_exec_void_retry(retry, "ROLLBACK TO bundle;", END);
+    sqlite_exec_void_retry(retry, "RELEASE bundle;", END);
+  } else
+    sqlite_exec_void_retry(retry, "ROLLBACK;", END);
+}
+
+/* Open one transaction for a batch of bundles.  It is IMMEDIATE so that the write lock is taken up
+ * front; otherwise two bulk importers could each hold a read lock and wait forever for the other
+ * to release it.  If there is room for payload_bytes in the store, then the payloads of the batch
+ * are written without checking the space for each one.
+ */
+int rhizome_bulk_begin(uint64_t payload_bytes)
+{
+  assert(!rhizome_database.bulk);
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_void_retry(&retry, "BEGIN IMMEDIATE TRANSACTION;", END) == -1)
+    return WHY("Failed to begin bulk transaction");
+  rhizome_database.bulk_rowid = 0;
+  sqlite_exec_uint64_retry(&retry, &rhizome_database.bulk_rowid, "SELECT IFNULL(MAX(rowid), 0) FROM MANIFESTS;", END);
+  rhizome_database.bulk = 1;
+  rhizome_database.bulk_space_reserved =
+    payload_bytes && rhizome_store_make_space(payload_bytes) == RHIZOME_PAYLOAD_STATUS_NEW;
+  return 0;
+}
+
+/* Commit the batch of bundles added since rhizome_bulk_begin().  The log message, bundle_add
+ * trigger and daemon notification that rhizome_add_manifest_to_store() does for each bundle are
+ * deferred until now, so nobody is told about a bundle that might still be rolled back.
+ */
+int rhizome_bulk_commit()
+{
+  assert(rhizome_database.bulk);
+  rhizome_database.bulk = 0;
+  rhizome_database.bulk_space_reserved = 0;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_void_retry(&retry, "COMMIT;", END) == -1) {
+    sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
+    return WHY("Failed to commit bulk transaction");
+  }
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
+      "SELECT service, id, version FROM MANIFESTS WHERE rowid > ? ORDER BY rowid;",
+      INT64, (int64_t)rhizome_database.bulk_rowid, END);
+  if (statement) {
+    while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
+      const char *service = (const char *) sqlite3_column_text(statement, 0);
+      // This message used in tests; do not modify or remove.
+      INFOF("RHIZOME ADD MANIFEST service=%s bid=%s version=%"PRIu64,
+	    service ? service : "NULL",
+	    (const char *) sqlite3_column_text(statement, 1),
+	    (uint64_t) sqlite3_column_int64(statement, 2)
+	  );
+    }
+    sqlite_finalize(statement);
+  }
+  if (serverMode != SERVER_NOT_RUNNING)
+    rhizome_process_added_bundles(INT64_MAX);
+  else
+    sync_rhizome();
+  return 0;
+}
+
 /* Insert the manifest 'm' into the Rhizome store.  This function encapsulates all the invariants
  * that a manifest must satisfy before it is allowed into the store, so it is used by both the sync
  * protocol and the application layer.
@@ -1499,7 +1734,7 @@ enum rhizome_bundle_status rhizome_add_manifest_to_store(rhizome_manifest *m, rh
   rhizome_manifest_to_bar(m, &bar);
 
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;", END) == -1)
+  if (rhizome_transaction_begin(&retry) == -1)
     return WHY("Failed to begin transaction");
 
   time_ms_t now = gettime_ms();
@@ -1524,9 +1759,10 @@ enum rhizome_bundle_status rhizome_add_manifest_to_store(rhizome_manifest *m, rh
 	  "sender,"
 	  "recipient,"
 	  "tail,"
-	  "manifest_hash"
+	  "manifest_hash,"
+	  "date"
 	") VALUES("
-	  "?,?,?,?,?,?,?,?,?,?,?,?,?,?"
+	  "?,?,?,?,?,?,?,?,?,?,?,?,?,?,CASE WHEN ? THEN ? END"
 	");",
 	RHIZOME_BID_T, &m->keypair.public_key,
 	STATIC_BLOB, m->manifestdata, m->manifest_all_bytes,
@@ -1543,35 +1779,41 @@ enum rhizome_bundle_status rhizome_add_manifest_to_store(rhizome_manifest *m, rh
 	SID_T|NUL, m->has_recipient ? &m->recipient : NULL,
 	INT64, m->tail,
 	RHIZOME_FILEHASH_T, &m->manifesthash,
+	INT, m->has_date,
+	INT64, m->date,
 	END
       )
   ) == NULL)
     goto rollback;
   if (!sqlite_code_ok(sqlite_step_retry(&retry, stmt)))
     goto rollback;
-  sqlite3_finalize(stmt);
+  sqlite_finalize(stmt);
   stmt = NULL;
   rhizome_manifest_set_rowid(m, sqlite3_last_insert_rowid(rhizome_database.db));
   rhizome_manifest_set_inserttime(m, now);
 
-  if (sqlite_exec_void_retry(&retry, "COMMIT;", END) != -1){
-    // This message used in tests; do not modify or remove.
-    INFOF("RHIZOME ADD MANIFEST service=%s bid=%s version=%"PRIu64,
-	  m->service ? m->service : "NULL",
-	  alloca_tohex_rhizome_bid_t(m->keypair.public_key),
-	  m->version
-	);
-    if (serverMode != SERVER_NOT_RUNNING) {
-      assert(max_rowid < m->rowid);
-      // detect any bundles added by the CLI
-      // due to potential race conditions, we have to do this here
-      // even though the CLI will try to send us a MDP_SYNC_RHIZOME message
-      if (m->rowid > max_rowid+1)
-	rhizome_process_added_bundles(m->rowid);
-      max_rowid = m->rowid;
-      CALL_TRIGGER(bundle_add, m);
-    }else{
-      sync_rhizome();
+  if (rhizome_transaction_commit(&retry) != -1){
+    if (rhizome_database.bulk) {
+      // rhizome_bulk_commit() will log and notify
+    } else {
+      // This message used in tests; do not modify or remove.
+      INFOF("RHIZOME ADD MANIFEST service=%s bid=%s version=%"PRIu64,
+	    m->service ? m->service : "NULL",
+	    alloca_tohex_rhizome_bid_t(m->keypair.public_key),
+	    m->version
+	  );
+      if (serverMode != SERVER_NOT_RUNNING) {
+	assert(max_rowid < m->rowid);
+	// detect any bundles added by the CLI
+	// due to potential race conditions, we have to do this here
+	// even though the CLI will try to send us a MDP_SYNC_RHIZOME message
+	if (m->rowid > max_rowid+1)
+	  rhizome_process_added_bundles(m->rowid);
+	max_rowid = m->rowid;
+	CALL_TRIGGER(bundle_add, m);
+      }else{
+	sync_rhizome();
+      }
     }
     if (mout)
       *mout = m;
@@ -1580,9 +1822,9 @@ enum rhizome_bundle_status rhizome_add_manifest_to_store(rhizome_manifest *m, rh
 
 rollback:
   if (stmt)
-    sqlite3_finalize(stmt);
+    sqlite_finalize(stmt);
   WHYF("Failed to store bundle bid=%s", alloca_tohex_rhizome_bid_t(m->keypair.public_key));
-  sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
+  rhizome_transaction_rollback(&retry);
   return RHIZOME_BUNDLE_STATUS_ERROR;
 }
 
@@ -1616,7 +1858,11 @@ int rhizome_list_open(struct rhizome_list_cursor *c)
         );
   IN();
   strbuf b = strbuf_alloca(1024);
-  strbuf_sprintf(b, "SELECT id, manifest, version, inserttime, author, rowid FROM manifests WHERE 1=1");
+  if (c->columns_only)
+    strbuf_puts(b, "SELECT id, CASE WHEN date IS NULL THEN manifest END, version, inserttime, author, rowid,"
+		   " service, name, sender, recipient, filesize, filehash, date FROM manifests WHERE 1=1");
+  else
+    strbuf_puts(b, "SELECT id, manifest, version, inserttime, author, rowid FROM manifests WHERE 1=1");
   if (c->service)
     strbuf_puts(b, " AND service = @service");
   if (c->name)
@@ -1659,12 +1905,55 @@ int rhizome_list_open(struct rhizome_list_cursor *c)
   RETURN(0);
   OUT();
 failure:
-  sqlite3_finalize(c->_statement);
+  sqlite_finalize(c->_statement);
   c->_statement = NULL;
   RETURN(-1);
   OUT();
 }
 
+/* Fill in a manifest from the columns of a rhizome_list_open() row that was selected with
+ * columns_only set.  Returns -1 if any column does not hold a valid value.
+ */
+static int rhizome_list_manifest_from_columns(rhizome_manifest *m, sqlite3_stmt *statement)
+{
+  rhizome_bid_t bid;
+  if (str_to_rhizome_bid_t(&bid, (const char *) sqlite3_column_text(statement, 0)) == -1)
+    return -1;
+  rhizome_manifest_set_id(m, &bid);
+  rhizome_manifest_set_version(m, sqlite3_column_int64(statement, 2));
+  const char *service = (const char *) sqlite3_column_text(statement, 6);
+  if (service == NULL)
+    return -1;
+  rhizome_manifest_set_service(m, service);
+  const char *name = (const char *) sqlite3_column_text(statement, 7);
+  if (name)
+    rhizome_manifest_set_name(m, name);
+  sid_t sid;
+  const char *sender = (const char *) sqlite3_column_text(statement, 8);
+  if (sender) {
+    if (str_to_sid_t(&sid, sender) == -1)
+      return -1;
+    rhizome_manifest_set_sender(m, &sid);
+  }
+  const char *recipient = (const char *) sqlite3_column_text(statement, 9);
+  if (recipient) {
+    if (str_to_sid_t(&sid, recipient) == -1)
+      return -1;
+    rhizome_manifest_set_recipient(m, &sid);
+  }
+  uint64_t filesize = sqlite3_column_int64(statement, 10);
+  rhizome_manifest_set_filesize(m, filesize);
+  if (filesize) {
+    rhizome_filehash_t hash;
+    const char *filehash = (const char *) sqlite3_column_text(statement, 11);
+    if (filehash == NULL || str_to_rhizome_filehash_t(&hash, filehash) == -1)
+      return -1;
+    rhizome_manifest_set_filehash(m, &hash);
+  }
+  rhizome_manifest_set_date(m, sqlite3_column_int64(statement, 12));
+  return 0;
+}
+
 /* Guaranteed to return manifests with monotonically descending rowid.  The first manifest will have
  * the greatest rowid.
  *
@@ -1696,9 +1985,9 @@ int rhizome_list_next(struct rhizome_list_cursor *c)
     }
     if ((r=sqlite_step_retry(&c->_retry, c->_statement)) != SQLITE_ROW)
       break;
-    assert(sqlite3_column_count(c->_statement) == 6);
+    assert(sqlite3_column_count(c->_statement) == (c->columns_only ? 13 : 6));
     assert(sqlite3_column_type(c->_statement, 0) == SQLITE_TEXT);
-    assert(sqlite3_column_type(c->_statement, 1) == SQLITE_BLOB);
+    assert(sqlite3_column_type(c->_statement, 1) == SQLITE_BLOB || (c->columns_only && sqlite3_column_type(c->_statement, 1) == SQLITE_NULL));
     assert(sqlite3_column_type(c->_statement, 2) == SQLITE_INTEGER);
     assert(sqlite3_column_type(c->_statement, 3) == SQLITE_INTEGER);
     assert(sqlite3_column_type(c->_statement, 4) == SQLITE_TEXT || sqlite3_column_type(c->_statement, 4) == SQLITE_NULL);
@@ -1721,13 +2010,20 @@ int rhizome_list_next(struct rhizome_list_cursor *c)
     rhizome_manifest *m = c->manifest = rhizome_new_manifest();
     if (m == NULL)
       RETURN(-1);
-    memcpy(m->manifestdata, manifestblob, manifestblobsize);
-    m->manifest_all_bytes = manifestblobsize;
-    if (   rhizome_manifest_parse(m) == -1
-	|| !rhizome_manifest_validate(m)
-    ) {
-      WHYF("MANIFESTS row id=%s has invalid manifest blob -- skipped", q_manifestid);
-      continue;
+    if (manifestblob == NULL) {
+      // The query left out the blob, because all the listed fields are in their own columns.
+      if (rhizome_list_manifest_from_columns(m, c->_statement) == -1) {
+	WHYF("MANIFESTS row id=%s has invalid columns -- skipped", q_manifestid);
+	continue;
+      }
+    } else {
+      if (   rhizome_manifest_copy_data(m, manifestblob, manifestblobsize) == -1
+	  || rhizome_manifest_parse(m) == -1
+	  || !rhizome_manifest_validate(m)
+      ) {
+	WHYF("MANIFESTS row id=%s has invalid manifest blob -- skipped", q_manifestid);
+	continue;
+      }
     }
     if (m->version != q_version) {
       WHYF("MANIFESTS row id=%s version=%"PRIu64" does not match manifest blob version=%"PRIu64" -- skipped",
@@ -1766,7 +2062,7 @@ void rhizome_list_release(struct rhizome_list_cursor *c)
     c->manifest = NULL;
   }
   if (c->_statement) {
-    sqlite3_finalize(c->_statement);
+    sqlite_finalize(c->_statement);
     c->_statement = NULL;
   }
 }
@@ -1829,9 +2125,8 @@ enum rhizome_bundle_status rhizome_find_duplicate(const rhizome_manifest *m, rhi
     const unsigned char *q_manifestid = sqlite3_column_text(statement, 0);
     const char *manifestblob = (char *) sqlite3_column_blob(statement, 1);
     size_t manifestblobsize = sqlite3_column_bytes(statement, 1); // must call after sqlite3_column_blob()
-    memcpy(blob_m->manifestdata, manifestblob, manifestblobsize);
-    blob_m->manifest_all_bytes = manifestblobsize;
-    if (   rhizome_manifest_parse(blob_m) == -1
+    if (   rhizome_manifest_copy_data(blob_m, manifestblob, manifestblobsize) == -1
+	|| rhizome_manifest_parse(blob_m) == -1
 	|| !rhizome_manifest_validate(blob_m)
        ) {
       WARNF("MANIFESTS row id=%s has invalid manifest blob -- skipped", q_manifestid);
@@ -1861,7 +2156,7 @@ next:
     if (blob_m)
       rhizome_manifest_free(blob_m);
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   if (!sqlite_code_ok(r))
     ret=-1;
   return ret;
@@ -1883,9 +2178,9 @@ static int unpack_manifest_row(rhizome_manifest *m, sqlite3_stmt *statement){
   const char *q_author = (const char *) sqlite3_column_text(statement, 4);
   size_t q_blobsize = sqlite3_column_bytes(statement, 1); // must call after sqlite3_column_blob()
   uint64_t q_rowid = sqlite3_column_int64(statement, 5);
-  memcpy(m->manifestdata, q_blob, q_blobsize);
-  m->manifest_all_bytes = q_blobsize;
-  if (rhizome_manifest_parse(m) == -1 || !rhizome_manifest_validate(m))
+  if (   rhizome_manifest_copy_data(m, q_blob, q_blobsize) == -1
+      || rhizome_manifest_parse(m) == -1
+      || !rhizome_manifest_validate(m))
     return WHYF("Manifest bid=%s in database but invalid", q_id);
   if (q_author) {
     sid_t author;
@@ -1935,7 +2230,7 @@ enum rhizome_bundle_status rhizome_retrieve_manifest(const rhizome_bid_t *bidp,
   if (!statement)
     return RHIZOME_BUNDLE_STATUS_ERROR;
   enum rhizome_bundle_status ret = step_unpack_manifest_row(&retry, m, statement);
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   return ret;
 }
 
@@ -1962,7 +2257,7 @@ enum rhizome_bundle_status rhizome_retrieve_manifest_by_prefix(const unsigned ch
   if (!statement)
     return RHIZOME_BUNDLE_STATUS_ERROR;
   enum rhizome_bundle_status ret = step_unpack_manifest_row(&retry, m, statement);
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   return ret;
 }
 
@@ -1981,7 +2276,7 @@ enum rhizome_bundle_status rhizome_retrieve_manifest_by_hash_prefix(const uint8_
   if (!statement)
     return RHIZOME_BUNDLE_STATUS_ERROR;
   enum rhizome_bundle_status ret = step_unpack_manifest_row(&retry, m, statement);
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   return ret;
 }
 
@@ -2027,7 +2322,7 @@ enum rhizome_bundle_status rhizome_retrieve_bar_by_hash_prefix(const uint8_t *pr
   ret = RHIZOME_BUNDLE_STATUS_SAME;
   
 end:
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   return ret;
 }
 
@@ -2053,7 +2348,7 @@ void rhizome_process_added_bundles(uint64_t up_to_rowid) {
     }
     rhizome_manifest_free(m);
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
 }
 
 static int rhizome_delete_manifest_retry(sqlite_retry_state *retry, const rhizome_bid_t *bidp)
@@ -2165,7 +2460,7 @@ static enum rhizome_bundle_status is_interesting(const char *id_hex, uint64_t ve
   }else{
     status = RHIZOME_BUNDLE_STATUS_NEW;
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   RETURN(status);
   OUT();
 }
@@ -650,7 +650,7 @@ int rhizome_direct_get_bars(const rhizome_bid_t *bidp_low,
       }
     }
   if (statement)
-    sqlite3_finalize(statement);
+    sqlite_finalize(statement);
   statement = NULL;
   
   return bars_written;
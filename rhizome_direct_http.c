@@ -844,7 +844,7 @@ static rhizome_manifest *rhizome_direct_get_manifest(unsigned char *bid_prefix,
       while (sqlite_code_busy(ret) && sqlite_retry(&retry, "sqlite3_blob_open"));
       if (!sqlite_code_ok(ret)) {
 	WHYF("sqlite3_blob_open() failed, %s", sqlite3_errmsg(rhizome_database.db));
-	sqlite3_finalize(statement);
+	sqlite_finalize(statement);
 	return NULL;
 	
       }
@@ -862,9 +862,8 @@ static rhizome_manifest *rhizome_direct_get_manifest(unsigned char *bid_prefix,
       rhizome_manifest *m = rhizome_new_manifest();
       if (!m)
 	goto error;
-      memcpy(m->manifestdata, manifestblob, manifestblobsize);
-      m->manifest_all_bytes = manifestblobsize;
-      if (   rhizome_manifest_parse(m) == -1
+      if (   rhizome_manifest_copy_data(m, manifestblob, manifestblobsize) == -1
+	  || rhizome_manifest_parse(m) == -1
 	  || !rhizome_manifest_validate(m)
       ) {
 	rhizome_manifest_free(m);
@@ -873,18 +872,18 @@ static rhizome_manifest *rhizome_direct_get_manifest(unsigned char *bid_prefix,
       
       DEBUGF(rhizome_direct, "Read manifest");
       sqlite3_blob_close(blob);
-      sqlite3_finalize(statement);
+      sqlite_finalize(statement);
       return m;
 
  error:
       sqlite3_blob_close(blob);
-      sqlite3_finalize(statement);
+      sqlite_finalize(statement);
       return NULL;
     }
   else 
     {
       DEBUGF(rhizome_direct, "no matching manifests");
-      sqlite3_finalize(statement);
+      sqlite_finalize(statement);
       return NULL;
     }
 
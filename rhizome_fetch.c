@@ -43,6 +43,13 @@ struct rhizome_fetch_candidate {
      for MDP. */
   struct socket_address addr;
   const struct subscriber *peer;
+
+  // position in the queue's heap (see rhizome_fetch_insert())
+  struct rhizome_fetch_queue *_queue;
+  unsigned _index;
+  uint64_t _sequence;
+  // while set aside by rhizome_start_next_queued_fetch()
+  struct rhizome_fetch_candidate *_parked_next;
 };
 
 /* Represents an active fetch (in progress) of a bundle payload (.manifest != NULL) or of a bundle
@@ -88,51 +95,92 @@ struct rhizome_fetch_slot {
   uint64_t mdp_last_request_offset;
   int mdpResponsesOutstanding;
   int mdpRXBlockLength;
-  unsigned char mdpRXWindow[32*200];
+  // adaptive request window (see rhizome_fetch_mdp_requestblocks())
+  unsigned mdpWindow;
+  unsigned mdpWindowThreshold;
+  time_ms_t mdpRTT;
+  time_ms_t mdpRTTVar;
+  uint8_t mdpRTTSampled:1;
+  // end of the furthest block requested so far, and where that was before the last request; only
+  // blocks beyond the latter have never been requested before, so only they give RTT samples
+  uint64_t mdp_requested_end;
+  uint64_t mdp_rtt_sample_offset;
 };
 
+// Limits of the Rhizome MDP block request protocol; a request carries a 32 bit bitmap of wanted
+// blocks, and servers refuse blocks larger than 1KiB.
+#define MDP_REQUEST_MAX_BLOCKS 32
+#define MDP_REQUEST_MAX_BLOCK_LENGTH 1024
+#define MDP_REQUEST_MIN_BLOCK_LENGTH 128
+#define MDP_REQUEST_MIN_TIMEOUT 100
+
 static enum rhizome_start_fetch_result rhizome_fetch_switch_to_mdp(struct rhizome_fetch_slot *slot);
 static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot);
 
-/* Represents a queue of fetch candidates and a single active fetch for bundle payloads whose size
- * is less than a given threshold.
- *
- * TODO: If the queues ever get much larger, use pointer-linked queue instead of physically ordered
- * in memory, to avoid the need for memory copies when deleting or inserting queue entries.
- *
- * @author Andrew Bettison <andrew@servalproject.com>
+/* Represents a queue of fetch candidates, and the fetch slots working through them, for bundle
+ * payloads whose size is less than a given threshold.  The candidates are kept in a binary min-heap
+ * ordered by payload size (then by arrival), which grows as needed, so that queueing and unqueueing
+ * a candidate costs O(log n) even when thousands of bundles are advertised at once.  The number of
+ * slots used for each queue is configured by rhizome.fetch_slots, up to RHIZOME_FETCH_MAX_SLOTS.
  */
+
 struct rhizome_fetch_queue {
-  struct rhizome_fetch_slot active; // must be first element in struct
-  unsigned candidate_queue_size;
-  struct rhizome_fetch_candidate *candidate_queue;
+  struct rhizome_fetch_slot slots[RHIZOME_FETCH_MAX_SLOTS];
+  struct rhizome_fetch_candidate **candidates;
+  unsigned candidate_count;
+  unsigned candidate_capacity;
   unsigned char log_size_threshold; // will only queue payloads smaller than this.
 };
 
-/* Static allocation of the candidate queues.
- */
-struct rhizome_fetch_candidate queue0[10];
-struct rhizome_fetch_candidate queue1[8];
-struct rhizome_fetch_candidate queue2[6];
-struct rhizome_fetch_candidate queue3[4];
-struct rhizome_fetch_candidate queue4[2];
-struct rhizome_fetch_candidate queue5[2];
-
-#define slotno(slot) (int)((struct rhizome_fetch_queue *)(slot) - &rhizome_fetch_queues[0])
-
 /* Static allocation of the queue structures.  Must be in order of ascending log_size_threshold.
  */
 struct rhizome_fetch_queue rhizome_fetch_queues[] = {
-  { .candidate_queue_size = NELS(queue0), .candidate_queue = queue0, .log_size_threshold =   10, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue1), .candidate_queue = queue1, .log_size_threshold =   13, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue2), .candidate_queue = queue2, .log_size_threshold =   16, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue3), .candidate_queue = queue3, .log_size_threshold =   19, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue4), .candidate_queue = queue4, .log_size_threshold =   22, .active = { .state = RHIZOME_FETCH_FREE } },
-  { .candidate_queue_size = NELS(queue5), .candidate_queue = queue5, .log_size_threshold = 0xFF, .active = { .state = RHIZOME_FETCH_FREE } }
+  { .log_size_threshold =   10 },
+  { .log_size_threshold =   13 },
+  { .log_size_threshold =   16 },
+  { .log_size_threshold =   19 },
+  { .log_size_threshold =   22 },
+  { .log_size_threshold = 0xFF }
 };
 
 #define NQUEUES	    NELS(rhizome_fetch_queues)
 
+static uint64_t candidate_sequence = 0;
+
+// Number of slots configured for the given queue; the configuration accepts no more than
+// RHIZOME_FETCH_MAX_SLOTS.
+static unsigned queue_slots(const struct rhizome_fetch_queue *q)
+{
+  uint32_t n = 1;
+  switch (q - rhizome_fetch_queues) {
+    case 0: n = config.rhizome.fetch_slots.under_1k; break;
+    case 1: n = config.rhizome.fetch_slots.under_8k; break;
+    case 2: n = config.rhizome.fetch_slots.under_64k; break;
+    case 3: n = config.rhizome.fetch_slots.under_512k; break;
+    case 4: n = config.rhizome.fetch_slots.under_4m; break;
+    case 5: n = config.rhizome.fetch_slots.larger; break;
+  }
+  assert(n <= RHIZOME_FETCH_MAX_SLOTS);
+  return n;
+}
+
+static struct rhizome_fetch_queue *slot_queue(const struct rhizome_fetch_slot *slot)
+{
+  unsigned i;
+  for (i = 0; i < NQUEUES; ++i) {
+    struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
+    if (slot >= q->slots && slot < q->slots + RHIZOME_FETCH_MAX_SLOTS)
+      return q;
+  }
+  FATAL("fetch slot is not in any queue");
+}
+
+static int slotno(const struct rhizome_fetch_slot *slot)
+{
+  struct rhizome_fetch_queue *q = slot_queue(slot);
+  return (int)(q - rhizome_fetch_queues) * RHIZOME_FETCH_MAX_SLOTS + (int)(slot - q->slots);
+}
+
 static const char * fetch_state(int state)
 {
   switch (state){
@@ -153,6 +201,26 @@ static const char * fetch_state(int state)
   }
 }
 
+int rhizome_fetch_queue_status(unsigned i, struct rhizome_fetch_queue_status *status)
+{
+  if (i >= NQUEUES)
+    return 0;
+  const struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
+  bzero(status, sizeof *status);
+  status->max_size = q->log_size_threshold == 0xFF ? 0 : (uint64_t)1 << q->log_size_threshold;
+  status->slots = queue_slots(q);
+  status->candidates = q->candidate_count;
+  unsigned j;
+  for (j = 0; j < q->candidate_count; j++) {
+    assert(q->candidates[j]->manifest->filesize != RHIZOME_SIZE_UNSET);
+    status->candidate_bytes += q->candidates[j]->manifest->filesize;
+  }
+  for (j = 0; j < RHIZOME_FETCH_MAX_SLOTS; j++)
+    if (q->slots[j].state != RHIZOME_FETCH_FREE)
+      status->active++;
+  return 1;
+}
+
 DEFINE_ALARM(rhizome_fetch_status);
 void rhizome_fetch_status(struct sched_ent *alarm)
 {
@@ -163,25 +231,24 @@ void rhizome_fetch_status(struct sched_ent *alarm)
   unsigned total=0;
   for(i=0;i<NQUEUES;i++){
     struct rhizome_fetch_queue *q=&rhizome_fetch_queues[i];
-    unsigned candidates=0;
-    uint64_t candidate_size = 0;
+    struct rhizome_fetch_queue_status status;
+    rhizome_fetch_queue_status(i, &status);
+    if (status.candidates == 0 && status.active == 0)
+      continue;
+    total+=status.candidates;
+    DEBUGF(rhizome_rx, "Fetch queue %d, candidates %u %"PRIu64" bytes, %u of %u slots active",
+	   i, status.candidates, status.candidate_bytes, status.active, status.slots);
     unsigned j;
-    for (j=0;j<q->candidate_queue_size;j++){
-      if (q->candidate_queue[j].manifest){
-	candidates++;
-	assert(q->candidate_queue[j].manifest->filesize != RHIZOME_SIZE_UNSET);
-	candidate_size += q->candidate_queue[j].manifest->filesize;
-      }
+    for (j=0;j<RHIZOME_FETCH_MAX_SLOTS;j++){
+      struct rhizome_fetch_slot *slot = &q->slots[j];
+      if (slot->state == RHIZOME_FETCH_FREE)
+	continue;
+      DEBUGF(rhizome_rx, "Fetch slot %d, %s %"PRIu64" of %"PRIu64,
+	     slotno(slot), fetch_state(slot->state),
+	     slot->write_state.file_offset,
+	     slot->manifest?slot->manifest->filesize:0
+	    );
     }
-    if (candidates == 0 && q->active.state==RHIZOME_FETCH_FREE)
-      continue;
-    total+=candidates;
-    DEBUGF(rhizome_rx, "Fetch slot %d, candidates %u of %u %"PRIu64" bytes, %s %"PRIu64" of %"PRIu64,
-	   i, candidates, q->candidate_queue_size, candidate_size,
-	   fetch_state(q->active.state),
-	   q->active.state==RHIZOME_FETCH_FREE?0:q->active.write_state.file_offset,
-	   q->active.manifest?q->active.manifest->filesize:0
-	  );
   }
   if (total){
     time_ms_t now = gettime_ms();
@@ -194,25 +261,24 @@ int rhizome_fetch_status_html(strbuf b)
   unsigned i;
   for(i=0;i<NQUEUES;i++){
     struct rhizome_fetch_queue *q=&rhizome_fetch_queues[i];
-    unsigned candidates=0;
-    uint64_t candidate_size = 0;
-    unsigned j;
-    for (j=0;j<q->candidate_queue_size;j++){
-      if (q->candidate_queue[j].manifest){
-	candidates++;
-	assert(q->candidate_queue[j].manifest->filesize != RHIZOME_SIZE_UNSET);
-	candidate_size += q->candidate_queue[j].manifest->filesize;
-      }
-    }
-    strbuf_sprintf(b, "<p>Slot %u, (%u of %u [%"PRIu64" bytes]): ", i, candidates, q->candidate_queue_size, candidate_size);
-    if (q->active.state!=RHIZOME_FETCH_FREE && q->active.manifest){
-      strbuf_sprintf(b, "%s %"PRIu64" of %"PRIu64" from %s*",
-	fetch_state(q->active.state),
-	q->active.write_state.file_offset,
-	q->active.manifest->filesize,
-	q->active.peer?alloca_tohex_sid_t_trunc(q->active.peer->sid, 16):"unknown");
-    }else{
+    struct rhizome_fetch_queue_status status;
+    rhizome_fetch_queue_status(i, &status);
+    strbuf_sprintf(b, "<p>Queue %u, (%u queued [%"PRIu64" bytes], %u of %u slots active): ",
+      i, status.candidates, status.candidate_bytes, status.active, status.slots);
+    if (status.active == 0){
       strbuf_puts(b, "inactive");
+      continue;
+    }
+    unsigned j;
+    for (j=0;j<RHIZOME_FETCH_MAX_SLOTS;j++){
+      struct rhizome_fetch_slot *slot = &q->slots[j];
+      if (slot->state == RHIZOME_FETCH_FREE || !slot->manifest)
+	continue;
+      strbuf_sprintf(b, "%s %"PRIu64" of %"PRIu64" from %s* ",
+	fetch_state(slot->state),
+	slot->write_state.file_offset,
+	slot->manifest->filesize,
+	slot->peer?alloca_tohex_sid_t_trunc(slot->peer->sid, 16):"unknown");
     }
   }
   return 0;
@@ -251,8 +317,12 @@ static struct rhizome_fetch_slot *rhizome_find_fetch_slot(uint64_t size)
   unsigned i;
   for (i = 0; i < NQUEUES; ++i) {
     struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
-    if (log_size < q->log_size_threshold && q->active.state == RHIZOME_FETCH_FREE)
-      return &q->active;
+    if (log_size >= q->log_size_threshold)
+      continue;
+    unsigned j, n = queue_slots(q);
+    for (j = 0; j < n; ++j)
+      if (q->slots[j].state == RHIZOME_FETCH_FREE)
+	return &q->slots[j];
   }
   return NULL;
 }
@@ -264,10 +334,13 @@ static struct rhizome_fetch_slot *fetch_search_slot(const unsigned char *id, int
   unsigned i;
   for (i = 0; i < NQUEUES; ++i) {
     struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
-    
-    if (q->active.state != RHIZOME_FETCH_FREE && 
-	memcmp(id, q->active.manifest->keypair.public_key.binary, prefix_length) == 0)
-      return &q->active;
+    unsigned j;
+    for (j = 0; j < RHIZOME_FETCH_MAX_SLOTS; ++j) {
+      struct rhizome_fetch_slot *slot = &q->slots[j];
+      if (slot->state != RHIZOME_FETCH_FREE && 
+	  memcmp(id, slot->manifest->keypair.public_key.binary, prefix_length) == 0)
+	return slot;
+    }
   }
   return NULL;
 }
@@ -279,10 +352,8 @@ static struct rhizome_fetch_candidate *fetch_search_candidate(const unsigned cha
   for (i = 0; i < NQUEUES; ++i) {
     struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
     unsigned j;
-    for (j = 0; j < q->candidate_queue_size; j++) {
-      struct rhizome_fetch_candidate *c = &q->candidate_queue[j];
-      if (!c->manifest)
-	continue;
+    for (j = 0; j < q->candidate_count; j++) {
+      struct rhizome_fetch_candidate *c = q->candidates[j];
       if (memcmp(c->manifest->keypair.public_key.binary, id, prefix_length))
 	continue;
       return c;
@@ -313,63 +384,117 @@ int rhizome_fetch_bar_queued(const rhizome_bar_t *bar)
   return 0;
 }
 
-/* Insert a candidate into a given queue at a given position.  All candidates succeeding the given
- * position are copied backward in the queue to open up an empty element at the given position.  If
- * the queue was full, then the tail element is discarded, freeing the manifest it points to.
- *
- * @author Andrew Bettison <andrew@servalproject.com>
- */
-static struct rhizome_fetch_candidate *rhizome_fetch_insert(struct rhizome_fetch_queue *q, unsigned i)
+static int candidate_before(const struct rhizome_fetch_candidate *a, const struct rhizome_fetch_candidate *b)
 {
-  struct rhizome_fetch_candidate * const c = &q->candidate_queue[i];
-  struct rhizome_fetch_candidate * e = &q->candidate_queue[q->candidate_queue_size - 1];
-  DEBUGF(rhizome_rx, "insert queue[%d] candidate[%u]", (int)(q - rhizome_fetch_queues), i);
-  assert(i < q->candidate_queue_size);
-  assert(i == 0 || c[-1].manifest);
-  if (e->manifest) // queue is full
-    rhizome_manifest_free(e->manifest);
-  else
-    while (e > c && !e[-1].manifest)
-      --e;
-  for (; e > c; --e)
-    e[0] = e[-1];
-  assert(e == c);
-  c->manifest = NULL;
-  return c;
+  return a->manifest->filesize < b->manifest->filesize
+    || (a->manifest->filesize == b->manifest->filesize && a->_sequence < b->_sequence);
 }
 
-/* Remove the given candidate from a given queue.  If the element points to a manifest structure,
- * then frees the manifest.  All succeeding candidates are copied forward in the queue to close up
- * the gap, leaving an empty element at the tail of the queue.
- *
- * @author Andrew Bettison <andrew@servalproject.com>
- */
-static void rhizome_fetch_unqueue(struct rhizome_fetch_queue *q, unsigned i)
+static void candidate_set(struct rhizome_fetch_queue *q, unsigned i, struct rhizome_fetch_candidate *c)
 {
-  assert(i < q->candidate_queue_size);
-  struct rhizome_fetch_candidate *c = &q->candidate_queue[i];
-  DEBUGF(rhizome_rx, "unqueue queue[%d] candidate[%d] manifest=%p", (int)(q - rhizome_fetch_queues), i, c->manifest);
-  if (c->manifest) {
-    rhizome_manifest_free(c->manifest);
-    c->manifest = NULL;
+  q->candidates[i] = c;
+  c->_index = i;
+}
+
+static void candidate_sift_up(struct rhizome_fetch_queue *q, unsigned i)
+{
+  struct rhizome_fetch_candidate *c = q->candidates[i];
+  while (i > 0){
+    unsigned parent = (i - 1) / 2;
+    if (!candidate_before(c, q->candidates[parent]))
+      break;
+    candidate_set(q, i, q->candidates[parent]);
+    i = parent;
+  }
+  candidate_set(q, i, c);
+}
+
+static void candidate_sift_down(struct rhizome_fetch_queue *q, unsigned i)
+{
+  struct rhizome_fetch_candidate *c = q->candidates[i];
+  while (1){
+    unsigned child = i * 2 + 1;
+    if (child >= q->candidate_count)
+      break;
+    if (child + 1 < q->candidate_count && candidate_before(q->candidates[child + 1], q->candidates[child]))
+      child++;
+    if (!candidate_before(q->candidates[child], c))
+      break;
+    candidate_set(q, i, q->candidates[child]);
+    i = child;
   }
-  struct rhizome_fetch_candidate *e = &q->candidate_queue[q->candidate_queue_size - 1];
-  for (; c < e && c[1].manifest; ++c)
-    c[0] = c[1];
-  c->manifest = NULL;
+  candidate_set(q, i, c);
+}
+
+// Add a candidate to the heap, which must have room for it.
+static void candidate_push(struct rhizome_fetch_queue *q, struct rhizome_fetch_candidate *c)
+{
+  assert(q->candidate_count < q->candidate_capacity);
+  q->candidates[q->candidate_count++] = c;
+  candidate_sift_up(q, q->candidate_count - 1);
+}
+
+// Take a candidate out of the heap, without freeing it.
+static void candidate_remove(struct rhizome_fetch_candidate *c)
+{
+  struct rhizome_fetch_queue *q = c->_queue;
+  unsigned i = c->_index;
+  assert(i < q->candidate_count && q->candidates[i] == c);
+  struct rhizome_fetch_candidate *last = q->candidates[--q->candidate_count];
+  if (last == c)
+    return;
+  candidate_set(q, i, last);
+  if (i > 0 && candidate_before(last, q->candidates[(i - 1) / 2]))
+    candidate_sift_up(q, i);
+  else
+    candidate_sift_down(q, i);
 }
 
-static void candidate_unqueue(struct rhizome_fetch_candidate *c)
+// The candidate that would be fetched last, which is always one of the leaves of the heap.
+static struct rhizome_fetch_candidate *candidate_last(const struct rhizome_fetch_queue *q)
 {
+  struct rhizome_fetch_candidate *last = NULL;
   unsigned i;
-  for (i = 0; i < NQUEUES; ++i) {
-    struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
-    unsigned index = c - q->candidate_queue;
-    if (index < q->candidate_queue_size){
-      rhizome_fetch_unqueue(q, index);
-      return;
-    }
+  for (i = q->candidate_count / 2; i < q->candidate_count; ++i)
+    if (!last || candidate_before(last, q->candidates[i]))
+      last = q->candidates[i];
+  return last;
+}
+
+/* Add a candidate for the given manifest to a queue, growing the queue if necessary.  Returns NULL
+ * if out of memory, otherwise the queue takes responsibility for freeing the manifest.
+ */
+static struct rhizome_fetch_candidate *rhizome_fetch_insert(struct rhizome_fetch_queue *q, rhizome_manifest *m)
+{
+  if (q->candidate_count >= q->candidate_capacity){
+    unsigned capacity = q->candidate_capacity ? q->candidate_capacity * 2 : 16;
+    struct rhizome_fetch_candidate **candidates = erealloc(q->candidates, capacity * sizeof(struct rhizome_fetch_candidate *));
+    if (!candidates)
+      return NULL;
+    q->candidates = candidates;
+    q->candidate_capacity = capacity;
   }
+  struct rhizome_fetch_candidate *c = emalloc_zero(sizeof(struct rhizome_fetch_candidate));
+  if (!c)
+    return NULL;
+  c->manifest = m;
+  c->_queue = q;
+  c->_sequence = candidate_sequence++;
+  candidate_push(q, c);
+  DEBUGF(rhizome_rx, "insert queue[%d] candidate[%u] of %u", (int)(q - rhizome_fetch_queues), c->_index, q->candidate_count);
+  return c;
+}
+
+/* Remove the given candidate from its queue.  If the candidate points to a manifest structure, then
+ * frees the manifest.
+ */
+static void rhizome_fetch_unqueue(struct rhizome_fetch_candidate *c)
+{
+  DEBUGF(rhizome_rx, "unqueue queue[%d] candidate[%u] manifest=%p", (int)(c->_queue - rhizome_fetch_queues), c->_index, c->manifest);
+  candidate_remove(c);
+  if (c->manifest)
+    rhizome_manifest_free(c->manifest);
+  free(c);
 }
 
 /* Return true if there are any active fetches currently in progress.
@@ -378,10 +503,11 @@ static void candidate_unqueue(struct rhizome_fetch_candidate *c)
  */
 int rhizome_any_fetch_active()
 {
-  unsigned i;
+  unsigned i, j;
   for (i = 0; i < NQUEUES; ++i)
-    if (rhizome_fetch_queues[i].active.state != RHIZOME_FETCH_FREE)
-      return 1;
+    for (j = 0; j < RHIZOME_FETCH_MAX_SLOTS; ++j)
+      if (rhizome_fetch_queues[i].slots[j].state != RHIZOME_FETCH_FREE)
+	return 1;
   return 0;
 }
 
@@ -393,7 +519,7 @@ int rhizome_any_fetch_queued()
 {
   unsigned i;
   for (i = 0; i < NQUEUES; ++i)
-    if (rhizome_fetch_queues[i].candidate_queue[0].manifest)
+    if (rhizome_fetch_queues[i].candidate_count)
       return 1;
   return 0;
 }
@@ -721,13 +847,15 @@ rhizome_fetch(struct rhizome_fetch_slot *slot, rhizome_manifest *m,
       }
     }
   }
-  unsigned i;
+  unsigned i, j;
   for (i = 0; i < NQUEUES; ++i) {
-    struct rhizome_fetch_slot *as = &rhizome_fetch_queues[i].active;
-    const rhizome_manifest *am = as->manifest;
-    if (as->state != RHIZOME_FETCH_FREE && cmp_rhizome_filehash_t(&m->filehash, &am->filehash) == 0) {
-      DEBUGF(rhizome_rx, "   fetch already in progress, slot=%d filehash=%s", i, alloca_tohex_rhizome_filehash_t(m->filehash));
-      RETURN(SAMEPAYLOAD);
+    for (j = 0; j < RHIZOME_FETCH_MAX_SLOTS; ++j) {
+      struct rhizome_fetch_slot *as = &rhizome_fetch_queues[i].slots[j];
+      const rhizome_manifest *am = as->manifest;
+      if (as->state != RHIZOME_FETCH_FREE && am && cmp_rhizome_filehash_t(&m->filehash, &am->filehash) == 0) {
+	DEBUGF(rhizome_rx, "   fetch already in progress, slot=%d filehash=%s", slotno(as), alloca_tohex_rhizome_filehash_t(m->filehash));
+	RETURN(SAMEPAYLOAD);
+      }
     }
   }
 
@@ -782,8 +910,8 @@ rhizome_fetch_request_manifest_by_prefix(const struct socket_address *addr,
   return schedule_fetch(slot);
 }
 
-/* Activate the next fetch for the given slot.  This takes the next job from the head of the slot's
- * own queue.  If there is none, then takes jobs from other queues.
+/* Activate the next fetch for the given slot.  This takes the smallest candidate from the slot's
+ * own queue.  If there is none, then takes jobs from the queues of smaller payloads.
  *
  * @author Andrew Bettison <andrew@servalproject.com>
  */
@@ -791,18 +919,23 @@ static void rhizome_start_next_queued_fetch(struct rhizome_fetch_slot *slot)
 {
   IN();
   struct rhizome_fetch_queue *q;
-  for (q = (struct rhizome_fetch_queue *) slot; q >= rhizome_fetch_queues; --q) {
-    unsigned i = 0;
-    struct rhizome_fetch_candidate *c;
-    while (i < q->candidate_queue_size && (c = &q->candidate_queue[i])->manifest) {
+  int finished = 0;
+  for (q = slot_queue(slot); !finished && q >= rhizome_fetch_queues; --q) {
+    // Try the candidates smallest first, by taking each from the top of the heap.  Those waiting
+    // for the fetch of an older version are set aside, then put back once this queue is done.
+    struct rhizome_fetch_candidate *parked = NULL;
+    while (!finished && q->candidate_count) {
+      struct rhizome_fetch_candidate *c = q->candidates[0];
       int result = rhizome_fetch(slot, c->manifest, &c->addr, c->peer);
       switch (result) {
       case SLOTBUSY:
-	OUT(); return;
+	finished = 1;
+	break;
       case STARTED:
 	c->manifest = NULL;
-	rhizome_fetch_unqueue(q, i);
-	OUT(); return;
+	rhizome_fetch_unqueue(c);
+	finished = 1;
+	break;
       case IMPORTED:
       case SAMEBUNDLE:
       case SAMEPAYLOAD:
@@ -811,15 +944,22 @@ static void rhizome_start_next_queued_fetch(struct rhizome_fetch_slot *slot)
       case NEWERBUNDLE:
       default:
 	// Discard the candidate fetch and loop to try the next in queue.
-	rhizome_fetch_unqueue(q, i);
+	rhizome_fetch_unqueue(c);
 	break;
       case OLDERBUNDLE:
 	// Do not un-queue, so that when the fetch of the older bundle finishes, we will start
 	// fetching a newer one.
-	++i;
+	candidate_remove(c);
+	c->_parked_next = parked;
+	parked = c;
 	break;
       }
     }
+    while (parked) {
+      struct rhizome_fetch_candidate *c = parked;
+      parked = c->_parked_next;
+      candidate_push(q, c);
+    }
   }
   OUT();
 }
@@ -832,24 +972,28 @@ static void rhizome_start_next_queued_fetches(struct sched_ent *alarm)
 {
   IN();
   assert(alarm == &sched_activate);
-  unsigned i;
-  for (i = 0; i < NQUEUES; ++i)
-    rhizome_start_next_queued_fetch(&rhizome_fetch_queues[i].active);
+  unsigned i, j;
+  for (i = 0; i < NQUEUES; ++i) {
+    struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
+    unsigned n = queue_slots(q);
+    for (j = 0; j < n; ++j)
+      if (q->slots[j].state == RHIZOME_FETCH_FREE)
+	rhizome_start_next_queued_fetch(&q->slots[j]);
+  }
   OUT();
 }
 
-/* Do we have space to add a fetch candidate of this size? */
+/* Do we have space to add a fetch candidate of this size?  A full queue still has space for a
+ * payload that is certainly smaller than its last candidate, which would be dropped to make room.
+ */
 int rhizome_fetch_has_queue_space(unsigned char log2_size){
   struct rhizome_fetch_queue *q = rhizome_find_queue(log2_size);
-  if (q){
-    // is there an empty candidate?
-    unsigned j;
-    for (j=0;j < q->candidate_queue_size;j++)
-      if (!q->candidate_queue[j].manifest)
-	return 1;
+  if (!q)
     return 0;
-  }
-  return 0;
+  if (q->candidate_count < config.rhizome.fetch_queue_limit)
+    return 1;
+  struct rhizome_fetch_candidate *last = candidate_last(q);
+  return last && log2ll(last->manifest->filesize) > log2_size;
 }
 
 /* Queue a fetch for the payload of the given manifest.  If 'addr' is not NULL, then it is used as
@@ -857,9 +1001,12 @@ int rhizome_fetch_has_queue_space(unsigned char log2_size){
  * is performed over MDP.
  *
  * If the fetch cannot be queued for any reason (error, queue full, no suitable queue) then the
- * manifest is freed and returns -1.  Otherwise, the pointer to the manifest is stored in the queue
+ * manifest is freed and returns -1, or 1 if the queue has reached rhizome.fetch_queue_limit.  Otherwise, the pointer to the manifest is stored in the queue
  * entry and the manifest is freed when the fetch has completed or is abandoned for any reason.
  *
+ * A full queue only turns away a candidate that would be fetched after all of its others.  A
+ * smaller payload takes the place of the queue's last candidate, which is dropped.
+ *
  * Verifies manifests as late as possible to avoid wasting time.
  *
  * This function does not activate any fetches, it just queues the fetch candidates and sets an
@@ -915,37 +1062,35 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
   // Search all the queues for the same manifest (it could be in any queue because its payload size
   // may have changed between versions.) If a newer or the same version is already queued, then
   // ignore this one.  Otherwise, unqueue all older candidates.
-  int ci = -1;
-  unsigned i;
-  for (i = 0; i < NQUEUES; ++i) {
-    struct rhizome_fetch_queue *q = &rhizome_fetch_queues[i];
-    unsigned j;
-    for (j = 0; j < q->candidate_queue_size; ) {
-      struct rhizome_fetch_candidate *c = &q->candidate_queue[j];
-      if (!c->manifest){
-	if (ci == -1 && q == qi)
-	  ci = j;
-	break;
-      }
-      
-      if (cmp_rhizome_bid_t(&m->keypair.public_key, &c->manifest->keypair.public_key) == 0) {
-	if (c->manifest->version >= m->version) {
-	  rhizome_manifest_free(m);
-	  RETURN(0);
-	}
-	rhizome_fetch_unqueue(q, j);
-      }else
-	j++;
+  struct rhizome_fetch_candidate *c = fetch_search_candidate(m->keypair.public_key.binary, sizeof m->keypair.public_key.binary);
+  if (c) {
+    if (c->manifest->version >= m->version) {
+      rhizome_manifest_free(m);
+      RETURN(0);
     }
+    rhizome_fetch_unqueue(c);
   }
-  // No duplicate was found, so if no free queue place was found either then bail out.
-  if (ci == -1) {
-    rhizome_manifest_free(m);
-    RETURN(1);
+  // No duplicate was found, so if the queue is already full then drop its last candidate to make
+  // room, or bail out if this one would come after it anyway.  Candidates of the same size are
+  // fetched in the order they arrived, so this one only goes ahead of a larger payload.
+  if (qi->candidate_count >= config.rhizome.fetch_queue_limit) {
+    struct rhizome_fetch_candidate *last = candidate_last(qi);
+    if (!last || last->manifest->filesize <= m->filesize) {
+      DEBUGF(rhizome_rx, "   fetch queue %d is full", (int)(qi - rhizome_fetch_queues));
+      rhizome_manifest_free(m);
+      RETURN(1);
+    }
+    DEBUGF(rhizome_rx, "   fetch queue %d is full, dropping bid=%s size=%"PRIu64,
+	   (int)(qi - rhizome_fetch_queues),
+	   alloca_tohex_rhizome_bid_t(last->manifest->keypair.public_key), last->manifest->filesize);
+    rhizome_fetch_unqueue(last);
   }
 
-  struct rhizome_fetch_candidate *c = rhizome_fetch_insert(qi, ci);
-  c->manifest = m;
+  c = rhizome_fetch_insert(qi, m);
+  if (!c) {
+    rhizome_manifest_free(m);
+    RETURN(-1);
+  }
   c->addr = *addr;
   c->peer = peer;
 
@@ -1012,34 +1157,90 @@ static void rhizome_fetch_mdp_slot_callback(struct sched_ent *alarm)
   DEBUGF(rhizome_rx, "Timeout: Resending request for slot=0x%p (%"PRIu64" of %"PRIu64" received)",
 	  slot, slot->write_state.file_offset,
 	  slot->write_state.file_length);
+  if (config.rhizome.mdp.adaptive && slot->mdpResponsesOutstanding > 0){
+    // some of the blocks we asked for never arrived, so back off; halve the window, and once it
+    // can't get any smaller, try smaller blocks (which are more likely to survive a lossy link)
+    if (slot->mdpWindow > 1){
+      slot->mdpWindow /= 2;
+    }else if (slot->mdpRXBlockLength > MDP_REQUEST_MIN_BLOCK_LENGTH){
+      slot->mdpRXBlockLength /= 2;
+      if (slot->mdpRXBlockLength < MDP_REQUEST_MIN_BLOCK_LENGTH)
+	slot->mdpRXBlockLength = MDP_REQUEST_MIN_BLOCK_LENGTH;
+    }
+    slot->mdpWindowThreshold = slot->mdpWindow;
+    DEBUGF(rhizome_rx, "Lost %d blocks, window=%u, block length=%d",
+	   slot->mdpResponsesOutstanding, slot->mdpWindow, slot->mdpRXBlockLength);
+  }
   rhizome_fetch_mdp_requestblocks(slot);
   OUT();
 }
 
 static int rhizome_fetch_mdp_touch_timeout(struct rhizome_fetch_slot *slot)
 {
-  // 266ms @ 1mbit (WiFi broadcast speed) = 32x1024 byte packets.
-  // But on a packet radio interface at perhaps 50kbit, this is clearly
-  // a bad policy.  Ideally we should know about the interface speed
-  // and adjust behaviour accordingly. Also the packet size should be smaller
-  // on lossy links.  1K packets seem to get through only very rarely.
-  // For now, we will just make the timeout 1 second from the time of the last
-  // received block.
+  // Without a round trip time measurement, give up waiting for the rest of the requested blocks
+  // (by default) 1 second after the last one was received.  Once the round trip time is known,
+  // wait a little longer than that, like TCP's retransmission timer.
+  time_ms_t timeout = config.rhizome.mdp.stall_timeout;
+  if (config.rhizome.mdp.adaptive && slot->mdpRTTSampled){
+    time_ms_t rto = 2 * slot->mdpRTT + 4 * slot->mdpRTTVar;
+    if (rto < MDP_REQUEST_MIN_TIMEOUT)
+      rto = MDP_REQUEST_MIN_TIMEOUT;
+    if (rto < timeout)
+      timeout = rto;
+  }
   unschedule(&slot->alarm);
-  slot->alarm.alarm=gettime_ms()+config.rhizome.mdp.stall_timeout;
+  slot->alarm.alarm=gettime_ms()+timeout;
   slot->alarm.deadline=slot->alarm.alarm+500;
   schedule(&slot->alarm);
   return 0;
 }
 
+// Called for each block received in response to our last request; measures the round trip time to
+// the first block that was not requested before (Karn's rule; a block that was asked for again
+// might be answering either request), and opens the request window once every requested block has
+// arrived.
+static void rhizome_fetch_mdp_received_block(struct rhizome_fetch_slot *slot, uint64_t offset)
+{
+  if (offset < slot->mdp_last_request_offset)
+    return;
+  time_ms_t now = gettime_ms();
+  if (!slot->mdpRTTSampled && offset >= slot->mdp_rtt_sample_offset){
+    time_ms_t sample = now - slot->mdp_last_request_time;
+    if (slot->mdpRTT == 0 && slot->mdpRTTVar == 0){
+      slot->mdpRTT = sample;
+      slot->mdpRTTVar = sample / 2;
+    }else{
+      time_ms_t delta = slot->mdpRTT > sample ? slot->mdpRTT - sample : sample - slot->mdpRTT;
+      slot->mdpRTTVar = (3 * slot->mdpRTTVar + delta) / 4;
+      slot->mdpRTT = (7 * slot->mdpRTT + sample) / 8;
+    }
+    slot->mdpRTTSampled = 1;
+  }
+  if (--slot->mdpResponsesOutstanding != 0 || !config.rhizome.mdp.adaptive)
+    return;
+  // no loss, so grow the window, exponentially at first, then linearly, and once the window is
+  // fully open, grow the blocks back towards the largest that servers will send
+  if (slot->mdpWindow < slot->mdpWindowThreshold)
+    slot->mdpWindow *= 2;
+  else
+    slot->mdpWindow++;
+  if (slot->mdpWindow > MDP_REQUEST_MAX_BLOCKS){
+    slot->mdpWindow = MDP_REQUEST_MAX_BLOCKS;
+    if (slot->mdpRXBlockLength < MDP_REQUEST_MAX_BLOCK_LENGTH){
+      slot->mdpRXBlockLength *= 2;
+      if (slot->mdpRXBlockLength > MDP_REQUEST_MAX_BLOCK_LENGTH)
+	slot->mdpRXBlockLength = MDP_REQUEST_MAX_BLOCK_LENGTH;
+    }
+  }
+}
+
 static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
 {
   IN();
-  // only issue new requests every 133ms.  
-  // we automatically re-issue once we have received all packets in this
-  // request also, so if there is no packet loss, we can go substantially
-  // faster.  Optimising behaviour when there is no packet loss is an
-  // outstanding task.
+  // Ask for the next window of blocks we don't have yet.  We automatically re-issue once we have
+  // received all the blocks in this request, otherwise when the request times out.  In adaptive
+  // mode the window is less than the 32 blocks a request can describe (the blocks beyond it are
+  // marked as already received), and grows or shrinks with loss.
   
   struct internal_mdp_header header;
   bzero(&header, sizeof header);
@@ -1055,18 +1256,23 @@ static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
   ob_append_bytes(payload, slot->bid.binary, sizeof slot->bid.binary);
   
   uint32_t bitmap=0;
-  int requests=32;
-  int i;
+  int requests=0;
+  uint64_t requested_end=0;
+  unsigned i;
   struct rhizome_write_buffer *p = slot->write_state.buffer_list;
   uint64_t offset = slot->write_state.file_offset;
-  for (i=0;i<32;i++){
-    while(p && p->offset + p->data_size < offset)
-      p=p->_next;
-    if (!p)
-      break;
-    if (p->offset <= offset && p->offset+p->data_size >= offset+slot->mdpRXBlockLength){
+  for (i=0;i<MDP_REQUEST_MAX_BLOCKS;i++){
+    if (i >= slot->mdpWindow || offset >= slot->write_state.file_length){
       bitmap |= 1<<(31-i);
-      requests --;
+    }else{
+      while(p && p->offset + p->data_size < offset)
+	p=p->_next;
+      if (p && p->offset <= offset && p->offset+p->data_size >= offset+slot->mdpRXBlockLength)
+	bitmap |= 1<<(31-i);
+      else{
+	requests++;
+	requested_end = offset + slot->mdpRXBlockLength;
+      }
     }
     offset+=slot->mdpRXBlockLength;
   }
@@ -1076,11 +1282,14 @@ static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
   ob_append_ui32_rv(payload, bitmap);
   ob_append_ui16_rv(payload, slot->mdpRXBlockLength);
   
-  DEBUGF(rhizome_tx, "src sid=%s, dst sid=%s, mdpRXWindowStart=0x%"PRIx64", slot->bidVersion=0x%"PRIx64,
+  DEBUGF(rhizome_tx, "src sid=%s, dst sid=%s, mdpRXWindowStart=0x%"PRIx64", slot->bidVersion=0x%"PRIx64", window=%u, blockLength=%d, rtt=%"PRId64"ms",
 	 alloca_tohex_sid_t(header.source->sid),
 	 alloca_tohex_sid_t(header.destination->sid),
 	 slot->write_state.file_offset,
-	 slot->bidVersion);
+	 slot->bidVersion,
+	 slot->mdpWindow,
+	 slot->mdpRXBlockLength,
+	 slot->mdpRTT);
   
   ob_flip(payload);
   overlay_send_frame(&header, payload);
@@ -1091,6 +1300,10 @@ static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
   slot->mdpResponsesOutstanding=requests;
   slot->mdp_last_request_offset = slot->write_state.file_offset;
   slot->mdp_last_request_time = gettime_ms();
+  slot->mdpRTTSampled = 0;
+  slot->mdp_rtt_sample_offset = slot->mdp_requested_end;
+  if (requested_end > slot->mdp_requested_end)
+    slot->mdp_requested_end = requested_end;
   
   rhizome_fetch_mdp_touch_timeout(slot);
   
@@ -1188,6 +1401,17 @@ static enum rhizome_start_fetch_result rhizome_fetch_switch_to_mdp(struct rhizom
     slot->mdpIdleTimeout *= 1+(q - rhizome_fetch_queues);
   
   slot->mdpRXBlockLength = config.rhizome.mdp.block_size; // Rhizome over MDP block size
+  if (slot->mdpRXBlockLength > MDP_REQUEST_MAX_BLOCK_LENGTH)
+    slot->mdpRXBlockLength = MDP_REQUEST_MAX_BLOCK_LENGTH;
+  slot->mdpRTT = slot->mdpRTTVar = 0;
+  slot->mdp_requested_end = slot->mdp_rtt_sample_offset = 0;
+  if (config.rhizome.mdp.adaptive){
+    // start small, and quickly open the window while nothing is lost
+    slot->mdpWindow = 4;
+    slot->mdpWindowThreshold = MDP_REQUEST_MAX_BLOCKS;
+  }else{
+    slot->mdpWindow = slot->mdpWindowThreshold = MDP_REQUEST_MAX_BLOCKS;
+  }
   rhizome_fetch_mdp_requestblocks(slot);
 
   RETURN(STARTED);
@@ -1263,9 +1487,8 @@ static int rhizome_write_complete(struct rhizome_fetch_slot *slot)
        call schedule queued items. */
     rhizome_manifest *m = rhizome_new_manifest();
     if (m) {
-      memcpy(m->manifestdata, slot->manifest_buffer, (size_t)slot->manifest_bytes);
-      m->manifest_all_bytes = (size_t)slot->manifest_bytes;
-      if (   rhizome_manifest_parse(m) == -1
+      if (   rhizome_manifest_copy_data(m, slot->manifest_buffer, (size_t)slot->manifest_bytes) == -1
+	  || rhizome_manifest_parse(m) == -1
 	  || !rhizome_manifest_validate(m)
       ) {
 	DEBUGF(rhizome_rx, "Couldn't read manifest");
@@ -1359,9 +1582,9 @@ int rhizome_received_content(const unsigned char *bidprefix,
     }
     
     slot->last_write_time=gettime_ms();
+    rhizome_fetch_mdp_received_block(slot, offset);
     rhizome_fetch_mdp_touch_timeout(slot);
 
-    slot->mdpResponsesOutstanding--;
     if (slot->mdpResponsesOutstanding==0) {
       // We have received all responses, so immediately ask for more
       rhizome_fetch_mdp_requestblocks(slot);
@@ -1391,7 +1614,7 @@ int rhizome_received_content(const unsigned char *bidprefix,
 	  INFOF("Completed MDP transfer in one hit for file %s",
 	      alloca_tohex_rhizome_filehash_t(m->filehash));
 	if (c)
-	  candidate_unqueue(c);
+	  rhizome_fetch_unqueue(c);
       }
       
       if (slot)
@@ -147,8 +147,9 @@ uint64_t rhizome_bar_bidprefix_ll(const rhizome_bar_t *bar)
 
 /* Queue an advertisment for a single manifest */
 int rhizome_advertise_manifest(struct subscriber *dest, rhizome_manifest *m){
-  struct overlay_frame *frame = malloc(sizeof(struct overlay_frame));
-  bzero(frame,sizeof(struct overlay_frame));
+  struct overlay_frame *frame = op_new();
+  if (!frame)
+    return -1;
   frame->type = OF_TYPE_RHIZOME_ADVERT;
   frame->source = get_my_subscriber(1);
   if (dest && dest->reachable&REACHABLE)
@@ -251,8 +252,8 @@ int overlay_rhizome_saw_advertisements(struct decode_context *context, struct ov
       // The manifest looks potentially interesting, so now do a full parse and validation.
       if ((m = rhizome_new_manifest()) == NULL)
 	goto next;
-      memcpy(m->manifestdata, data, manifest_length);
-      m->manifest_all_bytes = manifest_length;
+      if (rhizome_manifest_copy_data(m, data, manifest_length) == -1)
+	goto next;
       if (   rhizome_manifest_parse(m) == -1
 	  || !rhizome_manifest_validate(m)
       ) {
@@ -30,9 +30,11 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 DEFINE_FEATURE(http_rest_rhizome);
 
 DECLARE_HANDLER("/restful/rhizome/bundlelist.json", restful_rhizome_bundlelist_json);
+DECLARE_HANDLER("/restful/rhizome/fetchqueues.json", restful_rhizome_fetchqueues_json);
 DECLARE_HANDLER("/restful/rhizome/newsince/", restful_rhizome_newsince);
 DECLARE_HANDLER("/restful/rhizome/insert", restful_rhizome_insert);
 DECLARE_HANDLER("/restful/rhizome/import", restful_rhizome_import);
+DECLARE_HANDLER("/restful/rhizome/bulkimport", restful_rhizome_bulkimport);
 DECLARE_HANDLER("/restful/rhizome/append", restful_rhizome_append);
 DECLARE_HANDLER("/restful/rhizome/", restful_rhizome_);
 
@@ -53,6 +55,22 @@ static void finalise_union_rhizome_insert(httpd_request *r)
     rhizome_fail_write(&r->u.insert.write);
 }
 
+static void finalise_union_rhizome_bulkimport(httpd_request *r)
+{
+  form_buf_malloc_release(&r->u.bulk_import.manifest);
+  form_buf_malloc_release(&r->u.bulk_import.payload);
+  if (r->u.bulk_import.pending)
+    rhizome_manifest_free(r->u.bulk_import.pending);
+  r->u.bulk_import.pending = NULL;
+  unschedule(&r->u.bulk_import.flush_alarm);
+  if (r->u.bulk_import.bulk) {
+    // a request that did not reach the end of its content stores nothing more
+    rhizome_bulk_import_release(r->u.bulk_import.bulk);
+    free(r->u.bulk_import.bulk);
+    r->u.bulk_import.bulk = NULL;
+  }
+}
+
 static void finalise_union_rhizome_list(httpd_request *r)
 {
   if (r->u.rhlist.cursor.service)
@@ -249,6 +267,7 @@ static int restful_rhizome_bundlelist_json(httpd_request *r, const char *remaind
   if (r->http.verb != HTTP_VERB_GET)
     return 405;
   bzero(&r->u.rhlist.cursor, sizeof r->u.rhlist.cursor);
+  r->u.rhlist.cursor.columns_only = 1;
   return restful_open_cursor(r);
 }
 
@@ -279,6 +298,7 @@ static int restful_rhizome_newsince(httpd_request *r, const char *remainder)
   bzero(&r->u.rhlist.cursor, sizeof r->u.rhlist.cursor);
   r->u.rhlist.cursor.rowid_since = rowid;
   r->u.rhlist.cursor.oldest_first = 1;
+  r->u.rhlist.cursor.columns_only = 1;
   r->u.rhlist.end_time = gettime_ms() + config.api.restful.newsince_timeout * 1000;
   r->trigger_rhizome_bundle_added = on_rhizome_bundle_added;
   return restful_open_cursor(r);
@@ -415,6 +435,89 @@ static int restful_rhizome_bundlelist_json_content_chunk(struct http_request *hr
   abort();
 }
 
+static HTTP_CONTENT_GENERATOR restful_rhizome_fetchqueues_json_content;
+
+static int restful_rhizome_fetchqueues_json(httpd_request *r, const char *remainder)
+{
+  r->http.response.header.content_type = &CONTENT_TYPE_JSON;
+  if (!is_rhizome_http_enabled())
+    return 404;
+  int ret = authorize_restful(&r->http);
+  if (ret)
+    return ret;
+  if (*remainder)
+    return 404;
+  if (r->http.verb != HTTP_VERB_GET)
+    return 405;
+  r->u.fetchqueuelist.phase = LIST_HEADER;
+  r->u.fetchqueuelist.index = 0;
+  http_request_response_generated(&r->http, 200, &CONTENT_TYPE_JSON, restful_rhizome_fetchqueues_json_content);
+  return 1;
+}
+
+static HTTP_CONTENT_GENERATOR_STRBUF_CHUNKER restful_rhizome_fetchqueues_json_content_chunk;
+
+static int restful_rhizome_fetchqueues_json_content(struct http_request *hr, unsigned char *buf, size_t bufsz, struct http_content_generator_result *result)
+{
+  return generate_http_content_from_strbuf_chunks(hr, (char *)buf, bufsz, result, restful_rhizome_fetchqueues_json_content_chunk);
+}
+
+static int restful_rhizome_fetchqueues_json_content_chunk(struct http_request *hr, strbuf b)
+{
+  httpd_request *r = (httpd_request *) hr;
+  const char *headers[] = {
+    "max_size",
+    "slots",
+    "active",
+    "candidates",
+    "candidate_bytes"
+  };
+  struct rhizome_fetch_queue_status status;
+  switch (r->u.fetchqueuelist.phase) {
+    case LIST_HEADER:
+      strbuf_puts(b, "{\n\"header\":[");
+      unsigned i;
+      for (i = 0; i != NELS(headers); ++i) {
+	if (i)
+	  strbuf_putc(b, ',');
+	strbuf_json_string(b, headers[i]);
+      }
+      strbuf_puts(b, "],\n\"rows\":[");
+      if (!strbuf_overrun(b))
+	r->u.fetchqueuelist.phase = LIST_FIRST;
+      return 1;
+
+    case LIST_ROWS:
+    case LIST_FIRST:
+      if (!rhizome_fetch_queue_status(r->u.fetchqueuelist.index, &status)) {
+	r->u.fetchqueuelist.phase = LIST_END;
+	return 1;
+      }
+      if (r->u.fetchqueuelist.phase == LIST_ROWS)
+	strbuf_putc(b, ',');
+      strbuf_puts(b, "\n[");
+      if (status.max_size)
+	strbuf_sprintf(b, "%"PRIu64, status.max_size);
+      else
+	strbuf_json_null(b);
+      strbuf_sprintf(b, ",%u,%u,%u,%"PRIu64"]", status.slots, status.active, status.candidates, status.candidate_bytes);
+      if (!strbuf_overrun(b)) {
+	r->u.fetchqueuelist.phase = LIST_ROWS;
+	++r->u.fetchqueuelist.index;
+      }
+      return 1;
+
+    case LIST_END:
+      strbuf_puts(b, "\n]\n}\n");
+      if (!strbuf_overrun(b))
+	r->u.fetchqueuelist.phase = LIST_DONE;
+      // fall through...
+    case LIST_DONE:
+      return 0;
+  }
+  abort();
+}
+
 static HTTP_REQUEST_PARSER restful_rhizome_insert_end;
 static int insert_mime_part_start(struct http_request *);
 static int insert_mime_part_end(struct http_request *);
@@ -532,9 +635,8 @@ static int insert_make_manifest(httpd_request *r)
     return http_response_form_part(r, 400, "Missing", PART_MANIFEST, NULL, 0);
   if ((r->manifest = rhizome_new_manifest()) == NULL)
     return http_request_rhizome_response(r, 429, "Manifest table full"); // Too Many Requests
-  assert(r->u.insert.manifest.length <= sizeof r->manifest->manifestdata);
-  memcpy(r->manifest->manifestdata, r->u.insert.manifest.buffer, r->u.insert.manifest.length);
-  r->manifest->manifest_all_bytes = r->u.insert.manifest.length;
+  if (rhizome_manifest_copy_data(r->manifest, r->u.insert.manifest.buffer, r->u.insert.manifest.length) == -1)
+    return http_request_rhizome_response(r, 500, "Internal Error: Out of memory");
   int n = rhizome_manifest_parse(r->manifest);
   switch (n) {
     case 0:
@@ -936,6 +1038,193 @@ static int restful_rhizome_insert_end(struct http_request *hr)
   return 0;
 }
 
+/* The bulk import request body is a sequence of "manifest" parts, each followed by a "payload" part
+ * unless the payload is empty or already in the store.  The bundles are stored in batches as they
+ * arrive, so that a whole archive can be sent in one request, and the response gives the number of
+ * bundles in each outcome rather than a status for each one.  Payloads are held in memory until
+ * their batch is stored, so they are limited in size; larger bundles must use
+ * /restful/rhizome/import.
+ */
+#define RHIZOME_BULK_MAX_PAYLOAD (1024 * 1024)
+
+static int bulkimport_mime_part_start(struct http_request *);
+static int bulkimport_mime_part_header(struct http_request *, const struct mime_part_headers *);
+static int bulkimport_mime_part_body(struct http_request *, char *, size_t);
+static int bulkimport_mime_part_end(struct http_request *);
+static int restful_rhizome_bulkimport_end(struct http_request *);
+static void bulkimport_flush_step(struct sched_ent *);
+
+static struct profile_total bulkimport_flush_stats = { .name="bulkimport_flush_step" };
+
+static int restful_rhizome_bulkimport(httpd_request *r, const char *remainder)
+{
+  r->http.response.header.content_type = &CONTENT_TYPE_JSON;
+  if (!is_rhizome_http_enabled())
+    return 404;
+  int ret = authorize_restful(&r->http);
+  if (ret)
+    return ret;
+  if (*remainder)
+    return 404;
+  if (r->http.verb != HTTP_VERB_POST)
+    return 405;
+  assert(r->u.bulk_import.current_part == NULL);
+  assert(r->u.bulk_import.pending == NULL);
+  if ((r->u.bulk_import.bulk = emalloc_zero(sizeof *r->u.bulk_import.bulk)) == NULL)
+    return 500;
+  r->u.bulk_import.flush_alarm.function = bulkimport_flush_step;
+  r->u.bulk_import.flush_alarm.stats = &bulkimport_flush_stats;
+  r->u.bulk_import.flush_alarm.context = r;
+  r->u.bulk_import.flush_alarm.poll.fd = -1;
+  r->finalise_union = finalise_union_rhizome_bulkimport;
+  r->http.form_data.handle_mime_part_start = bulkimport_mime_part_start;
+  r->http.form_data.handle_mime_part_end = bulkimport_mime_part_end;
+  r->http.form_data.handle_mime_part_header = bulkimport_mime_part_header;
+  r->http.form_data.handle_mime_body = bulkimport_mime_part_body;
+  r->http.handle_content_end = restful_rhizome_bulkimport_end;
+  return 1;
+}
+
+static int bulkimport_mime_part_start(struct http_request *hr)
+{
+  httpd_request *r = (httpd_request *) hr;
+  assert(r->u.bulk_import.current_part == NULL);
+  return 0;
+}
+
+/* Store the current batch a few bundles at a time from an alarm, so that other clients and the
+ * overlay are not held up for the whole batch, and receive no more of the request until it is done.
+ */
+static void bulkimport_start_flush(httpd_request *r)
+{
+  http_request_pause_receive(&r->http);
+  time_ms_t now = gettime_ms();
+  RESCHEDULE(&r->u.bulk_import.flush_alarm, now, now, now);
+}
+
+static void bulkimport_flush_step(struct sched_ent *alarm)
+{
+  httpd_request *r = alarm->context;
+  if (rhizome_bulk_import_flush_step(r->u.bulk_import.bulk)) {
+    time_ms_t now = gettime_ms();
+    RESCHEDULE(alarm, now, now, now);
+  } else
+    http_request_resume_receive(&r->http); // could release the request
+}
+
+// Pass the pending manifest, and its payload if any, to the bulk import.
+static void bulkimport_add_pending(httpd_request *r)
+{
+  if (!r->u.bulk_import.pending)
+    return;
+  struct form_buf_malloc *payload = &r->u.bulk_import.payload;
+  rhizome_bulk_import_add(r->u.bulk_import.bulk, r->u.bulk_import.pending, NULL, (uint8_t *)payload->buffer, payload->length);
+  r->u.bulk_import.pending = NULL;
+  // the bulk import owns the buffer now
+  payload->buffer = NULL;
+  form_buf_malloc_release(payload);
+  if (rhizome_bulk_import_full(r->u.bulk_import.bulk))
+    bulkimport_start_flush(r);
+}
+
+static int bulkimport_mime_part_header(struct http_request *hr, const struct mime_part_headers *h)
+{
+  httpd_request *r = (httpd_request *) hr;
+  if (!h->content_disposition.type[0])
+    return http_response_content_disposition(r, 415, "Missing", h->content_disposition.type);
+  if (strcmp(h->content_disposition.type, "form-data") != 0)
+    return http_response_content_disposition(r, 415, "Unsupported", h->content_disposition.type);
+  if (strcmp(h->content_disposition.name, PART_MANIFEST) == 0) {
+    if (!mime_content_types_are_equal(&h->content_type, &CONTENT_TYPE_RHIZOME_MANIFEST))
+      return http_response_form_part(r, 415, "Unsupported Content-Type in", PART_MANIFEST, NULL, 0);
+    bulkimport_add_pending(r);
+    r->u.bulk_import.discard_payload = 0;
+    form_buf_malloc_init(&r->u.bulk_import.manifest, MAX_MANIFEST_BYTES);
+    r->u.bulk_import.current_part = PART_MANIFEST;
+  }
+  else if (strcmp(h->content_disposition.name, PART_PAYLOAD) == 0) {
+    if (!r->u.bulk_import.pending && !r->u.bulk_import.discard_payload)
+      return http_response_form_part(r, 400, "Missing", PART_MANIFEST, NULL, 0);
+    if (!r->u.bulk_import.discard_payload)
+      form_buf_malloc_init(&r->u.bulk_import.payload, RHIZOME_BULK_MAX_PAYLOAD);
+    r->u.bulk_import.current_part = PART_PAYLOAD;
+  }
+  else
+    return http_response_form_part(r, 400, "Unsupported", h->content_disposition.name, NULL, 0);
+  return 0;
+}
+
+static int bulkimport_mime_part_body(struct http_request *hr, char *buf, size_t len)
+{
+  httpd_request *r = (httpd_request *) hr;
+  if (r->u.bulk_import.current_part == PART_MANIFEST)
+    return form_buf_malloc_accumulate(r, PART_MANIFEST, &r->u.bulk_import.manifest, buf, len);
+  if (r->u.bulk_import.current_part == PART_PAYLOAD && r->u.bulk_import.discard_payload)
+    return 0;
+  if (r->u.bulk_import.current_part == PART_PAYLOAD)
+    return form_buf_malloc_accumulate(r, PART_PAYLOAD, &r->u.bulk_import.payload, buf, len);
+  FATALF("current_part = %s", alloca_str_toprint(r->u.bulk_import.current_part));
+}
+
+static int bulkimport_mime_part_end(struct http_request *hr)
+{
+  httpd_request *r = (httpd_request *) hr;
+  if (r->u.bulk_import.current_part == PART_MANIFEST) {
+    rhizome_manifest *m = rhizome_new_manifest();
+    if (!m)
+      return http_request_rhizome_response(r, 429, "Manifest table full"); // Too Many Requests
+    if (rhizome_manifest_copy_data(m, r->u.bulk_import.manifest.buffer, r->u.bulk_import.manifest.length) == -1) {
+      rhizome_manifest_free(m);
+      return http_request_rhizome_response(r, 500, "Internal Error: Out of memory");
+    }
+    form_buf_malloc_release(&r->u.bulk_import.manifest);
+    if (rhizome_manifest_parse(m) != 0) {
+      // one bad manifest does not spoil the rest of the archive
+      WARN("Bulk import: malformed manifest");
+      r->u.bulk_import.bulk->rejected++;
+      r->u.bulk_import.discard_payload = 1;
+      rhizome_manifest_free(m);
+    } else
+      r->u.bulk_import.pending = m;
+  }
+  else if (r->u.bulk_import.current_part == PART_PAYLOAD) {
+    bulkimport_add_pending(r);
+    r->u.bulk_import.discard_payload = 0;
+  }
+  else
+    FATALF("current_part = %s", alloca_str_toprint(r->u.bulk_import.current_part));
+  r->u.bulk_import.current_part = NULL;
+  return 0;
+}
+
+static int restful_rhizome_bulkimport_end(struct http_request *hr)
+{
+  httpd_request *r = (httpd_request *) hr;
+  struct rhizome_bulk_import *bulk = r->u.bulk_import.bulk;
+  bulkimport_add_pending(r);
+  if (bulk->count) {
+    // called again once the final batch is stored
+    if (!is_scheduled(&r->u.bulk_import.flush_alarm))
+      bulkimport_start_flush(r);
+    return 0;
+  }
+  r->http.response.result_extra[0].label = "rhizome_bulk_added";
+  r->http.response.result_extra[0].value.type = JSON_INTEGER;
+  r->http.response.result_extra[0].value.u.integer = bulk->added;
+  r->http.response.result_extra[1].label = "rhizome_bulk_stored";
+  r->http.response.result_extra[1].value.type = JSON_INTEGER;
+  r->http.response.result_extra[1].value.u.integer = bulk->stored;
+  r->http.response.result_extra[2].label = "rhizome_bulk_rejected";
+  r->http.response.result_extra[2].value.type = JSON_INTEGER;
+  r->http.response.result_extra[2].value.u.integer = bulk->rejected;
+  r->http.response.result_extra[3].label = "rhizome_bulk_failed";
+  r->http.response.result_extra[3].value.type = JSON_INTEGER;
+  r->http.response.result_extra[3].value.u.integer = bulk->failed;
+  uint16_t http_status = bulk->failed ? 500 : bulk->rejected ? 422 : bulk->added ? 201 : 200;
+  http_request_simple_response(&r->http, http_status, NULL);
+  return http_status;
+}
+
 static HTTP_HANDLER restful_rhizome_bid_rhm;
 static HTTP_HANDLER restful_rhizome_bid_raw_bin;
 static HTTP_HANDLER restful_rhizome_bid_decrypted_bin;
@@ -1111,21 +1400,35 @@ int rhizome_payload_content(struct http_request *hr, unsigned char *buf, size_t
   const size_t blocksz = 1 << 12;
   // Ask for a large buffer for all future reads.
   const size_t preferred_bufsz = 16 * blocksz;
-  // Reads the next part of the payload into the supplied buffer.
+  // Send at most this much straight from an external blob file at a time.
+  const size_t directsz = 256 * blocksz;
+  // Reads the next part of the payload into the supplied buffer, or if the payload is stored
+  // unencrypted in an external file, has the server send it straight from the file.
   httpd_request *r = (httpd_request *) hr;
   assert(r->u.read_state.length != RHIZOME_SIZE_UNSET);
   assert(r->u.read_state.offset < r->u.read_state.length);
   uint64_t remain = r->u.read_state.length - r->u.read_state.offset;
-  size_t readlen = bufsz;
-  if (remain <= bufsz)
-    readlen = remain;
-  else
-    readlen &= ~(blocksz - 1);
-  if (readlen > 0) {
-    ssize_t n = rhizome_read(&r->u.read_state, buf, readlen);
-    if (n == -1)
-      return -1;
-    result->generated = (size_t) n;
+  int fd;
+  uint64_t file_offset;
+  ssize_t n = rhizome_read_direct(&r->u.read_state, remain < directsz ? remain : directsz, &fd, &file_offset);
+  if (n == -1)
+    return -1;
+  if (n > 0) {
+    result->file_fd = fd;
+    result->file_offset = file_offset;
+    result->file_length = (size_t) n;
+  } else {
+    size_t readlen = bufsz;
+    if (remain <= bufsz)
+      readlen = remain;
+    else
+      readlen &= ~(blocksz - 1);
+    if (readlen > 0) {
+      n = rhizome_read(&r->u.read_state, buf, readlen);
+      if (n == -1)
+	return -1;
+      result->generated = (size_t) n;
+    }
   }
   assert(r->u.read_state.offset <= r->u.read_state.length);
   remain = r->u.read_state.length - r->u.read_state.offset;
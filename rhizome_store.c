@@ -31,6 +31,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #    define statvfs statfs
 #  endif
 #endif
+#ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+#endif
 #include "serval.h"
 #include "rhizome.h"
 #include "conf.h"
@@ -38,8 +41,6 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "numeric_str.h"
 #include "debug.h"
 
-#define RHIZOME_BUFFER_MAXIMUM_SIZE (1024*1024)
-
 uint64_t rhizome_copy_file_to_blob(int fd, uint64_t id, size_t size);
 
 #define FORM_BLOB_PATH(BUFF,SUBDIR,HASH) FORMF_RHIZOME_STORE_PATH((BUFF),"%s/%02X/%02X/%s", (SUBDIR), (HASH)->binary[0], (HASH)->binary[1], alloca_tohex(&(HASH)->binary[2], sizeof((HASH)->binary)-2))
@@ -327,7 +328,7 @@ static enum rhizome_payload_status store_make_space(uint64_t bytes, struct rhizo
       report->deleted_expired_files++;
     db_used = external_bytes + db_page_size * (db_page_count - db_free_page_count);
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
 
   if (sqlite_code_busy(stepcode))
     return RHIZOME_PAYLOAD_STATUS_BUSY;
@@ -350,6 +351,11 @@ int rhizome_store_cleanup(struct rhizome_cleanup_report *report)
   return store_make_space(0, report);
 }
 
+enum rhizome_payload_status rhizome_store_make_space(uint64_t bytes)
+{
+  return store_make_space(bytes, NULL);
+}
+
 enum rhizome_payload_status rhizome_open_write(struct rhizome_write *write, const rhizome_filehash_t *expectedHashp, uint64_t file_length)
 {
   DEBUGF(rhizome_store, "file_length=%"PRIu64, file_length);
@@ -369,7 +375,8 @@ enum rhizome_payload_status rhizome_open_write(struct rhizome_write *write, cons
     write->id_known=0;
   }
   
-  if (file_length!=RHIZOME_SIZE_UNSET){
+  // Working out the space used scans the FILES table, so a bulk import does it once per batch.
+  if (file_length!=RHIZOME_SIZE_UNSET && !rhizome_database.bulk_space_reserved){
     enum rhizome_payload_status status = store_make_space(file_length, NULL);
     if (status != RHIZOME_PAYLOAD_STATUS_NEW)
       return status;
@@ -440,7 +447,7 @@ static int write_get_lock(struct rhizome_write *write_state)
     DEBUGF(rhizome_store, "Writing to new blob file %s (fd=%d)", blob_path, write_state->blob_fd);
   }else{
     // use an explicit transaction so we can delay I/O failures until COMMIT so they can be retried.
-    if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;", END) == -1)
+    if (rhizome_transaction_begin(&retry) == -1)
       return -1;
     if (write_state->blob_rowid == 0){
       write_state->blob_rowid = rhizome_create_fileblob(&retry, write_state->temp_id, write_state->file_length);
@@ -453,7 +460,7 @@ static int write_get_lock(struct rhizome_write *write_state)
   return 0;
 
 fail:
-  sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
+  rhizome_transaction_rollback(&retry);
   return -1;
 }
 
@@ -501,8 +508,8 @@ static int write_release_lock(struct rhizome_write *write_state)
   if (write_state->sql_blob){
     ret = sqlite_blob_close(write_state->sql_blob);
     sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-    if (sqlite_exec_void_retry(&retry, "COMMIT;", END) == -1){
-      sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
+    if (rhizome_transaction_commit(&retry) == -1){
+      rhizome_transaction_rollback(&retry);
       ret=-1;
     }
     write_state->sql_blob=NULL;
@@ -844,7 +851,7 @@ enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write)
 
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
 
-  if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;", END) == -1)
+  if (rhizome_transaction_begin(&retry) == -1)
     goto dbfailure;
 
   // attempt the insert first
@@ -903,7 +910,7 @@ enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write)
   }else
     goto dbfailure;
 
-  if (sqlite_exec_void_retry(&retry, "COMMIT;", END) == -1)
+  if (rhizome_transaction_commit(&retry) == -1)
     goto dbfailure;
 
   write->blob_rowid = 0;
@@ -914,7 +921,7 @@ enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write)
   return status;
 
 dbfailure:
-  sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
+  rhizome_transaction_rollback(&retry);
   status = RHIZOME_PAYLOAD_STATUS_ERROR;
 failure:
   if (status != RHIZOME_PAYLOAD_STATUS_BUSY)
@@ -1172,15 +1179,13 @@ static ssize_t rhizome_read_retry(sqlite_retry_state *retry, struct rhizome_read
   IN();
   if (read_state->blob_fd != -1) {
     assert(read_state->offset <= read_state->length);
-    if (lseek64(read_state->blob_fd, (off64_t) read_state->offset, SEEK_SET) == -1)
-      RETURN(WHYF_perror("lseek64(%d,%"PRIu64",SEEK_SET)", read_state->blob_fd, read_state->offset));
     if (bufsz + read_state->offset > read_state->length)
       bufsz = read_state->length - read_state->offset;
     if (bufsz == 0)
       RETURN(0);
-    ssize_t rd = read(read_state->blob_fd, buffer, bufsz);
+    ssize_t rd = pread64(read_state->blob_fd, buffer, bufsz, (off64_t) read_state->offset);
     if (rd == -1)
-      RETURN(WHYF_perror("read(%d,%p,%zu)", read_state->blob_fd, buffer, bufsz));
+      RETURN(WHYF_perror("pread64(%d,%p,%zu,%"PRIu64")", read_state->blob_fd, buffer, bufsz, read_state->offset));
     DEBUGF(rhizome_store, "Read %zu bytes from fd=%d @%"PRIx64, (size_t) rd, read_state->blob_fd, read_state->offset);
     RETURN(rd);
   }
@@ -1214,6 +1219,28 @@ static ssize_t rhizome_read_retry(sqlite_retry_state *retry, struct rhizome_read
   OUT();
 }
 
+// add the next bytes of stored payload content to the running hash, returns -1 if that completes
+// the payload and the hash doesn't match
+static int rhizome_read_hash(struct rhizome_read *read_state, const unsigned char *buffer, size_t len)
+{
+  crypto_hash_sha512_update(&read_state->sha512_context, buffer, len);
+  read_state->hash_offset += len;
+  
+  // if we hash everything and the hash doesn't match, we need to delete the payload
+  if (read_state->hash_offset >= read_state->length){
+    rhizome_filehash_t hash_out;
+    crypto_hash_sha512_final(&read_state->sha512_context, hash_out.binary);
+    if (cmp_rhizome_filehash_t(&read_state->id, &hash_out) != 0) {
+      // hash failure, mark the payload as invalid
+      read_state->verified = -1;
+      return WHYF("Expected hash=%s, got %s", alloca_tohex_rhizome_filehash_t(read_state->id), alloca_tohex_rhizome_filehash_t(hash_out));
+    }
+    // we read it, and it's good. Lets remember that (not fatal if the database is locked)
+    read_state->verified = 1;
+  }
+  return 0;
+}
+
 /* Read content from the store, hashing and decrypting as we go. 
  Random access is supported, but hashing requires all payload contents to be read sequentially. */
 // returns the number of bytes read
@@ -1232,22 +1259,8 @@ ssize_t rhizome_read(struct rhizome_read *read_state, unsigned char *buffer, siz
 
   // hash the payload as we go, but only if we happen to read the payload data in order
   if (read_state->hash_offset == read_state->offset && buffer && bytes_read>0){
-    crypto_hash_sha512_update(&read_state->sha512_context, buffer, bytes_read);
-    read_state->hash_offset += bytes_read;
-    
-    // if we hash everything and the hash doesn't match, we need to delete the payload
-    if (read_state->hash_offset >= read_state->length){
-      rhizome_filehash_t hash_out;
-      crypto_hash_sha512_final(&read_state->sha512_context, hash_out.binary);
-      if (cmp_rhizome_filehash_t(&read_state->id, &hash_out) != 0) {
-	// hash failure, mark the payload as invalid
-	read_state->verified = -1;
-	RETURN(WHYF("Expected hash=%s, got %s", alloca_tohex_rhizome_filehash_t(read_state->id), alloca_tohex_rhizome_filehash_t(hash_out)));
-      }else{
-	// we read it, and it's good. Lets remember that (not fatal if the database is locked)
-	read_state->verified = 1;
-      }
-    }
+    if (rhizome_read_hash(read_state, buffer, bytes_read) == -1)
+      RETURN(-1);
   }
   
   if (read_state->crypt && buffer && bytes_read>0){
@@ -1264,10 +1277,59 @@ ssize_t rhizome_read(struct rhizome_read *read_state, unsigned char *buffer, siz
   OUT();
 }
 
+/* Skip over the next (at most) length bytes of an unencrypted payload stored in an external file,
+ * without copying them, so that the caller can send them directly from *fdp starting at *offsetp,
+ * eg, using sendfile(2).  If the payload is being read in order, the skipped bytes are still hashed
+ * by mapping them into memory, so a corrupt payload is detected before its last byte is sent.
+ *
+ * Returns the number of bytes skipped, zero if the payload cannot be read this way (the caller
+ * should use rhizome_read() instead), or -1 on error.
+ */
+ssize_t rhizome_read_direct(struct rhizome_read *read_state, size_t length, int *fdp, uint64_t *offsetp)
+{
+  IN();
+  if (read_state->verified == -1)
+    RETURN(-1);
+  if (read_state->blob_fd == -1 || read_state->crypt)
+    RETURN(0);
+  assert(read_state->length != RHIZOME_SIZE_UNSET);
+  assert(read_state->offset <= read_state->length);
+  if (length > read_state->length - read_state->offset)
+    length = read_state->length - read_state->offset;
+  if (length == 0)
+    RETURN(0);
+  if (read_state->hash_offset == read_state->offset){
+#ifdef HAVE_SYS_MMAN_H
+    uint64_t map_offset = read_state->offset & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+    if ((uint64_t)(off_t) map_offset != map_offset)
+      RETURN(0);
+    size_t skip = (size_t)(read_state->offset - map_offset);
+    void *map = mmap(NULL, skip + length, PROT_READ, MAP_SHARED, read_state->blob_fd, (off_t) map_offset);
+    if (map == MAP_FAILED){
+      WARNF_perror("mmap(%d,%zu,%"PRIu64")", read_state->blob_fd, skip + length, map_offset);
+      RETURN(0);
+    }
+    int r = rhizome_read_hash(read_state, (const unsigned char *)map + skip, length);
+    munmap(map, skip + length);
+    if (r == -1)
+      RETURN(-1);
+#else
+    RETURN(0);
+#endif
+  }
+  *fdp = read_state->blob_fd;
+  *offsetp = read_state->offset;
+  read_state->offset += length;
+  DEBUGF(rhizome_store, "Skipped %zu bytes of fd=%d @%"PRIx64, length, read_state->blob_fd, *offsetp);
+  RETURN(length);
+  OUT();
+}
+
 /* Read len bytes from read->offset into data, using *buffer to cache any reads */
 ssize_t rhizome_read_buffered(struct rhizome_read *read, struct rhizome_read_buffer *buffer, unsigned char *data, size_t len)
 {
   size_t bytes_copied=0;
+  uint64_t start_offset = read->offset;
   
   while (len>0){
     //DEBUGF(rhizome_store, "len=%zu read->length=%"PRIu64" read->offset=%"PRIu64" buffer->offset=%"PRIu64"", len, read->length, read->offset, buffer->offset);
@@ -1337,6 +1399,8 @@ ssize_t rhizome_read_buffered(struct rhizome_read *read, struct rhizome_read_buf
       return -1;
     buffer->len = (size_t) r;
   }
+  // bytes copied into the end of the data buffer did not advance the offset
+  read->offset = start_offset + bytes_copied;
   return bytes_copied;
 }
 
@@ -1369,72 +1433,104 @@ void rhizome_read_close(struct rhizome_read *read)
   read->tail = 0;
 }
 
+/* Open payloads being served to peers over MDP, so that a stream of small block requests
+ * doesn't re-open and re-seek the blob every time.  Entries are found through a small hash
+ * table keyed on BID and version, and kept on a most-recently-used list that is bounded by
+ * rhizome.mdp.cache_entries.  Each entry also buffers a window of the (decrypted) payload,
+ * which grows while the payload is being read sequentially.
+ */
+#define CACHE_HASH_BUCKETS (64)
+#define CACHE_READ_AHEAD_MAX (16 * RHIZOME_CRYPT_PAGE_SIZE)
+
 struct cache_entry{
-  struct cache_entry *_left;
-  struct cache_entry *_right;
+  struct cache_entry *_hash_next;
+  struct cache_entry *_lru_prev;
+  struct cache_entry *_lru_next;
   rhizome_bid_t bundle_id;
   uint64_t version;
   struct rhizome_read read_state;
   time_ms_t expires;
+  // buffered payload data, starting at block_offset
+  unsigned char *block;
+  uint64_t block_offset;
+  size_t block_len;
+  size_t block_size;
 };
-struct cache_entry *root;
 
-static struct cache_entry ** find_entry_location(struct cache_entry **ptr, const rhizome_bid_t *bundle_id, uint64_t version)
+static struct cache_entry *cache_buckets[CACHE_HASH_BUCKETS];
+// most recently used first; since every use extends the expiry time, the tail expires first
+static struct cache_entry *cache_head;
+static struct cache_entry *cache_tail;
+static unsigned cache_count;
+
+static struct cache_entry **cache_bucket(const rhizome_bid_t *bundle_id, uint64_t version)
 {
+  unsigned hash = (bundle_id->binary[0] | (bundle_id->binary[1] << 8)) ^ (unsigned)version ^ (unsigned)(version >> 32);
+  return &cache_buckets[hash & (CACHE_HASH_BUCKETS - 1)];
+}
+
+static struct cache_entry ** find_entry_location(const rhizome_bid_t *bundle_id, uint64_t version)
+{
+  struct cache_entry **ptr = cache_bucket(bundle_id, version);
   while(*ptr){
     struct cache_entry *entry = *ptr;
-    int cmp = cmp_rhizome_bid_t(bundle_id, &entry->bundle_id);
-    if (cmp==0){
-      if (entry->version==version)
-	break;
-      if (version < entry->version)
-	ptr = &entry->_left;
-      else
-	ptr = &entry->_right;
-      continue;
-    }
-    if (cmp<0)
-      ptr = &entry->_left;
-    else
-      ptr = &entry->_right;
+    if (entry->version == version && cmp_rhizome_bid_t(bundle_id, &entry->bundle_id) == 0)
+      break;
+    ptr = &entry->_hash_next;
   }
   return ptr;
 }
 
-static time_ms_t close_entries(struct cache_entry **entry, time_ms_t timeout)
+static void lru_unlink(struct cache_entry *entry)
 {
-  if (!*entry)
-    return 0;
-    
-  time_ms_t ret = close_entries(&(*entry)->_left, timeout);
-  time_ms_t t_right = close_entries(&(*entry)->_right, timeout);
-  if (t_right!=0 && (t_right < ret || ret==0))
-    ret=t_right;
-    
-  if ((*entry)->expires < timeout || timeout==0){
-    rhizome_read_close(&(*entry)->read_state);
-    // remember the two children
-    struct cache_entry *left=(*entry)->_left;
-    struct cache_entry *right=(*entry)->_right;
-    // free this entry
-    free(*entry);
-    // re-add both children to the tree
-    *entry=left;
-    if (right){
-      entry = find_entry_location(entry, &right->bundle_id, right->version);
-      *entry=right;
-    }
-  }else{
-    if ((*entry)->expires < ret || ret==0)
-      ret=(*entry)->expires;
-  }
-  return ret;
+  if (entry->_lru_prev)
+    entry->_lru_prev->_lru_next = entry->_lru_next;
+  else
+    cache_head = entry->_lru_next;
+  if (entry->_lru_next)
+    entry->_lru_next->_lru_prev = entry->_lru_prev;
+  else
+    cache_tail = entry->_lru_prev;
+  entry->_lru_prev = entry->_lru_next = NULL;
+}
+
+static void lru_push_head(struct cache_entry *entry)
+{
+  entry->_lru_prev = NULL;
+  entry->_lru_next = cache_head;
+  if (cache_head)
+    cache_head->_lru_prev = entry;
+  else
+    cache_tail = entry;
+  cache_head = entry;
+}
+
+static void close_entry(struct cache_entry *entry)
+{
+  struct cache_entry **ptr = find_entry_location(&entry->bundle_id, entry->version);
+  assert(*ptr == entry);
+  *ptr = entry->_hash_next;
+  lru_unlink(entry);
+  cache_count--;
+  rhizome_read_close(&entry->read_state);
+  if (entry->block)
+    free(entry->block);
+  free(entry);
+}
+
+// close entries that expire before timeout (or all entries if timeout is 0), returning the
+// expiry time of the oldest remaining entry
+static time_ms_t close_entries(time_ms_t timeout)
+{
+  while (cache_tail && (timeout == 0 || cache_tail->expires < timeout))
+    close_entry(cache_tail);
+  return cache_tail ? cache_tail->expires : 0;
 }
 
 // close any expired cache entries
 static void rhizome_cache_alarm(struct sched_ent *alarm)
 {
-  alarm->alarm = close_entries(&root, gettime_ms());
+  alarm->alarm = close_entries(gettime_ms());
   if (alarm->alarm){
     alarm->deadline = alarm->alarm + 1000;
     schedule(alarm);
@@ -1452,28 +1548,58 @@ static struct sched_ent cache_alarm={
 // close all cache entries
 int rhizome_cache_close()
 {
-  close_entries(&root, 0);
+  close_entries(0);
   unschedule(&cache_alarm);
   return 0;
 }
 
-static int _rhizome_cache_count(struct cache_entry *entry)
+int rhizome_cache_count()
 {
-  if (!entry)
-    return 0;
-  return 1+_rhizome_cache_count(entry->_left)+_rhizome_cache_count(entry->_right);
+  return cache_count;
 }
 
-int rhizome_cache_count()
+// Refill the entry's block buffer so that it contains fileOffset.  Sequential reads double the
+// read-ahead window, any other access pattern drops back to reading a single page.
+static int cache_fill_block(struct cache_entry *entry, uint64_t fileOffset)
 {
-  return _rhizome_cache_count(root);
+  size_t size = RHIZOME_CRYPT_PAGE_SIZE;
+  if (entry->block_len && fileOffset == entry->block_offset + entry->block_len){
+    size = entry->block_len * 2;
+    if (size > CACHE_READ_AHEAD_MAX)
+      size = CACHE_READ_AHEAD_MAX;
+  }
+  if (size > entry->block_size){
+    unsigned char *block = erealloc(entry->block, size);
+    if (!block)
+      return -1;
+    entry->block = block;
+    entry->block_size = size;
+  }
+  // read whole pages, so decryption and hashing work on aligned blocks
+  uint64_t read_offset = fileOffset & ~(uint64_t)(RHIZOME_CRYPT_PAGE_SIZE -1);
+  entry->block_len = 0;
+  entry->block_offset = read_offset;
+  entry->read_state.offset = read_offset;
+  size_t len = 0;
+  while (len < size){
+    ssize_t r = rhizome_read(&entry->read_state, entry->block + len, size - len);
+    if (r == -1)
+      return -1;
+    if (r == 0)
+      break;
+    len += (size_t) r;
+  }
+  entry->block_len = len;
+  DEBUGF(rhizome_store, "Cached %zu bytes of bid=%s @%"PRIu64,
+	 len, alloca_tohex_rhizome_bid_t(entry->bundle_id), read_offset);
+  return 0;
 }
 
-// read a block of data, caching meta data for reuse
+// read a block of data, caching meta data and payload contents for reuse
 ssize_t rhizome_read_cached(const rhizome_bid_t *bidp, uint64_t version, time_ms_t timeout, uint64_t fileOffset, unsigned char *buffer, size_t length)
 {
   // look for a cached entry
-  struct cache_entry **ptr = find_entry_location(&root, bidp, version);
+  struct cache_entry **ptr = find_entry_location(bidp, version);
   struct cache_entry *entry = *ptr;
   
   // if we don't have one yet, create one and open it
@@ -1506,24 +1632,52 @@ ssize_t rhizome_read_cached(const rhizome_bid_t *bidp, uint64_t version, time_ms
     }
     entry->bundle_id = *bidp;
     entry->version = version;
+    // make room by closing the least recently used payload
+    unsigned max_entries = config.rhizome.mdp.cache_entries;
+    while (cache_tail && cache_count >= max_entries)
+      close_entry(cache_tail);
+    // the bucket chain may have changed
+    ptr = find_entry_location(bidp, version);
     *ptr = entry;
+    cache_count++;
+  }else{
+    lru_unlink(entry);
   }
+  lru_push_head(entry);
   
-  entry->read_state.offset = fileOffset;
-  if (entry->read_state.length != RHIZOME_SIZE_UNSET && fileOffset >= entry->read_state.length)
-    return 0;
-  
+  // keep the list ordered by expiry time, so the alarm only needs to look at the tail
+  if (entry->_lru_next && timeout < entry->_lru_next->expires)
+    timeout = entry->_lru_next->expires;
   if (entry->expires < timeout){
     entry->expires = timeout;
     
-    if (!cache_alarm.alarm){
+    if (!is_scheduled(&cache_alarm)){
       cache_alarm.alarm = timeout;
       cache_alarm.deadline = timeout + 1000;
       schedule(&cache_alarm);
     }
   }
   
-  return rhizome_read(&entry->read_state, buffer, length);
+  if (entry->read_state.length != RHIZOME_SIZE_UNSET && fileOffset >= entry->read_state.length)
+    return 0;
+  
+  size_t copied = 0;
+  while (copied < length){
+    uint64_t offset = fileOffset + copied;
+    if (offset < entry->block_offset || offset >= entry->block_offset + entry->block_len){
+      if (cache_fill_block(entry, offset) == -1)
+	return -1;
+      if (offset >= entry->block_offset + entry->block_len)
+	break; // end of payload
+    }
+    size_t ofs = (size_t)(offset - entry->block_offset);
+    size_t size = entry->block_len - ofs;
+    if (size > length - copied)
+      size = length - copied;
+    bcopy(entry->block + ofs, buffer + copied, size);
+    copied += size;
+  }
+  return copied;
 }
 
 /* Returns -1 on error, 0 on success.
@@ -1652,7 +1806,7 @@ uint64_t rhizome_copy_file_to_blob(int fd, uint64_t id, size_t size)
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
 
   // use an explicit transaction so we can delay I/O failures until COMMIT so they can be retried.
-  if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;", END) == -1)
+  if (rhizome_transaction_begin(&retry) == -1)
     return 0;
 
   sqlite3_blob *blob = NULL;
@@ -1688,7 +1842,7 @@ uint64_t rhizome_copy_file_to_blob(int fd, uint64_t id, size_t size)
   sqlite_blob_close(blob);
   blob = NULL;
 
-  if (sqlite_exec_void_retry(&retry, "COMMIT;", END) == -1)
+  if (rhizome_transaction_commit(&retry) == -1)
     goto fail;
 
   return rowid;
@@ -1696,7 +1850,7 @@ uint64_t rhizome_copy_file_to_blob(int fd, uint64_t id, size_t size)
 fail:
   if (blob)
     sqlite_blob_close(blob);
-  sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
+  rhizome_transaction_rollback(&retry);
   return 0;
 }
 
@@ -1,4 +1,6 @@
 
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "lang.h" // for FALLTHROUGH
 #include "rhizome.h"
 #include "overlay_address.h"
@@ -14,6 +16,7 @@
 #include "overlay_interface.h"
 #include "route_link.h"
 #include "mem.h"
+#include "instance.h"
 
 #define STATE_SEND (1)
 #define STATE_REQ (2)
@@ -38,6 +41,32 @@
 
 #define REACHABLE_BIAS 2
 
+// A payload may be fetched from several neighbours at once, each one asked for a different range
+#define MAX_SOURCES (8)
+#define SOURCE_RANGE_BYTES (64*1024)
+
+struct sync_receive;
+
+struct sync_source{
+  struct sync_receive *receive;
+  // NULL if this range was abandoned by a neighbour before it was received
+  struct subscriber *peer;
+  uint64_t offset;
+  uint64_t end;
+};
+
+// A payload we are receiving, shared by the transfers of every neighbour we are fetching it from
+struct sync_receive{
+  struct sync_receive *next;
+  sync_key_t key;
+  rhizome_manifest *manifest;
+  // NULL once the payload has been received (or the write failed)
+  struct rhizome_write *write;
+  // every byte before this offset has been requested from somebody
+  uint64_t next_offset;
+  struct sync_source sources[MAX_SOURCES];
+};
+
 struct transfers{
   struct transfers *next;
   sync_key_t key;
@@ -48,6 +77,7 @@ struct transfers{
   union{
     struct rhizome_read *read;
     struct rhizome_write *write;
+    struct sync_source *source;
     rhizome_bar_t bar;
   };
 };
@@ -62,9 +92,93 @@ struct rhizome_sync_keys{
 struct sync_state *sync_tree=NULL;
 struct msp_server_state *sync_connections=NULL;
 struct transfers *completing=NULL;
+static struct sync_receive *receiving=NULL;
 
 DEFINE_ALARM(sync_send);
 
+static void sync_send_now()
+{
+  time_ms_t now = gettime_ms();
+  struct sched_ent *alarm=&ALARM_STRUCT(sync_send);
+  if (now < alarm->alarm || !is_scheduled(alarm))
+    RESCHEDULE(alarm, now, now, now);
+}
+
+static struct sync_receive *sync_receive_find(const sync_key_t *key)
+{
+  struct sync_receive *r = receiving;
+  while(r && memcmp(key, &r->key, sizeof(sync_key_t))!=0)
+    r = r->next;
+  return r;
+}
+
+static void sync_receive_free(struct sync_receive *r)
+{
+  struct sync_receive **ptr = &receiving;
+  while(*ptr != r)
+    ptr = &(*ptr)->next;
+  *ptr = r->next;
+  if (r->write){
+    rhizome_fail_write(r->write);
+    free(r->write);
+  }
+  if (r->manifest)
+    rhizome_manifest_free(r->manifest);
+  free(r);
+}
+
+// The neighbour has gone, or the transfer is finished; forget about it, and leave any range it
+// hadn't finished sending for another neighbour to pick up.
+static void sync_source_release(struct sync_source *source)
+{
+  struct sync_receive *r = source->receive;
+  source->peer = NULL;
+  unsigned i;
+  for (i=0;i<MAX_SOURCES;i++)
+    if (r->sources[i].peer)
+      return;
+  DEBUGF(rhizome_sync_keys, "No more sources for %s", alloca_sync_key(&r->key));
+  sync_receive_free(r);
+}
+
+// Choose the next range of the payload to ask this source for; first any range that another
+// neighbour abandoned, then the next range that nobody has been asked for yet.  Nothing is asked
+// for beyond what rhizome_random_write() can hold until it is written, or it would be dropped.
+// Returns 0 if there's nothing left to ask for right now.
+static int sync_source_next_range(struct sync_source *source)
+{
+  struct sync_receive *r = source->receive;
+  if (!r->write)
+    return 0;
+  unsigned i;
+  for (i=0;i<MAX_SOURCES;i++){
+    struct sync_source *abandoned = &r->sources[i];
+    if (!abandoned->peer && abandoned->offset < abandoned->end){
+      source->offset = abandoned->offset;
+      source->end = abandoned->end;
+      abandoned->offset = abandoned->end = 0;
+      return 1;
+    }
+  }
+  uint64_t end = r->write->file_length;
+  if (r->next_offset >= end)
+    return 0;
+  if (config.rhizome.fetch_sources > 1 && r->next_offset + SOURCE_RANGE_BYTES < end)
+    end = r->next_offset + SOURCE_RANGE_BYTES;
+  uint64_t limit = r->write->written_offset + RHIZOME_BUFFER_MAXIMUM_SIZE;
+  if (end > limit)
+    end = limit;
+  if (end <= r->next_offset){
+    // the buffer is full of data that could not be written yet, so try again now
+    if (rhizome_random_write(r->write, 0, NULL, 0) == -1)
+      WHYF("Write failed for %s!", alloca_sync_key(&r->key));
+    return 0;
+  }
+  source->offset = r->next_offset;
+  source->end = r->next_offset = end;
+  return 1;
+}
+
 static struct rhizome_sync_keys *get_peer_sync_state(struct subscriber *peer){
   if (!peer->sync_keys_state)
     peer->sync_keys_state = emalloc_zero(sizeof(struct rhizome_sync_keys));
@@ -98,8 +212,13 @@ static void _clear_transfer(struct __sourceloc __whence, struct transfers *ptr)
       }
       ptr->read=NULL;
       break;
-    case STATE_COMPLETING:
+    case STATE_REQ_PAYLOAD:
     case STATE_RECV_PAYLOAD:
+      if (ptr->source)
+	sync_source_release(ptr->source);
+      ptr->source=NULL;
+      break;
+    case STATE_COMPLETING:
       if (ptr->write){
 	rhizome_fail_write(ptr->write);
 	free(ptr->write);
@@ -151,12 +270,8 @@ static struct transfers **find_and_update_transfer(struct subscriber *peer, stru
 	  get_my_subscriber(1), MDP_PORT_RHIZOME_SYNC_KEYS,
 	  OQ_OPPORTUNISTIC);
 
-    if (msp_can_send(keys_state->connection)){
-      time_ms_t next_action = gettime_ms();
-      struct sched_ent *alarm=&ALARM_STRUCT(sync_send);
-      if (next_action < alarm->alarm || !is_scheduled(alarm))
-	RESCHEDULE(alarm, next_action, next_action, next_action);
-    }
+    if (msp_can_send(keys_state->connection))
+      sync_send_now();
   }
 
   struct transfers **ptr = &keys_state->queue;
@@ -204,13 +319,13 @@ static void sync_key_diffs(void *UNUSED(context), void *peer_context, const sync
     struct transfers *msg = *transfer;
     switch(msg->state){
       case STATE_REQ_PAYLOAD:
-	DEBUGF(rhizome_sync_keys, " - Requesting payload [%zu of %zu]", msg->write->file_offset, msg->write->file_length);
+	DEBUGF(rhizome_sync_keys, " - Requesting payload [%"PRIu64" to %"PRIu64"]", msg->source->offset, msg->source->end);
 	break;
       case STATE_SEND_PAYLOAD:
 	DEBUGF(rhizome_sync_keys, " - Sending payload [%zu of %zu]", msg->read->offset, msg->read->length);
 	break;
       case STATE_RECV_PAYLOAD:
-	DEBUGF(rhizome_sync_keys, " - Receiving payload [%zu of %zu]", msg->write->file_offset, msg->write->file_length);
+	DEBUGF(rhizome_sync_keys, " - Receiving payload [%"PRIu64" to %"PRIu64"]", msg->source->offset, msg->source->end);
 	break;
     }
   }
@@ -295,6 +410,45 @@ static int sync_manifest_rank(rhizome_manifest *m, struct subscriber *peer, uint
   return rank + bias;
 }
 
+// Ask another neighbour for part of a payload that we are receiving
+static void sync_receive_add_source(struct subscriber *peer, struct sync_receive *r)
+{
+  if (!r->write)
+    return;
+  struct sync_source *source = NULL;
+  unsigned i, count=0;
+  for (i=0;i<MAX_SOURCES;i++){
+    if (r->sources[i].peer == peer)
+      return;
+    if (r->sources[i].peer)
+      count++;
+    else if (!source && r->sources[i].offset >= r->sources[i].end)
+      source = &r->sources[i];
+  }
+  // every peer in the sync tree has broadcast to us, even if it is currently routed indirectly
+  if (!source || count >= config.rhizome.fetch_sources || !(peer->reachable & REACHABLE))
+    return;
+
+  DEBUGF(rhizome_sync_keys, "Fetching %s from %s (%u other sources)",
+    alloca_sync_key(&r->key), alloca_tohex_sid_t(peer->sid), count);
+
+  int rank = sync_manifest_rank(r->manifest, peer, 0, r->write->file_offset);
+  struct transfers *transfer = *find_and_update_transfer(peer, get_peer_sync_state(peer), &r->key, STATE_REQ_PAYLOAD, rank);
+  source->receive = r;
+  source->peer = peer;
+  source->offset = source->end = 0;
+  transfer->source = source;
+}
+
+// the payload whose sources are being found by sync_enum_differences()
+static struct sync_receive *finding_sources=NULL;
+
+static void sync_find_source(void *UNUSED(context), void *peer_context, const sync_key_t *key, uint8_t ours)
+{
+  if (!ours && memcmp(key, &finding_sources->key, sizeof(sync_key_t))==0)
+    sync_receive_add_source((struct subscriber *)peer_context, finding_sources);
+}
+
 static void sync_lookup_bar(struct subscriber *peer, struct rhizome_sync_keys *sync_state, struct transfers **ptr){
   // queue BAR for transmission based on the manifest details.
   // add a rank bias if there is no reachable recipient, to prioritise messaging
@@ -340,6 +494,16 @@ static void sync_send_peer(struct subscriber *peer, struct rhizome_sync_keys *sy
     struct transfers *msg = *ptr;
     if (msg->state == STATE_RECV_PAYLOAD){
       requested_bytes+=msg->req_len;
+    }else if (msg->state == STATE_REQ_PAYLOAD && !msg->source->receive->write){
+      // the payload has already arrived from other neighbours
+      *ptr = msg->next;
+      clear_transfer(msg);
+      free(msg);
+      continue;
+    }else if (msg->state == STATE_REQ_PAYLOAD
+      && msg->source->offset >= msg->source->end
+      && !sync_source_next_range(msg->source)){
+      // nothing to ask this neighbour for yet, wait for the other neighbours to catch up
     }else if ((msg->state & 3) == STATE_REQ){
       if (!payload){
 	payload = ob_static(buff, sizeof(buff));
@@ -351,9 +515,10 @@ static void sync_send_peer(struct subscriber *peer, struct rhizome_sync_keys *sy
       ob_append_bytes(payload, msg->key.key, sizeof(msg->key));
       ob_append_byte(payload, msg->rank);
       
-      // start from the specified file offset (eg journals, but one day perhaps resuming transfers)
+      // ask for the range of the payload assigned to this neighbour
       if (msg->state == STATE_REQ_PAYLOAD){
-	ob_append_packed_ui64(payload, msg->write->file_offset);
+	msg->req_len = msg->source->end - msg->source->offset;
+	ob_append_packed_ui64(payload, msg->source->offset);
 	ob_append_packed_ui64(payload, msg->req_len);
       }
       
@@ -563,7 +728,11 @@ static void sync_peer_has (void * UNUSED(context), void *peer_context, const syn
     alloca_tohex_sid_t(peer->sid),
     alloca_sync_key(key));
   
-  // noop, just wait for the BAR to arrive.
+  // if we are already fetching it from somebody else, ask this neighbour for part of it,
+  // otherwise just wait for the BAR to arrive.
+  struct sync_receive *r = sync_receive_find(key);
+  if (r && config.rhizome.fetch)
+    sync_receive_add_source(peer, r);
 }
 
 static void sync_peer_does_not_have (void * UNUSED(context), void *peer_context, void * UNUSED(key_context), const sync_key_t *key)
@@ -580,6 +749,12 @@ static void sync_peer_does_not_have (void * UNUSED(context), void *peer_context,
   if (!sync_state)
     return;
 
+  // the peer may already be fetching this payload from us, as one of several sources; don't
+  // replace that transfer with an announcement
+  struct transfers **existing = find_and_update_transfer(peer, sync_state, key, 0, -1);
+  if (existing && (*existing)->state != STATE_NONE)
+    return;
+
   struct transfers **send_bar = find_and_update_transfer(peer, sync_state, key, STATE_LOOKUP_BAR, 0);
   if (!send_bar && !*send_bar)
     return;
@@ -596,19 +771,393 @@ static void sync_peer_now_has (void * UNUSED(context), void *peer_context, void
     alloca_sync_key(key));
 }
 
-// this is probably fast enough. For huge stores, or slow storage media
-// we might need to use an alarm to slowly build this tree
+/* The tree of keys is persisted in an append-only snapshot file beside the database, so that a
+ * daemon starting (or re-enabling sync) does not have to read and verify every manifest row.  The
+ * file holds the database UUID, so a new database invalidates it, then one record for each key
+ * added to the tree, in rowid order.  On load, only manifests with a later rowid are read from the
+ * database.  Database triggers record the hash of every manifest that is replaced or deleted, or
+ * loses its payload, in the SYNC_REMOVED table; on load, any of those that are still gone are
+ * skipped and the file is rewritten without them.  While the daemon runs, the file is compacted the
+ * same way whenever enough of those rows have built up, so that neither the file nor the table
+ * grows with every replaced bundle.  That is checked at most once a second, and only while bundles
+ * are being added, so adding a bundle does not query the table.
+ */
+#define SNAPSHOT_FILE "sync_keys.snapshot"
+#define SNAPSHOT_TEMP_FILE "sync_keys.snapshot.tmp"
+#define SNAPSHOT_MAGIC "SYNCKEY2"
+#define SNAPSHOT_READ_RECORDS (256)
+// Compact once this many removals are waiting, and they are a quarter of the records, or there
+// are so many that the database would soon empty SYNC_REMOVED (at 4096 rows) and lose them.
+#define SNAPSHOT_COMPACT_MIN (64)
+#define SNAPSHOT_COMPACT_MAX (1024)
+#define SNAPSHOT_COMPACT_DELAY_MS (1000)
+
+struct snapshot_header {
+  char magic[8];
+  serval_uuid_t uuid;
+};
+
+struct snapshot_record {
+  sync_key_t key;
+  uint64_t rowid;
+};
+
+static int snapshot_fd = -1;
+static uint64_t snapshot_records = 0;
+
+static void snapshot_close()
+{
+  if (snapshot_fd != -1){
+    close(snapshot_fd);
+    snapshot_fd = -1;
+  }
+}
+
+// Stop using the snapshot file, and remove it so that the next build reads the database.
+static void snapshot_discard()
+{
+  snapshot_close();
+  char path[1024];
+  if (FORMF_RHIZOME_STORE_PATH(path, SNAPSHOT_FILE) && unlink(path) == -1 && errno != ENOENT)
+    WARNF_perror("unlink(%s)", alloca_str_toprint(path));
+}
+
+static int snapshot_create()
+{
+  snapshot_close();
+  char path[1024];
+  if (!FORMF_RHIZOME_STORE_PATH(path, SNAPSHOT_FILE))
+    return -1;
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0666);
+  if (fd == -1)
+    return WHYF_perror("open(%s,O_RDWR|O_CREAT|O_TRUNC|O_APPEND,0666)", alloca_str_toprint(path));
+  struct snapshot_header header;
+  bzero(&header, sizeof header);
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof header.magic);
+  header.uuid = rhizome_database.uuid;
+  if (write(fd, &header, sizeof header) != sizeof header){
+    WHYF_perror("write(%s)", alloca_str_toprint(path));
+    close(fd);
+    snapshot_discard();
+    return -1;
+  }
+  snapshot_fd = fd;
+  snapshot_records = 0;
+  return 0;
+}
+
+static void snapshot_append(const sync_key_t *key, uint64_t rowid)
+{
+  if (snapshot_fd == -1)
+    return;
+  struct snapshot_record record;
+  record.key = *key;
+  record.rowid = rowid;
+  if (write(snapshot_fd, &record, sizeof record) != sizeof record){
+    WHY_perror("write(" SNAPSHOT_FILE ")");
+    snapshot_discard();
+    return;
+  }
+  snapshot_records++;
+}
+
+static int cmp_sync_key(const void *a, const void *b)
+{
+  return memcmp(a, b, sizeof(sync_key_t));
+}
+
+/* Read the keys of manifests that were removed, or lost their payload, and have not been stored
+ * again since.  Returns a sorted array that the caller must free, or NULL on error, or if the
+ * database had to empty SYNC_REMOVED before they were applied.  Sets *upto to the last
+ * SYNC_REMOVED row that was considered.
+ */
+static sync_key_t *snapshot_removed_keys(size_t *countp, uint64_t *upto)
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  *countp = 0;
+  *upto = 0;
+  uint64_t lost = 0;
+  if (sqlite_exec_uint64_retry(&retry, &lost, "SELECT COUNT(*) FROM SYNC_REMOVED WHERE manifest_hash IS NULL;", END) == -1)
+    return NULL;
+  if (lost){
+    DEBUG(rhizome_sync_keys, "Removed manifests were not recorded, key snapshot is stale");
+    return NULL;
+  }
+  if (sqlite_exec_uint64_retry(&retry, upto, "SELECT IFNULL(MAX(rowid), 0) FROM SYNC_REMOVED;", END) == -1)
+    return NULL;
+  size_t count = 0, alloced = 16;
+  sync_key_t *keys = emalloc(alloced * sizeof *keys);
+  if (!keys)
+    return NULL;
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry, "SELECT DISTINCT manifest_hash FROM SYNC_REMOVED "
+    "WHERE rowid <= ? AND NOT EXISTS(SELECT 1 FROM MANIFESTS WHERE MANIFESTS.manifest_hash = SYNC_REMOVED.manifest_hash "
+    "AND (MANIFESTS.filehash IS NULL OR EXISTS(SELECT 1 FROM FILES WHERE FILES.id = MANIFESTS.filehash)));",
+    INT64, (int64_t)*upto, END);
+  if (!statement){
+    free(keys);
+    return NULL;
+  }
+  while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
+    const char *hash = (const char *) sqlite3_column_text(statement, 0);
+    rhizome_filehash_t manifest_hash;
+    if (!hash || str_to_rhizome_filehash_t(&manifest_hash, hash) == -1)
+      continue;
+    if (count == alloced){
+      sync_key_t *p = erealloc(keys, (alloced *= 2) * sizeof *keys);
+      if (!p){
+	sqlite_finalize(statement);
+	free(keys);
+	return NULL;
+      }
+      keys = p;
+    }
+    memcpy(keys[count++].key, manifest_hash.binary, sizeof(sync_key_t));
+  }
+  sqlite_finalize(statement);
+  qsort(keys, count, sizeof *keys, cmp_sync_key);
+  *countp = count;
+  return keys;
+}
+
+// The snapshot no longer holds the keys of any SYNC_REMOVED rows up to this one
+static void snapshot_applied_removed(uint64_t upto)
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite_exec_void_retry(&retry, "DELETE FROM SYNC_REMOVED WHERE rowid <= ?;", INT64, (int64_t)upto, END);
+}
+
+/* Read the records that follow the header in the snapshot file fd, optionally adding their keys to
+ * the tree, and drop the removed ones by copying the others into a new file that replaces it.
+ * Returns the descriptor of the file to append to, which is fd if nothing was dropped, or -1 on
+ * error, having closed fd.
+ */
+static int snapshot_filter(int fd, const struct snapshot_header *header, const sync_key_t *removed, size_t removed_count,
+  int add_to_tree, uint64_t *kept_count, int64_t *max_rowid)
+{
+  char path[1024];
+  char temp_path[1024];
+  int temp_fd = -1;
+  if (!FORMF_RHIZOME_STORE_PATH(path, SNAPSHOT_FILE)
+    || !FORMF_RHIZOME_STORE_PATH(temp_path, SNAPSHOT_TEMP_FILE))
+    goto error;
+
+  // If any keys may be dropped, copy the surviving records into a new file as they are read
+  if (removed_count){
+    temp_fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0666);
+    if (temp_fd == -1){
+      WHYF_perror("open(%s,O_RDWR|O_CREAT|O_TRUNC|O_APPEND,0666)", alloca_str_toprint(temp_path));
+      goto error;
+    }
+    if (write(temp_fd, header, sizeof *header) != sizeof *header){
+      WHYF_perror("write(%s)", alloca_str_toprint(temp_path));
+      goto error;
+    }
+  }
+
+  *kept_count = 0;
+  *max_rowid = 0;
+  uint64_t dropped = 0;
+  struct snapshot_record records[SNAPSHOT_READ_RECORDS];
+  ssize_t r;
+  while ((r = read(fd, records, sizeof records)) > 0){
+    size_t i, n = r / sizeof records[0], kept = 0;
+    for (i = 0; i < n; i++){
+      if ((int64_t)records[i].rowid > *max_rowid)
+	*max_rowid = records[i].rowid;
+      if (removed_count && bsearch(&records[i].key, removed, removed_count, sizeof *removed, cmp_sync_key)){
+	dropped++;
+	continue;
+      }
+      if (add_to_tree)
+	sync_add_key(sync_tree, &records[i].key, NULL);
+      records[kept++] = records[i];
+    }
+    *kept_count += kept;
+    if (temp_fd != -1 && kept && write(temp_fd, records, kept * sizeof records[0]) != (ssize_t)(kept * sizeof records[0])){
+      WHYF_perror("write(%s)", alloca_str_toprint(temp_path));
+      goto error;
+    }
+  }
+  if (r == -1){
+    WHYF_perror("read(%s)", alloca_str_toprint(path));
+    goto error;
+  }
+
+  if (dropped){
+    if (rename(temp_path, path) == -1){
+      WHYF_perror("rename(%s,%s)", alloca_str_toprint(temp_path), alloca_str_toprint(path));
+      goto error;
+    }
+    close(fd);
+    fd = temp_fd;
+    DEBUGF(rhizome_sync_keys, "Dropped %"PRIu64" stale keys from snapshot", dropped);
+  } else if (temp_fd != -1){
+    close(temp_fd);
+    unlink(temp_path);
+  }
+  return fd;
+
+error:
+  if (temp_fd != -1){
+    close(temp_fd);
+    unlink(temp_path);
+  }
+  close(fd);
+  return -1;
+}
+
+/* Add every key in the snapshot file to the tree, except those of removed manifests, leaving the
+ * file open for appending.  Returns the highest rowid that the snapshot covers, or -1 if there is
+ * no usable snapshot.
+ */
+static int64_t snapshot_load()
+{
+  snapshot_close();
+  char path[1024];
+  if (!FORMF_RHIZOME_STORE_PATH(path, SNAPSHOT_FILE))
+    return -1;
+  int fd = open(path, O_RDWR | O_APPEND);
+  if (fd == -1){
+    if (errno != ENOENT)
+      WARNF_perror("open(%s,O_RDWR|O_APPEND)", alloca_str_toprint(path));
+    return -1;
+  }
+  sync_key_t *removed = NULL;
+  struct stat st;
+  struct snapshot_header header;
+  if (fstat(fd, &st) == -1
+    || st.st_size < (off_t)sizeof header
+    || read(fd, &header, sizeof header) != sizeof header
+    || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof header.magic) != 0
+    || cmp_serval_uuid_t(&header.uuid, &rhizome_database.uuid) != 0){
+    DEBUG(rhizome_sync_keys, "Ignoring stale or invalid key snapshot");
+    goto discard;
+  }
+
+  // Drop any partial record left by a crash, so that appended records stay aligned
+  uint64_t count = (st.st_size - sizeof header) / sizeof(struct snapshot_record);
+  off_t length = sizeof header + count * sizeof(struct snapshot_record);
+  if (length != st.st_size && ftruncate(fd, length) == -1){
+    WARNF_perror("ftruncate(%s)", alloca_str_toprint(path));
+    goto discard;
+  }
+
+  uint64_t manifests = 0;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_uint64_retry(&retry, &manifests, "SELECT COUNT(*) FROM manifests;", END) == -1)
+    goto discard;
+  if (count > manifests + manifests / 4 + 16){
+    DEBUGF(rhizome_sync_keys, "Key snapshot has %"PRIu64" records for %"PRIu64" manifests, rebuilding", count, manifests);
+    goto discard;
+  }
+
+  size_t removed_count;
+  uint64_t removed_upto;
+  if ((removed = snapshot_removed_keys(&removed_count, &removed_upto)) == NULL)
+    goto discard;
+
+  int64_t max_rowid;
+  uint64_t kept;
+  fd = snapshot_filter(fd, &header, removed, removed_count, 1, &kept, &max_rowid);
+  free(removed);
+  if (fd == -1){
+    snapshot_discard();
+    return -1;
+  }
+  snapshot_applied_removed(removed_upto);
+
+  DEBUGF(rhizome_sync_keys, "Loaded %"PRIu64" keys from snapshot, up to rowid %"PRId64, kept, max_rowid);
+  snapshot_fd = fd;
+  snapshot_records = kept;
+  return max_rowid;
+
+discard:
+  free(removed);
+  close(fd);
+  snapshot_discard();
+  return -1;
+}
+
+/* Rewrite the snapshot without the keys of removed manifests, once enough of them are recorded in
+ * SYNC_REMOVED.  Those keys stay in the tree until the daemon restarts.
+ */
+static void snapshot_compact()
+{
+  if (snapshot_fd == -1)
+    return;
+  uint64_t pending = 0;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_uint64_retry(&retry, &pending, "SELECT COUNT(*) FROM SYNC_REMOVED;", END) == -1)
+    return;
+  if (pending < SNAPSHOT_COMPACT_MIN || (pending * 4 < snapshot_records && pending < SNAPSHOT_COMPACT_MAX))
+    return;
+
+  size_t removed_count;
+  uint64_t removed_upto;
+  sync_key_t *removed = snapshot_removed_keys(&removed_count, &removed_upto);
+  if (!removed){
+    // the next build will read the database instead
+    snapshot_discard();
+    return;
+  }
+  struct snapshot_header header;
+  int64_t max_rowid;
+  uint64_t kept;
+  int fd = snapshot_fd;
+  snapshot_fd = -1;
+  if (lseek(fd, 0, SEEK_SET) == -1 || read(fd, &header, sizeof header) != sizeof header){
+    WHY_perror("read(" SNAPSHOT_FILE ")");
+    close(fd);
+    fd = -1;
+  } else
+    fd = snapshot_filter(fd, &header, removed, removed_count, 0, &kept, &max_rowid);
+  free(removed);
+  if (fd == -1){
+    snapshot_discard();
+    return;
+  }
+  snapshot_applied_removed(removed_upto);
+  DEBUGF(rhizome_sync_keys, "Compacted key snapshot to %"PRIu64" records, applied %"PRIu64" removals", kept, pending);
+  snapshot_fd = fd;
+  snapshot_records = kept;
+}
+
+DEFINE_ALARM(sync_compact_snapshot);
+void sync_compact_snapshot(struct sched_ent *UNUSED(alarm))
+{
+  snapshot_compact();
+}
+
 static void build_tree()
 {
   sync_tree = sync_alloc_state(NULL, sync_peer_has, sync_peer_does_not_have, sync_peer_now_has);
-  
+
+  int64_t since_rowid = snapshot_load();
+  if (since_rowid == -1){
+    // start again with a fresh tree, in case a partly read snapshot left stale keys in it
+    sync_free_state(sync_tree);
+    sync_tree = sync_alloc_state(NULL, sync_peer_has, sync_peer_does_not_have, sync_peer_now_has);
+    since_rowid = 0;
+    // every removal so far is reflected in the manifests read below
+    sqlite_retry_state retry_removed = SQLITE_RETRY_STATE_DEFAULT;
+    sqlite_exec_void_retry(&retry_removed, "DELETE FROM SYNC_REMOVED;", END);
+    snapshot_create();
+  }
+
+  // this is probably fast enough when there is no snapshot. For huge stores, or slow storage media
+  // we might need to use an alarm to slowly build this tree
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  sqlite3_stmt *statement = sqlite_prepare(&retry, "SELECT id, version, manifest_hash FROM manifests "
-    "WHERE manifests.filehash IS NULL OR EXISTS(SELECT 1 FROM files WHERE files.id = manifests.filehash);");
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry, "SELECT id, version, manifest_hash, rowid FROM manifests "
+    "WHERE rowid > ? AND (manifests.filehash IS NULL OR EXISTS(SELECT 1 FROM files WHERE files.id = manifests.filehash)) "
+    "ORDER BY rowid;",
+    INT64, since_rowid, END);
+  if (!statement)
+    return;
   while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
     const char *q_id = (const char *) sqlite3_column_text(statement, 0);
     uint64_t q_version = sqlite3_column_int64(statement, 1);
     const char *hash = (const char *) sqlite3_column_text(statement, 2);
+    uint64_t q_rowid = sqlite3_column_int64(statement, 3);
 
     rhizome_filehash_t manifest_hash;
     if (str_to_rhizome_filehash_t(&manifest_hash, hash)==0){
@@ -619,9 +1168,10 @@ static void build_tree()
 	q_version,
 	alloca_sync_key(&key));
       sync_add_key(sync_tree, &key, NULL);
+      snapshot_append(&key, q_rowid);
     }
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
 }
 
 DEFINE_ALARM(sync_send_keys);
@@ -694,6 +1244,13 @@ static int process_transfer_message(struct subscriber *peer, struct rhizome_sync
 	if (!config.rhizome.fetch)
 	  break;
 
+	// already fetching this payload from somebody else? ask this neighbour for some of it too
+	struct sync_receive *r = sync_receive_find(&key);
+	if (r){
+	  sync_receive_add_source(peer, r);
+	  break;
+	}
+
 	enum rhizome_bundle_status status = rhizome_is_bar_interesting(&bar);
 	if (status == RHIZOME_BUNDLE_STATUS_SAME || status == RHIZOME_BUNDLE_STATUS_OLD){
 	  DEBUGF(rhizome_sync_keys, "Ignoring BAR %s:%"PRIu64" (hash %s), (Uninteresting)",
@@ -727,6 +1284,12 @@ static int process_transfer_message(struct subscriber *peer, struct rhizome_sync
 	if (!config.rhizome.fetch)
 	  break;
 	
+	struct sync_receive *r = sync_receive_find(&key);
+	if (r){
+	  sync_receive_add_source(peer, r);
+	  break;
+	}
+	
 	struct rhizome_manifest_summary summ;
 	if (!rhizome_manifest_inspect((char *)data, len, &summ)){
 	  WHYF("Ignoring manifest (hash %s), (Malformed)",
@@ -742,9 +1305,8 @@ static int process_transfer_message(struct subscriber *peer, struct rhizome_sync
 	  return 1;
 	}
 	
-	memcpy(m->manifestdata, data, len);
-	m->manifest_all_bytes = len;
-	if (   rhizome_manifest_parse(m) == -1
+	if (   rhizome_manifest_copy_data(m, data, len) == -1
+	    || rhizome_manifest_parse(m) == -1
 	    || !rhizome_manifest_validate(m)
 	) {
 	  WHYF("Ignoring manifest %s:%u"PRIu64" (hash %s), (Malformed)",
@@ -858,12 +1420,28 @@ static int process_transfer_message(struct subscriber *peer, struct rhizome_sync
 	// TODO improve rank algo here;
 	// Note that we still need to deal with this manifest, we don't want to run out of RAM
 
-	rank = sync_manifest_rank(m, peer, 0, write->file_offset);
-
-	struct transfers *transfer = *find_and_update_transfer(peer, sync_state, &key, STATE_REQ_PAYLOAD, rank);
-	transfer->manifest = m;
-	transfer->req_len = m->filesize - write->file_offset;
-	transfer->write = write;
+	r = emalloc_zero(sizeof(struct sync_receive));
+	if (!r){
+	  rhizome_manifest_free(m);
+	  rhizome_fail_write(write);
+	  free(write);
+	  ob_rewind(payload);
+	  return 1;
+	}
+	r->key = key;
+	r->manifest = m;
+	r->write = write;
+	r->next_offset = write->file_offset;
+	r->next = receiving;
+	receiving = r;
+	sync_receive_add_source(peer, r);
+
+	// ask any other neighbours who have told us they have this payload for part of it too
+	if (config.rhizome.fetch_sources > 1){
+	  finding_sources = r;
+	  sync_enum_differences(sync_tree, sync_find_source);
+	  finding_sources = NULL;
+	}
 	break;
       }
       case STATE_REQ_PAYLOAD:{
@@ -918,25 +1496,56 @@ static int process_transfer_message(struct subscriber *peer, struct rhizome_sync
 	  break;
 	}
 	struct transfers *transfer = *ptr;
+	struct sync_source *source = transfer->source;
+	struct sync_receive *r = source->receive;
+	if (len > transfer->req_len)
+	  len = transfer->req_len;
 	transfer->req_len -= len;
-	if (rhizome_write_buffer(transfer->write, buff, len)==-1){
+
+	if (!r->write){
+	  // already received from another neighbour, so just drain the rest of this range
+	  DEBUGF(rhizome_sync_keys, "Ignoring %zu bytes of %s, already received", len, alloca_sync_key(&key));
+	}else if (rhizome_random_write(r->write, source->offset, buff, len)==-1){
 	  WHYF("Write failed for %s!", alloca_sync_key(&key));
-	  if (transfer->manifest)
-	    rhizome_manifest_free(transfer->manifest);
-	  transfer->manifest=NULL;
+	  rhizome_fail_write(r->write);
+	  free(r->write);
+	  r->write=NULL;
 	  clear_transfer(transfer);
 	  *ptr = transfer->next;
 	  free(transfer);
+	  break;
 	}else{
-	  DEBUGF(rhizome_sync_keys, "Wrote to %s %zu, now %zu of %zu", 
-	    alloca_sync_key(&key), len, transfer->write->file_offset, transfer->write->file_length);
-
-	  if (transfer->write->file_offset >= transfer->write->file_length){
-	    // move this transfer to the global completing list
+	  source->offset += len;
+	  DEBUGF(rhizome_sync_keys, "Wrote to %s %zu @%"PRIu64", now %"PRIu64" of %"PRIu64,
+	    alloca_sync_key(&key), len, source->offset - len, r->write->file_offset, r->write->file_length);
+
+	  if (r->write->file_offset >= r->write->file_length){
+	    // move this transfer to the global completing list, taking the manifest and payload with it
+	    struct rhizome_write *write = r->write;
+	    transfer->manifest = r->manifest;
+	    r->write = NULL;
+	    r->manifest = NULL;
+	    clear_transfer(transfer);
 	    transfer->state = STATE_COMPLETING;
+	    transfer->write = write;
 	    *ptr = transfer->next;
 	    transfer->next = completing;
 	    completing = transfer;
+	    // drop any other neighbours that are waiting for another range
+	    sync_send_now();
+	    break;
+	  }
+	}
+
+	if (transfer->req_len == 0){
+	  if (r->write){
+	    // ask this neighbour for the next range, and let any that were waiting catch up
+	    transfer->state = STATE_REQ_PAYLOAD;
+	    sync_send_now();
+	  }else{
+	    clear_transfer(transfer);
+	    *ptr = transfer->next;
+	    free(transfer);
 	  }
 	}
 	break;
@@ -1046,11 +1655,13 @@ static void sync_config_changed(){
     DEBUG(rhizome_sync_keys,"Stop queueing messages");
     unschedule(&ALARM_STRUCT(sync_send_keys));
     unschedule(&ALARM_STRUCT(sync_keys_status));
+    unschedule(&ALARM_STRUCT(sync_compact_snapshot));
 
     if (sync_tree){
       sync_free_state(sync_tree);
       sync_tree = NULL;
     }
+    snapshot_close();
   }
 }
 DEFINE_TRIGGER(conf_change, sync_config_changed);
@@ -1067,6 +1678,13 @@ static void sync_bundle_add(rhizome_manifest *m)
   DEBUGF(rhizome_sync_keys, "Adding %s to tree",
     alloca_sync_key(&key));
   sync_add_key(sync_tree, &key, NULL);
+  snapshot_append(&key, m->rowid);
+  
+  struct sched_ent *compact = &ALARM_STRUCT(sync_compact_snapshot);
+  if (snapshot_fd != -1 && !is_scheduled(compact)){
+    time_ms_t next = gettime_ms()+SNAPSHOT_COMPACT_DELAY_MS;
+    RESCHEDULE(compact, next, next, TIME_MS_NEVER_WILL);
+  }
   
   if (link_has_neighbours()){
     struct sched_ent *alarm = &ALARM_STRUCT(sync_send_keys);
@@ -54,6 +54,9 @@ Link state routing;
 
 #define ACK_WINDOW (16)
 
+// how many times will we recalculate routes that depend on other changed routes, in one update
+#define MAX_ROUTE_PASSES (4)
+
 struct link{
   struct link *_left;
   struct link *_right;
@@ -79,6 +82,11 @@ struct link{
 
   // loop prevention;
   char calculating;
+
+  // has this link changed since we last updated our routes?
+  char changed;
+  // did the last path score calculation change the score?
+  char score_changed;
 };
 
 // statistics of incoming half of network links
@@ -120,6 +128,12 @@ struct neighbour{
   // when do we assume the link is dead because they stopped hearing us or vice versa?
   time_ms_t link_in_timeout;
 
+  // have we calculated any routes while this neighbour's links were dead?
+  char expired;
+
+  // has the next hop of any subscriber changed to, or from, this neighbour?
+  char cascade;
+
   // if a neighbour is telling the world that they are using us as a next hop, we need to send acks & nacks with high priority
   // otherwise we don't care too much about packet loss.
   char using_us;
@@ -157,7 +171,13 @@ struct link_state{
   struct subscriber *next_hop;
   struct subscriber *transmitter;
   int hop_count;
-  int route_version;
+  // does this route need to be recalculated? and is it in the dirty_routes list?
+  char dirty;
+  char queued;
+  struct subscriber *next_dirty;
+  // sequence numbers of the last calculation of this route, and the last change of next hop
+  uint64_t calculated;
+  uint64_t next_hop_changed;
   // if a neighbour is free'd this link will point to invalid memory.
   // don't use this pointer directly, call find_best_link instead
   struct link *link;
@@ -173,7 +193,10 @@ static int neighbour_find_best_link(struct neighbour *n);
 
 struct neighbour *neighbours=NULL;
 unsigned neighbour_count=0;
-int route_version=0;
+
+// routes that need to be recalculated before they can be used
+static struct subscriber *dirty_routes=NULL;
+static uint64_t route_calculations=0;
 
 struct network_destination * new_destination(struct overlay_interface *interface){
   assert(interface);
@@ -238,12 +261,26 @@ static int NumberOfSetBits(uint32_t i)
 static struct link_state *get_link_state(struct subscriber *subscriber)
 {
   if (!subscriber->link_state){
-    subscriber->link_state = emalloc_zero(sizeof(struct link_state));
-    subscriber->link_state->route_version = route_version -1;
+    struct link_state *state = subscriber->link_state = emalloc_zero(sizeof(struct link_state));
+    state->dirty = 1;
+    state->queued = 1;
+    state->next_dirty = dirty_routes;
+    dirty_routes = subscriber;
   }
   return subscriber->link_state;
 }
 
+static void route_dirty(struct subscriber *subscriber)
+{
+  struct link_state *state = get_link_state(subscriber);
+  state->dirty = 1;
+  if (!state->queued){
+    state->queued = 1;
+    state->next_dirty = dirty_routes;
+    dirty_routes = subscriber;
+  }
+}
+
 static struct neighbour *get_neighbour(struct subscriber *subscriber, char create)
 {
   struct neighbour *n = neighbours;
@@ -358,6 +395,7 @@ static void update_path_score(struct neighbour *neighbour, struct link *link){
 	   neighbour->path_version,
 	   hop_count);
 
+  link->score_changed = (hop_count != link->hop_count || drop_rate != link->path_drop_rate);
   link->hop_count = hop_count;
   link->path_version = neighbour->path_version;
   link->path_drop_rate = drop_rate;
@@ -372,7 +410,7 @@ static struct link * find_best_link(struct subscriber *subscriber)
     RETURN(NULL);
     
   struct link_state *state = get_link_state(subscriber);
-  if (state->route_version == route_version)
+  if (!state->dirty)
     RETURN(state->link);
 
   if (state->calculating)
@@ -388,8 +426,10 @@ static struct link * find_best_link(struct subscriber *subscriber)
   time_ms_t now = gettime_ms();
 
   while (neighbour){
-    if (neighbour->link_in_timeout < now)
+    if (neighbour->link_in_timeout < now){
+      neighbour->expired = 1;
       goto next;
+    }
 
     struct link *link = find_link(neighbour, subscriber, 0);
     if (!(link && link->transmitter))
@@ -424,10 +464,21 @@ next:
   if (state->transmitter != transmitter || state->link != best_link)
     changed = 1;
 
+  state->calculated = ++route_calculations;
+  if (state->next_hop != next_hop){
+    // any route that depends on this one, via the old or new next hop, may need to change too
+    struct neighbour *n;
+    if (state->next_hop && (n = get_neighbour(state->next_hop, 0)))
+      n->cascade = 1;
+    if (next_hop && (n = get_neighbour(next_hop, 0)))
+      n->cascade = 1;
+    state->next_hop_changed = state->calculated;
+  }
+
   state->next_hop = next_hop;
   state->transmitter = transmitter;
   state->hop_count = best_hop_count;
-  state->route_version = route_version;
+  state->dirty = 0;
   state->calculating = 0;
   state->link = best_link;
   
@@ -450,6 +501,83 @@ next:
   RETURN(best_link);
 }
 
+// mark every route that might use a link from this neighbour as dirty
+static void dirty_links(struct link *link)
+{
+  if (!link)
+    return;
+  dirty_links(link->_left);
+  dirty_links(link->_right);
+  route_dirty(link->receiver);
+}
+
+// update path scores after a change in the links of this neighbour, and mark routes to any
+// receiver whose link or path score has changed as dirty
+static void update_link_scores(struct neighbour *neighbour, struct link *link)
+{
+  if (!link)
+    return;
+  update_link_scores(neighbour, link->_left);
+  update_link_scores(neighbour, link->_right);
+  update_path_score(neighbour, link);
+  if (link->changed || link->score_changed)
+    route_dirty(link->receiver);
+  link->changed = 0;
+}
+
+static void neighbour_links_changed(struct neighbour *neighbour)
+{
+  neighbour->path_version ++;
+  if (neighbour->expired){
+    // routes have been calculated without this neighbour, reconsider them all
+    neighbour->expired = 0;
+    dirty_links(neighbour->root);
+  }
+  update_link_scores(neighbour, neighbour->root);
+}
+
+// a link is only usable if the transmitter is routed via the same neighbour,
+// so mark routes that depend on any transmitter whose next hop has changed since they were calculated
+static void cascade_links(struct link *link)
+{
+  if (!link)
+    return;
+  cascade_links(link->_left);
+  cascade_links(link->_right);
+  if (link->transmitter && link->transmitter->link_state){
+    uint64_t changed = link->transmitter->link_state->next_hop_changed;
+    if (changed && (!link->receiver->link_state || link->receiver->link_state->calculated < changed))
+      route_dirty(link->receiver);
+  }
+}
+
+// recalculate every dirty route, so that link_add_destinations only needs to read the result
+static void update_routes()
+{
+  unsigned passes = 0;
+  while (dirty_routes){
+    while (dirty_routes){
+      struct subscriber *subscriber = dirty_routes;
+      struct link_state *state = subscriber->link_state;
+      dirty_routes = state->next_dirty;
+      state->next_dirty = NULL;
+      state->queued = 0;
+      if (state->dirty)
+        find_best_link(subscriber);
+    }
+    struct neighbour *n;
+    for (n = neighbours; n; n = n->_next){
+      if (n->cascade){
+        n->cascade = 0;
+        cascade_links(n->root);
+      }
+    }
+    // give up on routes that keep flapping, we'll try again next time
+    if (++passes >= MAX_ROUTE_PASSES)
+      break;
+  }
+}
+
 static int append_link_state(struct overlay_buffer *payload, struct decode_context *context, char flags,
                              struct subscriber *transmitter, struct subscriber *receiver, 
                              int interface, int version, int ack_sequence, uint32_t ack_mask, 
@@ -511,6 +639,13 @@ static int free_subscriber_link_state(void **record, void *UNUSED(context))
   return 0;
 }
 
+static void free_routing_table()
+{
+  enum_subscribers(NULL, free_subscriber_link_state, NULL);
+  dirty_routes = NULL;
+  unschedule(&ALARM_STRUCT(link_send));
+}
+
 static int append_link(void **record, void *context)
 {
   struct subscriber *subscriber = *record;
@@ -627,26 +762,25 @@ static void clean_neighbours(time_ms_t now)
       }
     }
     
-    // when all links to a neighbour that we were directly routing to expire, force a routing calculation update
-    struct link_state *state = get_link_state(subscriber);
-    if (state->next_hop == subscriber && 
-	(n->link_in_timeout < now || !n->links || !alive) && 
-	state->route_version == route_version)
-      route_version++;
-      
+    // when links to a neighbour expire, recalculate every route that could have used them
+    if (!n->links || !alive || (n->link_in_timeout < now && !n->expired)){
+      n->expired = 1;
+      dirty_links(n->root);
+    }
+
     if (!n->links || !alive){
       free_neighbour(n_ptr);
       neighbour_count--;
       CALL_TRIGGER(nbr_change, subscriber, 0, neighbour_count);
       if (neighbour_count==0){
 	// clean up the routing table
-	enum_subscribers(NULL, free_subscriber_link_state, NULL);
-	unschedule(&ALARM_STRUCT(link_send));
+	free_routing_table();
       }
     }else{
       n_ptr = &n->_next;
     }
   }
+  update_routes();
 }
 
 static void link_status_html(struct strbuf *b, struct subscriber *n, struct link *link)
@@ -753,7 +887,7 @@ int link_destination_has_neighbours(struct network_destination *dest)
 }
 
 static int send_legacy_self_announce_ack(struct neighbour *neighbour, struct link_in *link, time_ms_t now){
-  struct overlay_frame *frame=emalloc_zero(sizeof(struct overlay_frame));
+  struct overlay_frame *frame=op_new();
   frame->type = OF_TYPE_SELFANNOUNCE_ACK;
   frame->ttl = 6;
   frame->destination = neighbour->subscriber;
@@ -841,7 +975,7 @@ static int send_neighbour_link(struct neighbour *n)
     send_legacy_self_announce_ack(n, n->best_link, now);
     n->last_update = now;
   } else {
-    struct overlay_frame *frame = emalloc_zero(sizeof(struct overlay_frame));
+    struct overlay_frame *frame = op_new();
     frame->type=OF_TYPE_DATA;
     frame->source=get_my_subscriber(1);
     frame->ttl=1;
@@ -950,6 +1084,7 @@ void link_send(struct sched_ent *alarm)
 
   // TODO use a separate alarm?
   link_send_neighbours();
+  update_routes();
 
   struct append_context context;
   bzero(&context, sizeof(context));
@@ -1009,6 +1144,7 @@ int link_stop_routing(struct subscriber *subscriber)
   subscriber->identity=NULL;
   if (serverMode && subscriber->link_state){
     struct link_state *state = get_link_state(subscriber);
+    route_dirty(subscriber);
     state->next_update = gettime_ms();
     update_alarm(__WHENCE__, state->next_update);
   }
@@ -1049,6 +1185,8 @@ struct link_in * get_neighbour_link(struct neighbour *neighbour, struct overlay_
 
 int link_add_destinations(struct overlay_frame *frame)
 {
+  update_routes();
+
   if (frame->destination){
     struct subscriber *next_hop = frame->destination;
     
@@ -1551,6 +1689,9 @@ static int link_receive(struct internal_mdp_header *header, struct overlay_buffe
 
     if (link->transmitter != transmitter || link->link_version != version){
       changed = 1;
+      link->changed = 1;
+      if (link->transmitter != transmitter)
+	link->parent = NULL;
       link->transmitter = transmitter;
       link->link_version = version & 0xFF;
       link->drop_rate = drop_rate;
@@ -1561,8 +1702,8 @@ static int link_receive(struct internal_mdp_header *header, struct overlay_buffe
   send_please_explain(&context, myself, header->source);
 
   if (changed){
-    route_version++;
-    neighbour->path_version ++;
+    neighbour_links_changed(neighbour);
+    update_routes();
     if (ALARM_STRUCT(link_send).alarm>now+5){
       RESCHEDULE(&ALARM_STRUCT(link_send), now+5, now+5, now+25);
     }
@@ -1616,6 +1757,7 @@ int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now)
   if (link->transmitter != get_my_subscriber(1))
     changed = 1;
 
+  link->changed |= changed;
   link->transmitter = get_my_subscriber(1);
   link->link_version = 1;
   link->destination = interface->destination;
@@ -1631,8 +1773,8 @@ int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now)
   neighbour->link_in_timeout = now + link->destination->ifconfig.reachable_timeout_ms;
 
   if (changed){
-    route_version++;
-    neighbour->path_version ++;
+    neighbour_links_changed(neighbour);
+    update_routes();
     if (ALARM_STRUCT(link_send).alarm>now+5){
       RESCHEDULE(&ALARM_STRUCT(link_send), now+5, now+5, now+25);
     }
@@ -1641,3 +1783,49 @@ int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now)
   return 0;
 }
 
+/* Hooks for the routing speed test in test_daemon_cli.c, which builds a synthetic link state
+ * table without receiving any link state packets.
+ */
+
+// set the link from a neighbour to a receiver, as if the neighbour had just announced it
+int link_test_set(struct subscriber *neighbour, struct subscriber *receiver, struct subscriber *transmitter,
+		  struct network_destination *destination, uint8_t drop_rate)
+{
+  struct neighbour *n = get_neighbour(neighbour, 1);
+  if (!n)
+    return -1;
+  // never time out while the test is running
+  n->link_in_timeout = TIME_MS_NEVER_WILL;
+  struct link *link = find_link(n, receiver, 1);
+  if (!link)
+    return -1;
+  if (link->transmitter != transmitter)
+    link->parent = NULL;
+  link->transmitter = transmitter;
+  set_destination_ref(&link->destination, destination);
+  link->link_version = (link->link_version + 1) & 0xFF;
+  link->drop_rate = drop_rate;
+  link->changed = 1;
+  return 0;
+}
+
+// bring routes up to date after link_test_set() has changed the links of one neighbour, or of
+// every neighbour if NULL
+void link_test_update_routes(struct subscriber *neighbour)
+{
+  struct neighbour *n;
+  for (n = neighbours; n; n = n->_next)
+    if (!neighbour || n->subscriber == neighbour)
+      neighbour_links_changed(n);
+  update_routes();
+}
+
+// forget every neighbour and route
+void link_test_release()
+{
+  while (neighbours){
+    free_neighbour(&neighbours);
+    neighbour_count--;
+  }
+  free_routing_table();
+}
@@ -45,6 +45,12 @@ int link_unicast_ack(struct subscriber *subscriber, struct overlay_interface *in
 void link_explained(struct subscriber *subscriber);
 int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now);
 
+// for the routing speed test
+int link_test_set(struct subscriber *neighbour, struct subscriber *receiver, struct subscriber *transmitter,
+		  struct network_destination *destination, uint8_t drop_rate);
+void link_test_update_routes(struct subscriber *neighbour);
+void link_test_release();
+
 DECLARE_TRIGGER(nbr_change, struct subscriber *neighbour, uint8_t found, unsigned count);
 DECLARE_TRIGGER(link_change, struct subscriber *subscriber, int prior_reachable);
 
@@ -199,6 +199,7 @@ int overlayServerMode(void);
 int _overlay_payload_enqueue(struct __sourceloc whence, struct overlay_frame *p);
 #define overlay_payload_enqueue(P) _overlay_payload_enqueue(__WHENCE__,P)
 int overlay_queue_remaining(int queue);
+void overlay_queue_set_max_length(int queue, int max_length);
 int overlay_queue_schedule_next(time_ms_t next_allowed_packet);
 int overlay_send_tick_packet(struct network_destination *destination);
 int overlay_queue_ack(struct subscriber *neighbour, struct network_destination *destination, uint32_t ack_mask, int ack_seq);
@@ -255,6 +256,8 @@ int overlay_send_stun_request(struct subscriber *server, struct subscriber *requ
 void rhizome_check_connections(struct sched_ent *alarm);
 
 int overlay_queue_init();
+void overlay_queue_release();
+time_ms_t overlay_queue_send_now();
 
 void monitor_client_poll(struct sched_ent *alarm);
 void monitor_poll(struct sched_ent *alarm);
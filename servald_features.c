@@ -34,6 +34,7 @@ void servald_features()
   USE_FEATURE(cli_monitor);
   USE_FEATURE(cli_msp_proxy);
   USE_FEATURE(cli_rhizome_direct);
+  USE_FEATURE(cli_debug);
 
   USE_FEATURE(log_output_file);
 
@@ -63,4 +64,5 @@ void servald_features()
   USE_FEATURE(http_rest_rhizome);
   USE_FEATURE(http_rest_meshms);
   USE_FEATURE(http_rest_meshmb);
+  USE_FEATURE(http_rest_debug);
 }
@@ -53,6 +53,8 @@ SERVAL_DAEMON_SOURCES = \
 	servald_main.c \
         conf_cli.c \
 	crypto.c \
+	debug_cli.c \
+	debug_restful.c \
 	directory_client.c \
 	dna_helper.c \
 	golay.c \
@@ -102,6 +104,7 @@ SERVAL_DAEMON_SOURCES = \
 	route_restful.c \
 	rhizome.c \
 	rhizome_bundle.c \
+	rhizome_bulk.c \
 	rhizome_crypto.c \
 	rhizome_database.c \
 	overlay_mdp_rhizome.c \
@@ -120,6 +123,7 @@ SERVAL_DAEMON_SOURCES = \
 	serval_packetvisualise.c \
 	server.c \
 	server_httpd.c \
+	test_daemon_cli.c \
 	vomp.c \
 	vomp_console.c \
         fec-3.0.1/ccsds_tables.c \
@@ -25,6 +25,10 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
 
 #include "cli.h"
 #include "serval_types.h"
@@ -36,6 +40,9 @@
 #include "str.h"
 #include "debug.h"
 #include "nibble_tree.h"
+#include "fdqueue.h"
+#include "base64.h"
+#include "strbuf.h"
 
 DEFINE_FEATURE(cli_tests);
 
@@ -253,6 +260,87 @@ static int app_mem_test(const struct cli_parsed *UNUSED(parsed), struct cli_cont
   return 0;
 }
 
+// Scheduler test
+
+static time_ms_t sched_test_last_run_before;
+static unsigned sched_test_called;
+
+static void sched_test_alarm(struct sched_ent *alarm)
+{
+  if (alarm->run_before < sched_test_last_run_before)
+    FATALF("alarm ran out of order, run_before=%"PRId64" after %"PRId64,
+	   alarm->run_before, sched_test_last_run_before);
+  sched_test_last_run_before = alarm->run_before;
+  sched_test_called++;
+}
+
+DEFINE_CMD(app_sched_test, 0,
+  "Run scheduler speed test",
+  "test","scheduler","[<count>]");
+static int app_sched_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *count_text;
+  if (cli_arg(parsed, "count", &count_text, NULL, "100000") == -1)
+    return -1;
+  unsigned count = atoi(count_text);
+  if (count == 0)
+    return WHYF("invalid count %s", alloca_str_toprint(count_text));
+  static struct profile_total stats = {.name = "sched_test_alarm"};
+  struct sched_ent *alarms = emalloc_zero(count * sizeof(struct sched_ent));
+  unsigned *order = emalloc(count * sizeof(unsigned));
+  if (!alarms || !order)
+    return -1;
+  unsigned i;
+  for (i = 0; i < count; ++i){
+    alarms[i].function = sched_test_alarm;
+    alarms[i].stats = &stats;
+    alarms[i].poll.fd = -1;
+    alarms[i]._poll_index = -1;
+    order[i] = i;
+  }
+  // shuffle the unschedule order
+  for (i = count - 1; i > 0; --i){
+    unsigned j = random() % (i + 1);
+    unsigned t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+  time_ms_t now = gettime_ms();
+
+  // far future alarms, so none become runnable
+  time_ms_t start = gettime_ms();
+  for (i = 0; i < count; ++i){
+    time_ms_t when = now + 3600000 + random() % 3600000;
+    RESCHEDULE(&alarms[i], when, when, when + random() % 1000);
+  }
+  time_ms_t end = gettime_ms();
+  cli_printf(context, "schedule %u alarms took %"PRId64"ms\n", count, (int64_t)(end - start));
+
+  start = gettime_ms();
+  for (i = 0; i < count; ++i)
+    unschedule(&alarms[order[i]]);
+  end = gettime_ms();
+  cli_printf(context, "unschedule %u alarms took %"PRId64"ms\n", count, (int64_t)(end - start));
+
+  // runnable alarms, which must be called in order of run_before
+  now = gettime_ms();
+  for (i = 0; i < count; ++i)
+    RESCHEDULE(&alarms[i], now, now, now + random() % 1000000);
+  sched_test_last_run_before = 0;
+  sched_test_called = 0;
+  start = gettime_ms();
+  while (fd_poll())
+    ;
+  end = gettime_ms();
+  cli_printf(context, "run %u alarms took %"PRId64"ms\n", sched_test_called, (int64_t)(end - start));
+
+  free(order);
+  free(alarms);
+  if (sched_test_called != count)
+    return WHYF("called %u alarms, expected %u", sched_test_called, count);
+  return 0;
+}
+
 DEFINE_CMD(app_config_test, 0,
    "Load a test config file and log various fields",
    "config","test","<file>");
@@ -413,27 +501,27 @@ static int app_nibble_tree_test(const struct cli_parsed *UNUSED(parsed), struct
   struct node *node2 = create_node(&root, 0x12345671);
   stats = tree_compute_statistics(&root);
   ASSERTF(stats.record_count == 2, "record_count=%zu", stats.record_count);
-  ASSERTF(stats.node_count == 8, "node_count=%zu", stats.node_count);
+  ASSERTF(stats.node_count == 2, "node_count=%zu", stats.node_count);
   ASSERTF(stats.empty_node_count == 0, "empty_node_count=%zu", stats.empty_node_count);
-  ASSERTF(stats.maximum_depth == 7, "maximum_depth=%zu", stats.maximum_depth);
+  ASSERTF(stats.maximum_depth == 1, "maximum_depth=%zu", stats.maximum_depth);
   struct node *node3 = create_node(&root, 0x12345672);
   stats = tree_compute_statistics(&root);
   ASSERTF(stats.record_count == 3, "record_count=%zu", stats.record_count);
-  ASSERTF(stats.node_count == 8, "node_count=%zu", stats.node_count);
+  ASSERTF(stats.node_count == 2, "node_count=%zu", stats.node_count);
   ASSERTF(stats.empty_node_count == 0, "empty_node_count=%zu", stats.empty_node_count);
-  ASSERTF(stats.maximum_depth == 7, "maximum_depth=%zu", stats.maximum_depth);
+  ASSERTF(stats.maximum_depth == 1, "maximum_depth=%zu", stats.maximum_depth);
   struct node *node4 = create_node(&root, 0x01234567);
   stats = tree_compute_statistics(&root);
   ASSERTF(stats.record_count == 4, "record_count=%zu", stats.record_count);
-  ASSERTF(stats.node_count == 8, "node_count=%zu", stats.node_count);
+  ASSERTF(stats.node_count == 2, "node_count=%zu", stats.node_count);
   ASSERTF(stats.empty_node_count == 0, "empty_node_count=%zu", stats.empty_node_count);
-  ASSERTF(stats.maximum_depth == 7, "maximum_depth=%zu", stats.maximum_depth);
+  ASSERTF(stats.maximum_depth == 1, "maximum_depth=%zu", stats.maximum_depth);
   struct node *node5 = create_node(&root, 0x23456789);
   stats = tree_compute_statistics(&root);
   ASSERTF(stats.record_count == 5, "record_count=%zu", stats.record_count);
-  ASSERTF(stats.node_count == 8, "node_count=%zu", stats.node_count);
+  ASSERTF(stats.node_count == 2, "node_count=%zu", stats.node_count);
   ASSERTF(stats.empty_node_count == 0, "empty_node_count=%zu", stats.empty_node_count);
-  ASSERTF(stats.maximum_depth == 7, "maximum_depth=%zu", stats.maximum_depth);
+  ASSERTF(stats.maximum_depth == 1, "maximum_depth=%zu", stats.maximum_depth);
   // Simple iteration through all nodes in order.
   tree_iterator_start(&it, &root);
   assert_current_node(&it, node4);
@@ -483,9 +571,9 @@ static int app_nibble_tree_test(const struct cli_parsed *UNUSED(parsed), struct
   node3 = NULL;
   stats = tree_compute_statistics(&root);
   ASSERTF(stats.record_count == 4, "record_count=%zu", stats.record_count);
-  ASSERTF(stats.node_count == 8, "node_count=%zu", stats.node_count);
+  ASSERTF(stats.node_count == 2, "node_count=%zu", stats.node_count);
   ASSERTF(stats.empty_node_count == 0, "empty_node_count=%zu", stats.empty_node_count);
-  ASSERTF(stats.maximum_depth == 7, "maximum_depth=%zu", stats.maximum_depth);
+  ASSERTF(stats.maximum_depth == 1, "maximum_depth=%zu", stats.maximum_depth);
   tree_iterator_free(&it);
   // Delete records from a node, leaving it empty.  A second iterator positioned in the node
   // prevents the node from being free()d until it advances.
@@ -501,24 +589,24 @@ static int app_nibble_tree_test(const struct cli_parsed *UNUSED(parsed), struct
   node1 = NULL;
   stats = tree_compute_statistics(&root);
   ASSERTF(stats.record_count == 3, "record_count=%zu", stats.record_count);
-  ASSERTF(stats.node_count == 8, "node_count=%zu", stats.node_count);
+  ASSERTF(stats.node_count == 2, "node_count=%zu", stats.node_count);
   ASSERTF(stats.empty_node_count == 0, "empty_node_count=%zu", stats.empty_node_count);
-  ASSERTF(stats.maximum_depth == 7, "maximum_depth=%zu", stats.maximum_depth);
+  ASSERTF(stats.maximum_depth == 1, "maximum_depth=%zu", stats.maximum_depth);
   assert_current_node(&it, node2); // node is not empty yet
   assert_current_node(&it2, node2);
   delete_current_node(&it); // makes the node empty
   node2 = NULL;
   stats = tree_compute_statistics(&root);
   ASSERTF(stats.record_count == 2, "record_count=%zu", stats.record_count);
-  ASSERTF(stats.node_count == 8, "node_count=%zu", stats.node_count);
+  ASSERTF(stats.node_count == 2, "node_count=%zu", stats.node_count);
   ASSERTF(stats.empty_node_count == 1, "empty_node_count=%zu", stats.empty_node_count);
-  ASSERTF(stats.maximum_depth == 7, "maximum_depth=%zu", stats.maximum_depth);
+  ASSERTF(stats.maximum_depth == 1, "maximum_depth=%zu", stats.maximum_depth);
   assert_current_node(&it, node5); // does not free() the empty node
   stats = tree_compute_statistics(&root);
   ASSERTF(stats.record_count == 2, "record_count=%zu", stats.record_count);
-  ASSERTF(stats.node_count == 8, "node_count=%zu", stats.node_count);
+  ASSERTF(stats.node_count == 2, "node_count=%zu", stats.node_count);
   ASSERTF(stats.empty_node_count == 1, "empty_node_count=%zu", stats.empty_node_count);
-  ASSERTF(stats.maximum_depth == 7, "maximum_depth=%zu", stats.maximum_depth);
+  ASSERTF(stats.maximum_depth == 1, "maximum_depth=%zu", stats.maximum_depth);
   assert_current_node(&it2, node5); // free()s the empty node
   stats = tree_compute_statistics(&root);
   ASSERTF(stats.record_count == 2, "record_count=%zu", stats.record_count);
@@ -529,3 +617,385 @@ static int app_nibble_tree_test(const struct cli_parsed *UNUSED(parsed), struct
   tree_iterator_free(&it);
   return 0;
 }
+
+// Nibble tree speed test; lookups of whole and abbreviated SID sized keys, as done when decoding
+// subscriber addresses.
+
+struct speed_record {
+  size_t nbits;
+  uint8_t binary[32];
+  // pad records out to roughly the size of a struct subscriber
+  uint8_t payload[160];
+};
+
+static void *create_speed_record(void *UNUSED(context), const uint8_t *binary, size_t binary_size_bytes)
+{
+  struct speed_record *ret = (struct speed_record *) emalloc_zero(sizeof(struct speed_record));
+  if (ret)
+    memcpy(ret->binary, binary, binary_size_bytes);
+  return ret;
+}
+
+static int free_speed_record(void **record, void *UNUSED(context))
+{
+  free(*record);
+  *record = NULL;
+  return 0;
+}
+
+DEFINE_CMD(app_tree_lookup_test, 0,
+  "Run nibble tree speed test",
+  "test","tree-lookup","[<count>]");
+static int app_tree_lookup_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *count_text;
+  if (cli_arg(parsed, "count", &count_text, NULL, "10000") == -1)
+    return -1;
+  unsigned count = atoi(count_text);
+  if (count == 0)
+    return WHYF("invalid count %s", alloca_str_toprint(count_text));
+  struct tree_root root = {.index_size_bytes = 32};
+  uint8_t (*keys)[32] = emalloc(count * sizeof *keys);
+  if (!keys)
+    return -1;
+  unsigned i, j;
+  for (i = 0; i < count; ++i)
+    for (j = 0; j < sizeof keys[i]; ++j)
+      keys[i][j] = random();
+  int ret = -1;
+
+  time_ms_t start = gettime_ms();
+  for (i = 0; i < count; ++i){
+    void *record;
+    if (tree_find(&root, &record, keys[i], sizeof keys[i], create_speed_record, NULL) != TREE_FOUND){
+      WHY("failed to insert record");
+      goto end;
+    }
+  }
+  time_ms_t end = gettime_ms();
+  cli_printf(context, "insert %u records took %"PRId64"ms\n", count, (int64_t)(end - start));
+
+  // visit the keys in a scattered order, without the cost of calling random() for each lookup,
+  // and report the best of a few rounds
+  const unsigned lookups = 1000000;
+  const unsigned stride = 7919;
+  const unsigned rounds = 5;
+  time_ms_t best = -1, best_abbreviated = -1;
+  unsigned round;
+  for (round = 0; round < rounds; ++round){
+    start = gettime_ms();
+    for (i = 0; i < lookups; ++i){
+      const uint8_t *key = keys[(i * stride) % count];
+      struct speed_record *record;
+      if (tree_find(&root, (void**)&record, key, sizeof keys[0], NULL, NULL) != TREE_FOUND
+	|| memcmp(record->binary, key, sizeof record->binary) != 0){
+	WHY("failed to find record");
+	goto end;
+      }
+    }
+    end = gettime_ms();
+    if (best == -1 || end - start < best)
+      best = end - start;
+
+    // abbreviated addresses are usually long enough to be unique
+    start = gettime_ms();
+    for (i = 0; i < lookups; ++i){
+      struct speed_record *record;
+      if (tree_find(&root, (void**)&record, keys[(i * stride) % count], 8, NULL, NULL) != TREE_FOUND){
+	WHY("failed to find abbreviated record");
+	goto end;
+      }
+    }
+    end = gettime_ms();
+    if (best_abbreviated == -1 || end - start < best_abbreviated)
+      best_abbreviated = end - start;
+  }
+  cli_printf(context, "%u lookups took %"PRId64"ms\n", lookups, (int64_t)best);
+  cli_printf(context, "%u abbreviated lookups took %"PRId64"ms\n", lookups, (int64_t)best_abbreviated);
+
+  start = gettime_ms();
+  tree_iterator it;
+  struct speed_record **node, *previous = NULL;
+  unsigned found = 0;
+  for (tree_iterator_start(&it, &root); (node = (struct speed_record **)tree_iterator_get_node(&it)); tree_iterator_advance(&it)){
+    if (previous && memcmp(previous->binary, (*node)->binary, sizeof previous->binary) >= 0)
+      break;
+    previous = *node;
+    found++;
+  }
+  tree_iterator_free(&it);
+  end = gettime_ms();
+  cli_printf(context, "iterate %u records took %"PRId64"ms\n", found, (int64_t)(end - start));
+  if (found != count){
+    WHYF("iterated %u records out of order, expected %u", found, count);
+    goto end;
+  }
+
+  struct tree_statistics stats = tree_compute_statistics(&root);
+  cli_printf(context, "%zu nodes, maximum depth %zu\n", stats.node_count, stats.maximum_depth);
+  ret = 0;
+
+end:
+  tree_walk(&root, NULL, 0, free_speed_record, NULL);
+  stats = tree_compute_statistics(&root);
+  free(keys);
+  if (ret == 0 && stats.record_count != 0)
+    return WHYF("%zu records remain", stats.record_count);
+  return ret;
+}
+
+/* A minimal blocking HTTP client for measuring request throughput against a running
+ * servald; it only understands the response framing that http_server.c produces.
+ */
+struct http_test_conn {
+  int fd;
+  size_t pos, len;
+  char buf[8192];
+};
+
+static int http_test_connect(struct http_test_conn *c, uint16_t port)
+{
+  c->pos = c->len = 0;
+  if ((c->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    return WHY_perror("socket");
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons(port),
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+  };
+  if (connect(c->fd, (struct sockaddr *)&addr, sizeof addr) == -1) {
+    WHY_perror("connect");
+    close(c->fd);
+    c->fd = -1;
+    return -1;
+  }
+  int one = 1;
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  return 0;
+}
+
+static void http_test_disconnect(struct http_test_conn *c)
+{
+  if (c->fd != -1)
+    close(c->fd);
+  c->fd = -1;
+}
+
+// Returns the number of bytes read, 0 at end of stream, -1 on error.
+static ssize_t http_test_fill(struct http_test_conn *c)
+{
+  if (c->pos) {
+    memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+    c->len -= c->pos;
+    c->pos = 0;
+  }
+  if (c->len == sizeof c->buf)
+    return WHY("response line too long");
+  ssize_t n = read(c->fd, c->buf + c->len, sizeof c->buf - c->len);
+  if (n == -1)
+    return WHY_perror("read");
+  c->len += n;
+  return n;
+}
+
+// Returns a pointer to the next CRLF-terminated line (with the CRLF replaced by NUL), or NULL.
+static const char *http_test_line(struct http_test_conn *c)
+{
+  while (1) {
+    char *crlf = memmem(c->buf + c->pos, c->len - c->pos, "\r\n", 2);
+    if (crlf) {
+      char *line = c->buf + c->pos;
+      *crlf = '\0';
+      c->pos = crlf + 2 - c->buf;
+      return line;
+    }
+    ssize_t n = http_test_fill(c);
+    if (n == 0)
+      WHY("connection closed mid-response");
+    if (n <= 0)
+      return NULL;
+  }
+}
+
+static int http_test_skip(struct http_test_conn *c, uint64_t bytes)
+{
+  while (bytes) {
+    if (c->pos == c->len) {
+      ssize_t n = http_test_fill(c);
+      if (n == 0)
+	return WHY("connection closed mid-response");
+      if (n == -1)
+	return -1;
+    }
+    size_t take = c->len - c->pos;
+    if (take > bytes)
+      take = bytes;
+    c->pos += take;
+    bytes -= take;
+  }
+  return 0;
+}
+
+// Consumes one complete "200 OK" response, returning 1 if the server will close the connection
+// afterwards, 0 if it stays open, -1 on error.
+static int http_test_response(struct http_test_conn *c)
+{
+  const char *line;
+  if ((line = http_test_line(c)) == NULL)
+    return -1;
+  if (strncmp(line, "HTTP/1.", 7) != 0 || strncmp(line + 8, " 200 ", 5) != 0)
+    return WHYF("unexpected response %s", alloca_str_toprint(line));
+  int closing = line[7] == '0';
+  int chunked = 0;
+  int64_t content_length = -1;
+  while ((line = http_test_line(c)) && *line) {
+    if (strncasecmp(line, "Content-Length:", 15) == 0)
+      content_length = strtoll(line + 15, NULL, 10);
+    else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+      chunked = strcasestr(line + 18, "chunked") != NULL;
+    else if (strncasecmp(line, "Connection:", 11) == 0) {
+      if (strcasestr(line + 11, "close"))
+	closing = 1;
+      else if (strcasestr(line + 11, "keep-alive"))
+	closing = 0;
+    }
+  }
+  if (!line)
+    return -1;
+  if (chunked) {
+    while (1) {
+      if ((line = http_test_line(c)) == NULL)
+	return -1;
+      uint64_t size = strtoull(line, NULL, 16);
+      if (size == 0)
+	break;
+      if (http_test_skip(c, size) == -1 || (line = http_test_line(c)) == NULL)
+	return -1;
+    }
+    // trailer
+    while ((line = http_test_line(c)) && *line)
+      ;
+    if (!line)
+      return -1;
+  } else if (content_length >= 0) {
+    if (http_test_skip(c, content_length) == -1)
+      return -1;
+  } else {
+    ssize_t n;
+    do {
+      c->pos = c->len = 0;
+    } while ((n = http_test_fill(c)) > 0);
+    if (n == -1)
+      return -1;
+    closing = 1;
+  }
+  return closing;
+}
+
+static int http_test_send(struct http_test_conn *c, const char *request, size_t len)
+{
+  while (len) {
+    ssize_t n = write(c->fd, request, len);
+    if (n == -1)
+      return WHY_perror("write");
+    request += n;
+    len -= n;
+  }
+  return 0;
+}
+
+DEFINE_CMD(app_http_test, 0,
+  "Measure HTTP request throughput of a running server with and without persistent connections",
+  "test","http","<port>","<path>","[<auth>]","[<count>]");
+static int app_http_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *port_text, *path, *auth, *count_text;
+  if (cli_arg(parsed, "port", &port_text, NULL, NULL) == -1
+    || cli_arg(parsed, "path", &path, NULL, NULL) == -1
+    || cli_arg(parsed, "auth", &auth, NULL, "") == -1
+    || cli_arg(parsed, "count", &count_text, NULL, "1000") == -1)
+    return -1;
+  uint16_t port = atoi(port_text);
+  unsigned count = atoi(count_text);
+  if (port == 0)
+    return WHYF("invalid port %s", alloca_str_toprint(port_text));
+  if (count == 0)
+    return WHYF("invalid count %s", alloca_str_toprint(count_text));
+
+  strbuf head = strbuf_alloca(1024);
+  strbuf_sprintf(head, "GET %s HTTP/1.1\r\nHost: localhost\r\n", path);
+  if (*auth)
+    strbuf_sprintf(head, "Authorization: Basic %s\r\n", alloca_base64((const unsigned char *)auth, strlen(auth)));
+  strbuf close_request = strbuf_alloca(1024);
+  strbuf_sprintf(close_request, "%sConnection: close\r\n\r\n", strbuf_str(head));
+  strbuf_puts(head, "\r\n");
+  if (strbuf_overrun(head) || strbuf_overrun(close_request))
+    return WHY("request too long");
+  const char *request = strbuf_str(head);
+  size_t request_len = strbuf_len(head);
+
+  struct http_test_conn conn = {.fd = -1};
+  unsigned i;
+  int ret = -1;
+
+  // a new connection for every request, as before persistent connections were supported
+  time_ms_t start = gettime_ms();
+  for (i = 0; i < count; ++i) {
+    if (http_test_connect(&conn, port) == -1
+      || http_test_send(&conn, strbuf_str(close_request), strbuf_len(close_request)) == -1
+      || http_test_response(&conn) == -1)
+      goto end;
+    http_test_disconnect(&conn);
+  }
+  time_ms_t elapsed = gettime_ms() - start;
+  cli_printf(context, "close:     %u requests in %"PRId64"ms, %.0f req/s\n",
+    count, (int64_t)elapsed, count * 1000.0 / (elapsed ? elapsed : 1));
+
+  // one persistent connection, waiting for each response before sending the next request
+  start = gettime_ms();
+  for (i = 0; i < count; ++i) {
+    if (conn.fd == -1 && http_test_connect(&conn, port) == -1)
+      goto end;
+    int closing;
+    if (http_test_send(&conn, request, request_len) == -1
+      || (closing = http_test_response(&conn)) == -1)
+      goto end;
+    if (closing)
+      http_test_disconnect(&conn);
+  }
+  elapsed = gettime_ms() - start;
+  http_test_disconnect(&conn);
+  cli_printf(context, "keepalive: %u requests in %"PRId64"ms, %.0f req/s\n",
+    count, (int64_t)elapsed, count * 1000.0 / (elapsed ? elapsed : 1));
+
+  // one persistent connection, sending several requests before reading their responses
+  const unsigned depth = 8;
+  start = gettime_ms();
+  for (i = 0; i < count; ) {
+    if (conn.fd == -1 && http_test_connect(&conn, port) == -1)
+      goto end;
+    unsigned batch = count - i < depth ? count - i : depth;
+    unsigned j;
+    for (j = 0; j < batch; ++j)
+      if (http_test_send(&conn, request, request_len) == -1)
+	goto end;
+    for (j = 0; j < batch; ++j) {
+      int closing = http_test_response(&conn);
+      if (closing == -1)
+	goto end;
+      ++i;
+      if (closing) {
+	http_test_disconnect(&conn);
+	break;
+      }
+    }
+  }
+  elapsed = gettime_ms() - start;
+  cli_printf(context, "pipelined: %u requests in %"PRId64"ms, %.0f req/s\n",
+    count, (int64_t)elapsed, count * 1000.0 / (elapsed ? elapsed : 1));
+  ret = 0;
+
+end:
+  http_test_disconnect(&conn);
+  return ret;
+}
@@ -0,0 +1,720 @@
+/*
+ Serval testing command line functions that need the daemon
+ Copyright (C) 2018 Flinders University
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* Speed tests of daemon internals.  Unlike test_cli.c, which is also built into the client
+ * library, these link against the whole daemon, so they are only linked into serval-tests.
+ */
+
+#include <fcntl.h>
+#include "serval.h"
+#include "conf.h"
+#include "cli.h"
+#include "commandline.h"
+#include "keyring.h"
+#include "server.h"
+#include "overlay_buffer.h"
+#include "overlay_interface.h"
+#include "overlay_packet.h"
+#include "route_link.h"
+#include "rhizome.h"
+#include "str.h"
+#include "mem.h"
+#include "numeric_str.h"
+#include "debug.h"
+
+DEFINE_FEATURE(cli_daemon_tests);
+
+// Queue assembly speed test; queue frames for many unicast destinations on a dummy interface
+// that writes to /dev/null, then time how long it takes to drain them into packets.
+
+DEFINE_CMD(app_overlay_queue_test, 0,
+  "Run overlay transmit queue speed test",
+  "test","overlay-queue","[<frames>]","[<destinations>]");
+static int app_overlay_queue_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *frames_text, *dests_text;
+  if (cli_arg(parsed, "frames", &frames_text, NULL, "10000") == -1
+    || cli_arg(parsed, "destinations", &dests_text, NULL, "50") == -1)
+    return -1;
+  unsigned frame_count = atoi(frames_text);
+  unsigned dest_count = atoi(dests_text);
+  if (frame_count == 0)
+    return WHYF("invalid frames %s", alloca_str_toprint(frames_text));
+  if (dest_count == 0 || dest_count > 250)
+    return WHYF("invalid destinations %s", alloca_str_toprint(dests_text));
+
+  overlay_interface *interface = &overlay_interfaces[0];
+  if (interface->state != INTERFACE_STATE_DOWN)
+    return WHY("interface 0 is in use");
+  if (!(keyring = keyring_open_instance("")))
+    return -1;
+  enum server_mode saved_mode = serverMode;
+  serverMode = SERVER_RUNNING;
+  overlay_queue_init();
+  overlay_queue_set_max_length(OQ_ORDINARY, frame_count);
+
+  int ret = -1;
+  int fd = -1;
+  unsigned i;
+  keyring_identity *self = NULL;
+  struct network_destination **dests = emalloc_zero(dest_count * sizeof(struct network_destination *));
+  struct subscriber **peers = emalloc_zero(dest_count * sizeof(struct subscriber *));
+  if (!dests || !peers)
+    goto end;
+  bzero(interface, sizeof *interface);
+  strcpy(interface->name, "bench");
+  interface->state = INTERFACE_STATE_UP;
+  interface->ifconfig.socket_type = SOCK_FILE;
+  interface->ifconfig.type = OVERLAY_INTERFACE_ETHERNET;
+  interface->ifconfig.unicast.mtu = 1200;
+  interface->ifconfig.unicast.send = 1;
+  interface->ifconfig.unicast.encapsulation = ENCAP_OVERLAY;
+  if ((fd = open("/dev/null", O_WRONLY)) == -1){
+    WHY_perror("open(/dev/null)");
+    goto end;
+  }
+  interface->alarm.poll.fd = fd;
+  for (i = 0; i < dest_count; ++i){
+    struct socket_address addr;
+    bzero(&addr, sizeof addr);
+    addr.addrlen = sizeof addr.inet;
+    addr.inet.sin_family = AF_INET;
+    addr.inet.sin_addr.s_addr = htonl(0x0A000001 + i);
+    addr.inet.sin_port = htons(PORT_DNA);
+    if (!(dests[i] = create_unicast_destination(&addr, interface)))
+      goto end;
+    // no rate limit, no expiry, and no sequence numbers so that nothing waits for an ack
+    limit_init(&dests[i]->transfer_limit, 0);
+    dests[i]->ifconfig.transmit_timeout_ms = 3600000;
+    sid_t sid;
+    randombytes_buf(sid.binary, sizeof sid.binary);
+    if (!(peers[i] = find_subscriber(sid.binary, sizeof sid.binary, 1)))
+      goto end;
+    peers[i]->max_packet_version = 1;
+  }
+
+  // packet headers are sent from our primary identity, which here will be an in-memory one
+  struct subscriber *my_subscriber = get_my_subscriber(1);
+  if (!my_subscriber)
+    goto end;
+  self = my_subscriber->identity;
+
+  time_ms_t start = gettime_ms();
+  for (i = 0; i < frame_count; ++i){
+    struct overlay_frame *frame = op_new();
+    if (!frame)
+      goto end;
+    frame->type = OF_TYPE_DATA;
+    frame->queue = OQ_ORDINARY;
+    frame->ttl = 1;
+    frame->source = my_subscriber;
+    frame->destination = peers[i % dest_count];
+    frame_add_destination(frame, frame->destination, dests[i % dest_count]);
+    if ((frame->payload = ob_new()) == NULL){
+      op_free(frame);
+      goto end;
+    }
+    size_t len = 20 + random() % 300;
+    uint8_t data[len];
+    bzero(data, len);
+    ob_append_bytes(frame->payload, data, len);
+    if (overlay_payload_enqueue(frame) == -1){
+      op_free(frame);
+      goto end;
+    }
+  }
+  time_ms_t end = gettime_ms();
+  cli_printf(context, "queue %u frames for %u destinations took %"PRId64"ms\n",
+    frame_count, dest_count, (int64_t)(end - start));
+
+  unsigned packets = 0;
+  time_ms_t slept = 0;
+  start = gettime_ms();
+  int queued;
+  while ((queued = frame_count - overlay_queue_remaining(OQ_ORDINARY)) > 0){
+    int before = interface->tx_count;
+    time_ms_t next = overlay_queue_send_now();
+    if (interface->tx_count == before && (queued = frame_count - overlay_queue_remaining(OQ_ORDINARY)) > 0){
+      // frames that didn't fit are held back briefly, wait for them like the scheduler would
+      time_ms_t now = gettime_ms();
+      if (next > now + 1000){
+	WHYF("no packet sent with %d frames queued", queued);
+	goto end;
+      }
+      if (next > now){
+	sleep_ms(next - now);
+	slept += next - now;
+      }
+    }
+    packets += interface->tx_count - before;
+  }
+  end = gettime_ms();
+  cli_printf(context, "send %u frames in %u packets took %"PRId64"ms (%"PRId64"ms idle)\n",
+    frame_count, packets, (int64_t)(end - start), (int64_t)slept);
+  ret = 0;
+
+end:
+  overlay_queue_release();
+  for (i = 0; dests && i < dest_count; ++i)
+    if (dests[i])
+      release_destination_ref(dests[i]);
+  free(dests);
+  free(peers);
+  if (fd != -1)
+    close(fd);
+  bzero(interface, sizeof *interface);
+  if (self){
+    keyring_free_identity(keyring, self);
+    // forget our primary identity
+    get_my_subscriber(0);
+  }
+  serverMode = saved_mode;
+  keyring_free(keyring);
+  keyring = NULL;
+  return ret;
+}
+
+// Routing speed test; build a synthetic link state table with many nodes reachable through a
+// handful of neighbours, then time route calculation, updates after link changes, and next hop
+// lookups for outgoing frames.
+
+// a random tree of nodes behind each of our neighbours, where every neighbour can also reach
+// every other neighbour (and therefore their whole tree) with one more hop
+static struct subscriber *routing_test_transmitter(struct subscriber **nodes, struct subscriber **parents,
+						   unsigned neighbour_total, unsigned i, unsigned j)
+{
+  if (j == i)
+    return get_my_subscriber(1);
+  return j < neighbour_total ? nodes[i] : parents[j];
+}
+
+DEFINE_CMD(app_routing_test, 0,
+  "Run routing table speed test",
+  "test","routing","[<nodes>]","[<neighbours>]");
+static int app_routing_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *nodes_text, *neighbours_text;
+  if (cli_arg(parsed, "nodes", &nodes_text, NULL, "1000") == -1
+    || cli_arg(parsed, "neighbours", &neighbours_text, NULL, "8") == -1)
+    return -1;
+  unsigned node_count = atoi(nodes_text);
+  unsigned neighbour_total = atoi(neighbours_text);
+  if (node_count < 2)
+    return WHYF("invalid nodes %s", alloca_str_toprint(nodes_text));
+  if (neighbour_total == 0 || neighbour_total > node_count)
+    return WHYF("invalid neighbours %s", alloca_str_toprint(neighbours_text));
+  if (link_has_neighbours())
+    return WHY("routing table is in use");
+
+  overlay_interface *interface = &overlay_interfaces[0];
+  if (interface->state != INTERFACE_STATE_DOWN)
+    return WHY("interface 0 is in use");
+  if (!(keyring = keyring_open_instance("")))
+    return -1;
+  enum server_mode saved_mode = serverMode;
+  serverMode = SERVER_RUNNING;
+
+  int ret = -1;
+  unsigned i, j;
+  struct network_destination *destination = NULL;
+  struct subscriber **nodes = emalloc_zero(node_count * sizeof(struct subscriber *));
+  struct subscriber **parents = emalloc_zero(node_count * sizeof(struct subscriber *));
+  struct subscriber *myself = get_my_subscriber(1);
+  if (!nodes || !parents || !myself)
+    goto end;
+  bzero(interface, sizeof *interface);
+  strcpy(interface->name, "bench");
+  if (!(destination = new_destination(interface)))
+    goto end;
+  destination->ifconfig.send = 1;
+  for (i = 0; i < node_count; ++i){
+    sid_t sid;
+    randombytes_buf(sid.binary, sizeof sid.binary);
+    if (!(nodes[i] = find_subscriber(sid.binary, sizeof sid.binary, 1)))
+      goto end;
+    // don't go asking for their keys
+    nodes[i]->id_valid = 1;
+  }
+
+  for (i = neighbour_total; i < node_count; ++i)
+    parents[i] = nodes[random() % i];
+  for (i = 0; i < neighbour_total; ++i)
+    for (j = 0; j < node_count; ++j)
+      if (link_test_set(nodes[i], nodes[j], routing_test_transmitter(nodes, parents, neighbour_total, i, j),
+			j == i ? destination : NULL, random() % 6) == -1)
+	goto end;
+
+  time_ms_t start = gettime_ms();
+  link_test_update_routes(NULL);
+  time_ms_t end = gettime_ms();
+  unsigned reachable = 0;
+  for (i = 0; i < node_count; ++i)
+    if (nodes[i]->reachable & REACHABLE)
+      reachable++;
+  cli_printf(context, "calculate routes to %u nodes via %u neighbours took %"PRId64"ms\n",
+    node_count, neighbour_total, (int64_t)(end - start));
+  if (reachable != node_count){
+    WHYF("only %u of %u nodes are reachable", reachable, node_count);
+    goto end;
+  }
+
+  // change the drop rate of one link at a time, and bring the routing table up to date
+  const unsigned changes = 1000;
+  start = gettime_ms();
+  for (i = 0; i < changes; ++i){
+    unsigned n = random() % neighbour_total;
+    j = random() % node_count;
+    link_test_set(nodes[n], nodes[j], routing_test_transmitter(nodes, parents, neighbour_total, n, j),
+		  j == n ? destination : NULL, random() % 6);
+    link_test_update_routes(nodes[n]);
+  }
+  end = gettime_ms();
+  cli_printf(context, "%u link changes took %"PRId64"ms\n", changes, (int64_t)(end - start));
+
+  // the next hop lookup done for every unicast frame we send
+  const unsigned lookups = 100000;
+  struct overlay_frame frame;
+  bzero(&frame, sizeof frame);
+  start = gettime_ms();
+  for (i = 0; i < lookups; ++i){
+    frame.destination = nodes[random() % node_count];
+    link_add_destinations(&frame);
+    if (frame.destination_count != 1){
+      WHYF("no destination for %s", alloca_tohex_sid_t(frame.destination->sid));
+      goto end;
+    }
+    frame_remove_destination(&frame, 0);
+  }
+  end = gettime_ms();
+  cli_printf(context, "%u next hop lookups took %"PRId64"ms\n", lookups, (int64_t)(end - start));
+  ret = 0;
+
+end:
+  link_test_release();
+  if (destination)
+    release_destination_ref(destination);
+  free(nodes);
+  free(parents);
+  if (myself){
+    keyring_free_identity(keyring, myself->identity);
+    // forget our primary identity
+    get_my_subscriber(0);
+  }
+  bzero(interface, sizeof *interface);
+  serverMode = saved_mode;
+  keyring_free(keyring);
+  keyring = NULL;
+  return ret;
+}
+
+// Frame allocation speed test; forward and create frames in batches, as the overlay does while
+// packets are waiting to be sent.
+
+DEFINE_CMD(app_frame_test, 0,
+  "Run overlay frame allocation speed test",
+  "test","frames","[<count>]","[<size>]");
+static int app_frame_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *count_text, *size_text;
+  if (cli_arg(parsed, "count", &count_text, NULL, "1000000") == -1
+    || cli_arg(parsed, "size", &size_text, NULL, "1024") == -1)
+    return -1;
+  unsigned count = atoi(count_text);
+  size_t size = atoi(size_text);
+  if (count == 0)
+    return WHYF("invalid count %s", alloca_str_toprint(count_text));
+  if (size == 0 || size > MDP_MTU)
+    return WHYF("invalid size %s", alloca_str_toprint(size_text));
+
+  unsigned char packet[MDP_MTU];
+  memset(packet, 0x55, sizeof packet);
+  struct overlay_buffer *received = ob_static(packet, size);
+  if (!received)
+    return -1;
+  ob_limitsize(received, size);
+
+  // queue frames in batches, as the forwarding path would while waiting for a packet to be sent
+  struct overlay_frame *batch[32];
+  unsigned i, j, queued = 0;
+  int ret = -1;
+
+  time_ms_t start = gettime_ms();
+  for (i = 0; i < count; i += NELS(batch)) {
+    for (j = 0; j < NELS(batch); ++j) {
+      struct overlay_frame f;
+      bzero(&f, sizeof f);
+      if ((f.payload = ob_slice(received, 0, size)) == NULL)
+	goto end;
+      ob_limitsize(f.payload, size);
+      batch[queued] = op_dup(&f);
+      ob_free(f.payload);
+      if (!batch[queued])
+	goto end;
+      queued++;
+    }
+    while (queued)
+      op_free(batch[--queued]);
+  }
+  time_ms_t forward = gettime_ms() - start;
+
+  start = gettime_ms();
+  for (i = 0; i < count; i += NELS(batch)) {
+    for (j = 0; j < NELS(batch); ++j) {
+      if ((batch[queued] = op_new()) == NULL)
+	goto end;
+      queued++;
+      if ((batch[queued - 1]->payload = ob_new()) == NULL)
+	goto end;
+      ob_append_bytes(batch[queued - 1]->payload, packet, size);
+    }
+    while (queued)
+      op_free(batch[--queued]);
+  }
+  time_ms_t create = gettime_ms() - start;
+
+  cli_printf(context, "forwarding %u frames of %zu bytes took %"PRId64"ms\n", i, size, (int64_t)forward);
+  cli_printf(context, "creating %u frames of %zu bytes took %"PRId64"ms\n", i, size, (int64_t)create);
+  ret = 0;
+end:
+  while (queued)
+    op_free(batch[--queued]);
+  ob_free(received);
+  if (IF_DEBUG(timing))
+    mpool_showstats();
+  return ret;
+}
+
+// Rhizome payload encryption speed test; check rhizome_crypt_xor_block() against the page at a
+// time implementation it replaced, and time both.
+
+// The page at a time implementation that rhizome_crypt_xor_block() replaced, for comparison.
+static void crypt_test_add_nonce(unsigned char *nonce, uint64_t value)
+{
+  int i=crypto_box_NONCEBYTES -1;
+  while(i>=0 && value>0){
+    int x = nonce[i]+(value & 0xFF);
+    nonce[i]=x&0xFF;
+    value = (value>>8)+(x>>8);
+    i--;
+  }
+}
+
+static void crypt_test_xor_paged(unsigned char *buffer, size_t buffer_size, uint64_t stream_offset,
+			    const unsigned char *key, const unsigned char *nonce)
+{
+  uint64_t nonce_offset = stream_offset & ~(RHIZOME_CRYPT_PAGE_SIZE -1);
+  size_t offset=0;
+  unsigned char block_nonce[crypto_box_NONCEBYTES];
+  bcopy(nonce, block_nonce, sizeof(block_nonce));
+  crypt_test_add_nonce(block_nonce, nonce_offset);
+  if (nonce_offset < stream_offset){
+    size_t padding = stream_offset & (RHIZOME_CRYPT_PAGE_SIZE -1);
+    size_t size = RHIZOME_CRYPT_PAGE_SIZE - padding;
+    if (size>buffer_size)
+      size=buffer_size;
+    unsigned char temp[RHIZOME_CRYPT_PAGE_SIZE];
+    bcopy(buffer, temp + padding, size);
+    crypto_stream_xsalsa20_xor(temp, temp, size+padding, block_nonce, key);
+    bcopy(temp + padding, buffer, size);
+    crypt_test_add_nonce(block_nonce, RHIZOME_CRYPT_PAGE_SIZE);
+    offset+=size;
+  }
+  while(offset < buffer_size){
+    size_t size = buffer_size - offset;
+    if (size>RHIZOME_CRYPT_PAGE_SIZE)
+      size=RHIZOME_CRYPT_PAGE_SIZE;
+    crypto_stream_xsalsa20_xor(buffer+offset, buffer+offset, (unsigned long long) size, block_nonce, key);
+    crypt_test_add_nonce(block_nonce, RHIZOME_CRYPT_PAGE_SIZE);
+    offset+=size;
+  }
+}
+
+static int crypt_payload_test(struct cli_context *context, size_t size)
+{
+  unsigned char key[RHIZOME_CRYPT_KEY_BYTES];
+  unsigned char nonce[crypto_box_NONCEBYTES];
+  randombytes_buf(key, sizeof key);
+  randombytes_buf(nonce, sizeof nonce);
+  // exercise the carry from the Salsa20 nonce into the HSalsa20 nonce
+  memset(nonce + 16, 0xff, 6);
+  unsigned char *a = emalloc(size);
+  unsigned char *b = emalloc(size);
+  if (!a || !b){
+    free(a);
+    free(b);
+    return -1;
+  }
+  randombytes_buf(a, size);
+  bcopy(a, b, size);
+  const size_t bufsz = 16 * RHIZOME_CRYPT_PAGE_SIZE;
+  size_t ofs;
+  time_ms_t start = gettime_ms();
+  for (ofs = 0; ofs < size; ofs += bufsz)
+    crypt_test_xor_paged(a + ofs, size - ofs < bufsz ? size - ofs : bufsz, ofs, key, nonce);
+  time_ms_t paged = gettime_ms() - start;
+  start = gettime_ms();
+  for (ofs = 0; ofs < size; ofs += bufsz)
+    rhizome_crypt_xor_block(b + ofs, size - ofs < bufsz ? size - ofs : bufsz, ofs, key, nonce);
+  time_ms_t batched = gettime_ms() - start;
+  int ret = 0;
+  if (memcmp(a, b, size) != 0)
+    ret = WHYF("rhizome_crypt_xor_block() output differs for %zu byte payload", size);
+  // unaligned reads, as when a reader seeks into the middle of a page
+  for (ofs = 0; ret == 0 && ofs < size; ofs += 1000 + ofs % 7919){
+    size_t len = 1 + (ofs % 9001);
+    if (len > size - ofs)
+      len = size - ofs;
+    crypt_test_xor_paged(a + ofs, len, ofs, key, nonce);
+    rhizome_crypt_xor_block(b + ofs, len, ofs, key, nonce);
+    if (memcmp(a + ofs, b + ofs, len) != 0)
+      ret = WHYF("rhizome_crypt_xor_block() output differs at offset %zu length %zu", ofs, len);
+  }
+  free(a);
+  free(b);
+  cli_printf(context, "%zu bytes - page at a time %"PRId64"ms (%.1f MiB/s), batched %"PRId64"ms (%.1f MiB/s)\n",
+      size,
+      (int64_t)paged, paged ? size / 1048.576 / paged : 0.0,
+      (int64_t)batched, batched ? size / 1048.576 / batched : 0.0);
+  return ret;
+}
+
+DEFINE_CMD(app_rhizome_crypt_test, 0,
+   "Run Rhizome payload encryption speed test",
+   "test","rhizomecrypt","[<size>]");
+static int app_rhizome_crypt_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *size_text;
+  if (cli_arg(parsed, "size", &size_text, NULL, NULL) == -1)
+    return -1;
+  if (size_text){
+    uint64_t size;
+    if (!str_to_uint64_scaled(size_text, 10, &size, NULL) || size == 0 || size > SIZE_MAX)
+      return WHYF("invalid size %s", alloca_str_toprint(size_text));
+    return crypt_payload_test(context, (size_t)size);
+  }
+  if (crypt_payload_test(context, 1024 * 1024) == -1)
+    return -1;
+  return crypt_payload_test(context, 100 * 1024 * 1024);
+}
+
+// Rhizome bulk import speed test.
+
+struct bulk_test_bundle {
+  uint8_t *manifest;
+  size_t manifest_len;
+  uint8_t payload[64];
+};
+
+static int bulk_test_make_bundles(struct bulk_test_bundle *bundles, unsigned count)
+{
+  unsigned i;
+  for (i = 0; i < count; ++i) {
+    struct bulk_test_bundle *b = &bundles[i];
+    randombytes_buf(b->payload, sizeof b->payload);
+    rhizome_filehash_t hash;
+    crypto_hash_sha512(hash.binary, b->payload, sizeof b->payload);
+    rhizome_manifest *m = rhizome_new_manifest();
+    if (!m)
+      return -1;
+    char name[20];
+    snprintf(name, sizeof name, "bulk%u", i);
+    rhizome_manifest_createid(m);
+    rhizome_manifest_set_service(m, RHIZOME_SERVICE_FILE);
+    rhizome_manifest_set_name(m, name);
+    rhizome_manifest_set_version(m, 1);
+    rhizome_manifest_set_date(m, gettime_ms());
+    rhizome_manifest_set_filesize(m, sizeof b->payload);
+    rhizome_manifest_set_filehash(m, &hash);
+    struct rhizome_bundle_result result = rhizome_manifest_validate(m)
+      ? rhizome_manifest_sign(m)
+      : rhizome_bundle_result(RHIZOME_BUNDLE_STATUS_INVALID);
+    int ok = result.status == RHIZOME_BUNDLE_STATUS_NEW;
+    rhizome_bundle_result_free(&result);
+    if (ok && (b->manifest = emalloc(m->manifest_all_bytes)) != NULL) {
+      memcpy(b->manifest, m->manifestdata, m->manifest_all_bytes);
+      b->manifest_len = m->manifest_all_bytes;
+    } else
+      ok = 0;
+    rhizome_manifest_free(m);
+    if (!ok)
+      return WHY("Failed to create test bundle");
+  }
+  return 0;
+}
+
+static rhizome_manifest *bulk_test_manifest(const struct bulk_test_bundle *b)
+{
+  rhizome_manifest *m = rhizome_new_manifest();
+  if (!m)
+    return NULL;
+  if (rhizome_manifest_copy_data(m, b->manifest, b->manifest_len) == -1 || rhizome_manifest_parse(m) != 0) {
+    rhizome_manifest_free(m);
+    return NULL;
+  }
+  return m;
+}
+
+DEFINE_CMD(app_rhizome_bulk_test, 0,
+   "Run Rhizome bulk import speed test",
+   "test","rhizomebulk","[<count>]");
+static int app_rhizome_bulk_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *count_text;
+  if (cli_arg(parsed, "count", &count_text, NULL, "10000") == -1)
+    return -1;
+  uint32_t count;
+  if (!str_to_uint32(count_text, 10, &count, NULL) || count == 0)
+    return WHYF("invalid count %s", alloca_str_toprint(count_text));
+  if (rhizome_opendb() == -1)
+    return -1;
+
+  // Half the bundles are imported one at a time, as "rhizome import bundle" does, the other half
+  // with a bulk import.  They are all different, so neither run finds the other's bundles.
+  struct bulk_test_bundle *bundles = emalloc_zero(2 * count * sizeof *bundles);
+  struct rhizome_bulk_import *bulk = emalloc_zero(sizeof *bulk);
+  int ret = -1;
+  if (!bundles || !bulk || bulk_test_make_bundles(bundles, 2 * count) == -1)
+    goto end;
+
+  unsigned single_added = 0;
+  time_ms_t start = gettime_ms();
+  unsigned i;
+  for (i = 0; i < count; ++i) {
+    rhizome_manifest *m = bulk_test_manifest(&bundles[i]);
+    if (!m)
+      goto end;
+    if (   rhizome_manifest_validate(m)
+	&& rhizome_manifest_verify(m)
+	&& rhizome_manifest_check_stored(m, NULL) == RHIZOME_BUNDLE_STATUS_NEW
+	&& rhizome_import_buffer(m, bundles[i].payload, sizeof bundles[i].payload) == RHIZOME_PAYLOAD_STATUS_NEW
+	&& rhizome_add_manifest_to_store(m, NULL) == RHIZOME_BUNDLE_STATUS_NEW)
+      ++single_added;
+    rhizome_manifest_free(m);
+  }
+  time_ms_t single = gettime_ms() - start;
+
+  start = gettime_ms();
+  for (i = count; i < 2 * count; ++i) {
+    rhizome_manifest *m = bulk_test_manifest(&bundles[i]);
+    uint8_t *payload = emalloc(sizeof bundles[i].payload);
+    if (!m || !payload) {
+      rhizome_manifest_free(m);
+      free(payload);
+      rhizome_bulk_import_release(bulk);
+      goto end;
+    }
+    memcpy(payload, bundles[i].payload, sizeof bundles[i].payload);
+    rhizome_bulk_import_add(bulk, m, NULL, payload, sizeof bundles[i].payload);
+    if (rhizome_bulk_import_full(bulk))
+      rhizome_bulk_import_flush(bulk);
+  }
+  rhizome_bulk_import_flush(bulk);
+  time_ms_t bulked = gettime_ms() - start;
+
+  cli_printf(context, "%u bundles - one at a time %"PRId64"ms (%u added), bulk %"PRId64"ms (%u added)\n",
+      (unsigned)count,
+      (int64_t)single, single_added,
+      (int64_t)bulked, bulk->added);
+  ret = (single_added == count && bulk->added == count) ? 0 : 1;
+end:
+  if (bundles) {
+    for (i = 0; i < 2 * count; ++i)
+      free(bundles[i].manifest);
+    free(bundles);
+  }
+  free(bulk);
+  return ret;
+}
+
+DEFINE_CMD(app_rhizome_list_test, 0,
+   "Run Rhizome bundle list speed test over the bundles already in the store",
+   "test","rhizomelist","[<service>]");
+static int app_rhizome_list_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *service;
+  if (cli_arg(parsed, "service", &service, NULL, "") == -1)
+    return -1;
+  if (rhizome_opendb() == -1)
+    return -1;
+  unsigned mode;
+  for (mode = 0; mode < 2; ++mode) {
+    struct rhizome_list_cursor cursor;
+    bzero(&cursor, sizeof cursor);
+    cursor.service = service[0] ? service : NULL;
+    cursor.columns_only = mode;
+    time_ms_t start = gettime_ms();
+    if (rhizome_list_open(&cursor) == -1)
+      return -1;
+    unsigned rows = 0;
+    int n;
+    while ((n = rhizome_list_next(&cursor)) == 1) {
+      rhizome_lookup_author(cursor.manifest);
+      ++rows;
+    }
+    rhizome_list_release(&cursor);
+    if (n == -1)
+      return -1;
+    cli_printf(context, "%s: %u bundles in %"PRId64"ms\n",
+	mode ? "columns" : "manifests", rows, (int64_t)(gettime_ms() - start));
+  }
+  return 0;
+}
+
+DEFINE_CMD(app_keyring_unlock_test, 0,
+  "Run keyring PIN unlock speed test, adding identities to the keyring until it has <count>",
+  "test","keyring-unlock","[<count>]");
+static int app_keyring_unlock_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *count_text;
+  if (cli_arg(parsed, "count", &count_text, NULL, "10000") == -1)
+    return -1;
+  uint32_t count;
+  if (!str_to_uint32(count_text, 10, &count, NULL) || count == 0)
+    return WHYF("invalid count %s", alloca_str_toprint(count_text));
+  const char *pin = "unlock-test";
+  keyring_file *k = keyring_open_instance("");
+  if (!k)
+    return -1;
+  unsigned have = keyring_enter_pin(k, pin);
+  time_ms_t start = gettime_ms();
+  unsigned added = 0;
+  for (; have + added < count; ++added)
+    if (keyring_create_identity(k, pin) == NULL) {
+      keyring_free(k);
+      return WHY("Could not create new identity");
+    }
+  if (added && keyring_commit(k) == -1) {
+    keyring_free(k);
+    return WHY("Could not write new identities");
+  }
+  keyring_free(k);
+  if (added)
+    cli_printf(context, "added %u identities in %"PRId64"ms\n", added, (int64_t)(gettime_ms() - start));
+
+  if ((k = keyring_open_instance("")) == NULL)
+    return -1;
+  start = gettime_ms();
+  unsigned found = keyring_enter_pin(k, "not-the-pin");
+  cli_printf(context, "wrong PIN: %u identities in %"PRId64"ms\n", found, (int64_t)(gettime_ms() - start));
+  start = gettime_ms();
+  found = keyring_enter_pin(k, pin);
+  cli_printf(context, "right PIN: %u identities in %"PRId64"ms\n", found, (int64_t)(gettime_ms() - start));
+  keyring_free(k);
+  return found == count ? 0 : 1;
+}
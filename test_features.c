@@ -26,6 +26,9 @@ void test_features()
   USE_FEATURE(cli_log);
   USE_FEATURE(cli_vomp_console);
   USE_FEATURE(cli_tests);
+  USE_FEATURE(cli_daemon_tests);
+  // the daemon tests link in httpd.c, which needs at least one HTTP handler
+  USE_FEATURE(http_server);
   USE_FEATURE(log_output_console);
 }
 